@@ -0,0 +1,164 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#include "BridgeConfiguration.h"
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// ChannelConfiguration
+
+ChannelConfiguration::ChannelConfiguration()
+	: m_valid(0)
+	, m_enabled(false)
+	, m_range(0)
+	, m_offset(0)
+	, m_threshold(0)
+	, m_hysteresis(0)
+{
+}
+
+/**
+	@brief Returns the set of fields which are set here, but either not set or set to a different value in applied
+ */
+uint32_t ChannelConfiguration::Diff(const ChannelConfiguration& applied) const
+{
+	uint32_t changed = m_valid & ~applied.m_valid;
+	uint32_t both = m_valid & applied.m_valid;
+
+	if( (both & CHAN_ENABLED) && (m_enabled != applied.m_enabled) )
+		changed |= CHAN_ENABLED;
+	if( (both & CHAN_COUPLING) && (m_coupling != applied.m_coupling) )
+		changed |= CHAN_COUPLING;
+	if( (both & CHAN_RANGE) && (m_range != applied.m_range) )
+		changed |= CHAN_RANGE;
+	if( (both & CHAN_OFFSET) && (m_offset != applied.m_offset) )
+		changed |= CHAN_OFFSET;
+	if( (both & CHAN_THRESHOLD) && (m_threshold != applied.m_threshold) )
+		changed |= CHAN_THRESHOLD;
+	if( (both & CHAN_HYSTERESIS) && (m_hysteresis != applied.m_hysteresis) )
+		changed |= CHAN_HYSTERESIS;
+
+	return changed;
+}
+
+/**
+	@brief Copies the selected fields from another configuration
+ */
+void ChannelConfiguration::Merge(const ChannelConfiguration& other, uint32_t fields)
+{
+	fields &= other.m_valid;
+
+	if(fields & CHAN_ENABLED)
+		m_enabled = other.m_enabled;
+	if(fields & CHAN_COUPLING)
+		m_coupling = other.m_coupling;
+	if(fields & CHAN_RANGE)
+		m_range = other.m_range;
+	if(fields & CHAN_OFFSET)
+		m_offset = other.m_offset;
+	if(fields & CHAN_THRESHOLD)
+		m_threshold = other.m_threshold;
+	if(fields & CHAN_HYSTERESIS)
+		m_hysteresis = other.m_hysteresis;
+
+	m_valid |= fields;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// BridgeConfiguration
+
+BridgeConfiguration::BridgeConfiguration()
+	: m_valid(0)
+	, m_sampleRate(0)
+	, m_sampleDepth(0)
+	, m_triggerDelay(0)
+	, m_triggerSource(0)
+	, m_triggerLevel(0)
+	, m_segmentCount(1)
+{
+}
+
+/**
+	@brief Returns the set of device level fields which are set here, but either not set or set to a different value
+	in applied
+
+	Channels are compared separately, with ChannelConfiguration::Diff().
+ */
+uint32_t BridgeConfiguration::Diff(const BridgeConfiguration& applied) const
+{
+	uint32_t changed = m_valid & ~applied.m_valid;
+	uint32_t both = m_valid & applied.m_valid;
+
+	if( (both & CFG_SAMPLE_RATE) && (m_sampleRate != applied.m_sampleRate) )
+		changed |= CFG_SAMPLE_RATE;
+	if( (both & CFG_SAMPLE_DEPTH) && (m_sampleDepth != applied.m_sampleDepth) )
+		changed |= CFG_SAMPLE_DEPTH;
+	if( (both & CFG_TRIGGER_DELAY) && (m_triggerDelay != applied.m_triggerDelay) )
+		changed |= CFG_TRIGGER_DELAY;
+	if( (both & CFG_TRIGGER_SOURCE) && (m_triggerSource != applied.m_triggerSource) )
+		changed |= CFG_TRIGGER_SOURCE;
+	if( (both & CFG_TRIGGER_LEVEL) && (m_triggerLevel != applied.m_triggerLevel) )
+		changed |= CFG_TRIGGER_LEVEL;
+	if( (both & CFG_TRIGGER_TYPE) && (m_triggerType != applied.m_triggerType) )
+		changed |= CFG_TRIGGER_TYPE;
+	if( (both & CFG_TRIGGER_EDGE) && (m_triggerEdge != applied.m_triggerEdge) )
+		changed |= CFG_TRIGGER_EDGE;
+	if( (both & CFG_SEGMENT_COUNT) && (m_segmentCount != applied.m_segmentCount) )
+		changed |= CFG_SEGMENT_COUNT;
+
+	return changed;
+}
+
+/**
+	@brief Copies the selected device level fields from another configuration
+ */
+void BridgeConfiguration::Merge(const BridgeConfiguration& other, uint32_t fields)
+{
+	fields &= other.m_valid;
+
+	if(fields & CFG_SAMPLE_RATE)
+		m_sampleRate = other.m_sampleRate;
+	if(fields & CFG_SAMPLE_DEPTH)
+		m_sampleDepth = other.m_sampleDepth;
+	if(fields & CFG_TRIGGER_DELAY)
+		m_triggerDelay = other.m_triggerDelay;
+	if(fields & CFG_TRIGGER_SOURCE)
+		m_triggerSource = other.m_triggerSource;
+	if(fields & CFG_TRIGGER_LEVEL)
+		m_triggerLevel = other.m_triggerLevel;
+	if(fields & CFG_TRIGGER_TYPE)
+		m_triggerType = other.m_triggerType;
+	if(fields & CFG_TRIGGER_EDGE)
+		m_triggerEdge = other.m_triggerEdge;
+	if(fields & CFG_SEGMENT_COUNT)
+		m_segmentCount = other.m_segmentCount;
+
+	m_valid |= fields;
+}
@@ -0,0 +1,201 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef BridgeConfiguration_h
+#define BridgeConfiguration_h
+
+#include <map>
+#include <string>
+#include <stdint.h>
+
+/**
+	@brief Configuration of a single channel, as requested by the client
+
+	Each field is only meaningful if the corresponding bit is set in m_valid.
+ */
+class ChannelConfiguration
+{
+public:
+	ChannelConfiguration();
+
+	enum Field
+	{
+		CHAN_ENABLED	= 0x01,
+		CHAN_COUPLING	= 0x02,
+		CHAN_RANGE		= 0x04,
+		CHAN_OFFSET		= 0x08,
+		CHAN_THRESHOLD	= 0x10,
+		CHAN_HYSTERESIS	= 0x20
+	};
+
+	uint32_t Diff(const ChannelConfiguration& applied) const;
+	void Merge(const ChannelConfiguration& other, uint32_t fields);
+
+	void SetEnabled(bool enabled)
+	{
+		m_enabled = enabled;
+		m_valid |= CHAN_ENABLED;
+	}
+
+	void SetCoupling(const std::string& coupling)
+	{
+		m_coupling = coupling;
+		m_valid |= CHAN_COUPLING;
+	}
+
+	void SetRange(double range)
+	{
+		m_range = range;
+		m_valid |= CHAN_RANGE;
+	}
+
+	void SetOffset(double offset)
+	{
+		m_offset = offset;
+		m_valid |= CHAN_OFFSET;
+	}
+
+	void SetThreshold(double threshold)
+	{
+		m_threshold = threshold;
+		m_valid |= CHAN_THRESHOLD;
+	}
+
+	void SetHysteresis(double hysteresis)
+	{
+		m_hysteresis = hysteresis;
+		m_valid |= CHAN_HYSTERESIS;
+	}
+
+	///@brief Bitmask of Field values which have been set
+	uint32_t m_valid;
+
+	bool m_enabled;
+	std::string m_coupling;
+	double m_range;
+	double m_offset;
+	double m_threshold;
+	double m_hysteresis;
+};
+
+/**
+	@brief Configuration of a whole instrument, as requested by the client
+
+	Used by BridgeSCPIServer to stage configuration changes and apply them to hardware in one batch.
+	Each device level field is only meaningful if the corresponding bit is set in m_valid.
+ */
+class BridgeConfiguration
+{
+public:
+	BridgeConfiguration();
+
+	enum Field
+	{
+		CFG_SAMPLE_RATE		= 0x01,
+		CFG_SAMPLE_DEPTH	= 0x02,
+		CFG_TRIGGER_DELAY	= 0x04,
+		CFG_TRIGGER_SOURCE	= 0x08,
+		CFG_TRIGGER_LEVEL	= 0x10,
+		CFG_TRIGGER_TYPE	= 0x20,
+		CFG_TRIGGER_EDGE	= 0x40,
+		CFG_SEGMENT_COUNT	= 0x80
+	};
+
+	uint32_t Diff(const BridgeConfiguration& applied) const;
+	void Merge(const BridgeConfiguration& other, uint32_t fields);
+
+	///@brief Gets the configuration for a channel, creating an empty one if needed
+	ChannelConfiguration& GetChannel(size_t chan)
+	{ return m_channels[chan]; }
+
+	void SetSampleRate(uint64_t rate)
+	{
+		m_sampleRate = rate;
+		m_valid |= CFG_SAMPLE_RATE;
+	}
+
+	void SetSampleDepth(uint64_t depth)
+	{
+		m_sampleDepth = depth;
+		m_valid |= CFG_SAMPLE_DEPTH;
+	}
+
+	void SetTriggerDelay(uint64_t delay)
+	{
+		m_triggerDelay = delay;
+		m_valid |= CFG_TRIGGER_DELAY;
+	}
+
+	void SetTriggerSource(size_t chan)
+	{
+		m_triggerSource = chan;
+		m_valid |= CFG_TRIGGER_SOURCE;
+	}
+
+	void SetTriggerLevel(double level)
+	{
+		m_triggerLevel = level;
+		m_valid |= CFG_TRIGGER_LEVEL;
+	}
+
+	void SetTriggerType(const std::string& type)
+	{
+		m_triggerType = type;
+		m_valid |= CFG_TRIGGER_TYPE;
+	}
+
+	void SetTriggerEdge(const std::string& edge)
+	{
+		m_triggerEdge = edge;
+		m_valid |= CFG_TRIGGER_EDGE;
+	}
+
+	void SetSegmentCount(size_t segments)
+	{
+		m_segmentCount = segments;
+		m_valid |= CFG_SEGMENT_COUNT;
+	}
+
+	///@brief Per-channel configuration, indexed by channel ID
+	std::map<size_t, ChannelConfiguration> m_channels;
+
+	///@brief Bitmask of Field values which have been set
+	uint32_t m_valid;
+
+	uint64_t m_sampleRate;
+	uint64_t m_sampleDepth;
+	uint64_t m_triggerDelay;
+	size_t m_triggerSource;
+	double m_triggerLevel;
+	std::string m_triggerType;
+	std::string m_triggerEdge;
+	size_t m_segmentCount;
+};
+
+#endif
@@ -28,244 +28,1788 @@
 ***********************************************************************************************************************/
 
 #include "BridgeSCPIServer.h"
-#include <stdexcept>
+#include "SCPINumeric.h"
+#include "SCPIThreading.h"
 #include "../log/log.h"
 
 #define FS_PER_SECOND 1e15
 #define SECONDS_PER_FS 1e-15
 
+//Default recorder geometry for REC:START
+#define REC_DEFAULT_SEGMENT_SIZE (256 * 1024 * 1024)
+#define REC_DEFAULT_SEGMENT_COUNT 8
+
 using namespace std;
 
+//Every session drives the same hardware, so what was last applied to it is tracked process wide
+static mutex g_configMutex;
+static BridgeConfiguration g_appliedConfig;
+
+//Name a client first used for each channel ID, for the keys of the CONFIG? reply (protected by g_configMutex)
+static map<size_t, string> g_channelNames;
+
+//Trigger state recorded by OnTriggerArmedChanged(). ARMED? reports it (on the I/O thread, without calling into the
+//driver) for drivers which push their state, see UsesPushedTriggerState().
+static atomic<bool> g_triggerArmed(false);
+
+//Capture buffer pool shared by every session (see EnableBufferPool()) and sized from g_appliedConfig, since there's
+//one acquisition thread filling it whichever client is connected. Created once, and protected along with its
+//settings by g_configMutex. Declared ahead of the recorder so it outlives any buffers the recorder holds at exit.
+static unique_ptr<WaveformBufferPool> g_bufferPool;
+static size_t g_poolBytesPerSample = 0;
+static size_t g_poolBuffersPerChannel = 0;
+
+//Recorder shared by every session, so a recording outlives the client that started it.
+//The mutex serializes REC:START, REC:STOP and REC:STAT? between sessions; the acquisition thread doesn't take it.
+static mutex g_recorderMutex;
+static WaveformRecorder g_recorder;
+
+//Capability replies shared by every session (see GetCapabilityReply()), keyed by CapabilityReply and protected by
+//g_capabilityMutex. The generation is bumped whenever configuration is applied to hardware, and a reply is only
+//current if it was generated at the current generation.
+class CachedCapabilityReply
+{
+public:
+	uint64_t m_generation;
+	string m_reply;
+};
+static mutex g_capabilityMutex;
+static map<int, CachedCapabilityReply> g_capabilityReplies;
+static atomic<uint64_t> g_capabilityGeneration(1);
+
+//Directory REC:START may create files in (empty to disable recording), and the most space a recording may take
+static string g_recordingDirectory;
+static uint64_t g_recordingMaxBytes = 0;
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Construction / destruction
 
 BridgeSCPIServer::BridgeSCPIServer(ZSOCKET sock)
 	: SCPIServer(sock)
+	, m_legacyHandlers(true)
+	, m_legacyCommand(nullptr)
+	, m_bufferPool(nullptr)
+	, m_streamer(nullptr)
+	, m_decimation(0)
+	, m_compression(false)
+	, m_deferConfiguration(false)
 {
+	for(size_t i=0; i<CAP_COUNT; i++)
+		m_capabilityGenerations[i] = 0;
+	RegisterBuiltinCommands();
 }
 
 BridgeSCPIServer::~BridgeSCPIServer()
 {
+	ReleaseRetainedWaveforms();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Trigger state
+
+/**
+	@brief Records that the trigger has been armed or disarmed, and tells subscribed clients
+
+	START, SINGLE and STOP call this themselves. A driver which returns true from UsesPushedTriggerState() must call
+	it with false when a single shot capture disarms (or the hardware stops for any other reason). Drivers should call
+	BroadcastEvent() themselves with EVENT_TRIGGERED when the trigger fires and EVENT_WAVEFORM when a waveform is
+	ready. Safe to call from any thread.
+ */
+void BridgeSCPIServer::OnTriggerArmedChanged(bool armed)
+{
+	g_triggerArmed.store(armed, memory_order_relaxed);
+	BroadcastEvent(EVENT_ARMED, armed ? "1" : "0");
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Helpers
 
-bool BridgeSCPIServer::ParseDouble(const std::string& s, double& v)
+/**
+	@brief Parses a floating point argument (see ParseSCPIDouble() for the accepted syntax)
+ */
+bool BridgeSCPIServer::ParseDouble(string_view s, double& v)
 {
-	try
-	{
-		v = stod(s);
+	if(ParseSCPIDouble(s, v))
 		return true;
+
+	LogWarning("Invalid double: %.*s\n", static_cast<int>(s.length()), s.data());
+	return false;
+}
+
+/**
+	@brief Parses an unsigned integer argument (see ParseSCPIUint64() for the accepted syntax)
+ */
+bool BridgeSCPIServer::ParseUint64(string_view s, uint64_t& v)
+{
+	if(ParseSCPIUint64(s, v))
+		return true;
+
+	LogWarning("Invalid u64: %.*s\n", static_cast<int>(s.length()), s.data());
+	return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Waveform buffer pool
+
+/**
+	@brief Enables the capture buffer pool
+
+	There's one pool per process, shared by every session: the first call creates it and later calls (from other
+	sessions) attach to it, keeping the settings it was created with. It's kept sized for the memory depth and set of
+	enabled channels in effect in hardware, whichever session applied them, and only reallocated when one of those
+	changes.
+
+	@param bytesPerSample		Size of one sample in the driver's capture format
+	@param buffersPerChannel	Number of buffers per enabled channel to preallocate (captures in flight at once)
+	@param hugePages			True to back buffers with huge pages where possible
+
+	Buffers are placed on the NUMA node configured for the acquisition thread, if any (see SCPIThreading).
+ */
+void BridgeSCPIServer::EnableBufferPool(size_t bytesPerSample, size_t buffersPerChannel, bool hugePages)
+{
+	{
+		lock_guard<mutex> lock(g_configMutex);
+		if(!g_bufferPool)
+		{
+			g_poolBytesPerSample = bytesPerSample;
+			g_poolBuffersPerChannel = buffersPerChannel;
+			g_bufferPool = make_unique<WaveformBufferPool>(64, hugePages);
+			g_bufferPool->SetNumaNode(SCPIThreading::Get().GetNumaNode(SCPIThreading::THREAD_ACQUISITION));
+		}
+		else if( (bytesPerSample != g_poolBytesPerSample) || (buffersPerChannel != g_poolBuffersPerChannel) )
+			LogWarning("Buffer pool already enabled with different settings, keeping them\n");
+		m_bufferPool = g_bufferPool.get();
 	}
-	catch (const std::invalid_argument& ia)
+	UpdateBufferPool();
+
+	if(m_streamer)
+		m_streamer->SetBufferPool(m_bufferPool);
+}
+
+/**
+	@brief Resizes the buffer pool to match the depth and channel set in effect in hardware (if they changed)
+
+	Must not be called with g_configMutex held.
+ */
+void BridgeSCPIServer::UpdateBufferPool()
+{
+	if(!m_bufferPool)
+		return;
+
+	lock_guard<mutex> lock(g_configMutex);
+
+	uint64_t depth = 0;
+	if(g_appliedConfig.m_valid & BridgeConfiguration::CFG_SAMPLE_DEPTH)
+		depth = g_appliedConfig.m_sampleDepth;
+
+	size_t channels = 0;
+	for(auto& it : g_appliedConfig.m_channels)
 	{
-		LogWarning("Invalid double: %s\n", s.c_str());
+		if( (it.second.m_valid & ChannelConfiguration::CHAN_ENABLED) && it.second.m_enabled )
+			channels ++;
+	}
+
+	g_bufferPool->Configure(depth, g_poolBytesPerSample, channels, g_poolBuffersPerChannel);
+}
+
+/**
+	@brief Gets a capture buffer for one channel from the pool
+
+	Must only be called from one thread in the whole process (normally the acquisition thread), since the pool is
+	shared by every session. Call Release() on the buffer once it's no longer needed.
+
+	@return The buffer, or nullptr if the pool isn't enabled or the depth hasn't been set yet
+ */
+WaveformBuffer* BridgeSCPIServer::AllocateWaveformBuffer()
+{
+	if(!m_bufferPool)
+		return nullptr;
+	return m_bufferPool->Allocate();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Recording to disk
+
+/**
+	@brief Hands a capture to the recorder, if REC:START is in effect
+
+	Call from the acquisition thread for every capture, alongside queueing it for the client. Several sessions may
+	call this at once, since the recorder serializes submissions. Never waits for the disk; if the recorder has fallen
+	behind, the capture is dropped from the recording (and counted in REC:STAT?) but still sent to the client as usual.
+
+	@param wfm		Description of the capture (m_cookie is ignored)
+	@param buffer	Buffer holding the samples. A reference is added while the capture is queued, so the caller keeps
+					its own.
+ */
+void BridgeSCPIServer::RecordWaveform(const WaveformDescriptor& wfm, WaveformBuffer* buffer)
+{
+	if(!g_recorder.IsRunning())
+		return;
+
+	WaveformDescriptor queued = wfm;
+	queued.m_cookie = buffer;
+	buffer->AddRef();
+	if(!g_recorder.Submit(queued))
+		buffer->Release();
+}
+
+/**
+	@brief Sets the directory REC:START records into
+
+	There's one recorder per process, shared by every session, so a recording keeps going after the client that
+	started it disconnects and any client can stop it or check on it. Clients only pass REC:START a file name, which
+	is created in this directory. Recording is disabled until this is called.
+
+	@param path		Directory to record into (empty to disable recording)
+	@param maxBytes	Most disk space a recording may preallocate (segment size times count), or 0 for no limit
+ */
+void BridgeSCPIServer::SetRecordingDirectory(const string& path, uint64_t maxBytes)
+{
+	lock_guard<mutex> lock(g_recorderMutex);
+	g_recordingDirectory = path;
+	g_recordingMaxBytes = maxBytes;
+}
+
+/**
+	@brief Handles REC:START, replacing any recording in progress
+
+	@param name			Base name of the segment files, created in the recording directory. Must be a plain file name
+						(no directory separators, and not starting with '.').
+	@param segmentSize	Size of each segment file in bytes
+	@param segmentCount	Number of segment files
+ */
+bool BridgeSCPIServer::StartRecording(string_view name, uint64_t segmentSize, uint64_t segmentCount)
+{
+	lock_guard<mutex> lock(g_recorderMutex);
+	if(g_recordingDirectory.empty())
+	{
+		LogWarning("REC:START: no recording directory configured\n");
+		return false;
+	}
+	if( name.empty() || (name[0] == '.') || (name.find_first_of("/\\") != string_view::npos) )
+	{
+		LogWarning("REC:START: invalid file name \"%.*s\"\n", static_cast<int>(name.length()), name.data());
+		return false;
+	}
+	if( g_recordingMaxBytes && ( (segmentCount == 0) || (segmentSize > g_recordingMaxBytes / segmentCount) ) )
+	{
+		LogWarning("REC:START: recording would take more than %lu bytes\n", (unsigned long)g_recordingMaxBytes);
 		return false;
 	}
+
+	g_recorder.Stop();
+	g_recorder.SetCompletionCallback([](void* cookie)
+		{ static_cast<WaveformBuffer*>(cookie)->Release(); });
+	return g_recorder.Start(g_recordingDirectory + "/" + string(name), segmentSize, segmentCount);
+}
+
+/**
+	@brief Handles REC:STOP
+ */
+void BridgeSCPIServer::StopRecording()
+{
+	lock_guard<mutex> lock(g_recorderMutex);
+	g_recorder.Stop();
+}
+
+/**
+	@brief Formats the REC:STAT? reply (counters cover the current or most recent recording)
+ */
+string BridgeSCPIServer::FormatRecordingStatus()
+{
+	lock_guard<mutex> lock(g_recorderMutex);
+	return
+		string("recording=") + (g_recorder.IsRunning() ? "1" : "0") +
+		" waveforms=" + to_string(g_recorder.GetWrittenCount()) +
+		" bytes=" + to_string(g_recorder.GetWrittenBytes()) +
+		" dropped=" + to_string(g_recorder.GetDropCount()) +
+		" segments=" + to_string(g_recorder.GetGeneration()) +
+		" bytes_per_sec=" + to_string(static_cast<uint64_t>(g_recorder.GetThroughput()));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Decimation and full resolution readback
+
+/**
+	@brief Attaches the streamer used for this client's data plane, so DECIMATE and COMPRESS can configure it
+
+	The buffer pool, if enabled, is handed to the streamer too, so it can register the pool's buffers for io_uring
+	sends (see WaveformStreamer::EnableUring()). The streamer must outlive the session, or be detached again by
+	passing null.
+ */
+void BridgeSCPIServer::AttachStreamer(WaveformStreamer* streamer)
+{
+	m_streamer = streamer;
+	if(m_streamer)
+	{
+		m_streamer->SetDecimation(m_decimation);
+		m_streamer->SetCompression(m_compression);
+		m_streamer->SetBufferPool(m_bufferPool);
+	}
+}
+
+/**
+	@brief Keeps a reference to the most recent capture of a channel, so the client can read back any window of it at
+	full resolution with DATA? after receiving a decimated overview
+
+	May be called from any thread (normally the acquisition thread, just before the waveform is queued for sending).
+	The previously retained capture of the channel is released.
+
+	@param wfm		Description of the capture
+	@param buffer	Buffer holding the samples. A reference is added, so the caller keeps its own.
+ */
+void BridgeSCPIServer::RetainWaveform(const WaveformDescriptor& wfm, WaveformBuffer* buffer)
+{
+	buffer->AddRef();
+
+	WaveformBuffer* old = nullptr;
+	{
+		lock_guard<mutex> lock(m_retainMutex);
+		auto& slot = m_retained[wfm.m_channel];
+		old = slot.m_buffer;
+		slot.m_waveform = wfm;
+		slot.m_buffer = buffer;
+	}
+
+	if(old)
+		old->Release();
+}
+
+/**
+	@brief Releases every retained capture (for example when the channel configuration changes)
+ */
+void BridgeSCPIServer::ReleaseRetainedWaveforms()
+{
+	map<size_t, RetainedWaveform> retained;
+	{
+		lock_guard<mutex> lock(m_retainMutex);
+		retained.swap(m_retained);
+	}
+
+	for(auto& it : retained)
+		it.second.m_buffer->Release();
+}
+
+/**
+	@brief Replies to DATA? with a window of the most recent capture of a channel
+
+	The reply is an IEEE 488.2 definite length block holding a WaveformHeader followed by the samples in
+	[start, start+count), or their min/max envelope if buckets is nonzero and smaller than half the window (see
+	WAVEFORM_MIN_MAX). The header's sequence number is that of the capture, so a client can tell if a newer capture
+	replaced the one it was looking at. An empty block is sent if nothing has been captured on the channel.
+ */
+void BridgeSCPIServer::SendWaveformWindow(size_t chan, uint64_t start, uint64_t count, size_t buckets)
+{
+	RetainedWaveform retained;
+	{
+		lock_guard<mutex> lock(m_retainMutex);
+		auto it = m_retained.find(chan);
+		if(it == m_retained.end())
+		{
+			SendReply("#10");
+			return;
+		}
+		retained = it->second;
+		retained.m_buffer->AddRef();
+	}
+
+	auto& wfm = retained.m_waveform;
+	start = min(start, wfm.m_sampleCount);
+	count = min(count, wfm.m_sampleCount - start);
+
+	WaveformHeader header;
+	header.m_magic = WAVEFORM_MAGIC;
+	header.m_channel = wfm.m_channel;
+	header.m_encoding = wfm.m_encoding;
+	header.m_bytesPerSample = wfm.m_bytesPerSample;
+	header.m_sequence = wfm.m_sequence;
+	header.m_sampleRate = wfm.m_sampleRate;
+	header.m_triggerPhase = wfm.m_triggerPhase;
+	header.m_sampleCount = count;
+
+	iovec iov[3];
+	iov[1].iov_base = &header;
+	iov[1].iov_len = sizeof(header);
+	iov[2].iov_base = reinterpret_cast<uint8_t*>(wfm.m_samples) + start * wfm.m_bytesPerSample;
+	iov[2].iov_len = count * wfm.m_bytesPerSample;
+
+	vector<uint8_t> envelope;
+	if(buckets && (count > 2*buckets) && WaveformStreamer::CanDecimate(wfm.m_encoding, wfm.m_bytesPerSample))
+	{
+		WaveformStreamer::Decimate(wfm.m_encoding, wfm.m_bytesPerSample, iov[2].iov_base, count, buckets, envelope);
+		header.m_encoding |= WAVEFORM_MIN_MAX;
+		iov[2].iov_base = envelope.data();
+		iov[2].iov_len = envelope.size();
+	}
+	header.m_dataLength = iov[2].iov_len;
+
+	char prefix[16];
+	size_t payloadLength = sizeof(header) + iov[2].iov_len;
+	int ndigits = snprintf(prefix + 2, sizeof(prefix) - 2, "%zu", payloadLength);
+	prefix[0] = '#';
+	prefix[1] = '0' + ndigits;
+	iov[0].iov_base = prefix;
+	iov[0].iov_len = ndigits + 2;
+
+	//Block framing is only defined up to 9 length digits
+	if(ndigits > 9)
+	{
+		LogWarning("DATA?: window too large for an IEEE 488.2 block\n");
+		SendReply("#10");
+	}
+	else
+	{
+		SendVectored(iov, 3);
+		SendReply("");
+	}
+
+	retained.m_buffer->Release();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Deferred configuration
+
+/**
+	@brief Enables or disables deferred configuration
+
+	When enabled, configuration commands (ON, OFF, COUP, RANGE, OFFS, THRESH, HYS, RATE, DEPTH and TRIG:*) only update
+	the staged configuration. The changes are applied to hardware in one batch by CommitConfiguration(), which runs
+	at START and SINGLE, on the COMMIT command, and before RATES? and DEPTHS? (whose answers depend on hardware state).
+	Settings which are already in effect in hardware are skipped, so a client restoring a whole session only
+	reprograms what actually differs. What's in effect is tracked across all sessions, so a change made by another
+	client is never mistaken for one already applied.
+
+	Disabling deferred configuration commits any pending changes first.
+ */
+void BridgeSCPIServer::EnableDeferredConfiguration(bool enable)
+{
+	if(m_deferConfiguration && !enable)
+		CommitConfiguration();
+	m_deferConfiguration = enable;
+}
+
+/**
+	@brief Returns a copy of the configuration most recently applied to hardware, by any session
+ */
+BridgeConfiguration BridgeSCPIServer::GetAppliedConfiguration()
+{
+	lock_guard<mutex> lock(g_configMutex);
+	return g_appliedConfig;
+}
+
+/**
+	@brief Applies all staged configuration changes to hardware
+
+	Channels are applied first (in ID order), then the timebase, then the trigger, since valid sample rates and
+	trigger sources may depend on which channels are enabled.
+
+	Staged settings are compared against what's in effect in hardware, whichever session applied it, and the whole
+	commit runs under the configuration lock so commits from different sessions don't interleave. The staged
+	configuration is empty again afterwards.
+
+	@return True (the individual setters have no way to report failure)
+ */
+bool BridgeSCPIServer::CommitConfiguration()
+{
+	bool anyChanged = false;
+	unique_lock<mutex> lock(g_configMutex);
+
+	//Channels
+	for(auto& it : m_stagedConfig.m_channels)
+	{
+		size_t chan = it.first;
+		auto& config = it.second;
+		auto& applied = g_appliedConfig.GetChannel(chan);
+
+		uint32_t changed = config.Diff(applied);
+		if(!changed)
+			continue;
+		anyChanged = true;
+
+		uint32_t remaining = changed & ~ApplyChannelConfiguration(chan, config, changed);
+		if(remaining & ChannelConfiguration::CHAN_ENABLED)
+			SetChannelEnabled(chan, config.m_enabled);
+		if(remaining & ChannelConfiguration::CHAN_COUPLING)
+			SetAnalogCoupling(chan, config.m_coupling);
+		if(remaining & ChannelConfiguration::CHAN_RANGE)
+			SetAnalogRange(chan, config.m_range);
+		if(remaining & ChannelConfiguration::CHAN_OFFSET)
+			SetAnalogOffset(chan, config.m_offset);
+		if(remaining & ChannelConfiguration::CHAN_THRESHOLD)
+			SetDigitalThreshold(chan, config.m_threshold);
+		if(remaining & ChannelConfiguration::CHAN_HYSTERESIS)
+			SetDigitalHysteresis(chan, config.m_hysteresis);
+
+		if(changed & ChannelConfiguration::CHAN_ENABLED)
+			OnChannelEnableChanged();
+		applied.Merge(config, changed);
+	}
+
+	//Timebase and trigger
+	auto& config = m_stagedConfig;
+	uint32_t changed = config.Diff(g_appliedConfig);
+	if(changed)
+	{
+		anyChanged = true;
+		uint32_t remaining = changed & ~ApplyDeviceConfiguration(config, changed);
+		if(remaining & BridgeConfiguration::CFG_SAMPLE_RATE)
+			SetSampleRate(config.m_sampleRate);
+		if(remaining & BridgeConfiguration::CFG_SAMPLE_DEPTH)
+			SetSampleDepth(config.m_sampleDepth);
+		if(remaining & BridgeConfiguration::CFG_SEGMENT_COUNT)
+			SetSegmentCount(config.m_segmentCount);
+		if(remaining & BridgeConfiguration::CFG_TRIGGER_TYPE)
+			SetTriggerTypeEdge();
+		if(remaining & BridgeConfiguration::CFG_TRIGGER_SOURCE)
+			SetTriggerSource(config.m_triggerSource);
+		if(remaining & BridgeConfiguration::CFG_TRIGGER_LEVEL)
+			SetTriggerLevel(config.m_triggerLevel);
+		if(remaining & BridgeConfiguration::CFG_TRIGGER_EDGE)
+			SetEdgeTriggerEdge(config.m_triggerEdge);
+		if(remaining & BridgeConfiguration::CFG_TRIGGER_DELAY)
+			SetTriggerDelay(config.m_triggerDelay);
+
+		if(changed & BridgeConfiguration::CFG_SAMPLE_RATE)
+			OnSampleRateChanged();
+		if(changed & BridgeConfiguration::CFG_SAMPLE_DEPTH)
+			OnSampleDepthChanged();
+		g_appliedConfig.Merge(config, changed);
+	}
+
+	m_stagedConfig = BridgeConfiguration();
+	lock.unlock();
+
+	//Other sessions only learn that something changed, since a commit may touch any number of settings
+	if(anyChanged)
+	{
+		UpdateBufferPool();
+		BroadcastEvent(EVENT_CONFIG, "", this);
+	}
+
+	return true;
+}
+
+/**
+	@brief Updates internal state after a channel has been enabled or disabled in hardware
+ */
+void BridgeSCPIServer::OnChannelEnableChanged()
+{
+	InvalidateCapabilityCache();
+}
+
+/**
+	@brief Updates internal state after the sample rate has been changed in hardware
+ */
+void BridgeSCPIServer::OnSampleRateChanged()
+{
+	InvalidateCapabilityCache();
+}
+
+/**
+	@brief Updates internal state after the memory depth has been changed in hardware
+ */
+void BridgeSCPIServer::OnSampleDepthChanged()
+{
+	InvalidateCapabilityCache();
+}
+
+/**
+	@brief Tells other sessions subscribed to CONFIG that this one changed a setting in hardware
+
+	@param command	The command that made the change, passed on as the event detail
+ */
+void BridgeSCPIServer::OnConfigurationChanged(const SCPICommand& command)
+{
+	BroadcastEvent(EVENT_CONFIG, command.m_line, this);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Capability reply cache
+
+/**
+	@brief Returns the reply to a capability query, generating it from the driver accessors only if not cached
+
+	Replies are cached process wide, since every session talks to the same hardware, and each session keeps its own
+	copy so it can send one without taking a lock. The sample rate and depth lists are invalidated for every session
+	whenever channels, sample rate or depth are applied to hardware, by any session.
+	Derived classes that change them any other way (for example from their own commands, or when hardware is
+	reconfigured behind our back) must call InvalidateCapabilityCache().
+ */
+const string& BridgeSCPIServer::GetCapabilityReply(CapabilityReply reply)
+{
+	uint64_t generation = g_capabilityGeneration.load(memory_order_acquire);
+	string& ret = m_capabilityReplies[reply];
+	if(m_capabilityGenerations[reply] == generation)
+		return ret;
+
+	//Another session may have generated it already
+	{
+		lock_guard<mutex> lock(g_capabilityMutex);
+		auto it = g_capabilityReplies.find(reply);
+		if( (it != g_capabilityReplies.end()) && (it->second.m_generation == generation) )
+		{
+			ret = it->second.m_reply;
+			m_capabilityGenerations[reply] = generation;
+			return ret;
+		}
+	}
+
+	ret.clear();
+	switch(reply)
+	{
+		case CAP_IDN:
+			ret = GetMake() + "," + GetModel() + "," + GetSerial() + "," + GetFirmwareVersion();
+			break;
+
+		case CAP_CHANS:
+			AppendSCPIUint64(ret, GetAnalogChannelCount());
+			break;
+
+		case CAP_RATES:
+			for(auto rate : GetSampleRates())
+			{
+				AppendSCPIDouble(ret, FS_PER_SECOND / rate);
+				ret += ',';
+			}
+			break;
+
+		case CAP_DEPTHS:
+			for(auto d : GetSampleDepths())
+			{
+				AppendSCPIUint64(ret, d);
+				ret += ',';
+			}
+			break;
+
+		default:
+			break;
+	}
+
+	//Share it, unless the configuration changed while we were asking the driver
+	{
+		lock_guard<mutex> lock(g_capabilityMutex);
+		if(g_capabilityGeneration.load(memory_order_relaxed) == generation)
+		{
+			auto& cached = g_capabilityReplies[reply];
+			cached.m_generation = generation;
+			cached.m_reply = ret;
+		}
+	}
+
+	m_capabilityGenerations[reply] = generation;
+	return ret;
+}
+
+/**
+	@brief Discards all cached capability replies, in every session, so they're regenerated on the next query
+
+	Call after the hardware configuration has changed, not before.
+ */
+void BridgeSCPIServer::InvalidateCapabilityCache()
+{
+	g_capabilityGeneration.fetch_add(1, memory_order_acq_rel);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Bulk configuration
+
+/**
+	@brief Resolves a channel name with GetChannelID(), remembering the name for the CONFIG? reply
+ */
+bool BridgeSCPIServer::LookupChannel(string_view name, size_t& id)
+{
+	if(!GetChannelID(string(name), id))
+		return false;
+
+	RememberChannelName(id, name);
+	return true;
+}
+
+/**
+	@brief Records the name a client used for a channel, as the key for it in the CONFIG? reply, unless one already is
+ */
+void BridgeSCPIServer::RememberChannelName(size_t id, string_view name)
+{
+	lock_guard<mutex> lock(g_configMutex);
+	if(g_channelNames.find(id) == g_channelNames.end())
+		g_channelNames[id] = name;
+}
+
+/**
+	@brief Appends a key=value field to a CONFIG? reply
+ */
+void BridgeSCPIServer::AppendConfigurationField(string& reply, string_view key, string_view value)
+{
+	if(!reply.empty())
+		reply += ';';
+	reply += key;
+	reply += '=';
+	reply += value;
+}
+
+/**
+	@brief Formats the CONFIG? reply: the instrument's capabilities and every setting any client has made
+
+	The reply is a list of key=value fields separated by semicolons. It starts with the capability fields IDN, CHANS,
+	RATES, DEPTHS and SEGMENTS.MAX, whose values are the replies to the queries of the same names (without trailing
+	commas). Then come the settings, keyed by the command that sets them with '.' in place of ':' (the command parser
+	treats the first ':' of a line as the subject separator, so keys can't contain one): RATE, DEPTH, SEGMENTS,
+	TRIG.MODE, TRIG.SOU, TRIG.LEV, TRIG.EDGE.DIR, TRIG.DELAY, then <channel>.ON (1 or 0), <channel>.COUP,
+	<channel>.RANGE, <channel>.OFFS, <channel>.THRESH and <channel>.HYS.
+
+	Settings are those in effect in hardware, whichever session made them. Settings no client has made are read back
+	through the driver's GetSampleRate() and friends, and left out if the driver doesn't know them. Channels are
+	listed only once some client has referred to them by name, since that's where their keys come from. Derived
+	classes add their own fields with AppendConfiguration().
+ */
+string BridgeSCPIServer::FormatConfiguration()
+{
+	string reply;
+	string value;
+
+	auto list = [](const string& s)
+		{ return string_view(s).substr(0, s.empty() ? 0 : s.length() - (s.back() == ',')); };
+	auto u64 = [&value](uint64_t v) -> const string&
+		{
+			value.clear();
+			AppendSCPIUint64(value, v);
+			return value;
+		};
+	auto dbl = [&value](double v) -> const string&
+		{
+			value.clear();
+			AppendSCPIDouble(value, v);
+			return value;
+		};
+
+	AppendConfigurationField(reply, "IDN", GetCapabilityReply(CAP_IDN));
+	AppendConfigurationField(reply, "CHANS", GetCapabilityReply(CAP_CHANS));
+	AppendConfigurationField(reply, "RATES", list(GetCapabilityReply(CAP_RATES)));
+	AppendConfigurationField(reply, "DEPTHS", list(GetCapabilityReply(CAP_DEPTHS)));
+	AppendConfigurationField(reply, "SEGMENTS.MAX", u64(GetMaxSegmentCount()));
+
+	BridgeConfiguration config;
+	map<size_t, string> names;
+	{
+		lock_guard<mutex> lock(g_configMutex);
+		config = g_appliedConfig;
+		names = g_channelNames;
+	}
+
+	//Ask the driver about anything no client has set
+	uint64_t u;
+	size_t id;
+	double d;
+	string s;
+	bool b;
+	if(!(config.m_valid & BridgeConfiguration::CFG_SAMPLE_RATE) && GetSampleRate(u))
+		config.SetSampleRate(u);
+	if(!(config.m_valid & BridgeConfiguration::CFG_SAMPLE_DEPTH) && GetSampleDepth(u))
+		config.SetSampleDepth(u);
+	if(!(config.m_valid & BridgeConfiguration::CFG_TRIGGER_DELAY) && GetTriggerDelay(u))
+		config.SetTriggerDelay(u);
+	if(!(config.m_valid & BridgeConfiguration::CFG_TRIGGER_SOURCE) && GetTriggerSource(id))
+		config.SetTriggerSource(id);
+	if(!(config.m_valid & BridgeConfiguration::CFG_TRIGGER_LEVEL) && GetTriggerLevel(d))
+		config.SetTriggerLevel(d);
+	if(!(config.m_valid & BridgeConfiguration::CFG_TRIGGER_EDGE) && GetEdgeTriggerEdge(s))
+		config.SetTriggerEdge(s);
+	for(auto& it : names)
+	{
+		auto& chan = config.GetChannel(it.first);
+		if(!(chan.m_valid & ChannelConfiguration::CHAN_ENABLED) && GetChannelEnabled(it.first, b))
+			chan.SetEnabled(b);
+		if(!(chan.m_valid & ChannelConfiguration::CHAN_COUPLING) && GetAnalogCoupling(it.first, s))
+			chan.SetCoupling(s);
+		if(!(chan.m_valid & ChannelConfiguration::CHAN_RANGE) && GetAnalogRange(it.first, d))
+			chan.SetRange(d);
+		if(!(chan.m_valid & ChannelConfiguration::CHAN_OFFSET) && GetAnalogOffset(it.first, d))
+			chan.SetOffset(d);
+		if(!(chan.m_valid & ChannelConfiguration::CHAN_THRESHOLD) && GetDigitalThreshold(it.first, d))
+			chan.SetThreshold(d);
+		if(!(chan.m_valid & ChannelConfiguration::CHAN_HYSTERESIS) && GetDigitalHysteresis(it.first, d))
+			chan.SetHysteresis(d);
+	}
+
+	if(config.m_valid & BridgeConfiguration::CFG_SAMPLE_RATE)
+		AppendConfigurationField(reply, "RATE", u64(config.m_sampleRate));
+	if(config.m_valid & BridgeConfiguration::CFG_SAMPLE_DEPTH)
+		AppendConfigurationField(reply, "DEPTH", u64(config.m_sampleDepth));
+	if(config.m_valid & BridgeConfiguration::CFG_SEGMENT_COUNT)
+		AppendConfigurationField(reply, "SEGMENTS", u64(config.m_segmentCount));
+	if(config.m_valid & BridgeConfiguration::CFG_TRIGGER_TYPE)
+		AppendConfigurationField(reply, "TRIG.MODE", config.m_triggerType);
+	if(config.m_valid & BridgeConfiguration::CFG_TRIGGER_SOURCE)
+	{
+		auto it = names.find(config.m_triggerSource);
+		if(it != names.end())
+			AppendConfigurationField(reply, "TRIG.SOU", it->second);
+	}
+	if(config.m_valid & BridgeConfiguration::CFG_TRIGGER_LEVEL)
+		AppendConfigurationField(reply, "TRIG.LEV", dbl(config.m_triggerLevel));
+	if(config.m_valid & BridgeConfiguration::CFG_TRIGGER_EDGE)
+		AppendConfigurationField(reply, "TRIG.EDGE.DIR", config.m_triggerEdge);
+	if(config.m_valid & BridgeConfiguration::CFG_TRIGGER_DELAY)
+		AppendConfigurationField(reply, "TRIG.DELAY", u64(config.m_triggerDelay));
+
+	for(auto& it : config.m_channels)
+	{
+		auto name = names.find(it.first);
+		if(name == names.end())
+			continue;
+		string prefix = name->second + ".";
+
+		auto& chan = it.second;
+		if(chan.m_valid & ChannelConfiguration::CHAN_ENABLED)
+			AppendConfigurationField(reply, prefix + "ON", chan.m_enabled ? "1" : "0");
+		if(chan.m_valid & ChannelConfiguration::CHAN_COUPLING)
+			AppendConfigurationField(reply, prefix + "COUP", chan.m_coupling);
+		if(chan.m_valid & ChannelConfiguration::CHAN_RANGE)
+			AppendConfigurationField(reply, prefix + "RANGE", dbl(chan.m_range));
+		if(chan.m_valid & ChannelConfiguration::CHAN_OFFSET)
+			AppendConfigurationField(reply, prefix + "OFFS", dbl(chan.m_offset));
+		if(chan.m_valid & ChannelConfiguration::CHAN_THRESHOLD)
+			AppendConfigurationField(reply, prefix + "THRESH", dbl(chan.m_threshold));
+		if(chan.m_valid & ChannelConfiguration::CHAN_HYSTERESIS)
+			AppendConfigurationField(reply, prefix + "HYS", dbl(chan.m_hysteresis));
+	}
+
+	AppendConfiguration(reply);
+	return reply;
+}
+
+/**
+	@brief Handles CONFIG <key>=<value>[,<key>=<value>...]
+
+	Keys are the setting keys of the CONFIG? reply. Every field is checked before anything is applied, so a command
+	with any invalid field changes nothing. The built in settings are then committed to hardware in one batch
+	through CommitConfiguration() (along with anything already staged in deferred mode), followed by the driver
+	specific fields.
+ */
+bool BridgeSCPIServer::ApplyConfiguration(const SCPICommand& command)
+{
+	if(command.GetArgCount() == 0)
+		return false;
+
+	BridgeConfiguration config;
+	map<size_t, string_view> names;
+	vector<pair<string_view, string_view>> driverFields;
+	for(size_t i=0; i<command.GetArgCount(); i++)
+	{
+		auto field = command[i];
+		auto eq = field.find('=');
+		if(eq == string_view::npos)
+		{
+			LogWarning("CONFIG: expected key=value, got \"%.*s\"\n", static_cast<int>(field.length()), field.data());
+			return false;
+		}
+
+		auto key = field.substr(0, eq);
+		auto value = field.substr(eq + 1);
+		if(StageConfigurationField(key, value, config, names))
+			continue;
+		if(!OnConfigurationField(key, value, false))
+		{
+			LogWarning("CONFIG: invalid field \"%.*s\"\n", static_cast<int>(field.length()), field.data());
+			return false;
+		}
+		driverFields.push_back(make_pair(key, value));
+	}
+
+	m_stagedConfig.Merge(config, config.m_valid);
+	for(auto& it : config.m_channels)
+		m_stagedConfig.GetChannel(it.first).Merge(it.second, it.second.m_valid);
+	CommitConfiguration();
+
+	for(auto& f : driverFields)
+		OnConfigurationField(f.first, f.second, true);
+
+	//Only now that everything is applied are the channel names worth remembering
+	for(auto& it : names)
+		RememberChannelName(it.first, it.second);
+	return true;
 }
 
-bool BridgeSCPIServer::ParseUint64(const std::string& s, uint64_t& v)
+/**
+	@brief Parses one built in CONFIG field into a configuration
+
+	Channel names are resolved without being remembered for the CONFIG? reply, since the command may still be
+	rejected. They're added to names instead, for the caller to remember once the command has been applied.
+
+	@return False if the key isn't a built in setting, or its value is invalid
+ */
+bool BridgeSCPIServer::StageConfigurationField(
+	string_view key,
+	string_view value,
+	BridgeConfiguration& config,
+	map<size_t, string_view>& names)
 {
-	try
+	uint64_t u;
+	double d;
+	size_t chan;
+
+	//Device level settings
+	if(key == "RATE")
+	{
+		if(!ParseUint64(value, u))
+			return false;
+		config.SetSampleRate(u);
+		return true;
+	}
+	if(key == "DEPTH")
+	{
+		if(!ParseUint64(value, u))
+			return false;
+		config.SetSampleDepth(u);
+		return true;
+	}
+	if(key == "SEGMENTS")
+	{
+		if(!ParseUint64(value, u) || (u < 1) || (u > GetMaxSegmentCount()) )
+			return false;
+		config.SetSegmentCount(u);
+		return true;
+	}
+	if(key == "TRIG.MODE")
+	{
+		if(value != "EDGE")
+			return false;
+		config.SetTriggerType("EDGE");
+		return true;
+	}
+	if(key == "TRIG.SOU")
+	{
+		if(!GetChannelID(string(value), chan))
+			return false;
+		names.emplace(chan, value);
+		config.SetTriggerSource(chan);
+		return true;
+	}
+	if(key == "TRIG.LEV")
+	{
+		if(!ParseDouble(value, d))
+			return false;
+		config.SetTriggerLevel(d);
+		return true;
+	}
+	if(key == "TRIG.EDGE.DIR")
 	{
-		v = stoull(s);
+		config.SetTriggerEdge(string(value));
 		return true;
 	}
-	catch (const std::invalid_argument& ia)
+	if(key == "TRIG.DELAY")
 	{
-		LogWarning("Invalid u64: %s\n", s.c_str());
+		if(!ParseUint64(value, u))
+			return false;
+		config.SetTriggerDelay(u);
+		return true;
+	}
+
+	//Channel settings
+	auto dot = key.rfind('.');
+	if( (dot == string_view::npos) || !GetChannelID(string(key.substr(0, dot)), chan) )
 		return false;
+	names.emplace(chan, key.substr(0, dot));
+	auto setting = key.substr(dot + 1);
+	auto type = GetChannelType(chan);
+	auto& ch = config.GetChannel(chan);
+
+	if(setting == "ON")
+	{
+		if( (value != "0") && (value != "1") )
+			return false;
+		ch.SetEnabled(value == "1");
+		return true;
+	}
+	if( (setting == "COUP") && (type == CH_ANALOG) )
+	{
+		ch.SetCoupling(string(value));
+		return true;
+	}
+	if( (setting == "RANGE") && (type == CH_ANALOG) && ParseDouble(value, d) )
+	{
+		ch.SetRange(d);
+		return true;
+	}
+	if( (setting == "OFFS") && (type == CH_ANALOG) && ParseDouble(value, d) )
+	{
+		ch.SetOffset(d);
+		return true;
 	}
+	if( (setting == "THRESH") && (type == CH_DIGITAL) && ParseDouble(value, d) )
+	{
+		ch.SetThreshold(d);
+		return true;
+	}
+	if( (setting == "HYS") && (type == CH_DIGITAL) && ParseDouble(value, d) )
+	{
+		ch.SetHysteresis(d);
+		return true;
+	}
+	return false;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Command processing
+// Command registration
+
+/**
+	@brief Registers a command handler
 
-bool BridgeSCPIServer::OnCommand(const std::string& line, const std::string& subject,
-                                 const std::string& cmd, const std::vector<std::string>& args)
+	Derived classes may call this from their constructor to add their own commands, or to replace a built-in one.
+
+	@param subject	Subject name (for example "TRIG"), or empty for device level commands
+	@param cmd		Command name
+	@param arity	Number of arguments required, or SCPIDispatchTable::ANY_ARITY
+	@param handler	The handler
+ */
+void BridgeSCPIServer::RegisterCommand(string_view subject, string_view cmd, size_t arity, CommandHandler handler)
 {
-	(void) line;
+	m_dispatch.Register(
+		subject.empty() ? SCPIDispatchTable::SUBJECT_NONE : SCPIDispatchTable::SUBJECT_NAMED,
+		subject, cmd, false, arity, ANY_CHANNEL_TYPE, handler);
+}
 
-	if (subject == "")
-	{
-		// Device commands
+/**
+	@brief Registers a query handler
+
+	@param subject		Subject name (for example "TRIG"), or empty for device level queries
+	@param cmd			Command name, without the trailing '?'
+	@param arity		Number of arguments required, or SCPIDispatchTable::ANY_ARITY
+	@param handler		The handler
+	@param nonblocking	True if the handler only reads cached or thread safe state, and may be answered immediately
+						instead of waiting for earlier commands when async execution is enabled
+ */
+void BridgeSCPIServer::RegisterQuery(
+	string_view subject,
+	string_view cmd,
+	size_t arity,
+	CommandHandler handler,
+	bool nonblocking)
+{
+	m_dispatch.Register(
+		subject.empty() ? SCPIDispatchTable::SUBJECT_NONE : SCPIDispatchTable::SUBJECT_NAMED,
+		subject, cmd, true, arity, ANY_CHANNEL_TYPE, handler, nonblocking);
+}
 
-		if (cmd == "START")
+/**
+	@brief Registers a command handler for a per-channel command (for example "C1:OFFS")
+
+	@param cmd			Command name
+	@param arity		Number of arguments required, or SCPIDispatchTable::ANY_ARITY
+	@param channelTypes	Bitmask of (1 << ChannelType) values the command is valid for
+	@param handler		The handler, which is passed the channel ID from GetChannelID()
+ */
+void BridgeSCPIServer::RegisterChannelCommand(
+	string_view cmd,
+	size_t arity,
+	uint32_t channelTypes,
+	CommandHandler handler)
+{
+	m_dispatch.Register(SCPIDispatchTable::SUBJECT_CHANNEL, "", cmd, false, arity, channelTypes, handler);
+}
+
+/**
+	@brief Registers a query handler for a per-channel query (for example "C1:OFFS?")
+
+	@param cmd			Command name, without the trailing '?'
+	@param arity		Number of arguments required, or SCPIDispatchTable::ANY_ARITY
+	@param channelTypes	Bitmask of (1 << ChannelType) values the query is valid for
+	@param handler		The handler, which is passed the channel ID from GetChannelID()
+ */
+void BridgeSCPIServer::RegisterChannelQuery(
+	string_view cmd,
+	size_t arity,
+	uint32_t channelTypes,
+	CommandHandler handler)
+{
+	m_dispatch.Register(SCPIDispatchTable::SUBJECT_CHANNEL, "", cmd, true, arity, channelTypes, handler);
+}
+
+/**
+	@brief Registers handlers for all of the commands common to every bridge
+ */
+void BridgeSCPIServer::RegisterBuiltinCommands()
+{
+	const size_t any = SCPIDispatchTable::ANY_ARITY;
+	const uint32_t analog = (1 << CH_ANALOG);
+	const uint32_t digital = (1 << CH_DIGITAL);
+
+	// Device commands
+
+	RegisterCommand("", "START", any, [this](const SCPICommand&, size_t)
+		{
+			if(m_deferConfiguration)
+				CommitConfiguration();
 			AcquisitionStart(false);
-		else if (cmd == "SINGLE")
+			OnTriggerArmedChanged(true);
+			return true;
+		});
+	RegisterCommand("", "SINGLE", any, [this](const SCPICommand&, size_t)
+		{
+			if(m_deferConfiguration)
+				CommitConfiguration();
 			AcquisitionStart(true);
-		else if (cmd == "FORCE")
+			OnTriggerArmedChanged(true);
+			return true;
+		});
+	RegisterCommand("", "FORCE", any, [this](const SCPICommand&, size_t)
+		{
 			AcquisitionForceTrigger();
-		else if (cmd == "STOP")
+			return true;
+		});
+	RegisterCommand("", "STOP", any, [this](const SCPICommand&, size_t)
+		{
 			AcquisitionStop();
-		else if (cmd == "RATE" && args.size() == 1)
+			OnTriggerArmedChanged(false);
+			return true;
+		});
+	RegisterCommand("", "RATE", 1, [this](const SCPICommand& c, size_t)
 		{
 			uint64_t arg;
-			if (ParseUint64(args[0], arg))
-				SetSampleRate(arg);
+			if(!ParseUint64(c[0], arg))
+				return false;
+			if(m_deferConfiguration)
+				m_stagedConfig.SetSampleRate(arg);
 			else
+			{
+				{
+					lock_guard<mutex> lock(g_configMutex);
+					SetSampleRate(arg);
+					g_appliedConfig.SetSampleRate(arg);
+				}
+				OnSampleRateChanged();
+				OnConfigurationChanged(c);
+			}
+			return true;
+		});
+	RegisterCommand("", "DEPTH", 1, [this](const SCPICommand& c, size_t)
+		{
+			uint64_t arg;
+			if(!ParseUint64(c[0], arg))
 				return false;
-		}
-		else if (cmd == "DEPTH" && args.size() == 1)
+			if(m_deferConfiguration)
+				m_stagedConfig.SetSampleDepth(arg);
+			else
+			{
+				{
+					lock_guard<mutex> lock(g_configMutex);
+					SetSampleDepth(arg);
+					g_appliedConfig.SetSampleDepth(arg);
+				}
+				OnSampleDepthChanged();
+				UpdateBufferPool();
+				OnConfigurationChanged(c);
+			}
+			return true;
+		});
+	RegisterCommand("", "SEGMENTS", 1, [this](const SCPICommand& c, size_t)
 		{
 			uint64_t arg;
-			if (ParseUint64(args[0], arg))
-				SetSampleDepth(arg);
+			if(!ParseUint64(c[0], arg))
+				return false;
+			if( (arg < 1) || (arg > GetMaxSegmentCount()) )
+				return false;
+			if(m_deferConfiguration)
+				m_stagedConfig.SetSegmentCount(arg);
 			else
+			{
+				{
+					lock_guard<mutex> lock(g_configMutex);
+					SetSegmentCount(arg);
+					g_appliedConfig.SetSegmentCount(arg);
+				}
+				OnConfigurationChanged(c);
+			}
+			return true;
+		});
+	RegisterCommand("", "COMMIT", 0, [this](const SCPICommand&, size_t)
+		{
+			return CommitConfiguration();
+		});
+	RegisterCommand("", "CONFIG", any, [this](const SCPICommand& c, size_t)
+		{
+			return ApplyConfiguration(c);
+		});
+	RegisterCommand("", "DECIMATE", 1, [this](const SCPICommand& c, size_t)
+		{
+			uint64_t arg;
+			if(!ParseUint64(c[0], arg))
 				return false;
-		}
-		else
-			return false;
-	}
-	else
-	{
-		if (subject == "TRIG")
+			m_decimation = arg;
+			if(m_streamer)
+				m_streamer->SetDecimation(arg);
+			return true;
+		});
+	RegisterCommand("", "COMPRESS", 1, [this](const SCPICommand& c, size_t)
+		{
+			uint64_t arg;
+			if(!ParseUint64(c[0], arg))
+				return false;
+			m_compression = (arg != 0);
+			if(m_streamer)
+				m_streamer->SetCompression(m_compression);
+			return true;
+		});
+
+	//Record captures to disk: REC:START <name>[,<segment size>[,<segment count>]] (see SetRecordingDirectory())
+	RegisterCommand("REC", "START", any, [this](const SCPICommand& c, size_t)
 		{
-			// Trigger commands
+			uint64_t segmentSize = REC_DEFAULT_SEGMENT_SIZE;
+			uint64_t segmentCount = REC_DEFAULT_SEGMENT_COUNT;
+			if( (c.GetArgCount() < 1) || (c.GetArgCount() > 3) || c[0].empty() )
+				return false;
+			if( (c.GetArgCount() >= 2) && !ParseUint64(c[1], segmentSize) )
+				return false;
+			if( (c.GetArgCount() >= 3) && !ParseUint64(c[2], segmentCount) )
+				return false;
+
+			return StartRecording(c[0], segmentSize, segmentCount);
+		});
+	RegisterCommand("REC", "STOP", 0, [](const SCPICommand&, size_t)
+		{
+			StopRecording();
+			return true;
+		});
+
+	// Trigger commands
 
-			if (cmd == "DELAY" && args.size() == 1)
+	RegisterCommand("TRIG", "DELAY", 1, [this](const SCPICommand& c, size_t)
+		{
+			uint64_t arg;
+			if(!ParseUint64(c[0], arg))
+				return false;
+			if(m_deferConfiguration)
+				m_stagedConfig.SetTriggerDelay(arg);
+			else
 			{
-				uint64_t arg;
-				if (ParseUint64(args[0], arg))
+				{
+					lock_guard<mutex> lock(g_configMutex);
 					SetTriggerDelay(arg);
-				else
-					return false;
+					g_appliedConfig.SetTriggerDelay(arg);
+				}
+				OnConfigurationChanged(c);
 			}
-			else if (cmd == "SOU" && args.size() == 1)
+			return true;
+		});
+	RegisterCommand("TRIG", "SOU", 1, [this](const SCPICommand& c, size_t)
+		{
+			size_t arg;
+			if(!LookupChannel(c[0], arg))
+				return false;
+			if(m_deferConfiguration)
+				m_stagedConfig.SetTriggerSource(arg);
+			else
 			{
-				size_t arg;
-				if (GetChannelID(args[0], arg))
+				{
+					lock_guard<mutex> lock(g_configMutex);
 					SetTriggerSource(arg);
-				else
-					return false;
+					g_appliedConfig.SetTriggerSource(arg);
+				}
+				OnConfigurationChanged(c);
 			}
-			else if (cmd == "MODE" && args.size() == 1)
+			return true;
+		});
+	RegisterCommand("TRIG", "MODE", 1, [this](const SCPICommand& c, size_t)
+		{
+			if(c[0] != "EDGE")
+				return false;
+			if(m_deferConfiguration)
+				m_stagedConfig.SetTriggerType("EDGE");
+			else
 			{
-				if (args[0] == "EDGE")
+				{
+					lock_guard<mutex> lock(g_configMutex);
 					SetTriggerTypeEdge();
-				else
-					return false;
+					g_appliedConfig.SetTriggerType("EDGE");
+				}
+				OnConfigurationChanged(c);
 			}
-			else if (cmd == "LEV" && args.size() == 1)
+			return true;
+		});
+	RegisterCommand("TRIG", "LEV", 1, [this](const SCPICommand& c, size_t)
+		{
+			double arg;
+			if(!ParseDouble(c[0], arg))
+				return false;
+			if(m_deferConfiguration)
+				m_stagedConfig.SetTriggerLevel(arg);
+			else
 			{
-				double arg;
-				if (ParseDouble(args[0], arg))
+				{
+					lock_guard<mutex> lock(g_configMutex);
 					SetTriggerLevel(arg);
-				else
-					return false;
+					g_appliedConfig.SetTriggerLevel(arg);
+				}
+				OnConfigurationChanged(c);
 			}
-			else if (cmd == "EDGE:DIR" && args.size() == 1)
-				SetEdgeTriggerEdge(args[0]);
-			else
-				return false;
-		}
-		else
+			return true;
+		});
+	RegisterCommand("TRIG", "EDGE:DIR", 1, [this](const SCPICommand& c, size_t)
 		{
-			// Channel commands (probably)
-
-			size_t channelId;
-
-			if (!GetChannelID(subject, channelId)) return false;
+			if(m_deferConfiguration)
+				m_stagedConfig.SetTriggerEdge(string(c[0]));
+			else
+			{
+				{
+					lock_guard<mutex> lock(g_configMutex);
+					SetEdgeTriggerEdge(string(c[0]));
+					g_appliedConfig.SetTriggerEdge(string(c[0]));
+				}
+				OnConfigurationChanged(c);
+			}
+			return true;
+		});
 
-			ChannelType channelType = GetChannelType(channelId);
+	// Channel commands
 
-			if (cmd == "ON")
-				SetChannelEnabled(channelId, true);
-			else if (cmd == "OFF")
-				SetChannelEnabled(channelId, false);
-			else if (cmd == "COUP" && channelType == CH_ANALOG && args.size() == 1)
-				SetAnalogCoupling(channelId, args[0]);
-			else if (cmd == "RANGE" && channelType == CH_ANALOG && args.size() == 1)
+	RegisterChannelCommand("ON", any, ANY_CHANNEL_TYPE, [this](const SCPICommand& c, size_t chan)
+		{
+			if(m_deferConfiguration)
+				m_stagedConfig.GetChannel(chan).SetEnabled(true);
+			else
+			{
+				{
+					lock_guard<mutex> lock(g_configMutex);
+					SetChannelEnabled(chan, true);
+					g_appliedConfig.GetChannel(chan).SetEnabled(true);
+				}
+				OnChannelEnableChanged();
+				UpdateBufferPool();
+				OnConfigurationChanged(c);
+			}
+			return true;
+		});
+	RegisterChannelCommand("OFF", any, ANY_CHANNEL_TYPE, [this](const SCPICommand& c, size_t chan)
+		{
+			if(m_deferConfiguration)
+				m_stagedConfig.GetChannel(chan).SetEnabled(false);
+			else
 			{
-				double arg;
-				if (ParseDouble(args[0], arg))
-					SetAnalogRange(channelId, arg);
-				else
-					return false;
+				{
+					lock_guard<mutex> lock(g_configMutex);
+					SetChannelEnabled(chan, false);
+					g_appliedConfig.GetChannel(chan).SetEnabled(false);
+				}
+				OnChannelEnableChanged();
+				UpdateBufferPool();
+				OnConfigurationChanged(c);
 			}
-			else if (cmd == "OFFS" && channelType == CH_ANALOG && args.size() == 1)
+			return true;
+		});
+	RegisterChannelCommand("COUP", 1, analog, [this](const SCPICommand& c, size_t chan)
+		{
+			if(m_deferConfiguration)
+				m_stagedConfig.GetChannel(chan).SetCoupling(string(c[0]));
+			else
 			{
-				double arg;
-				if (ParseDouble(args[0], arg))
-					SetAnalogOffset(channelId, arg);
-				else
-					return false;
+				{
+					lock_guard<mutex> lock(g_configMutex);
+					SetAnalogCoupling(chan, string(c[0]));
+					g_appliedConfig.GetChannel(chan).SetCoupling(string(c[0]));
+				}
+				OnConfigurationChanged(c);
 			}
-			else if (cmd == "THRESH" && channelType == CH_DIGITAL && args.size() == 1)
+			return true;
+		});
+	RegisterChannelCommand("RANGE", 1, analog, [this](const SCPICommand& c, size_t chan)
+		{
+			double arg;
+			if(!ParseDouble(c[0], arg))
+				return false;
+			if(m_deferConfiguration)
+				m_stagedConfig.GetChannel(chan).SetRange(arg);
+			else
 			{
-				double arg;
-				if (ParseDouble(args[0], arg))
-					SetDigitalThreshold(channelId, arg);
-				else
-					return false;
+				{
+					lock_guard<mutex> lock(g_configMutex);
+					SetAnalogRange(chan, arg);
+					g_appliedConfig.GetChannel(chan).SetRange(arg);
+				}
+				OnConfigurationChanged(c);
 			}
-			else if (cmd == "HYS" && channelType == CH_DIGITAL && args.size() == 1)
+			return true;
+		});
+	RegisterChannelCommand("OFFS", 1, analog, [this](const SCPICommand& c, size_t chan)
+		{
+			double arg;
+			if(!ParseDouble(c[0], arg))
+				return false;
+			if(m_deferConfiguration)
+				m_stagedConfig.GetChannel(chan).SetOffset(arg);
+			else
 			{
-				double arg;
-				if (ParseDouble(args[0], arg))
-					SetDigitalHysteresis(channelId, arg);
-				else
-					return false;
+				{
+					lock_guard<mutex> lock(g_configMutex);
+					SetAnalogOffset(chan, arg);
+					g_appliedConfig.GetChannel(chan).SetOffset(arg);
+				}
+				OnConfigurationChanged(c);
 			}
+			return true;
+		});
+	RegisterChannelCommand("THRESH", 1, digital, [this](const SCPICommand& c, size_t chan)
+		{
+			double arg;
+			if(!ParseDouble(c[0], arg))
+				return false;
+			if(m_deferConfiguration)
+				m_stagedConfig.GetChannel(chan).SetThreshold(arg);
 			else
+			{
+				{
+					lock_guard<mutex> lock(g_configMutex);
+					SetDigitalThreshold(chan, arg);
+					g_appliedConfig.GetChannel(chan).SetThreshold(arg);
+				}
+				OnConfigurationChanged(c);
+			}
+			return true;
+		});
+	RegisterChannelCommand("HYS", 1, digital, [this](const SCPICommand& c, size_t chan)
+		{
+			double arg;
+			if(!ParseDouble(c[0], arg))
 				return false;
-		}
+			if(m_deferConfiguration)
+				m_stagedConfig.GetChannel(chan).SetHysteresis(arg);
+			else
+			{
+				{
+					lock_guard<mutex> lock(g_configMutex);
+					SetDigitalHysteresis(chan, arg);
+					g_appliedConfig.GetChannel(chan).SetHysteresis(arg);
+				}
+				OnConfigurationChanged(c);
+			}
+			return true;
+		});
+
+	// Queries
+
+	//Read ID code
+	RegisterQuery("", "*IDN", any, [this](const SCPICommand&, size_t)
+		{
+			SendReply(GetCapabilityReply(CAP_IDN));
+			return true;
+		});
+
+	//Get number of channels
+	RegisterQuery("", "CHANS", any, [this](const SCPICommand&, size_t)
+		{
+			SendReply(GetCapabilityReply(CAP_CHANS));
+			return true;
+		});
+
+	//Checks if we're armed. Only non-blocking for drivers which push their trigger state (see IsNonBlockingQuery())
+	RegisterQuery("", "ARMED", any, [this](const SCPICommand&, size_t)
+		{
+			bool armed;
+			if(UsesPushedTriggerState())
+				armed = g_triggerArmed.load(memory_order_relaxed);
+			else
+				armed = IsTriggerArmed();
+
+			if(armed)
+				SendReply("1");
+			else
+				SendReply("0");
+			return true;
+		}, true);
+
+	//Get legal sample rates for the current configuration
+	RegisterQuery("", "RATES", any, [this](const SCPICommand&, size_t)
+		{
+			if(m_deferConfiguration)
+				CommitConfiguration();
+			SendReply(GetCapabilityReply(CAP_RATES));
+			return true;
+		});
+
+	//Get capabilities and every setting in one reply (see FormatConfiguration())
+	RegisterQuery("", "CONFIG", any, [this](const SCPICommand&, size_t)
+		{
+			if(m_deferConfiguration)
+				CommitConfiguration();
+			SendReply(FormatConfiguration());
+			return true;
+		});
+
+	//Get the number of segments per acquisition, and the most the hardware can do at the current depth
+	RegisterQuery("", "SEGMENTS", any, [this](const SCPICommand&, size_t)
+		{
+			if(m_deferConfiguration)
+				CommitConfiguration();
+			//Report what's in hardware, which another session may have changed since this one last set it
+			size_t segments;
+			{
+				lock_guard<mutex> lock(g_configMutex);
+				segments = g_appliedConfig.m_segmentCount;
+			}
+			string reply;
+			AppendSCPIUint64(reply, segments);
+			SendReply(reply);
+			return true;
+		});
+	RegisterQuery("SEGMENTS", "MAX", any, [this](const SCPICommand&, size_t)
+		{
+			if(m_deferConfiguration)
+				CommitConfiguration();
+			string reply;
+			AppendSCPIUint64(reply, GetMaxSegmentCount());
+			SendReply(reply);
+			return true;
+		});
+
+	//Get the current decimation setting
+	RegisterQuery("", "DECIMATE", any, [this](const SCPICommand&, size_t)
+		{
+			string reply;
+			AppendSCPIUint64(reply, m_decimation);
+			SendReply(reply);
+			return true;
+		});
+
+	//Get the current compression setting
+	RegisterQuery("", "COMPRESS", any, [this](const SCPICommand&, size_t)
+		{
+			SendReply(m_compression ? "1" : "0");
+			return true;
+		});
+
+	//Get recorder status and throughput (counters cover the current or most recent recording)
+	RegisterQuery("REC", "STAT", any, [this](const SCPICommand&, size_t)
+		{
+			SendReply(FormatRecordingStatus());
+			return true;
+		});
+
+	//Read back a window of the last capture: <chan>:DATA? <start>,<count>[,<buckets>]
+	RegisterChannelQuery("DATA", any, ANY_CHANNEL_TYPE, [this](const SCPICommand& c, size_t chan)
+		{
+			uint64_t start;
+			uint64_t count;
+			uint64_t buckets = 0;
+			if( (c.GetArgCount() < 2) || (c.GetArgCount() > 3) )
+				return false;
+			if(!ParseUint64(c[0], start) || !ParseUint64(c[1], count))
+				return false;
+			if( (c.GetArgCount() == 3) && !ParseUint64(c[2], buckets) )
+				return false;
+			SendWaveformWindow(chan, start, count, buckets);
+			return true;
+		});
+
+	//Get memory depths
+	RegisterQuery("", "DEPTHS", any, [this](const SCPICommand&, size_t)
+		{
+			if(m_deferConfiguration)
+				CommitConfiguration();
+			SendReply(GetCapabilityReply(CAP_DEPTHS));
+			return true;
+		});
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Command processing
+
+/**
+	@brief Looks up a command in the dispatch table and runs its handler
+
+	@param command	The parsed command
+	@param result	Return value of the handler (false if the command was found but invalid for the subject)
+
+	@return True if a handler was found, false if the command isn't registered
+ */
+bool BridgeSCPIServer::Dispatch(const SCPICommand& command, bool& result)
+{
+	result = false;
+
+	SCPIDispatchTable::SubjectClass subjectClass;
+	size_t channelId = 0;
+	ChannelType channelType = CH_ANALOG;
+	if(command.m_subject.empty())
+		subjectClass = SCPIDispatchTable::SUBJECT_NONE;
+	else if(m_dispatch.IsNamedSubject(command.m_subject))
+		subjectClass = SCPIDispatchTable::SUBJECT_NAMED;
+	else
+	{
+		//Not a subject we know about, so it's probably a channel
+		if(!LookupChannel(command.m_subject, channelId))
+			return false;
+		channelType = GetChannelType(channelId);
+		subjectClass = SCPIDispatchTable::SUBJECT_CHANNEL;
 	}
 
+	auto e = m_dispatch.Lookup(subjectClass, command.m_subject, command.m_cmd, command.m_query);
+	if(!e)
+		return false;
+
+	//Registered, but not valid with these arguments or for this channel
+	if( (e->m_arity != SCPIDispatchTable::ANY_ARITY) && (e->m_arity != command.GetArgCount()) )
+		return true;
+	if( (subjectClass == SCPIDispatchTable::SUBJECT_CHANNEL) && !(e->m_channelTypes & (1 << channelType)) )
+		return true;
+
+	result = e->m_handler(command, channelId);
 	return true;
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Query processing
+/**
+	@brief Checks if a query was registered as non-blocking
 
-bool BridgeSCPIServer::OnQuery(const string& line, const string& subject, const string& cmd)
+	Only device level and named subject queries are considered, since resolving a channel name calls into the driver.
+	ARMED? asks the driver unless it pushes its trigger state (see UsesPushedTriggerState()), so it's only
+	non-blocking then.
+ */
+bool BridgeSCPIServer::IsNonBlockingQuery(const SCPICommand& command)
 {
-	(void) line; (void) subject;
+	//A string-based override might replace the query with something that isn't safe to run here
+	if(m_legacyHandlers)
+		return false;
 
-	//Read ID code
-	if(cmd == "*IDN")
-		SendReply(GetMake() + "," + GetModel() + "," + GetSerial() + "," + GetFirmwareVersion());
+	SCPIDispatchTable::SubjectClass subjectClass;
+	if(command.m_subject.empty())
+		subjectClass = SCPIDispatchTable::SUBJECT_NONE;
+	else if(m_dispatch.IsNamedSubject(command.m_subject))
+		subjectClass = SCPIDispatchTable::SUBJECT_NAMED;
+	else
+		return false;
 
-	//Get number of channels
-	else if(cmd == "CHANS")
-		SendReply(to_string(GetAnalogChannelCount()));
+	auto e = m_dispatch.Lookup(subjectClass, command.m_subject, command.m_cmd, command.m_query);
+	if(!e || !e->m_nonblocking)
+		return false;
+	if( (e->m_cmd == "ARMED") && !UsesPushedTriggerState() )
+		return false;
+	return true;
+}
+
+/**
+	@brief Process a command
 
-	//Checks if we're armed
-	else if(cmd == "ARMED")
+	If legacy handlers are enabled (see SetLegacyHandlersEnabled()), the command goes to the string-based OnCommand()
+	first, so a derived class overriding it sees every command before the dispatch table, as it did before the table
+	existed. Otherwise it's looked up in the table directly.
+ */
+bool BridgeSCPIServer::OnCommand(const SCPICommand& command)
+{
+	if(m_legacyHandlers)
 	{
-		if(IsTriggerArmed())
-			SendReply("1");
-		else
-			SendReply("0");
+		//Keep the parsed command around so the string-based handler can dispatch it without parsing it again
+		auto outer = m_legacyCommand;
+		m_legacyCommand = &command;
+		bool result = SCPIServer::OnCommand(command);
+		m_legacyCommand = outer;
+		return result;
 	}
 
-	//Get legal sample rates for the current configuration
-	else if(cmd == "RATES")
+	bool result;
+	if(Dispatch(command, result))
+		return result;
+	return false;
+}
+
+/**
+	@brief Process a query (see view-based OnCommand())
+ */
+bool BridgeSCPIServer::OnQuery(const SCPICommand& command)
+{
+	if(m_legacyHandlers)
 	{
-		auto rates = GetSampleRates();
-		string ret = "";
-		for(auto rate : rates)
-		{
-			double interval = FS_PER_SECOND / rate;
-			ret += to_string(interval) + ",";
-		}
-		SendReply(ret);
+		auto outer = m_legacyCommand;
+		m_legacyCommand = &command;
+		bool result = SCPIServer::OnQuery(command);
+		m_legacyCommand = outer;
+		return result;
 	}
 
-	//Get memory depths
-	else if(cmd == "DEPTHS")
+	bool result;
+	if(Dispatch(command, result))
+		return result;
+	return false;
+}
+
+/**
+	@brief Process a command via the dispatch table
+
+	Reached when legacy handlers are enabled, either directly (no derived class overrides the string-based
+	interface) or from a derived class passing down a command it doesn't handle.
+ */
+bool BridgeSCPIServer::OnCommand(const string& line, const string& subject,
+                                 const string& cmd, const vector<string>& args)
+{
+	return DispatchLegacy(line, subject, cmd, false, &args);
+}
+
+/**
+	@brief Process a query via the dispatch table (see string-based OnCommand())
+ */
+bool BridgeSCPIServer::OnQuery(const string& line, const string& subject, const string& cmd)
+{
+	return DispatchLegacy(line, subject, cmd, true, nullptr);
+}
+
+/**
+	@brief Dispatches a command passed down through the string-based handlers
+
+	If the fields are the ones we passed up, the command parsed on receipt (m_legacyCommand) is dispatched as is.
+	Otherwise a derived class rewrote the command (or called us directly), so one is built from the fields it gave us.
+
+	@param line		Full SCPI line
+	@param subject	Subject of the command
+	@param cmd		Command
+	@param query	True if the command is a query
+	@param args		Arguments of a command. Null for a query, whose arguments are taken from line.
+ */
+bool BridgeSCPIServer::DispatchLegacy(
+	const string& line,
+	const string& subject,
+	const string& cmd,
+	bool query,
+	const vector<string>* args)
+{
+	bool result;
+
+	//Unchanged on the way down?
+	auto parsed = m_legacyCommand;
+	bool same = parsed && (parsed->m_query == query) && (parsed->m_line == line) &&
+		(parsed->m_subject == subject) && (parsed->m_cmd == cmd);
+	if(same && args)
 	{
-		auto depths = GetSampleDepths();
-		string ret = "";
-		for(auto d : depths)
-			ret += to_string(d) + ",";
-		SendReply(ret);
+		same = (args->size() == parsed->GetArgCount());
+		for(size_t i=0; same && (i < args->size()); i++)
+			same = ((*args)[i] == parsed->GetArg(i));
 	}
-
-	//Nope, invalid command or something handled by the derived class
-	else
+	if(same)
+	{
+		if(Dispatch(*parsed, result))
+			return result;
 		return false;
+	}
 
-	return true;
+	//Rewritten, so put a line back together from its parts and parse that
+	SCPICommand original;
+	if(!args)
+		original.Parse(line);
+
+	string rebuilt;
+	if(!subject.empty())
+		rebuilt = subject + ":";
+	rebuilt += cmd;
+	if(query)
+		rebuilt += "?";
+	size_t argCount = args ? args->size() : original.GetArgCount();
+	for(size_t i=0; i<argCount; i++)
+	{
+		rebuilt += (i == 0) ? " " : ",";
+		if(args)
+			rebuilt += (*args)[i];
+		else
+			rebuilt += original.GetArg(i);
+	}
+
+	SCPICommand command;
+	command.Parse(rebuilt);
+	if(Dispatch(command, result))
+		return result;
+	return false;
 }
@@ -31,9 +31,29 @@
 #define BridgeSCPIServer_h
 
 #include "SCPIServer.h"
+#include "SCPIDispatchTable.h"
+#include "BridgeConfiguration.h"
+#include "WaveformBufferPool.h"
+#include "WaveformRecorder.h"
+#include "WaveformRing.h"
+#include "WaveformStreamer.h"
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 
 /**
 	@brief SCPI server supporting common commands shared by all scopehal bridge servers
+
+	Built in commands are handled through a dispatch table, which derived classes can add their own handlers to with
+	RegisterCommand() and friends.
+
+	For compatibility, derived classes may still override the legacy string-based OnCommand() and OnQuery(): they
+	see every command first (including built in ones, so they can replace them) and pass the ones they don't handle
+	down to BridgeSCPIServer. Such classes should also declare "using BridgeSCPIServer::OnCommand;" and
+	"using BridgeSCPIServer::OnQuery;" so the view-based overloads aren't hidden. Derived classes that don't override
+	the string-based handlers should call SetLegacyHandlersEnabled(false), so commands go straight to the table
+	without being converted to strings.
  */
 class BridgeSCPIServer : public SCPIServer
 {
@@ -41,7 +61,13 @@ public:
 	BridgeSCPIServer(ZSOCKET sock);
 	virtual ~BridgeSCPIServer();
 
+	static void OnTriggerArmedChanged(bool armed);
+	static void SetRecordingDirectory(const std::string& path, uint64_t maxBytes = 0);
+
 protected:
+	virtual bool OnCommand(const SCPICommand& command);
+	virtual bool OnQuery(const SCPICommand& command);
+	virtual bool IsNonBlockingQuery(const SCPICommand& command);
 
 	virtual bool OnCommand(
 		const std::string& line,
@@ -54,11 +80,216 @@ protected:
 		const std::string& subject,
 		const std::string& cmd);
 
+	bool Dispatch(const SCPICommand& command, bool& result);
+	bool DispatchLegacy(
+		const std::string& line,
+		const std::string& subject,
+		const std::string& cmd,
+		bool query,
+		const std::vector<std::string>* args);
+
+	//Command registration
+protected:
+	typedef SCPIDispatchTable::Handler CommandHandler;
+
+	///@brief Bitmask for RegisterChannelCommand() matching any channel type
+	static const uint32_t ANY_CHANNEL_TYPE = 0xffffffff;
+
+	void RegisterCommand(std::string_view subject, std::string_view cmd, size_t arity, CommandHandler handler);
+	void RegisterQuery(
+		std::string_view subject,
+		std::string_view cmd,
+		size_t arity,
+		CommandHandler handler,
+		bool nonblocking = false);
+	void RegisterChannelCommand(std::string_view cmd, size_t arity, uint32_t channelTypes, CommandHandler handler);
+	void RegisterChannelQuery(std::string_view cmd, size_t arity, uint32_t channelTypes, CommandHandler handler);
+
+	void RegisterBuiltinCommands();
+
+	/**
+		@brief Selects whether commands are passed through the string-based OnCommand() and OnQuery() first
+
+		Enabled by default, so derived classes overriding the string-based handlers keep working. Non-blocking queries
+		(see RegisterQuery()) run on the caller's thread only when this is disabled, since a string-based override
+		of one might not be safe to run there.
+	 */
+	void SetLegacyHandlersEnabled(bool enable)
+	{ m_legacyHandlers = enable; }
+
+	///@brief Table of all registered commands, both built in and from derived classes
+	SCPIDispatchTable m_dispatch;
+
+	///@brief True to pass commands through the string-based handlers before the dispatch table
+	bool m_legacyHandlers;
+
+	///@brief Command currently being passed through the string-based handlers (null outside of them)
+	const SCPICommand* m_legacyCommand;
+
+	//Waveform buffer pool
+protected:
+	void EnableBufferPool(size_t bytesPerSample, size_t buffersPerChannel, bool hugePages = false);
+	void UpdateBufferPool();
+	WaveformBuffer* AllocateWaveformBuffer();
+
+	///@brief The process wide pool of capture buffers, sized for the current depth and channel set (null unless
+	///enabled by this session)
+	WaveformBufferPool* m_bufferPool;
+
+	//Decimation and full resolution readback
+protected:
+	void AttachStreamer(WaveformStreamer* streamer);
+	void RetainWaveform(const WaveformDescriptor& wfm, WaveformBuffer* buffer);
+	void ReleaseRetainedWaveforms();
+	void SendWaveformWindow(size_t chan, uint64_t start, uint64_t count, size_t buckets);
+
+	///@brief The most recent capture of one channel, kept for DATA? queries
+	class RetainedWaveform
+	{
+	public:
+		///@brief Description of the capture
+		WaveformDescriptor m_waveform;
+
+		///@brief Reference to the buffer holding the samples
+		WaveformBuffer* m_buffer;
+	};
+
+	///@brief Data plane streamer that DECIMATE and COMPRESS apply to (null if not attached)
+	WaveformStreamer* m_streamer;
+
+	///@brief Number of min/max buckets most recently requested with DECIMATE (0 for full resolution)
+	size_t m_decimation;
+
+	///@brief True if the client most recently asked for compressed waveforms with COMPRESS
+	bool m_compression;
+
+	///@brief Protects m_retained (captures are retained from the acquisition thread)
+	std::mutex m_retainMutex;
+
+	///@brief Most recent capture of each channel, indexed by channel ID
+	std::map<size_t, RetainedWaveform> m_retained;
+
+	//Recording to disk
+protected:
+	void RecordWaveform(const WaveformDescriptor& wfm, WaveformBuffer* buffer);
+	static bool StartRecording(std::string_view name, uint64_t segmentSize, uint64_t segmentCount);
+	static void StopRecording();
+	static std::string FormatRecordingStatus();
+
+	//Deferred configuration
+protected:
+	void EnableDeferredConfiguration(bool enable = true);
+	bool CommitConfiguration();
+	static BridgeConfiguration GetAppliedConfiguration();
+
+	/**
+		@brief Applies several settings of one channel to hardware in a single operation
+
+		Called by CommitConfiguration() for each channel with staged changes. Drivers which can reprogram a channel's
+		front end in one go should override this, apply whichever of the changed fields they can, and return them.
+		Any changed fields not returned are then applied one at a time through the individual setters.
+
+		@param chan		Channel ID
+		@param config	Staged configuration for the channel
+		@param changed	Bitmask of ChannelConfiguration::Field values that differ from what was last applied (by any
+						session)
+
+		@return Bitmask of fields applied. The default implementation applies nothing.
+	 */
+	virtual uint32_t ApplyChannelConfiguration(
+		size_t /*chan*/,
+		const ChannelConfiguration& /*config*/,
+		uint32_t /*changed*/)
+	{ return 0; }
+
+	/**
+		@brief Applies several device level settings (timebase and trigger) to hardware in a single operation
+
+		Called by CommitConfiguration() after all channels have been applied. See ApplyChannelConfiguration().
+
+		@param config	Staged configuration
+		@param changed	Bitmask of BridgeConfiguration::Field values that differ from what was last applied
+
+		@return Bitmask of fields applied. The default implementation applies nothing.
+	 */
+	virtual uint32_t ApplyDeviceConfiguration(const BridgeConfiguration& /*config*/, uint32_t /*changed*/)
+	{ return 0; }
+
+	void OnChannelEnableChanged();
+	void OnSampleRateChanged();
+	void OnSampleDepthChanged();
+	void OnConfigurationChanged(const SCPICommand& command);
+
+	///@brief True if configuration commands are staged rather than applied immediately
+	bool m_deferConfiguration;
+
+	///@brief Changes requested by this client in deferred mode and not yet committed
+	BridgeConfiguration m_stagedConfig;
+
+	//Bulk configuration
+protected:
+	std::string FormatConfiguration();
+	bool ApplyConfiguration(const SCPICommand& command);
+	bool StageConfigurationField(
+		std::string_view key,
+		std::string_view value,
+		BridgeConfiguration& config,
+		std::map<size_t, std::string_view>& names);
+	bool LookupChannel(std::string_view name, size_t& id);
+	void RememberChannelName(size_t id, std::string_view name);
+	static void AppendConfigurationField(std::string& reply, std::string_view key, std::string_view value);
+
+	/**
+		@brief Adds driver specific fields to the CONFIG? reply
+
+		Call AppendConfigurationField() for each field. Keys should follow the command syntax with '.' in place of ':'
+		("FOO" for a device level setting set with FOO, "C1.BAR" for a channel setting set with C1:BAR). The default
+		implementation adds nothing.
+	 */
+	virtual void AppendConfiguration(std::string& /*reply*/)
+	{}
+
+	/**
+		@brief Handles a driver specific field of a CONFIG command
+
+		Called twice for each field the library doesn't recognize: first with apply false to check the value without
+		changing anything, then, only once every field of the command has been checked and the built in settings have
+		been committed, with apply true to apply it.
+
+		@return True if the field is valid. The default implementation rejects everything.
+	 */
+	virtual bool OnConfigurationField(std::string_view /*key*/, std::string_view /*value*/, bool /*apply*/)
+	{ return false; }
+
+	//Capability reply cache
+protected:
+	/**
+		@brief Queries whose replies are cached between configuration changes
+	 */
+	enum CapabilityReply
+	{
+		CAP_IDN,
+		CAP_CHANS,
+		CAP_RATES,
+		CAP_DEPTHS,
+
+		CAP_COUNT
+	};
+
+	const std::string& GetCapabilityReply(CapabilityReply reply);
+	static void InvalidateCapabilityCache();
+
+	///@brief This session's copy of the pre-serialized reply for each capability query
+	std::string m_capabilityReplies[CAP_COUNT];
+
+	///@brief Cache generation each entry of m_capabilityReplies was generated at (zero if never)
+	uint64_t m_capabilityGenerations[CAP_COUNT];
+
 	//Accessor methods for queries (must be overridden in derived classes)
 protected:
 
-	bool ParseDouble(const std::string& s, double& v);
-	bool ParseUint64(const std::string& s, uint64_t& v);
+	bool ParseDouble(std::string_view s, double& v);
+	bool ParseUint64(std::string_view s, uint64_t& v);
 
 	//-- Version Information Accessors --//
 	/**
@@ -115,10 +346,39 @@ protected:
 	virtual void AcquisitionStop() =0;
 
 	/**
-		@brief Checks if the trigger is currently armed\
+		@brief Checks if the trigger is currently armed
+
+		Called by ARMED? (in order with other commands) unless UsesPushedTriggerState() returns true.
 	 */
 	virtual bool IsTriggerArmed() =0;
 
+	/**
+		@brief Returns true if the driver reports every change of trigger state through OnTriggerArmedChanged()
+
+		ARMED? is then answered from the recorded state without calling into the driver, so with async execution it
+		doesn't wait behind earlier commands. The default is false, and ARMED? calls IsTriggerArmed().
+	 */
+	virtual bool UsesPushedTriggerState()
+	{ return false; }
+
+	/**
+		@brief Returns the largest number of segments the hardware can capture per acquisition at the current memory
+		depth, or 1 if segmented acquisition isn't supported (the default)
+	 */
+	virtual size_t GetMaxSegmentCount()
+	{ return 1; }
+
+	/**
+		@brief Sets the number of triggers captured per acquisition (1 for normal, non-segmented acquisition)
+
+		Called with a value between 1 and GetMaxSegmentCount(). In segmented mode the hardware captures each trigger
+		into its own segment of onboard memory, re-arming itself in between, and the driver sends the whole batch
+		once the last segment is done (see WaveformStreamer::SendSegments()) rather than transferring each capture
+		separately. The default implementation does nothing.
+	 */
+	virtual void SetSegmentCount(size_t /*segments*/)
+	{}
+
 
 	//-- Probe Configuration --//
 	/**
@@ -192,6 +452,61 @@ protected:
 	 */
 	virtual void SetEdgeTriggerEdge(const std::string& edge) =0;
 
+	//-- Configuration Readback --//
+	/*
+		Used to fill in the CONFIG? reply for settings no client has made since the bridge started. Each returns true
+		and places the value into its output argument if the driver knows it. The default implementations return
+		false, and the setting is left out of the reply.
+	 */
+
+	///@brief Gets the current sample rate in Hz
+	virtual bool GetSampleRate(uint64_t& /*rate_hz*/)
+	{ return false; }
+
+	///@brief Gets the current memory depth in samples
+	virtual bool GetSampleDepth(uint64_t& /*depth*/)
+	{ return false; }
+
+	///@brief Gets the current trigger delay in femtoseconds
+	virtual bool GetTriggerDelay(uint64_t& /*delay_fs*/)
+	{ return false; }
+
+	///@brief Gets the ID of the channel the trigger is sourced from
+	virtual bool GetTriggerSource(size_t& /*chIndex*/)
+	{ return false; }
+
+	///@brief Gets the trigger's level in Volts
+	virtual bool GetTriggerLevel(double& /*level_V*/)
+	{ return false; }
+
+	///@brief Gets the edge the edge trigger activates on ("RISING", "FALLING", ...)
+	virtual bool GetEdgeTriggerEdge(std::string& /*edge*/)
+	{ return false; }
+
+	///@brief Gets whether channel `chIndex` is enabled
+	virtual bool GetChannelEnabled(size_t /*chIndex*/, bool& /*enabled*/)
+	{ return false; }
+
+	///@brief Gets the coupling of the probe on channel `chIndex`
+	virtual bool GetAnalogCoupling(size_t /*chIndex*/, std::string& /*coupling*/)
+	{ return false; }
+
+	///@brief Gets the voltage range of the probe on channel `chIndex` (Volts max-to-min)
+	virtual bool GetAnalogRange(size_t /*chIndex*/, double& /*range_V*/)
+	{ return false; }
+
+	///@brief Gets the voltage offset of the probe on channel `chIndex` (Volts)
+	virtual bool GetAnalogOffset(size_t /*chIndex*/, double& /*offset_V*/)
+	{ return false; }
+
+	///@brief Gets the threshold for a digital HIGH on channel `chIndex`
+	virtual bool GetDigitalThreshold(size_t /*chIndex*/, double& /*threshold_V*/)
+	{ return false; }
+
+	///@brief Gets the hysteresis value for the digital channel `chIndex`
+	virtual bool GetDigitalHysteresis(size_t /*chIndex*/, double& /*hysteresis*/)
+	{ return false; }
+
 	//-- Channel Information --//
 	/**
 		@brief Converts a string name (for example "C2") to an implementation-specific numeric channel ID.
@@ -0,0 +1,130 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#include "SCPICommand.h"
+#include <ctype.h>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+SCPICommand::SCPICommand()
+	: m_query(false)
+	, m_argCount(0)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Parsing
+
+void SCPICommand::AddArg(string_view arg)
+{
+	if(m_argCount < SCPI_INLINE_ARGS)
+		m_args[m_argCount] = arg;
+	else
+		m_extraArgs.push_back(arg);
+	m_argCount ++;
+}
+
+/**
+	@brief Crack an inbound SCPI command into its component parts
+
+	Follows the same rules as SCPIServer::ParseLine(), except that a '?' is only removed from the token it is in if
+	it's at the start or end of the token (since tokens are views into the line and must be contiguous).
+
+	@param line		The inbound SCPI command. Must remain valid for as long as this object's fields are used.
+ */
+void SCPICommand::Parse(string_view line)
+{
+	//Reset fields
+	m_line = line;
+	m_subject = string_view();
+	m_cmd = string_view();
+	m_query = false;
+	m_argCount = 0;
+	m_extraArgs.clear();
+
+	//Current token is line[tokStart, tokEnd)
+	size_t tokStart = 0;
+	size_t tokEnd = 0;
+	bool reading_cmd = true;
+	for(size_t i=0; i<line.length(); i++)
+	{
+		char c = line[i];
+
+		//If there's no colon in the command, the first block is the command.
+		//If there is one, the first block is the subject and the second is the command.
+		//If more than one, treat it as freeform text in the command.
+		if( (c == ':') && m_subject.empty() )
+		{
+			m_subject = line.substr(tokStart, tokEnd - tokStart);
+			tokStart = tokEnd = 0;
+			continue;
+		}
+
+		//Detect queries
+		if(c == '?')
+		{
+			m_query = true;
+			continue;
+		}
+
+		//Comma delimits arguments, space delimits command-to-args
+		if(!(isspace(static_cast<unsigned char>(c)) && m_cmd.empty()) && c != ',')
+		{
+			if(tokStart == tokEnd)
+				tokStart = i;
+			tokEnd = i + 1;
+			continue;
+		}
+
+		//merge multiple delimiters into one delimiter
+		if(tokStart == tokEnd)
+			continue;
+
+		//Save command or argument
+		if(reading_cmd)
+			m_cmd = line.substr(tokStart, tokEnd - tokStart);
+		else
+			AddArg(line.substr(tokStart, tokEnd - tokStart));
+
+		reading_cmd = false;
+		tokStart = tokEnd = 0;
+	}
+
+	//Stuff left over at the end? Figure out which field it belongs in
+	if(tokStart != tokEnd)
+	{
+		if(!m_cmd.empty())
+			AddArg(line.substr(tokStart, tokEnd - tokStart));
+		else
+			m_cmd = line.substr(tokStart, tokEnd - tokStart);
+	}
+}
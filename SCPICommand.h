@@ -0,0 +1,95 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef SCPICommand_h
+#define SCPICommand_h
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+//Number of arguments stored inline in a SCPICommand. Commands with more than this spill over into a vector.
+#define SCPI_INLINE_ARGS 8
+
+/**
+	@brief A parsed SCPI command
+
+	All fields are views into the line passed to Parse(), and are only valid as long as that line is. An instance is
+	meant to be reused across commands, so parsing a typical command does not allocate any memory.
+ */
+class SCPICommand
+{
+public:
+	SCPICommand();
+
+	void Parse(std::string_view line);
+
+	///@brief Returns the number of arguments to the command
+	size_t GetArgCount() const
+	{ return m_argCount; }
+
+	///@brief Returns the argument at index i
+	std::string_view GetArg(size_t i) const
+	{
+		if(i < SCPI_INLINE_ARGS)
+			return m_args[i];
+		else
+			return m_extraArgs[i - SCPI_INLINE_ARGS];
+	}
+
+	///@brief Returns the argument at index i
+	std::string_view operator[](size_t i) const
+	{ return GetArg(i); }
+
+	///@brief Full SCPI line (for display in error messages or logs)
+	std::string_view m_line;
+
+	///@brief Subject of the command (for example "C2" in "C2:OFFS?"), empty if none
+	std::string_view m_subject;
+
+	///@brief Command (for example "OFFS" in "C2:OFFS?")
+	std::string_view m_cmd;
+
+	///@brief True if the command is a query
+	bool m_query;
+
+protected:
+	void AddArg(std::string_view arg);
+
+	///@brief Inline storage for the first SCPI_INLINE_ARGS arguments
+	std::string_view m_args[SCPI_INLINE_ARGS];
+
+	///@brief Number of arguments
+	size_t m_argCount;
+
+	///@brief Storage for arguments past the first SCPI_INLINE_ARGS (capacity is retained across commands)
+	std::vector<std::string_view> m_extraArgs;
+};
+
+#endif
@@ -0,0 +1,167 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#include "SCPIDispatchTable.h"
+#include <log.h>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+SCPIDispatchTable::SCPIDispatchTable()
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Hashing
+
+/**
+	@brief FNV-1a hash of a string, continuing from a previous hash value
+ */
+uint64_t SCPIDispatchTable::Hash(string_view str, uint64_t hash)
+{
+	for(char c : str)
+	{
+		hash ^= static_cast<uint8_t>(c);
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/**
+	@brief Hash of a full lookup key
+
+	The subject name is only part of the key for SUBJECT_NAMED entries.
+ */
+uint64_t SCPIDispatchTable::Hash(SubjectClass subjectClass, string_view subject, string_view cmd, bool query)
+{
+	char prefix[2] = { static_cast<char>('0' + subjectClass), query ? '?' : '.' };
+
+	uint64_t hash = Hash(string_view(prefix, sizeof(prefix)));
+	if(subjectClass == SUBJECT_NAMED)
+	{
+		hash = Hash(subject, hash);
+		hash = Hash(":", hash);
+	}
+	return Hash(cmd, hash);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Registration and lookup
+
+/**
+	@brief Registers a handler, replacing any previous handler for the same key
+
+	@param subjectClass	Kind of subject the command applies to
+	@param subject		Subject name (SUBJECT_NAMED only, ignored otherwise)
+	@param cmd			Command name
+	@param query		True to register a query, false for a command
+	@param arity		Number of arguments the command takes, or ANY_ARITY to skip the check
+	@param channelTypes	Bitmask of channel types the command is valid for (SUBJECT_CHANNEL only)
+	@param handler		The handler
+	@param nonblocking	True if the handler only reads cached state (see SCPIServer::IsNonBlockingQuery())
+ */
+void SCPIDispatchTable::Register(
+	SubjectClass subjectClass,
+	string_view subject,
+	string_view cmd,
+	bool query,
+	size_t arity,
+	uint32_t channelTypes,
+	Handler handler,
+	bool nonblocking)
+{
+	if(subjectClass != SUBJECT_NAMED)
+		subject = string_view();
+
+	uint64_t hash = Hash(subjectClass, subject, cmd, query);
+
+	//Make sure we're replacing the same command, not a hash collision with a different one
+	auto it = m_entries.find(hash);
+	if(it != m_entries.end())
+	{
+		auto& e = it->second;
+		if( (e.m_subjectClass != subjectClass) || (e.m_subject != subject) || (e.m_cmd != cmd) ||
+			(e.m_query != query) )
+		{
+			LogError("SCPIDispatchTable: hash collision between %s:%s and %s:%s, not registering\n",
+				e.m_subject.c_str(), e.m_cmd.c_str(), string(subject).c_str(), string(cmd).c_str());
+			return;
+		}
+	}
+
+	auto& e = m_entries[hash];
+	e.m_subjectClass = subjectClass;
+	e.m_subject = subject;
+	e.m_cmd = cmd;
+	e.m_query = query;
+	e.m_arity = arity;
+	e.m_channelTypes = channelTypes;
+	e.m_nonblocking = nonblocking;
+	e.m_handler = handler;
+
+	if(subjectClass == SUBJECT_NAMED)
+		m_namedSubjects[Hash(subject)] = subject;
+}
+
+/**
+	@brief Looks up the handler for a command
+
+	@return The entry, or nullptr if no handler is registered
+ */
+const SCPIDispatchTable::Entry* SCPIDispatchTable::Lookup(
+	SubjectClass subjectClass,
+	string_view subject,
+	string_view cmd,
+	bool query) const
+{
+	if(subjectClass != SUBJECT_NAMED)
+		subject = string_view();
+
+	auto it = m_entries.find(Hash(subjectClass, subject, cmd, query));
+	if(it == m_entries.end())
+		return nullptr;
+
+	//Verify it's really the same key
+	auto& e = it->second;
+	if( (e.m_subjectClass != subjectClass) || (e.m_subject != subject) || (e.m_cmd != cmd) || (e.m_query != query) )
+		return nullptr;
+
+	return &e;
+}
+
+/**
+	@brief Checks if a subject name has any SUBJECT_NAMED handlers registered for it
+ */
+bool SCPIDispatchTable::IsNamedSubject(string_view subject) const
+{
+	auto it = m_namedSubjects.find(Hash(subject));
+	return (it != m_namedSubjects.end()) && (it->second == subject);
+}
@@ -0,0 +1,133 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef SCPIDispatchTable_h
+#define SCPIDispatchTable_h
+
+#include "SCPICommand.h"
+#include <functional>
+#include <stdint.h>
+#include <unordered_map>
+
+/**
+	@brief Hash table mapping (subject class, command, query flag) to a handler
+
+	Keys are hashed once at registration time; lookups hash the string_views from the parsed command and never
+	allocate.
+ */
+class SCPIDispatchTable
+{
+public:
+	SCPIDispatchTable();
+
+	///@brief What kind of object a command operates on
+	enum SubjectClass
+	{
+		///@brief No subject (device level commands like "START")
+		SUBJECT_NONE,
+
+		///@brief A fixed subject name (for example "TRIG" in "TRIG:LEV")
+		SUBJECT_NAMED,
+
+		///@brief Any channel name (for example "C1" in "C1:OFFS")
+		SUBJECT_CHANNEL
+	};
+
+	///@brief Arity value that accepts any number of arguments
+	static const size_t ANY_ARITY = SIZE_MAX;
+
+	/**
+		@brief Handler for a command
+
+		@param command	The parsed command
+		@param channel	Channel ID for SUBJECT_CHANNEL commands, zero otherwise
+
+		@return True if the command was processed, false if invalid
+	 */
+	typedef std::function<bool(const SCPICommand& command, size_t channel)> Handler;
+
+	///@brief A registered handler
+	class Entry
+	{
+	public:
+		SubjectClass m_subjectClass;
+		std::string m_subject;
+		std::string m_cmd;
+		bool m_query;
+
+		///@brief Number of arguments required, or ANY_ARITY
+		size_t m_arity;
+
+		///@brief Bitmask of channel types the command is valid for (SUBJECT_CHANNEL only, interpreted by the caller)
+		uint32_t m_channelTypes;
+
+		///@brief True if the handler only reads cached state and may run without waiting for earlier commands
+		bool m_nonblocking;
+
+		Handler m_handler;
+	};
+
+	void Register(
+		SubjectClass subjectClass,
+		std::string_view subject,
+		std::string_view cmd,
+		bool query,
+		size_t arity,
+		uint32_t channelTypes,
+		Handler handler,
+		bool nonblocking = false);
+
+	const Entry* Lookup(
+		SubjectClass subjectClass,
+		std::string_view subject,
+		std::string_view cmd,
+		bool query) const;
+
+	bool IsNamedSubject(std::string_view subject) const;
+
+protected:
+	static uint64_t Hash(SubjectClass subjectClass, std::string_view subject, std::string_view cmd, bool query);
+	static uint64_t Hash(std::string_view str, uint64_t hash = 0xcbf29ce484222325ULL);
+
+	///@brief Keys are already hashed, so the table doesn't need to hash them again
+	class IdentityHash
+	{
+	public:
+		size_t operator()(uint64_t h) const
+		{ return static_cast<size_t>(h); }
+	};
+
+	///@brief Map of precomputed key hash to handler
+	std::unordered_map<uint64_t, Entry, IdentityHash> m_entries;
+
+	///@brief Map of subject name hash to name, for all subjects used by SUBJECT_NAMED entries
+	std::unordered_map<uint64_t, std::string, IdentityHash> m_namedSubjects;
+};
+
+#endif
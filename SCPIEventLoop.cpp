@@ -0,0 +1,929 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#include "SCPIEventLoop.h"
+#include "SCPIStatistics.h"
+#include "SCPIThreading.h"
+#include "SCPIUnixListener.h"
+#include "SCPIUring.h"
+#include <log.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+//Maximum number of events returned by one epoll_wait() call
+#define MAX_EVENTS 64
+
+//Stop reading commands from a session while it has more than this much reply data backed up
+#define TX_HIGH_WATER (1024 * 1024)
+
+//epoll user data value identifying the listening sockets and wakeup eventfd (sessions use their socket handle)
+#define LISTEN_TAG (-1)
+#define WAKE_TAG (-2)
+#define UNIX_LISTEN_TAG (-3)
+
+//io_uring submission queue size, and number and size of the provided receive buffers, per worker
+#define URING_ENTRIES 256
+#define URING_RX_BUFFERS 256
+#define URING_RX_BUFFER_SIZE 4096
+
+#ifdef HAVE_IO_URING
+
+//io_uring operations, stored in the low byte of the user data (the rest is the socket handle or tag)
+#define URING_OP_POLL 1
+#define URING_OP_RECV 2
+#define URING_OP_SEND 3
+#define URING_OP_CANCEL 4
+
+static uint64_t UringData(int fd, int op)
+{
+	return (static_cast<uint64_t>(static_cast<uint32_t>(fd)) << 8) | op;
+}
+
+static int UringFD(uint64_t userData)
+{
+	return static_cast<int>(static_cast<uint32_t>(userData >> 8));
+}
+
+static int UringOp(uint64_t userData)
+{
+	return static_cast<int>(userData & 0xff);
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+/**
+	@brief Creates an event loop
+
+	@param factory		Creates a session object for each new client
+	@param nthreads		Number of threads to run sessions on
+	@param backend		Socket I/O backend
+ */
+SCPIEventLoop::SCPIEventLoop(SessionFactory factory, size_t nthreads, Backend backend)
+	: m_factory(factory)
+	, m_nextWorker(0)
+	, m_stopping(false)
+{
+	bool uring = (ResolveBackend(backend) == BACKEND_URING);
+
+	if(nthreads == 0)
+		nthreads = 1;
+	for(size_t i=0; i<nthreads; i++)
+		m_workers.push_back(make_unique<Worker>(uring));
+
+	m_backend = m_workers[0]->m_ring ? BACKEND_URING : BACKEND_EPOLL;
+	LogVerbose("SCPIEventLoop: using %s backend\n", GetBackendName(m_backend));
+}
+
+SCPIEventLoop::~SCPIEventLoop()
+{
+}
+
+/**
+	@brief Creates a worker's epoll instance or io_uring, and its wakeup eventfd
+
+	@param uring	True to try io_uring first
+ */
+SCPIEventLoop::Worker::Worker(bool uring)
+	: m_epollfd(-1)
+{
+	m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(m_wakefd < 0)
+		LogError("SCPIEventLoop: eventfd failed (%s)\n", strerror(errno));
+
+#ifdef HAVE_IO_URING
+	if(uring)
+	{
+		m_ring = make_unique<SCPIUring>();
+		if(m_ring->Open(URING_ENTRIES) && m_ring->SetupReceiveBuffers(URING_RX_BUFFERS, URING_RX_BUFFER_SIZE))
+			return;
+
+		LogWarning("SCPIEventLoop: failed to set up io_uring, falling back to epoll\n");
+		m_ring.reset();
+	}
+#else
+	(void)uring;
+#endif
+
+	m_epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if(m_epollfd < 0)
+		LogError("SCPIEventLoop: epoll_create1 failed (%s)\n", strerror(errno));
+
+	epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = WAKE_TAG;
+	epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_wakefd, &ev);
+}
+
+SCPIEventLoop::Worker::~Worker()
+{
+#ifdef HAVE_IO_URING
+	//Sends and receives in flight reference session buffers, so shut every socket down and wait for them to finish
+	if(m_ring)
+	{
+		vector<int> fds;
+		for(auto& it : m_sessions)
+			fds.push_back(it.first);
+		for(auto fd : fds)
+			CloseSession(fd, false);
+
+		while(!m_sessions.empty())
+		{
+			if(m_ring->Submit(1) < 0)
+				break;
+			while(auto cqe = m_ring->PeekCQE())
+			{
+				uint64_t userData = cqe->user_data;
+				int res = cqe->res;
+				uint32_t flags = cqe->flags;
+				m_ring->AdvanceCQ();
+				HandleCompletion(userData, res, flags);
+			}
+		}
+	}
+#endif
+
+	//Close sessions before the epoll instance they're registered with
+	for(auto& it : m_sessions)
+		it.second->StopAsyncExecution();
+	m_sessions.clear();
+
+	for(auto sock : m_pendingClients)
+		close(sock);
+
+	close(m_wakefd);
+	if(m_epollfd >= 0)
+		close(m_epollfd);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Backend selection
+
+/**
+	@brief Picks the backend to use for a requested one, based on the environment and what the kernel supports
+ */
+SCPIEventLoop::Backend SCPIEventLoop::ResolveBackend(Backend backend)
+{
+	if(backend == BACKEND_AUTO)
+	{
+		backend = BACKEND_EPOLL;
+
+		auto env = getenv("SCPI_IO_BACKEND");
+		if(env && !strcmp(env, "uring"))
+			backend = BACKEND_URING;
+		else if(env && strcmp(env, "epoll"))
+			LogWarning("SCPIEventLoop: unknown SCPI_IO_BACKEND \"%s\", using epoll\n", env);
+	}
+
+	if(backend != BACKEND_URING)
+		return backend;
+
+#ifdef HAVE_IO_URING
+	if(SCPIUring::IsSupported())
+		return BACKEND_URING;
+	LogNotice("SCPIEventLoop: io_uring not supported by this kernel, using epoll\n");
+#else
+	LogNotice("SCPIEventLoop: built without io_uring support, using epoll\n");
+#endif
+	return BACKEND_EPOLL;
+}
+
+/**
+	@brief Returns the name of a backend, as used by SCPI_IO_BACKEND
+ */
+const char* SCPIEventLoop::GetBackendName(Backend backend)
+{
+	switch(backend)
+	{
+		case BACKEND_EPOLL:
+			return "epoll";
+		case BACKEND_URING:
+			return "uring";
+		default:
+			return "auto";
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Client management
+
+/**
+	@brief Opens a TCP socket listening for new clients on the given port
+ */
+bool SCPIEventLoop::Listen(uint16_t port)
+{
+	m_listenSocket = make_unique<Socket>(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+	if(!m_listenSocket->SetReuseaddr(true))
+		LogWarning("SCPIEventLoop: failed to set SO_REUSEADDR\n");
+	if(!m_listenSocket->Bind(port))
+	{
+		LogError("SCPIEventLoop: failed to bind port %d\n", port);
+		return false;
+	}
+	if(!m_listenSocket->Listen())
+	{
+		LogError("SCPIEventLoop: failed to listen on port %d\n", port);
+		return false;
+	}
+
+	if(!AddListener(*m_listenSocket, LISTEN_TAG))
+		return false;
+
+	LogVerbose("SCPIEventLoop: listening on port %d\n", port);
+	return true;
+}
+
+/**
+	@brief Opens a Unix domain socket listening for new local clients at the given path
+
+	May be used instead of, or as well as, Listen().
+ */
+bool SCPIEventLoop::ListenUnix(const string& path)
+{
+	m_unixListener = make_unique<SCPIUnixListener>();
+	if(!m_unixListener->Listen(path))
+		return false;
+	return AddListener(m_unixListener->GetSocket(), UNIX_LISTEN_TAG);
+}
+
+/**
+	@brief Registers a listening socket with the first worker, which handles accepting
+
+	With the io_uring backend, call before Run().
+ */
+bool SCPIEventLoop::AddListener(int fd, int tag)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+	//The io_uring backend arms its polls from the worker thread once Run() starts
+	if(m_workers[0]->m_ring)
+	{
+		m_listeners.push_back(make_pair(fd, tag));
+		return true;
+	}
+
+	epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = tag;
+	if(0 != epoll_ctl(m_workers[0]->m_epollfd, EPOLL_CTL_ADD, fd, &ev))
+	{
+		LogError("SCPIEventLoop: failed to add listening socket to epoll (%s)\n", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/**
+	@brief Adds an already connected client socket to the event loop
+
+	May be called from any thread. The socket is handed to the workers in round-robin order.
+ */
+bool SCPIEventLoop::AddClient(ZSOCKET sock)
+{
+	auto worker = m_workers[m_nextWorker.fetch_add(1, memory_order_relaxed) % m_workers.size()].get();
+
+	{
+		lock_guard<mutex> lock(worker->m_pendingMutex);
+		worker->m_pendingClients.push_back(sock);
+	}
+	worker->Wake();
+	return true;
+}
+
+/**
+	@brief Accepts all clients waiting on a listening socket
+ */
+void SCPIEventLoop::AcceptClients(int listenfd)
+{
+	while(true)
+	{
+		ZSOCKET sock = accept4(listenfd, nullptr, nullptr, SOCK_CLOEXEC);
+		if(sock < 0)
+		{
+			if( (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR) )
+				LogWarning("SCPIEventLoop: accept failed (%s)\n", strerror(errno));
+			return;
+		}
+
+		AddClient(sock);
+	}
+}
+
+/**
+	@brief Creates sessions for all clients handed to a worker thread
+ */
+void SCPIEventLoop::AddPendingClients(Worker* worker)
+{
+	vector<ZSOCKET> socks;
+	{
+		lock_guard<mutex> lock(worker->m_pendingMutex);
+		socks.swap(worker->m_pendingClients);
+	}
+
+	for(auto sock : socks)
+	{
+		unique_ptr<SCPIServer> session(m_factory(sock));
+		if(!session)
+			continue;
+
+#ifdef HAVE_IO_URING
+		if(worker->m_ring)
+		{
+			if(!session->SetCompletionIO())
+			{
+				LogWarning("SCPIEventLoop: failed to make socket non-blocking, dropping client\n");
+				continue;
+			}
+
+			session->SetAsyncWakeCallback([worker, sock]{ worker->WakeSession(sock); });
+			worker->m_sessions[sock] = std::move(session);
+			worker->m_uringSessions[sock] = Worker::UringSession();
+			worker->ArmReceive(sock);
+			continue;
+		}
+#endif
+
+		if(!session->SetNonBlocking())
+		{
+			LogWarning("SCPIEventLoop: failed to make socket non-blocking, dropping client\n");
+			continue;
+		}
+
+		epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = sock;
+		if(0 != epoll_ctl(worker->m_epollfd, EPOLL_CTL_ADD, sock, &ev))
+		{
+			LogWarning("SCPIEventLoop: failed to add client to epoll (%s)\n", strerror(errno));
+			continue;
+		}
+
+		session->SetAsyncWakeCallback([worker, sock]{ worker->WakeSession(sock); });
+		worker->m_sessions[sock] = std::move(session);
+	}
+}
+
+/**
+	@brief Sends replies that async session workers have finished since the last wakeup
+ */
+void SCPIEventLoop::ServiceWokenSessions(Worker* worker)
+{
+	vector<int> fds;
+	{
+		lock_guard<mutex> lock(worker->m_pendingMutex);
+		fds.swap(worker->m_wokenSessions);
+	}
+
+	for(auto fd : fds)
+	{
+		auto it = worker->m_sessions.find(fd);
+		if(it == worker->m_sessions.end())
+			continue;
+		auto session = it->second.get();
+
+		if(session->OnAsyncComplete())
+			worker->UpdateInterest(session);
+		else
+			worker->CloseSession(fd);
+	}
+}
+
+/**
+	@brief Wakes the worker thread up from epoll_wait()
+ */
+void SCPIEventLoop::Worker::Wake()
+{
+	uint64_t one = 1;
+	if(sizeof(one) != write(m_wakefd, &one, sizeof(one)))
+		LogWarning("SCPIEventLoop: failed to wake worker\n");
+}
+
+/**
+	@brief Asks the worker thread to send a session's finished async replies. May be called from any thread.
+ */
+void SCPIEventLoop::Worker::WakeSession(int fd)
+{
+	{
+		lock_guard<mutex> lock(m_pendingMutex);
+		m_wokenSessions.push_back(fd);
+	}
+	Wake();
+}
+
+/**
+	@brief Updates the events we wait for on a session's socket based on how much reply data it has queued
+
+	Sessions with a large reply backlog stop being read from until the client catches up. With io_uring, this is also
+	where queued reply data is picked up for sending.
+ */
+void SCPIEventLoop::Worker::UpdateInterest(SCPIServer* session)
+{
+#ifdef HAVE_IO_URING
+	if(m_ring)
+	{
+		int fd = session->GetSocket();
+		auto& state = m_uringSessions[fd];
+		if(state.m_closing)
+			return;
+
+		if(!state.m_sending && !SubmitSend(fd))
+		{
+			CloseSession(fd);
+			return;
+		}
+
+		//Stop receiving while the backlog is too big (the multishot receive ends once the cancel goes through)
+		size_t backlog = session->GetPendingTxSize() + state.m_tx.size() - state.m_txOffset;
+		if(backlog >= TX_HIGH_WATER)
+		{
+			if(!state.m_throttled && state.m_receiving)
+			{
+				auto sqe = m_ring->GetSQE();
+				if(sqe)
+					SCPIUring::PrepCancel(sqe, UringData(fd, URING_OP_RECV), UringData(fd, URING_OP_CANCEL));
+			}
+			state.m_throttled = true;
+		}
+		else
+		{
+			state.m_throttled = false;
+			if(!state.m_receiving)
+				ArmReceive(fd);
+		}
+		return;
+	}
+#endif
+
+	epoll_event ev;
+	ev.events = 0;
+	if(session->GetPendingTxSize() < TX_HIGH_WATER)
+		ev.events |= EPOLLIN;
+	if(session->HasPendingTx())
+		ev.events |= EPOLLOUT;
+	ev.data.fd = session->GetSocket();
+	epoll_ctl(m_epollfd, EPOLL_CTL_MOD, session->GetSocket(), &ev);
+}
+
+/**
+	@brief Closes a session and removes it from the event loop
+
+	With io_uring, the session is only removed once its operations in flight have finished, after sending whatever
+	replies it still has queued.
+
+	@param fd		Socket handle of the session
+	@param flush	False to shut the socket down right away without sending queued replies (io_uring only)
+ */
+void SCPIEventLoop::Worker::CloseSession(int fd, bool flush)
+{
+#ifdef HAVE_IO_URING
+	if(m_ring)
+	{
+		auto it = m_sessions.find(fd);
+		if(it == m_sessions.end())
+			return;
+		auto& state = m_uringSessions[fd];
+		if(state.m_closing)
+			return;
+		state.m_closing = true;
+		if(!flush)
+			state.m_failed = true;
+
+		//Let queued commands finish, and stop reading any more
+		it->second->StopAsyncExecution();
+		if(state.m_receiving && !state.m_failed)
+		{
+			auto sqe = m_ring->GetSQE();
+			if(sqe)
+				SCPIUring::PrepCancel(sqe, UringData(fd, URING_OP_RECV), UringData(fd, URING_OP_CANCEL));
+		}
+		ContinueClose(fd);
+		return;
+	}
+#else
+	(void)flush;
+#endif
+
+	epoll_ctl(m_epollfd, EPOLL_CTL_DEL, fd, nullptr);
+
+	//Let queued commands finish before the session goes away
+	auto it = m_sessions.find(fd);
+	if(it != m_sessions.end())
+		it->second->StopAsyncExecution();
+	m_sessions.erase(fd);
+	LogVerbose("SCPIEventLoop: client disconnected\n");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// io_uring backend
+
+#ifdef HAVE_IO_URING
+
+/**
+	@brief Arms a multishot poll for readability on the wakeup eventfd or a listening socket
+ */
+void SCPIEventLoop::Worker::ArmPoll(int fd, int tag)
+{
+	auto sqe = m_ring->GetSQE();
+	if(!sqe)
+	{
+		LogError("SCPIEventLoop: io_uring submission queue full, can't poll\n");
+		return;
+	}
+	SCPIUring::PrepPollMultishot(sqe, fd, UringData(tag, URING_OP_POLL));
+}
+
+/**
+	@brief Arms a multishot receive on a session's socket
+ */
+void SCPIEventLoop::Worker::ArmReceive(int fd)
+{
+	auto sqe = m_ring->GetSQE();
+	if(!sqe)
+	{
+		LogError("SCPIEventLoop: io_uring submission queue full, can't receive\n");
+		return;
+	}
+	SCPIUring::PrepRecvMultishot(sqe, fd, UringData(fd, URING_OP_RECV));
+	m_uringSessions[fd].m_receiving = true;
+}
+
+/**
+	@brief Sends the rest of the reply data in flight, or whatever the session has queued if that's all gone
+
+	Must not be called while a send is in flight.
+
+	@return False if the send couldn't be queued
+ */
+bool SCPIEventLoop::Worker::SubmitSend(int fd)
+{
+	auto& state = m_uringSessions[fd];
+	if(state.m_txOffset >= state.m_tx.size())
+	{
+		state.m_txOffset = 0;
+		if(!m_sessions[fd]->TakePendingTx(state.m_tx))
+			return true;
+	}
+
+	auto sqe = m_ring->GetSQE();
+	if(!sqe)
+	{
+		LogError("SCPIEventLoop: io_uring submission queue full, can't send\n");
+		return false;
+	}
+
+	//MSG_WAITALL has the kernel retry partial sends itself
+	SCPIUring::PrepSend(
+		sqe,
+		fd,
+		state.m_tx.data() + state.m_txOffset,
+		state.m_tx.size() - state.m_txOffset,
+		MSG_NOSIGNAL | MSG_WAITALL,
+		UringData(fd, URING_OP_SEND));
+	state.m_sending = true;
+	return true;
+}
+
+/**
+	@brief Handles a completion for a session operation
+
+	@return False if the completion is for a poll, which the caller has to handle
+ */
+bool SCPIEventLoop::Worker::HandleCompletion(uint64_t userData, int res, uint32_t flags)
+{
+	switch(UringOp(userData))
+	{
+		case URING_OP_RECV:
+			OnReceiveComplete(UringFD(userData), res, flags);
+			return true;
+
+		case URING_OP_SEND:
+			OnSendComplete(UringFD(userData), res);
+			return true;
+
+		case URING_OP_POLL:
+			return false;
+
+		default:
+			return true;
+	}
+}
+
+/**
+	@brief Handles data (or an error, or the end of the stream) from a session's multishot receive
+ */
+void SCPIEventLoop::Worker::OnReceiveComplete(int fd, int res, uint32_t flags)
+{
+	auto it = m_sessions.find(fd);
+	if(it == m_sessions.end())
+		return;
+	auto session = it->second.get();
+	auto& state = m_uringSessions[fd];
+
+	if(!(flags & IORING_CQE_F_MORE))
+		state.m_receiving = false;
+
+	//Run the commands in the data, then give the buffer straight back to the kernel
+	bool ok = true;
+	if(flags & IORING_CQE_F_BUFFER)
+	{
+		uint16_t id = flags >> IORING_CQE_BUFFER_SHIFT;
+		if( (res > 0) && !state.m_closing )
+			ok = session->OnReceived(m_ring->GetReceiveBuffer(id), res);
+		m_ring->RecycleReceiveBuffer(id);
+	}
+
+	//Client closed the connection, or the socket failed. Out of buffers or cancelled just means re-arm (or not).
+	if(res == 0)
+		ok = false;
+	else if( (res < 0) && (res != -ENOBUFS) && (res != -ECANCELED) )
+	{
+		state.m_failed = true;
+		ok = false;
+	}
+
+	if(state.m_closing)
+		ContinueClose(fd);
+	else if(!ok)
+		CloseSession(fd);
+	else
+		UpdateInterest(session);
+}
+
+/**
+	@brief Handles the end of a send, moving on to the next batch of reply data
+ */
+void SCPIEventLoop::Worker::OnSendComplete(int fd, int res)
+{
+	auto it = m_sessions.find(fd);
+	if(it == m_sessions.end())
+		return;
+	auto& state = m_uringSessions[fd];
+	state.m_sending = false;
+
+	if(res < 0)
+	{
+		state.m_failed = true;
+		if(!state.m_closing)
+			LogVerbose("SCPIEventLoop: send failed (%s)\n", strerror(-res));
+	}
+	else
+	{
+		state.m_txOffset += res;
+
+		auto& stats = SCPIStatistics::Get();
+		if(stats.IsEnabled())
+			stats.RecordBytesOut(res);
+	}
+
+	if(state.m_closing)
+		ContinueClose(fd);
+	else if(state.m_failed)
+		CloseSession(fd);
+	else
+		UpdateInterest(it->second.get());
+}
+
+/**
+	@brief Moves a closing session along: sends what it still owes the client, shuts the socket down, and removes it
+	once nothing is in flight any more
+ */
+void SCPIEventLoop::Worker::ContinueClose(int fd)
+{
+	auto& state = m_uringSessions[fd];
+	if(state.m_sending)
+		return;
+
+	if(!state.m_shutdown)
+	{
+		if(!state.m_failed)
+		{
+			if(!SubmitSend(fd))
+				state.m_failed = true;
+			else if(state.m_sending)
+				return;
+		}
+
+		//Ends the receive and any send still in flight
+		shutdown(fd, SHUT_RDWR);
+		state.m_shutdown = true;
+	}
+
+	if(state.m_receiving || state.m_sending)
+		return;
+
+	m_uringSessions.erase(fd);
+	m_sessions.erase(fd);
+	LogVerbose("SCPIEventLoop: client disconnected\n");
+}
+
+/**
+	@brief Runs one worker on the io_uring backend
+
+	Every pass submits whatever was queued (reply sends, re-armed receives) and waits for the next completions in the
+	same io_uring_enter() call.
+ */
+void SCPIEventLoop::UringWorkerLoop(Worker* worker, bool acceptClients)
+{
+	auto ring = worker->m_ring.get();
+
+	worker->ArmPoll(worker->m_wakefd, WAKE_TAG);
+	if(acceptClients)
+	{
+		for(auto& l : m_listeners)
+			worker->ArmPoll(l.first, l.second);
+	}
+
+	while(!m_stopping)
+	{
+		if(ring->Submit(1) < 0)
+			break;
+
+		while(auto cqe = ring->PeekCQE())
+		{
+			uint64_t userData = cqe->user_data;
+			int res = cqe->res;
+			uint32_t flags = cqe->flags;
+			ring->AdvanceCQ();
+
+			if(worker->HandleCompletion(userData, res, flags))
+				continue;
+
+			//Poll on the wakeup eventfd or a listening socket. Re-arm it if the kernel dropped it.
+			int tag = UringFD(userData);
+			int fd = worker->m_wakefd;
+			for(auto& l : m_listeners)
+			{
+				if(l.second == tag)
+					fd = l.first;
+			}
+			if(!(flags & IORING_CQE_F_MORE))
+			{
+				if(res < 0)
+					LogWarning("SCPIEventLoop: poll failed (%s)\n", strerror(-res));
+				else
+					worker->ArmPoll(fd, tag);
+			}
+			if(res < 0)
+				continue;
+
+			if(tag == WAKE_TAG)
+			{
+				uint64_t count;
+				if(sizeof(count) == read(worker->m_wakefd, &count, sizeof(count)))
+				{
+					AddPendingClients(worker);
+					ServiceWokenSessions(worker);
+				}
+			}
+			else if(acceptClients)
+				AcceptClients(fd);
+		}
+	}
+}
+
+#else
+
+void SCPIEventLoop::UringWorkerLoop(Worker* /*worker*/, bool /*acceptClients*/)
+{
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Main loop
+
+/**
+	@brief Runs the event loop, blocking until Stop() is called
+
+	Worker threads other than the first are started here and joined before returning.
+ */
+void SCPIEventLoop::Run()
+{
+	vector<thread> threads;
+	for(size_t i=1; i<m_workers.size(); i++)
+		threads.push_back(thread(&SCPIEventLoop::WorkerLoop, this, m_workers[i].get(), false));
+
+	WorkerLoop(m_workers[0].get(), true);
+
+	for(auto& t : threads)
+		t.join();
+}
+
+/**
+	@brief Requests that Run() return. May be called from any thread, including from a handler.
+ */
+void SCPIEventLoop::Stop()
+{
+	m_stopping = true;
+	for(auto& w : m_workers)
+		w->Wake();
+}
+
+void SCPIEventLoop::WorkerLoop(Worker* worker, bool acceptClients)
+{
+	SCPIThreading::Get().ApplyToCurrentThread(SCPIThreading::THREAD_CONTROL);
+
+	if(worker->m_ring)
+	{
+		UringWorkerLoop(worker, acceptClients);
+		return;
+	}
+
+	epoll_event events[MAX_EVENTS];
+	while(!m_stopping)
+	{
+		int nev = epoll_wait(worker->m_epollfd, events, MAX_EVENTS, -1);
+		if(nev < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			LogError("SCPIEventLoop: epoll_wait failed (%s)\n", strerror(errno));
+			break;
+		}
+
+		for(int i=0; i<nev; i++)
+		{
+			int fd = events[i].data.fd;
+
+			if(fd == WAKE_TAG)
+			{
+				uint64_t count;
+				if(sizeof(count) == read(worker->m_wakefd, &count, sizeof(count)))
+				{
+					AddPendingClients(worker);
+					ServiceWokenSessions(worker);
+				}
+				continue;
+			}
+
+			if(fd == LISTEN_TAG)
+			{
+				if(acceptClients)
+					AcceptClients(*m_listenSocket);
+				continue;
+			}
+
+			if(fd == UNIX_LISTEN_TAG)
+			{
+				if(acceptClients)
+					AcceptClients(m_unixListener->GetSocket());
+				continue;
+			}
+
+			auto it = worker->m_sessions.find(fd);
+			if(it == worker->m_sessions.end())
+				continue;
+			auto session = it->second.get();
+
+			bool ok = true;
+			if(events[i].events & (EPOLLERR | EPOLLHUP))
+				ok = false;
+			if(ok && (events[i].events & EPOLLOUT))
+				ok = session->OnWritable();
+			if(ok && (events[i].events & EPOLLIN))
+				ok = session->OnReadable();
+
+			if(ok)
+				worker->UpdateInterest(session);
+			else
+				worker->CloseSession(fd);
+		}
+	}
+}
@@ -0,0 +1,220 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef SCPIEventLoop_h
+#define SCPIEventLoop_h
+
+#include "SCPIServer.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+class SCPIUnixListener;
+class SCPIUring;
+
+/**
+	@brief epoll based event loop running many SCPIServer sessions on a small, fixed pool of threads
+
+	Each session stays on the thread it was first assigned to, so a session's handlers are never called concurrently.
+	Handlers of different sessions may run concurrently if more than one thread is used.
+
+	Sessions may use SCPIServer::EnableAsyncExecution() to run slow handlers on their own worker thread; the event
+	loop is woken to send their replies once they finish.
+
+	Two I/O backends are available. The epoll backend waits for readiness and has the sessions call recv() and send()
+	themselves. The io_uring backend (Linux 6.0 or newer, if compiled with HAVE_IO_URING) instead keeps a multishot
+	receive armed on every session, so the kernel fills a shared ring of provided buffers as data arrives, and
+	submits reply sends in the same system call that waits for the next completions. Sessions on the io_uring backend
+	can't open shared memory rings (SHM:OPEN?). A worker whose ring can't be set up falls back to epoll.
+ */
+class SCPIEventLoop
+{
+public:
+	/**
+		@brief Creates a new session for an accepted client socket
+
+		The event loop takes ownership of the returned object and deletes it when the client disconnects.
+	 */
+	typedef std::function<SCPIServer*(ZSOCKET sock)> SessionFactory;
+
+	///@brief Socket I/O backends
+	enum Backend
+	{
+		///@brief Chosen by the SCPI_IO_BACKEND environment variable ("epoll" or "uring"), or epoll if not set
+		BACKEND_AUTO,
+
+		///@brief Readiness notification with epoll, sessions do their own recv() and send() calls
+		BACKEND_EPOLL,
+
+		///@brief Completion based I/O with io_uring, falling back to epoll if the kernel doesn't support it
+		BACKEND_URING
+	};
+
+	SCPIEventLoop(SessionFactory factory, size_t nthreads = 1, Backend backend = BACKEND_AUTO);
+	virtual ~SCPIEventLoop();
+
+	///@brief Returns the backend the first worker thread ended up with (the one listening sockets are on)
+	Backend GetBackend() const
+	{ return m_backend; }
+
+	static const char* GetBackendName(Backend backend);
+
+	bool Listen(uint16_t port);
+	bool ListenUnix(const std::string& path);
+	bool AddClient(ZSOCKET sock);
+
+	void Run();
+	void Stop();
+
+protected:
+
+	/**
+		@brief One thread of the event loop, with its own epoll instance and set of sessions
+	 */
+	class Worker
+	{
+	public:
+		Worker(bool uring);
+		~Worker();
+
+		void Wake();
+		void WakeSession(int fd);
+		void UpdateInterest(SCPIServer* session);
+		void CloseSession(int fd, bool flush = true);
+
+		//io_uring backend
+		void ArmPoll(int fd, int tag);
+		void ArmReceive(int fd);
+		bool HandleCompletion(uint64_t userData, int res, uint32_t flags);
+		void OnReceiveComplete(int fd, int res, uint32_t flags);
+		void OnSendComplete(int fd, int res);
+		bool SubmitSend(int fd);
+		void ContinueClose(int fd);
+
+		///@brief The epoll instance (-1 if this worker uses io_uring)
+		int m_epollfd;
+
+		///@brief The io_uring instance (null if this worker uses epoll)
+		std::unique_ptr<SCPIUring> m_ring;
+
+		///@brief State of a session on the io_uring backend
+		class UringSession
+		{
+		public:
+			UringSession()
+			: m_txOffset(0)
+			, m_sending(false)
+			, m_receiving(false)
+			, m_throttled(false)
+			, m_closing(false)
+			, m_failed(false)
+			, m_shutdown(false)
+			{}
+
+			///@brief Reply data taken from the session, being sent
+			std::string m_tx;
+
+			///@brief Bytes of m_tx already sent
+			size_t m_txOffset;
+
+			///@brief True while a send is in flight (it references m_tx)
+			bool m_sending;
+
+			///@brief True while the multishot receive is armed
+			bool m_receiving;
+
+			///@brief True if receiving was stopped because too much reply data is backed up
+			bool m_throttled;
+
+			///@brief True once the session is closing, sending what it still owes the client
+			bool m_closing;
+
+			///@brief True if the socket failed, so nothing more should be sent
+			bool m_failed;
+
+			///@brief True once the socket has been shut down, waiting for operations in flight to finish
+			bool m_shutdown;
+		};
+
+		///@brief io_uring state of each session, indexed by socket handle
+		std::unordered_map<int, UringSession> m_uringSessions;
+
+		///@brief eventfd used to wake the thread for new clients or shutdown
+		int m_wakefd;
+
+		///@brief Sessions owned by this thread, indexed by socket handle
+		std::unordered_map<int, std::unique_ptr<SCPIServer>> m_sessions;
+
+		///@brief Accepted sockets waiting to be picked up by this thread
+		std::vector<ZSOCKET> m_pendingClients;
+
+		///@brief Sessions whose async worker has finished replies waiting to be sent
+		std::vector<int> m_wokenSessions;
+
+		///@brief Mutex protecting m_pendingClients and m_wokenSessions
+		std::mutex m_pendingMutex;
+	};
+
+	static Backend ResolveBackend(Backend backend);
+	void WorkerLoop(Worker* worker, bool acceptClients);
+	void UringWorkerLoop(Worker* worker, bool acceptClients);
+	bool AddListener(int fd, int tag);
+	void AcceptClients(int listenfd);
+	void AddPendingClients(Worker* worker);
+	void ServiceWokenSessions(Worker* worker);
+
+	///@brief Factory for new sessions
+	SessionFactory m_factory;
+
+	///@brief Worker threads (the first one runs on the thread that called Run())
+	std::vector<std::unique_ptr<Worker>> m_workers;
+
+	///@brief Listening socket, if Listen() was called
+	std::unique_ptr<Socket> m_listenSocket;
+
+	///@brief Listening Unix domain socket, if ListenUnix() was called
+	std::unique_ptr<SCPIUnixListener> m_unixListener;
+
+	///@brief Listening sockets and their tags, for the io_uring backend to poll once Run() starts
+	std::vector<std::pair<int, int>> m_listeners;
+
+	///@brief Backend of the first worker
+	Backend m_backend;
+
+	///@brief Counter picking the worker the next client goes to (modulo the worker count)
+	std::atomic<size_t> m_nextWorker;
+
+	///@brief Set by Stop() to shut down all threads
+	std::atomic<bool> m_stopping;
+};
+
+#endif
@@ -0,0 +1,249 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#include "SCPINumeric.h"
+#include <charconv>
+#include <ctype.h>
+#include <math.h>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Helpers
+
+/**
+	@brief Returns true for characters skipped around a number
+ */
+static bool IsSpace(char c)
+{
+	return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n');
+}
+
+/**
+	@brief Returns true if str is a unit name we accept after a number (compared case insensitively)
+ */
+static bool IsUnit(string_view str)
+{
+	static const string_view units[] = { "Hz", "V", "A", "W", "s", "Sa", "pts", "B" };
+	for(auto u : units)
+	{
+		if(u.length() != str.length())
+			continue;
+
+		bool match = true;
+		for(size_t i=0; match && (i < u.length()); i++)
+			match = (tolower(static_cast<unsigned char>(u[i])) == tolower(static_cast<unsigned char>(str[i])));
+		if(match)
+			return true;
+	}
+	return false;
+}
+
+/**
+	@brief Strips leading and trailing whitespace, and a leading '+' (which from_chars doesn't accept)
+ */
+static string_view Trim(string_view str)
+{
+	while(!str.empty() && IsSpace(str.front()))
+		str.remove_prefix(1);
+	while(!str.empty() && IsSpace(str.back()))
+		str.remove_suffix(1);
+
+	//Only strip the '+' if it's followed by a digit or point, so "+-1" is still rejected
+	if( (str.length() > 1) && (str[0] == '+') && (str[1] != '-') && (str[1] != '+') )
+		str.remove_prefix(1);
+	return str;
+}
+
+/**
+	@brief Parses the engineering suffix and unit following a number
+
+	The text must be empty, a unit, a multiplier, or a multiplier followed by a unit. A unit on its own is checked
+	first, so "pts" isn't read as pico followed by "ts".
+
+	@param str			Text after the number
+	@param exponent		Power of ten the suffix stands for (zero if none)
+
+	@return False if the text isn't a valid suffix and unit
+ */
+static bool ParseSuffix(string_view str, int& exponent)
+{
+	exponent = 0;
+	while(!str.empty() && IsSpace(str.front()))
+		str.remove_prefix(1);
+	if(str.empty() || IsUnit(str))
+		return true;
+
+	switch(str[0])
+	{
+		case 'f':	exponent = -15;	break;
+		case 'p':	exponent = -12;	break;
+		case 'n':	exponent = -9;	break;
+		case 'u':	exponent = -6;	break;
+		case 'm':	exponent = -3;	break;
+		case 'k':
+		case 'K':	exponent = 3;	break;
+		case 'M':	exponent = 6;	break;
+		case 'G':	exponent = 9;	break;
+		case 'T':	exponent = 12;	break;
+		case 'P':	exponent = 15;	break;
+		default:					break;
+	}
+	if(exponent == 0)
+		return false;
+	str.remove_prefix(1);
+
+	//Anything left must be a unit name
+	return str.empty() || IsUnit(str);
+}
+
+/**
+	@brief Returns 10^exponent exactly for the suffix exponents we support
+ */
+static double PowerOfTen(int exponent)
+{
+	static const double positive[] = {1, 1e3, 1e6, 1e9, 1e12, 1e15};
+	if(exponent >= 0)
+		return positive[exponent / 3];
+	return positive[-exponent / 3];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Parsing
+
+/**
+	@brief Parses a floating point value
+
+	@param str		Text to parse
+	@param value	Parsed value (only written on success)
+
+	@return False if the text isn't a valid finite number
+ */
+bool ParseSCPIDouble(string_view str, double& value)
+{
+	str = Trim(str);
+
+	double v;
+	auto result = from_chars(str.data(), str.data() + str.length(), v);
+	if(result.ec != errc())
+		return false;
+
+	int exponent;
+	if(!ParseSuffix(string_view(result.ptr, str.data() + str.length() - result.ptr), exponent))
+		return false;
+
+	//Divide for negative exponents so that "1m" gives exactly the same double as "1e-3"
+	if(exponent > 0)
+		v *= PowerOfTen(exponent);
+	else if(exponent < 0)
+		v /= PowerOfTen(exponent);
+
+	if(!isfinite(v))
+		return false;
+
+	value = v;
+	return true;
+}
+
+/**
+	@brief Parses an unsigned integer value
+
+	Fractional notation is accepted as long as the result is a whole number ("1.5k" is 1500).
+
+	@param str		Text to parse
+	@param value	Parsed value (only written on success)
+
+	@return False if the text isn't a valid number, is negative, isn't a whole number, or doesn't fit in 64 bits
+ */
+bool ParseSCPIUint64(string_view str, uint64_t& value)
+{
+	str = Trim(str);
+	const char* end = str.data() + str.length();
+
+	//Plain integers, with or without a suffix, are parsed exactly
+	uint64_t v;
+	auto result = from_chars(str.data(), end, v);
+	if(result.ec == errc::result_out_of_range)
+		return false;
+	if( (result.ec == errc()) && (result.ptr == end || ( (*result.ptr != '.') && (*result.ptr != 'e') &&
+		(*result.ptr != 'E') ) ) )
+	{
+		int exponent;
+		if(!ParseSuffix(string_view(result.ptr, end - result.ptr), exponent))
+			return false;
+
+		//Whole multipliers only, with overflow check. Fractional ones go through the floating point path.
+		if(exponent >= 0)
+		{
+			uint64_t scale = static_cast<uint64_t>(PowerOfTen(exponent));
+			if( (scale > 1) && (v > UINT64_MAX / scale) )
+				return false;
+			value = v * scale;
+			return true;
+		}
+	}
+
+	//Decimal point, exponent, or fractional suffix
+	double d;
+	if(!ParseSCPIDouble(str, d))
+		return false;
+	if( (d < 0) || (d >= 18446744073709551616.0) || (d != floor(d)) )
+		return false;
+
+	value = static_cast<uint64_t>(d);
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Formatting
+
+/**
+	@brief Appends the shortest fixed point text that parses back to exactly the same value
+
+	Non-finite values are written as "nan" and "inf" / "-inf".
+ */
+void AppendSCPIDouble(string& out, double value)
+{
+	//Fixed notation of a double can need up to ~330 digits for extreme exponents
+	char buf[400];
+	auto result = to_chars(buf, buf + sizeof(buf), value, chars_format::fixed);
+	if(result.ec != errc())
+		return;
+	out.append(buf, result.ptr - buf);
+}
+
+/**
+	@brief Appends an unsigned integer in decimal
+ */
+void AppendSCPIUint64(string& out, uint64_t value)
+{
+	char buf[24];
+	auto result = to_chars(buf, buf + sizeof(buf), value);
+	out.append(buf, result.ptr - buf);
+}
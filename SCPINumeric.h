@@ -0,0 +1,54 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef SCPINumeric_h
+#define SCPINumeric_h
+
+#include <string>
+#include <string_view>
+#include <stdint.h>
+
+/*
+	Locale independent, exception free conversion between numbers and their SCPI text form.
+
+	Parsing accepts an optional sign, decimal or exponent notation (1.5, 10E-3), and an optional engineering suffix
+	(f p n u m k M G T P, case sensitive so that "m" is milli and "M" is mega) followed by an optional unit name,
+	which is ignored (for example "1.5GHz", "200mV" or "5 V"). Units are Hz, V, A, W, s, Sa, pts and B, in any case;
+	any other trailing text is rejected. Leading and trailing whitespace is allowed.
+
+	Formatting produces the shortest text that parses back to exactly the same value, without an exponent.
+ */
+
+bool ParseSCPIDouble(std::string_view str, double& value);
+bool ParseSCPIUint64(std::string_view str, uint64_t& value);
+
+void AppendSCPIDouble(std::string& out, double value);
+void AppendSCPIUint64(std::string& out, uint64_t value);
+
+#endif
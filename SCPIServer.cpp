@@ -28,24 +28,164 @@
 ***********************************************************************************************************************/
 
 #include "SCPIServer.h"
+#include "SCPINumeric.h"
+#include "SCPIStatistics.h"
+#include "SCPIThreading.h"
 #include <log.h>
+#include <algorithm>
+#include <set>
+#include <string.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include "WaveformSharedRing.h"
+#endif
 
 using namespace std;
 
+//Initial size of the receive buffer. Grows on demand if a single command doesn't fit.
+#define RX_BUFFER_SIZE 4096
+
+//Longest command we'll buffer. A client sending more than this without a newline gets disconnected.
+#define RX_MAX_LINE_LENGTH (1024 * 1024)
+
+//Flush queued replies early in blocking mode if more than this much data is waiting
+#define TX_FLUSH_THRESHOLD (64 * 1024)
+
+//Maximum number of buffers passed to one sendmsg() call
+#define MAX_IOVECS 64
+
+//Default and maximum size of a shared memory waveform ring
+#define SHARED_RING_DEFAULT_SIZE (64 * 1024 * 1024)
+#define SHARED_RING_MAX_SIZE (1024ULL * 1024 * 1024)
+
+//How long to wait for queued replies to drain before passing a file descriptor in non-blocking mode
+#define DESCRIPTOR_TIMEOUT_MS 1000
+
+//How often a blocking session checks for queued events while waiting for its client, where there's no wake pipe
+#define EVENT_POLL_MS 20
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+//Wire names of events, indexed by SCPIServer::EventType
+static const char* g_eventNames[SCPIServer::EVENT_COUNT] =
+{
+	"ARMED",
+	"TRIGGERED",
+	"WAVEFORM",
+	"CONFIG"
+};
+
+//Every live session in the process, for BroadcastEvent()
+static mutex g_sessionsMutex;
+static set<SCPIServer*> g_sessions;
+
+//Signaled when a BroadcastEvent() call lets go of its sessions
+static condition_variable g_sessionsCond;
+
+/**
+	@brief Checks if the last socket call failed only because a non-blocking socket wasn't ready
+ */
+static bool SocketWouldBlock()
+{
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR);
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Construction / destruction
 
 SCPIServer::SCPIServer(ZSOCKET sock)
 	: m_socket(sock)
+	, m_rxBuffer(RX_BUFFER_SIZE)
+	, m_rxStart(0)
+	, m_rxEnd(0)
+	, m_rxScan(0)
+	, m_txOffset(0)
+	, m_nonblocking(false)
+	, m_completionIO(false)
+	, m_stallStart(0)
+	, m_local(false)
+	, m_asyncStopping(false)
+	, m_workerReply(nullptr)
+	, m_inlineReply(nullptr)
+	, m_subscriptions(0)
+	, m_eventsUsed(false)
+	, m_broadcastRefs(0)
 {
+	m_eventWake[0] = -1;
+	m_eventWake[1] = -1;
+
 	LogVerbose("Client connected to SCPI socket\n");
 
-	if(!m_socket.DisableNagle())
+#ifndef _WIN32
+	sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	if( (0 == getsockname(sock, reinterpret_cast<sockaddr*>(&addr), &addrlen)) && (addr.ss_family == AF_UNIX) )
+		m_local = true;
+#endif
+
+	//Nagle only applies to TCP
+	if(!m_local && !m_socket.DisableNagle())
 		LogWarning("Failed to disable Nagle on socket, performance may be poor\n");
+
+	lock_guard<mutex> lock(g_sessionsMutex);
+	g_sessions.insert(this);
 }
 
 SCPIServer::~SCPIServer()
 {
+	//Once we're out of the list no new broadcast can find us, so just wait out the ones in progress
+	{
+		unique_lock<mutex> lock(g_sessionsMutex);
+		g_sessions.erase(this);
+		g_sessionsCond.wait(lock, [this]{ return m_broadcastRefs == 0; });
+	}
+
+#ifndef _WIN32
+	if(m_eventWake[0] >= 0)
+	{
+		close(m_eventWake[0]);
+		close(m_eventWake[1]);
+	}
+#endif
+
+	//Derived class members are already gone by now, so whoever owns the session should have stopped this already
+	if(m_asyncThread)
+		LogWarning("SCPIServer destroyed with async execution still running\n");
+	StopAsyncExecution();
+}
+
+/**
+	@brief Starts recording the session to a trace file
+
+	Every command line, reply, event notification and handler run time is appended to the trace, which can be fed
+	back through a server later with the scpi-trace-replay tool. Call before the session starts running.
+
+	@param path	Trace file to create (replaced if it exists)
+ */
+bool SCPIServer::StartTrace(const string& path)
+{
+	return m_trace.Open(path);
+}
+
+/**
+	@brief Stops recording and finishes the trace file
+ */
+void SCPIServer::StopTrace()
+{
+	m_trace.Close();
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -54,141 +194,1411 @@ SCPIServer::~SCPIServer()
 /**
 	@brief Sends a SCPI reply (terminated by newline)
 
+	Replies are queued and sent together when the session runs out of buffered commands and is about to wait for
+	more, so a pipelined batch of queries is answered with a single send. Call FlushReplies() to push a reply out
+	immediately.
+
 	@param cmd	Reply to send
  */
 bool SCPIServer::SendReply(const string& cmd)
 {
-	string tempbuf = cmd + "\n";
-	return m_socket.SendLooped((unsigned char*)tempbuf.c_str(), tempbuf.length());
+	if(m_trace.IsOpen())
+		m_trace.Record(TRACE_REPLY, cmd);
+
+	//In async mode, replies go into the slot of the command being run so they're sent in protocol order
+	if(m_asyncThread)
+	{
+		auto reply = GetCurrentAsyncReply();
+		if(reply)
+		{
+			reply->m_data += cmd;
+			reply->m_data += '\n';
+			return true;
+		}
+	}
+
+	unique_lock<mutex> lock(m_txMutex, defer_lock);
+	if(SharesTxBuffer())
+		lock.lock();
+
+	m_txBuffer += cmd;
+	m_txBuffer += '\n';
+
+	//Don't let a long batch pile up an unbounded amount of data
+	if(!m_nonblocking && (GetPendingTxSize() > TX_FLUSH_THRESHOLD))
+	{
+		if(lock.owns_lock())
+			lock.unlock();
+		return FlushReplies();
+	}
+	return true;
 }
 
 /**
-	@brief Reads a SCPI command (terminated by newline or semicolon)
+	@brief Sends all queued replies now
 
-	@param str	Output command
+	In blocking mode, waits until everything has been sent. In non-blocking mode, sends as much as the socket will
+	accept and leaves the rest to the event loop.
+
+	@return False if the socket failed
  */
-bool SCPIServer::RecvCommand(string& str)
+bool SCPIServer::FlushReplies()
 {
-	int sockid = m_socket;
+	if(m_nonblocking)
+		return FlushTxBuffer();
 
-	char tmp = ' ';
-	str = "";
-	while(true)
+	//The worker thread (or an event source) may be sending at the same time
+	unique_lock<mutex> lock(m_txMutex, defer_lock);
+	if(SharesTxBuffer())
+		lock.lock();
+
+	if(m_eventsUsed.load(memory_order_relaxed))
+		TakePendingEvents();
+	if(!HasPendingTx())
+		return true;
+
+	auto& stats = SCPIStatistics::Get();
+	uint64_t start = stats.IsEnabled() ? SCPIStatistics::Now() : 0;
+
+	bool ok = SendAll(m_txBuffer.c_str() + m_txOffset, GetPendingTxSize());
+	m_txBuffer.clear();
+	m_txOffset = 0;
+
+	if(start)
+		stats.RecordLatency(SCPIStatistics::PHASE_SEND, SCPIStatistics::Now() - start);
+	return ok;
+}
+
+/**
+	@brief Sends a buffer on a blocking socket, waiting until all of it has been sent
+
+	Each send is first tried without blocking, so time spent waiting for the client to make room can be counted as
+	a stall.
+
+	@return False if the socket failed
+ */
+bool SCPIServer::SendAll(const char* data, size_t len)
+{
+#ifdef _WIN32
+	return m_socket.SendLooped(reinterpret_cast<const unsigned char*>(data), len);
+#else
+	auto& stats = SCPIStatistics::Get();
+	bool record = stats.IsEnabled();
+
+	while(len)
 	{
-		if(1 != recv(sockid, &tmp, 1, MSG_WAITALL))
+		ssize_t sent = send(m_socket, data, len, SEND_FLAGS | MSG_DONTWAIT);
+		if( (sent < 0) && ( (errno == EAGAIN) || (errno == EWOULDBLOCK) ) )
+		{
+			//Socket buffer is full, wait for the client to catch up
+			uint64_t start = record ? SCPIStatistics::Now() : 0;
+			sent = send(m_socket, data, len, SEND_FLAGS);
+			if(record)
+				stats.RecordStall(SCPIStatistics::Now() - start);
+		}
+
+		if(sent < 0)
+		{
+			if(errno == EINTR)
+				continue;
 			return false;
+		}
 
-		if( (tmp == '\n') || ( (tmp == ';') ) )
-			break;
-		else
-			str += tmp;
+		if(record)
+			stats.RecordBytesOut(sent);
+		data += sent;
+		len -= sent;
 	}
-
 	return true;
+#endif
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// SCPI command parsing
-
 /**
-	@brief Crack an inbound SCPI query into its component parts
+	@brief Sends any queued replies followed by the given buffers, with as few system calls as possible
 
-	@param line		The inbound SCPI command
-	@param subject	The object that the command operates on (for example, outputs C2 if line is C2:OFFS)
-	@param cmd		The main text of the command (for example, outputs OFFS if line is C2:OFFS)
-	@param query	Outputs true if the command is a query, false if not
-	@param args		List of arguments after the main command
+	In blocking mode the data is sent straight from the caller's buffers with scatter-gather I/O, and this call
+	returns once everything has been sent. In non-blocking mode, or when called from a handler with async execution
+	enabled, the data is copied into the transmit queue.
+
+	@param iov		Buffers to send
+	@param iovcnt	Number of buffers
+
+	@return False if the socket failed
  */
-void SCPIServer::ParseLine(
-	const string& line,
-	string& subject,
-	string& cmd,
-	bool& query,
-	vector<string>& args)
+bool SCPIServer::SendVectored(const iovec* iov, size_t iovcnt)
 {
-	//Reset fields
-	query = false;
-	subject = "";
-	cmd = "";
-	args.clear();
+	//In async mode, data sent by a handler has to wait its turn behind earlier replies
+	if(m_asyncThread)
+	{
+		auto reply = GetCurrentAsyncReply();
+		if(reply)
+		{
+			for(size_t i=0; i<iovcnt; i++)
+				reply->m_data.append(reinterpret_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+			return true;
+		}
+	}
 
-	string tmp;
-	bool reading_cmd = true;
-	for(size_t i=0; i<line.length(); i++)
+	if(m_nonblocking)
 	{
-		//If there's no colon in the command, the first block is the command.
-		//If there is one, the first block is the subject and the second is the command.
-		//If more than one, treat it as freeform text in the command.
-		if( (line[i] == ':') && subject.empty() )
+		for(size_t i=0; i<iovcnt; i++)
+			m_txBuffer.append(reinterpret_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+		return FlushTxBuffer();
+	}
+
+	unique_lock<mutex> lock(m_txMutex, defer_lock);
+	if(SharesTxBuffer())
+		lock.lock();
+
+#ifdef _WIN32
+	if(HasPendingTx())
+	{
+		bool ok = m_socket.SendLooped(
+			reinterpret_cast<const unsigned char*>(m_txBuffer.c_str()) + m_txOffset, GetPendingTxSize());
+		m_txBuffer.clear();
+		m_txOffset = 0;
+		if(!ok)
+			return false;
+	}
+	for(size_t i=0; i<iovcnt; i++)
+	{
+		if(!m_socket.SendLooped(reinterpret_cast<const unsigned char*>(iov[i].iov_base), iov[i].iov_len))
+			return false;
+	}
+	return true;
+#else
+
+	auto& stats = SCPIStatistics::Get();
+	bool record = stats.IsEnabled();
+	uint64_t start = record ? SCPIStatistics::Now() : 0;
+
+	//Queued replies go first
+	iovec vecs[MAX_IOVECS];
+	size_t nvecs = 0;
+	if(HasPendingTx())
+	{
+		vecs[0].iov_base = const_cast<char*>(m_txBuffer.c_str()) + m_txOffset;
+		vecs[0].iov_len = GetPendingTxSize();
+		nvecs = 1;
+	}
+
+	size_t next = 0;
+	while( (next < iovcnt) || (nvecs > 0) )
+	{
+		//Top up the batch with caller buffers
+		for(; (next < iovcnt) && (nvecs < MAX_IOVECS); next++)
 		{
-			subject = tmp;
-			tmp = "";
-			continue;
+			if(iov[next].iov_len)
+				vecs[nvecs++] = iov[next];
 		}
+		if(nvecs == 0)
+			break;
 
-		//Detect queries
-		if(line[i] == '?')
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = vecs;
+		msg.msg_iovlen = nvecs;
+		ssize_t len = sendmsg(m_socket, &msg, SEND_FLAGS | MSG_DONTWAIT);
+		if( (len < 0) && ( (errno == EAGAIN) || (errno == EWOULDBLOCK) ) )
 		{
-			query = true;
-			continue;
+			//Socket buffer is full, wait for the client to catch up
+			uint64_t stallStart = record ? SCPIStatistics::Now() : 0;
+			len = sendmsg(m_socket, &msg, SEND_FLAGS);
+			if(record)
+				stats.RecordStall(SCPIStatistics::Now() - stallStart);
+		}
+		if(len < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			m_txBuffer.clear();
+			m_txOffset = 0;
+			return false;
 		}
+		if(record)
+			stats.RecordBytesOut(len);
 
-		//Comma delimits arguments, space delimits command-to-args
-		if(!(isspace(line[i]) && cmd.empty()) && line[i] != ',')
+		//Drop everything that was fully sent, and trim the first partially sent buffer
+		size_t done = 0;
+		size_t remaining = len;
+		while( (done < nvecs) && (remaining >= vecs[done].iov_len) )
 		{
-			tmp += line[i];
-			continue;
+			remaining -= vecs[done].iov_len;
+			done ++;
 		}
+		if(done < nvecs)
+		{
+			vecs[done].iov_base = reinterpret_cast<char*>(vecs[done].iov_base) + remaining;
+			vecs[done].iov_len -= remaining;
+		}
+		memmove(vecs, vecs + done, (nvecs - done) * sizeof(iovec));
+		nvecs -= done;
+	}
 
-		//merge multiple delimiters into one delimiter
-		if(tmp == "")
+	m_txBuffer.clear();
+	m_txOffset = 0;
+
+	if(record)
+		stats.RecordLatency(SCPIStatistics::PHASE_SEND, SCPIStatistics::Now() - start);
+	return true;
+
+#endif
+}
+
+/**
+	@brief Sends a reply line with a file descriptor attached (SCM_RIGHTS), for clients on a Unix domain socket
+
+	The descriptor is attached to the first byte of the line, so all previously queued replies are sent first. In
+	non-blocking mode this may briefly wait for the socket to drain. Not supported in completion I/O mode.
+
+	@param line		Reply text, without the trailing newline
+	@param fd		Descriptor to pass. The caller keeps its own copy.
+ */
+bool SCPIServer::SendDescriptor(const string& line, int fd)
+{
+#ifdef _WIN32
+	(void)line;
+	(void)fd;
+	return false;
+#else
+	//Queued replies may already be in flight on the event loop's ring, so there's no way to send ahead of them
+	if(m_completionIO)
+		return false;
+
+	if(m_trace.IsOpen())
+		m_trace.Record(TRACE_REPLY, line);
+
+	if(!FlushReplies())
+		return false;
+	while(HasPendingTx())
+	{
+		pollfd pfd;
+		pfd.fd = m_socket;
+		pfd.events = POLLOUT;
+		if(poll(&pfd, 1, DESCRIPTOR_TIMEOUT_MS) <= 0)
+		{
+			LogWarning("Timed out waiting to send file descriptor\n");
+			return false;
+		}
+		if(!FlushTxBuffer())
+			return false;
+	}
+
+	unique_lock<mutex> lock(m_txMutex, defer_lock);
+	if(SharesTxBuffer())
+		lock.lock();
+
+	string data = line + '\n';
+	iovec iov;
+	iov.iov_base = &data[0];
+	iov.iov_len = data.size();
+
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(control, 0, sizeof(control));
+
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	ssize_t len;
+	while(true)
+	{
+		len = sendmsg(m_socket, &msg, SEND_FLAGS);
+		if( (len < 0) && (errno == EINTR) )
 			continue;
 
-		//Save command or argument
-		if(reading_cmd)
-			cmd = tmp;
-		else
-			args.push_back(tmp);
+		if( (len < 0) && SocketWouldBlock() )
+		{
+			pollfd pfd;
+			pfd.fd = m_socket;
+			pfd.events = POLLOUT;
+			if(poll(&pfd, 1, DESCRIPTOR_TIMEOUT_MS) > 0)
+				continue;
+		}
+		break;
+	}
+	if(len < 0)
+	{
+		LogWarning("Failed to send file descriptor (%s)\n", strerror(errno));
+		return false;
+	}
 
-		reading_cmd = false;
-		tmp = "";
+	SCPIStatistics::Get().RecordBytesOut(len);
+
+	//The descriptor went with the first byte, the rest of the line can go out normally
+	if(static_cast<size_t>(len) < data.size())
+	{
+		if(!m_nonblocking)
+			return SendAll(data.c_str() + len, data.size() - len);
+		m_txBuffer.append(data, len, string::npos);
+		return FlushTxBuffer();
 	}
+	return true;
+#endif
+}
 
-	//Stuff left over at the end? Figure out which field it belongs in
-	if(tmp != "")
+/**
+	@brief Sends as much queued reply data as possible without blocking
+
+	Does nothing in completion I/O mode, where the event loop sends the queued data itself.
+
+	@return False if the socket failed
+ */
+bool SCPIServer::FlushTxBuffer()
+{
+	//The event loop picks the data up with TakePendingTx()
+	if(!HasPendingTx() || m_completionIO)
+		return true;
+
+	auto& stats = SCPIStatistics::Get();
+	bool record = stats.IsEnabled();
+	uint64_t start = record ? SCPIStatistics::Now() : 0;
+
+	while(m_txOffset < m_txBuffer.size())
 	{
-		if(cmd != "")
-			args.push_back(tmp);
-		else
-			cmd = tmp;
+		int len = send(m_socket, m_txBuffer.c_str() + m_txOffset, m_txBuffer.size() - m_txOffset, SEND_FLAGS);
+		if(len < 0)
+		{
+			if(SocketWouldBlock())
+			{
+				//Client isn't keeping up. Count the stall from now until the queue drains.
+				if(record)
+				{
+					uint64_t now = SCPIStatistics::Now();
+					stats.RecordLatency(SCPIStatistics::PHASE_SEND, now - start);
+					if(!m_stallStart)
+						m_stallStart = now;
+				}
+				return true;
+			}
+			return false;
+		}
+		m_txOffset += len;
+
+		if(record)
+			stats.RecordBytesOut(len);
+	}
+
+	//Everything sent, reuse the buffer
+	m_txBuffer.clear();
+	m_txOffset = 0;
+
+	if(record)
+	{
+		uint64_t now = SCPIStatistics::Now();
+		stats.RecordLatency(SCPIStatistics::PHASE_SEND, now - start);
+		if(m_stallStart)
+			stats.RecordStall(now - m_stallStart);
 	}
+	m_stallStart = 0;
+	return true;
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Main event loop
+/**
+	@brief Reads a SCPI command (terminated by newline or semicolon)
 
-void SCPIServer::MainLoop()
+	Data is read from the socket in large chunks and buffered, so a burst of commands costs one recv() call rather
+	than one per byte.
+
+	@param str	Output command
+ */
+bool SCPIServer::RecvCommand(string& str)
+{
+	string_view line;
+	if(!RecvCommand(line))
+		return false;
+
+	str.assign(line);
+	return true;
+}
+
+/**
+	@brief Reads a SCPI command (terminated by newline or semicolon) without copying it
+
+	@param line	Output command. Points into the receive buffer and is only valid until the next RecvCommand() call.
+ */
+bool SCPIServer::RecvCommand(string_view& line)
 {
-	//Main command loop
-	string line;
-	string cmd;
-	bool query;
-	string subject;
-	vector<string> args;
 	while(true)
 	{
-		//Get the inbound command
-		if(!RecvCommand(line))
-			break;
-		LogTrace((line + "\n").c_str());
-		ParseLine(line, subject, cmd, query, args);
+		//Hand out a buffered command if we have a complete one
+		if(ExtractCommand(line))
+			return true;
 
-		//Process the command
-		if(query)
-			OnQuery(line, subject, cmd);
-		else if(cmd == "EXIT")
-			break;
-		else
-			OnCommand(line, subject, cmd, args);
+		//We're about to block waiting for the client, so send it everything we owe it first
+		if(!m_nonblocking && !FlushReplies())
+			return false;
+
+		//Events queued by other threads are sent from here, so keep an eye out for them while we wait
+		if(!m_nonblocking && m_eventsUsed.load(memory_order_acquire) && !WaitForClient())
+			return false;
+
+		//Nope, need more data
+		if(!FillRxBuffer())
+			return false;
+	}
+}
+
+/**
+	@brief Pulls the next complete command out of the receive buffer, if there is one
+
+	@param line	Output command (not including the terminator). Points into the receive buffer.
+
+	@return True if a command was found, false if the buffer doesn't contain a complete command yet
+ */
+bool SCPIServer::ExtractCommand(string_view& line)
+{
+	const char* buf = &m_rxBuffer[0];
+
+	//Only search bytes we haven't looked at already
+	for(; m_rxScan < m_rxEnd; m_rxScan ++)
+	{
+		char c = buf[m_rxScan];
+		if( (c == '\n') || (c == ';') )
+		{
+			line = string_view(buf + m_rxStart, m_rxScan - m_rxStart);
+
+			m_rxScan ++;
+			m_rxStart = m_rxScan;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+	@brief Reads as much data as is available from the socket
+
+	In blocking mode, waits until at least one byte arrives.
+
+	@param wouldBlock	If not null, set to true if the read failed only because a non-blocking socket had no data
+
+	@return False if the socket was closed, an error occurred, or no data was available
+ */
+bool SCPIServer::FillRxBuffer(bool* wouldBlock)
+{
+	if(wouldBlock)
+		*wouldBlock = false;
+
+	size_t space = ReserveRxSpace();
+	if(space == 0)
+		return false;
+
+	int sockid = m_socket;
+	int len = recv(sockid, &m_rxBuffer[m_rxEnd], space, 0);
+	if(len <= 0)
+	{
+		if( (len < 0) && wouldBlock && SocketWouldBlock())
+			*wouldBlock = true;
+		return false;
+	}
+
+	m_rxEnd += len;
+
+	auto& stats = SCPIStatistics::Get();
+	if(stats.IsEnabled())
+		stats.RecordBytesIn(len);
+	return true;
+}
+
+/**
+	@brief Waits until the client has sent something, sending event notifications as they're queued (blocking mode)
+
+	@return False if waiting failed
+ */
+bool SCPIServer::WaitForClient()
+{
+#ifdef _WIN32
+	//No wake pipe to poll on here, so look for queued events at a short interval instead
+	WSAPOLLFD pfd;
+	pfd.fd = m_socket;
+	pfd.events = POLLRDNORM;
+	while(true)
+	{
+		pfd.revents = 0;
+		int ret = WSAPoll(&pfd, 1, EVENT_POLL_MS);
+		if(ret < 0)
+			return false;
+		if(ret > 0)
+			return true;
+		if(!FlushReplies())
+			return false;
+	}
+#else
+	pollfd pfds[2];
+	pfds[0].fd = m_socket;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = m_eventWake[0];
+	pfds[1].events = POLLIN;
+	while(true)
+	{
+		pfds[0].revents = 0;
+		pfds[1].revents = 0;
+		if(poll(pfds, 2, -1) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return false;
+		}
+
+		if(pfds[1].revents)
+		{
+			char buf[64];
+			while(read(m_eventWake[0], buf, sizeof(buf)) > 0)
+			{}
+			if(!FlushReplies())
+				return false;
+		}
+
+		//Errors and hangups are reported by the recv() that follows
+		if(pfds[0].revents)
+			return true;
+	}
+#endif
+}
+
+/**
+	@brief Makes room at the end of the receive buffer for more data
+
+	@return Number of bytes free after m_rxEnd, or zero if a single command has outgrown RX_MAX_LINE_LENGTH and the
+			connection should be dropped
+ */
+size_t SCPIServer::ReserveRxSpace()
+{
+	//Everything consumed? Start over at the beginning of the buffer
+	if(m_rxStart == m_rxEnd)
+	{
+		m_rxStart = 0;
+		m_rxEnd = 0;
+		m_rxScan = 0;
+	}
+
+	//Out of space at the end. Move the partial command down to the start of the buffer,
+	//then grow the buffer if the partial command is taking up the whole thing.
+	if(m_rxEnd == m_rxBuffer.size())
+	{
+		if(m_rxStart > 0)
+		{
+			memmove(&m_rxBuffer[0], &m_rxBuffer[m_rxStart], m_rxEnd - m_rxStart);
+			m_rxEnd -= m_rxStart;
+			m_rxScan -= m_rxStart;
+			m_rxStart = 0;
+		}
+		else if(m_rxBuffer.size() >= RX_MAX_LINE_LENGTH)
+		{
+			LogWarning("Command longer than %d bytes without a newline, closing connection\n", RX_MAX_LINE_LENGTH);
+			return 0;
+		}
+		else
+			m_rxBuffer.resize(m_rxBuffer.size() * 2);
+	}
+
+	return m_rxBuffer.size() - m_rxEnd;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// SCPI command parsing
+
+/**
+	@brief Crack an inbound SCPI query into its component parts
+
+	@param line		The inbound SCPI command
+	@param subject	The object that the command operates on (for example, outputs C2 if line is C2:OFFS)
+	@param cmd		The main text of the command (for example, outputs OFFS if line is C2:OFFS)
+	@param query	Outputs true if the command is a query, false if not
+	@param args		List of arguments after the main command
+ */
+void SCPIServer::ParseLine(
+	const string& line,
+	string& subject,
+	string& cmd,
+	bool& query,
+	vector<string>& args)
+{
+	//Reset fields
+	query = false;
+	subject = "";
+	cmd = "";
+	args.clear();
+
+	string tmp;
+	bool reading_cmd = true;
+	for(size_t i=0; i<line.length(); i++)
+	{
+		//If there's no colon in the command, the first block is the command.
+		//If there is one, the first block is the subject and the second is the command.
+		//If more than one, treat it as freeform text in the command.
+		if( (line[i] == ':') && subject.empty() )
+		{
+			subject = tmp;
+			tmp = "";
+			continue;
+		}
+
+		//Detect queries
+		if(line[i] == '?')
+		{
+			query = true;
+			continue;
+		}
+
+		//Comma delimits arguments, space delimits command-to-args
+		if(!(isspace(line[i]) && cmd.empty()) && line[i] != ',')
+		{
+			tmp += line[i];
+			continue;
+		}
+
+		//merge multiple delimiters into one delimiter
+		if(tmp == "")
+			continue;
+
+		//Save command or argument
+		if(reading_cmd)
+			cmd = tmp;
+		else
+			args.push_back(tmp);
+
+		reading_cmd = false;
+		tmp = "";
+	}
+
+	//Stuff left over at the end? Figure out which field it belongs in
+	if(tmp != "")
+	{
+		if(cmd != "")
+			args.push_back(tmp);
+		else
+			cmd = tmp;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Default command handlers
+
+bool SCPIServer::OnCommand(const SCPICommand& command)
+{
+	vector<string> args;
+	for(size_t i=0; i<command.GetArgCount(); i++)
+		args.push_back(string(command.GetArg(i)));
+
+	return OnCommand(string(command.m_line), string(command.m_subject), string(command.m_cmd), args);
+}
+
+bool SCPIServer::OnQuery(const SCPICommand& command)
+{
+	return OnQuery(string(command.m_line), string(command.m_subject), string(command.m_cmd));
+}
+
+bool SCPIServer::OnCommand(
+	const string& /*line*/,
+	const string& /*subject*/,
+	const string& /*cmd*/,
+	const vector<string>& /*args*/)
+{
+	return false;
+}
+
+bool SCPIServer::OnQuery(
+	const string& /*line*/,
+	const string& /*subject*/,
+	const string& /*cmd*/)
+{
+	return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Main event loop
+
+/**
+	@brief Runs the session on the calling thread, blocking until the client disconnects or sends EXIT
+ */
+void SCPIServer::MainLoop()
+{
+	SCPIThreading::Get().ApplyToCurrentThread(SCPIThreading::THREAD_CONTROL);
+
+	//Main command loop
+	string_view line;
+	while(true)
+	{
+		//Get the inbound command
+		if(!RecvCommand(line))
+			break;
+		if(!ProcessCommand(line))
+			break;
+	}
+
+	//Finish any commands still queued, then send their replies and any to commands before an EXIT
+	StopAsyncExecution();
+	FlushReplies();
+}
+
+/**
+	@brief Parses and runs a single command
+
+	@param line	The command
+
+	@return False if the client asked to close the session
+ */
+bool SCPIServer::ProcessCommand(string_view line)
+{
+	LogTrace("%.*s\n", static_cast<int>(line.length()), line.data());
+	if(m_trace.IsOpen())
+		m_trace.Record(TRACE_COMMAND, line);
+
+	if(m_asyncThread)
+		return ProcessCommandAsync(line);
+
+	ParseCommand(m_command, line);
+	return RunCommand(m_command);
+}
+
+/**
+	@brief Parses a command, recording how long it took
+ */
+void SCPIServer::ParseCommand(SCPICommand& command, string_view line)
+{
+	auto& stats = SCPIStatistics::Get();
+	if(!stats.IsEnabled())
+	{
+		command.Parse(line);
+		return;
+	}
+
+	uint64_t start = SCPIStatistics::Now();
+	command.Parse(line);
+	stats.RecordLatency(SCPIStatistics::PHASE_PARSE, SCPIStatistics::Now() - start);
+}
+
+/**
+	@brief Runs the handler for a parsed command, recording how long it took
+
+	STATS?, THREADS?, SHM:OPEN?, SUBSCRIBE and UNSUBSCRIBE are handled here for every server, before the derived class sees
+	them.
+
+	@return False if the client asked to close the session
+ */
+bool SCPIServer::RunCommand(const SCPICommand& command)
+{
+	if(!command.m_query && (command.m_cmd == "EXIT"))
+		return false;
+
+	auto& stats = SCPIStatistics::Get();
+	bool record = stats.IsEnabled();
+	uint64_t start = record ? SCPIStatistics::Now() : 0;
+	bool trace = m_trace.IsOpen();
+	uint64_t traceStart = trace ? m_trace.Now() : 0;
+
+	if(command.m_query)
+	{
+		if(command.m_subject.empty() && (command.m_cmd == "STATS"))
+			SendReply(stats.Format());
+		else if(command.m_subject.empty() && (command.m_cmd == "THREADS"))
+			SendReply(SCPIThreading::Get().Format());
+		else if( (command.m_subject == "SHM") && (command.m_cmd == "OPEN") )
+			OpenSharedRing(command);
+		else if(command.m_subject.empty() && (command.m_cmd == "SUBSCRIBE"))
+			UpdateSubscriptions(command, true);
+		else
+			OnQuery(command);
+	}
+	else if(command.m_subject.empty() && (command.m_cmd == "SUBSCRIBE"))
+		UpdateSubscriptions(command, true);
+	else if(command.m_subject.empty() && (command.m_cmd == "UNSUBSCRIBE"))
+		UpdateSubscriptions(command, false);
+	else
+		OnCommand(command);
+
+	if(record)
+	{
+		uint64_t dt = SCPIStatistics::Now() - start;
+		stats.RecordLatency(SCPIStatistics::PHASE_HANDLER, dt);
+		stats.RecordCommand(command.m_cmd, command.m_query, dt);
+	}
+	if(trace)
+		m_trace.RecordHandler(command.m_line, traceStart, m_trace.Now() - traceStart);
+
+	return true;
+}
+
+/**
+	@brief Handles SHM:OPEN? [size]
+
+	Creates a shared memory waveform ring of the requested size (default 64 MB, SI suffixes allowed) and replies with
+	its actual size, passing the ring's memfd along with the reply. Replies 0 if a ring can't be used: the session
+	isn't on a Unix domain socket, async execution or completion I/O is enabled, or the platform doesn't support it.
+ */
+void SCPIServer::OpenSharedRing(const SCPICommand& command)
+{
+#ifdef __linux__
+	uint64_t size = SHARED_RING_DEFAULT_SIZE;
+	if( (command.GetArgCount() >= 1) && (!ParseSCPIUint64(command[0], size) || (size > SHARED_RING_MAX_SIZE)) )
+	{
+		LogWarning("SHM:OPEN?: invalid ring size \"%.*s\"\n", (int)command[0].size(), command[0].data());
+		SendReply("0");
+		return;
+	}
+
+	//Descriptors can only be passed over Unix sockets, and the fd has to be attached to a reply sent in order
+	if(!m_local || m_asyncThread || m_completionIO)
+	{
+		LogWarning("SHM:OPEN?: shared memory rings are only supported on synchronous Unix socket sessions\n");
+		SendReply("0");
+		return;
+	}
+
+	auto ring = make_shared<WaveformSharedRing>();
+	if(!ring->Create(size))
+	{
+		SendReply("0");
+		return;
+	}
+
+	string reply;
+	AppendSCPIUint64(reply, ring->GetSize());
+	if(!SendDescriptor(reply, ring->GetFD()))
+		return;
+
+	LogVerbose("Opened %zu byte shared memory waveform ring\n", ring->GetSize());
+	m_sharedRing = ring;
+	OnSharedRingOpened();
+#else
+	(void)command;
+	SendReply("0");
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Event loop interface
+
+/**
+	@brief Puts the socket in non-blocking mode, for use with an event loop instead of MainLoop()
+ */
+bool SCPIServer::SetNonBlocking()
+{
+#ifdef _WIN32
+	u_long mode = 1;
+	if(0 != ioctlsocket(m_socket, FIONBIO, &mode))
+		return false;
+#else
+	int flags = fcntl(m_socket, F_GETFL, 0);
+	if( (flags < 0) || (0 != fcntl(m_socket, F_SETFL, flags | O_NONBLOCK)) )
+		return false;
+#endif
+
+	m_nonblocking = true;
+	return true;
+}
+
+/**
+	@brief Called by the event loop when the socket has data to read
+
+	Reads whatever is available and runs every complete command in the buffer.
+
+	@return False if the session should be closed
+ */
+bool SCPIServer::OnReadable()
+{
+	bool wouldBlock;
+	if(!FillRxBuffer(&wouldBlock))
+		return wouldBlock;
+
+	return RunBufferedCommands();
+}
+
+/**
+	@brief Runs every complete command in the receive buffer, then sends all of their replies at once
+
+	@return False if the session should be closed
+ */
+bool SCPIServer::RunBufferedCommands()
+{
+	string_view line;
+	while(ExtractCommand(line))
+	{
+		if(!ProcessCommand(line))
+		{
+			FlushTxBuffer();
+			return false;
+		}
+	}
+
+	//Send all replies for this batch at once
+	return FlushTxBuffer();
+}
+
+/**
+	@brief Called by the event loop when the socket can accept more reply data
+
+	@return False if the session should be closed
+ */
+bool SCPIServer::OnWritable()
+{
+	return FlushTxBuffer();
+}
+
+/**
+	@brief Hands all socket I/O to a completion based event loop (see SCPIEventLoop::BACKEND_URING)
+
+	The loop receives data itself and passes it in with OnReceived(), and sends whatever TakePendingTx() returns.
+	Replies are only ever queued by the session. Shared memory rings (SHM:OPEN?) aren't available in this mode, since
+	their descriptor has to be sent ahead of any queued data.
+ */
+bool SCPIServer::SetCompletionIO()
+{
+	if(!SetNonBlocking())
+		return false;
+
+	m_completionIO = true;
+	return true;
+}
+
+/**
+	@brief Called by a completion based event loop with data received from the socket
+
+	Buffers the data and runs every complete command in it. Commands are run as the buffer fills up, so it only ever
+	has to grow for a single long command.
+
+	@return False if the session should be closed
+ */
+bool SCPIServer::OnReceived(const char* data, size_t len)
+{
+	auto& stats = SCPIStatistics::Get();
+	if(stats.IsEnabled())
+		stats.RecordBytesIn(len);
+
+	while(len)
+	{
+		size_t chunk = min(len, ReserveRxSpace());
+		if(chunk == 0)
+			return false;
+
+		memcpy(&m_rxBuffer[m_rxEnd], data, chunk);
+		m_rxEnd += chunk;
+		data += chunk;
+		len -= chunk;
+
+		if(!RunBufferedCommands())
+			return false;
+	}
+
+	return true;
+}
+
+/**
+	@brief Takes all queued reply data, for a completion based event loop to send
+
+	The session's queue is swapped with the given string, so a loop that passes back the string from its previous
+	send (once that has completed) reuses both buffers without allocating.
+
+	@param data	Replaced with the queued data
+
+	@return True if there was anything to send
+ */
+bool SCPIServer::TakePendingTx(string& data)
+{
+	data.clear();
+	if(!HasPendingTx())
+		return false;
+
+	if(m_txOffset)
+		m_txBuffer.erase(0, m_txOffset);
+	m_txOffset = 0;
+	data.swap(m_txBuffer);
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Asynchronous command execution
+
+/**
+	@brief Runs command handlers on a dedicated worker thread, so slow hardware calls don't hold up the I/O thread
+
+	Commands are still run one at a time, in the order they were received. Queries for which IsNonBlockingQuery()
+	returns true are answered on the I/O thread right away instead of waiting behind earlier commands. Every query
+	gets a reply slot when it's received and replies are sent strictly in slot order, so the client sees replies in
+	protocol order either way. Commands (which have no reply) don't hold up later non-blocking queries; anything
+	a command handler does send goes out after the replies already queued when it sends it.
+
+	Call before MainLoop() or before handing the session to an event loop. Whoever owns the session must call
+	StopAsyncExecution() before destroying it (MainLoop() and SCPIEventLoop do this), since the worker thread calls
+	virtual methods of derived classes.
+ */
+void SCPIServer::EnableAsyncExecution()
+{
+	if(m_asyncThread)
+		return;
+
+	m_asyncStopping = false;
+	m_asyncThread = make_unique<thread>(&SCPIServer::AsyncWorkerLoop, this);
+	m_asyncThreadId = m_asyncThread->get_id();
+}
+
+/**
+	@brief Runs all queued commands to completion, then stops the worker thread and sends any remaining replies
+ */
+void SCPIServer::StopAsyncExecution()
+{
+	if(!m_asyncThread)
+		return;
+
+	{
+		lock_guard<mutex> lock(m_asyncMutex);
+		m_asyncStopping = true;
+	}
+	m_asyncCond.notify_one();
+	m_asyncThread->join();
+	m_asyncThread.reset();
+	m_asyncThreadId = thread::id();
+
+	DrainAsyncReplies();
+	FlushReplies();
+}
+
+/**
+	@brief Called by the event loop (on the I/O thread) after the wake callback fires, to send finished replies and
+	pending event notifications
+
+	@return False if the socket failed
+ */
+bool SCPIServer::OnAsyncComplete()
+{
+	TakePendingEvents();
+	DrainAsyncReplies();
+	return FlushTxBuffer();
+}
+
+/**
+	@brief Queues a command for the worker thread, or runs it right away if it's a non-blocking query
+
+	@return False if the client asked to close the session
+ */
+bool SCPIServer::ProcessCommandAsync(string_view line)
+{
+	ParseCommand(m_command, line);
+	if(!m_command.m_query && (m_command.m_cmd == "EXIT"))
+		return false;
+
+	//Only queries have a reply to keep in order
+	AsyncReply* reply = nullptr;
+	if(m_command.m_query)
+	{
+		lock_guard<mutex> lock(m_asyncMutex);
+		m_asyncReplies.emplace_back();
+		reply = &m_asyncReplies.back();
+	}
+
+	if(reply && IsNonBlockingQuery(m_command))
+	{
+		bool trace = m_trace.IsOpen();
+		uint64_t traceStart = trace ? m_trace.Now() : 0;
+
+		m_inlineReply = reply;
+		OnQuery(m_command);
+		m_inlineReply = nullptr;
+
+		if(trace)
+			m_trace.RecordHandler(m_command.m_line, traceStart, m_trace.Now() - traceStart);
+		CompleteAsyncReply(reply);
+		return true;
+	}
+
+	{
+		lock_guard<mutex> lock(m_asyncMutex);
+		m_asyncJobs.push_back(AsyncJob{string(line), reply});
+	}
+	m_asyncCond.notify_one();
+	return true;
+}
+
+/**
+	@brief Worker thread: runs queued commands in order until stopped
+ */
+void SCPIServer::AsyncWorkerLoop()
+{
+	SCPIThreading::Get().ApplyToCurrentThread(SCPIThreading::THREAD_CONTROL);
+
+	while(true)
+	{
+		AsyncJob job;
+		{
+			unique_lock<mutex> lock(m_asyncMutex);
+			m_asyncCond.wait(lock, [this]{ return !m_asyncJobs.empty() || m_asyncStopping; });
+
+			//Only exit once everything that was queued has run
+			if(m_asyncJobs.empty())
+				return;
+
+			job = std::move(m_asyncJobs.front());
+			m_asyncJobs.pop_front();
+		}
+
+		m_workerReply = job.m_reply;
+		ParseCommand(m_asyncCommand, job.m_line);
+		RunCommand(m_asyncCommand);
+
+		//Commands only get a slot if they sent something
+		if(m_workerReply)
+			CompleteAsyncReply(m_workerReply);
+		m_workerReply = nullptr;
+	}
+}
+
+/**
+	@brief Returns the reply slot of the command running on the calling thread, or null if none
+
+	A command running on the worker thread that has no slot (because it isn't a query) gets one at the end of the
+	queue.
+ */
+SCPIServer::AsyncReply* SCPIServer::GetCurrentAsyncReply()
+{
+	if(this_thread::get_id() != m_asyncThreadId)
+		return m_inlineReply;
+
+	if(!m_workerReply)
+	{
+		lock_guard<mutex> lock(m_asyncMutex);
+		m_asyncReplies.emplace_back();
+		m_workerReply = &m_asyncReplies.back();
+	}
+	return m_workerReply;
+}
+
+/**
+	@brief Marks a reply slot as finished and gets the replies at the head of the queue on their way
+ */
+void SCPIServer::CompleteAsyncReply(AsyncReply* reply)
+{
+	{
+		lock_guard<mutex> lock(m_asyncMutex);
+		reply->m_done = true;
+	}
+
+	bool onWorker = (this_thread::get_id() == m_asyncThreadId);
+
+	//In non-blocking mode the transmit queue belongs to the event loop thread, so just poke it
+	if(m_nonblocking)
+	{
+		if(!onWorker)
+			DrainAsyncReplies();
+		else if(m_asyncWake)
+			m_asyncWake();
+		return;
+	}
+
+	//In blocking mode the I/O thread may be sitting in recv(), so the worker sends replies itself.
+	//The I/O thread sends its own when it's next about to block.
+	DrainAsyncReplies();
+	if(onWorker)
+		FlushReplies();
+}
+
+/**
+	@brief Moves finished replies from the head of the slot queue to the transmit queue, stopping at the first
+	unfinished one
+ */
+void SCPIServer::DrainAsyncReplies()
+{
+	unique_lock<mutex> txlock(m_txMutex, defer_lock);
+	if(!m_nonblocking)
+		txlock.lock();
+
+	lock_guard<mutex> lock(m_asyncMutex);
+	while(!m_asyncReplies.empty() && m_asyncReplies.front().m_done)
+	{
+		m_txBuffer += m_asyncReplies.front().m_data;
+		m_asyncReplies.pop_front();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Event notifications
+
+/**
+	@brief Returns the name of an event, as used by SUBSCRIBE and in notification lines
+ */
+const char* SCPIServer::GetEventName(EventType type)
+{
+	if(type >= EVENT_COUNT)
+		return "";
+	return g_eventNames[type];
+}
+
+/**
+	@brief Handles SUBSCRIBE <event>[,<event>...], UNSUBSCRIBE [<event>,...] and SUBSCRIBE?
+
+	ALL selects every event, and UNSUBSCRIBE with no arguments cancels every subscription. SUBSCRIBE? replies with
+	a comma separated list of the current subscriptions.
+ */
+void SCPIServer::UpdateSubscriptions(const SCPICommand& command, bool subscribe)
+{
+	uint32_t mask = 0;
+	if(!command.m_query)
+	{
+		if(!subscribe && (command.GetArgCount() == 0))
+			mask = (1 << EVENT_COUNT) - 1;
+
+		for(size_t i=0; i<command.GetArgCount(); i++)
+		{
+			auto name = command[i];
+			if(name == "ALL")
+			{
+				mask = (1 << EVENT_COUNT) - 1;
+				continue;
+			}
+
+			bool found = false;
+			for(int j=0; j<EVENT_COUNT; j++)
+			{
+				if(name == g_eventNames[j])
+				{
+					mask |= (1 << j);
+					found = true;
+				}
+			}
+			if(!found)
+				LogWarning("Unknown event \"%.*s\"\n", static_cast<int>(name.length()), name.data());
+		}
+
+		//Once events are in use, other threads may queue them at any time. A blocking session waits on a pipe as
+		//well as the socket, so it can be woken to send them.
+		if(subscribe)
+		{
+#ifndef _WIN32
+			if(!m_nonblocking && (m_eventWake[0] < 0))
+			{
+				if(0 != pipe(m_eventWake))
+				{
+					LogError("Failed to create event wake pipe\n");
+					return;
+				}
+				fcntl(m_eventWake[0], F_SETFL, O_NONBLOCK);
+				fcntl(m_eventWake[1], F_SETFL, O_NONBLOCK);
+			}
+#endif
+			m_eventsUsed = true;
+			m_subscriptions.fetch_or(mask, memory_order_acq_rel);
+		}
+		else
+			m_subscriptions.fetch_and(~mask, memory_order_acq_rel);
+		return;
+	}
+
+	string reply;
+	uint32_t subscriptions = m_subscriptions.load(memory_order_acquire);
+	for(int j=0; j<EVENT_COUNT; j++)
+	{
+		if(!(subscriptions & (1 << j)))
+			continue;
+		if(!reply.empty())
+			reply += ',';
+		reply += g_eventNames[j];
+	}
+	SendReply(reply);
+}
+
+/**
+	@brief Sends an event notification to this session's client, if it subscribed to the event
+
+	The notification is a single line, "!<event>" or "!<event> <detail>", sent between replies (never in the middle
+	of one). Clients that subscribe must check every line they read for the leading '!'.
+
+	May be called from any thread. The line is only queued here, and sent by the session's own thread (the event
+	loop thread in non-blocking mode, or the session thread, which is woken if it's waiting for the client, in
+	blocking mode), so a slow client never holds up whoever raised the event.
+ */
+void SCPIServer::NotifyEvent(EventType type, string_view detail)
+{
+	if(!IsSubscribed(type))
+		return;
+
+	string line = "!";
+	line += g_eventNames[type];
+	if(!detail.empty())
+	{
+		line += ' ';
+		line += detail;
+	}
+	if(m_trace.IsOpen())
+		m_trace.Record(TRACE_EVENT, line);
+	line += '\n';
+
+	{
+		lock_guard<mutex> lock(m_eventMutex);
+		m_pendingEvents += line;
+	}
+
+	if(m_nonblocking)
+	{
+		if(m_asyncWake)
+			m_asyncWake();
+	}
+#ifndef _WIN32
+	else if(m_eventWake[1] >= 0)
+	{
+		//A full pipe just means the session thread already has a wakeup waiting
+		char c = 0;
+		if(write(m_eventWake[1], &c, 1) < 0)
+		{}
+	}
+#endif
+}
+
+/**
+	@brief Moves event notifications queued by other threads into the transmit queue
+
+	Only called between whole replies, so a notification never lands in the middle of one. In blocking mode the
+	caller must hold m_txMutex if the transmit queue is shared.
+ */
+void SCPIServer::TakePendingEvents()
+{
+	lock_guard<mutex> lock(m_eventMutex);
+	m_txBuffer += m_pendingEvents;
+	m_pendingEvents.clear();
+}
+
+/**
+	@brief Sends an event notification to every session in the process that subscribed to it
+
+	@param type		The event
+	@param detail	Event details, if any
+	@param except	Session to skip (for example the one that made a configuration change)
+
+	The session list is only locked long enough to take a reference to each session, so sessions can come and go
+	(and other broadcasts run) while notifications are being queued.
+ */
+void SCPIServer::BroadcastEvent(EventType type, string_view detail, const SCPIServer* except)
+{
+	vector<SCPIServer*> sessions;
+	{
+		lock_guard<mutex> lock(g_sessionsMutex);
+		sessions.reserve(g_sessions.size());
+		for(auto session : g_sessions)
+		{
+			if(session == except)
+				continue;
+			session->m_broadcastRefs ++;
+			sessions.push_back(session);
+		}
+	}
+
+	for(auto session : sessions)
+		session->NotifyEvent(type, detail);
+
+	{
+		lock_guard<mutex> lock(g_sessionsMutex);
+		for(auto session : sessions)
+			session->m_broadcastRefs --;
 	}
+	g_sessionsCond.notify_all();
 }
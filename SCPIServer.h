@@ -31,9 +31,33 @@
 #define SCPIServer_h
 
 #include "../../lib/xptools/Socket.h"
+#include "SCPICommand.h"
+#include "SCPITraceWriter.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
+#ifdef _WIN32
+///@brief Scatter-gather buffer descriptor, matching the POSIX definition
+struct iovec
+{
+	void* iov_base;
+	size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#endif
+
+class WaveformSharedRing;
+
 /**
 	@brief Server class for managing a single SCPI client connection
  */
@@ -45,9 +69,126 @@ public:
 
 	void MainLoop();
 
+	//Interface for running the session from an event loop (see SCPIEventLoop)
+	bool SetNonBlocking();
+	bool OnReadable();
+	bool OnWritable();
+
+	//Interface for running the session from a completion based event loop (io_uring), which does the socket I/O
+	bool SetCompletionIO();
+	bool OnReceived(const char* data, size_t len);
+	bool TakePendingTx(std::string& data);
+
+	///@brief Returns true if there is reply data waiting to be sent
+	bool HasPendingTx() const
+	{ return m_txOffset < m_txBuffer.size(); }
+
+	///@brief Returns the number of bytes of reply data waiting to be sent
+	size_t GetPendingTxSize() const
+	{ return m_txBuffer.size() - m_txOffset; }
+
+	///@brief Returns the socket handle for this session
+	ZSOCKET GetSocket() const
+	{ return m_socket; }
+
+	//Asynchronous command execution
+	void EnableAsyncExecution();
+	void StopAsyncExecution();
+	bool OnAsyncComplete();
+
+	///@brief Sets a function called from the worker thread when replies are ready (non-blocking mode only)
+	void SetAsyncWakeCallback(std::function<void()> callback)
+	{ m_asyncWake = callback; }
+
+	///@brief Events a client can subscribe to with SUBSCRIBE
+	enum EventType
+	{
+		///@brief Trigger armed or disarmed (detail is 1 or 0)
+		EVENT_ARMED,
+
+		///@brief Trigger fired
+		EVENT_TRIGGERED,
+
+		///@brief Waveform ready (detail is implementation specific, typically a sequence number)
+		EVENT_WAVEFORM,
+
+		///@brief Configuration changed by another session (detail is the command, if known)
+		EVENT_CONFIG,
+
+		EVENT_COUNT
+	};
+
+	static const char* GetEventName(EventType type);
+	static void BroadcastEvent(EventType type, std::string_view detail = "", const SCPIServer* except = nullptr);
+	void NotifyEvent(EventType type, std::string_view detail = "");
+
+	///@brief Returns true if the client is subscribed to an event
+	bool IsSubscribed(EventType type) const
+	{ return (m_subscriptions.load(std::memory_order_acquire) >> type) & 1; }
+
+	///@brief Returns true if the client is connected over a Unix domain socket rather than TCP
+	bool IsLocal() const
+	{ return m_local; }
+
+	///@brief Returns the shared memory waveform ring the client opened with SHM:OPEN?, if any
+	std::shared_ptr<WaveformSharedRing> GetSharedRing() const
+	{ return m_sharedRing; }
+
+	//Session recording (see SCPITrace.h)
+	bool StartTrace(const std::string& path);
+	void StopTrace();
+
+	///@brief Returns true if the session is being recorded to a trace file
+	bool IsTracing() const
+	{ return m_trace.IsOpen(); }
+
 protected:
 	bool RecvCommand(std::string& str);
+	bool RecvCommand(std::string_view& line);
 	bool SendReply(const std::string& cmd);
+	bool FlushReplies();
+	bool SendVectored(const iovec* iov, size_t iovcnt);
+	bool SendDescriptor(const std::string& line, int fd);
+
+	bool ExtractCommand(std::string_view& line);
+	bool FillRxBuffer(bool* wouldBlock = nullptr);
+	bool WaitForClient();
+	size_t ReserveRxSpace();
+	bool RunBufferedCommands();
+	bool FlushTxBuffer();
+	bool SendAll(const char* data, size_t len);
+
+	bool ProcessCommand(std::string_view line);
+	bool ProcessCommandAsync(std::string_view line);
+	void ParseCommand(SCPICommand& command, std::string_view line);
+	bool RunCommand(const SCPICommand& command);
+	void OpenSharedRing(const SCPICommand& command);
+	void UpdateSubscriptions(const SCPICommand& command, bool subscribe);
+
+	///@brief Returns true if threads other than the I/O thread may send on the socket in blocking mode
+	bool SharesTxBuffer() const
+	{ return !m_nonblocking && m_asyncThread; }
+
+	/**
+		@brief Called after the client has opened a shared memory waveform ring with SHM:OPEN?
+
+		Servers that stream waveforms to this client can pass GetSharedRing() to WaveformStreamer::SetSharedRing().
+		The default implementation does nothing.
+	 */
+	virtual void OnSharedRingOpened()
+	{}
+
+	/**
+		@brief Checks if a query can be answered immediately when async execution is enabled
+
+		Non-blocking queries run on the I/O thread without waiting for earlier commands to finish on the worker
+		thread, so they must only read cached or otherwise thread safe state. Their replies are still sent in
+		protocol order.
+
+		The default implementation returns false for everything.
+	 */
+	virtual bool IsNonBlockingQuery(const SCPICommand& /*command*/)
+	{ return false; }
 
 	void ParseLine(
 		const std::string& line,
@@ -59,16 +200,39 @@ protected:
 	/**
 		@brief Process a command
 
+		The default implementation converts the command to strings and calls the string-based OnCommand(), for
+		compatibility with servers that haven't moved to the view-based interface.
+
+		@param command	The parsed command. Fields are only valid for the duration of the call.
+
+		@return True if the command was recognized and processed, false if unknown or invalid.
+	 */
+	virtual bool OnCommand(const SCPICommand& command);
+
+	/**
+		@brief Process a query command
+
+		The default implementation calls the string-based OnQuery().
+
+		@param command	The parsed command. Fields are only valid for the duration of the call.
+
+		@return True if the command was recognized and processed, false if unknown or invalid.
+	 */
+	virtual bool OnQuery(const SCPICommand& command);
+
+	/**
+		@brief Process a command (legacy string-based interface)
+
 		@return True if the command was recognized and processed, false if unknown or invalid.
 	 */
 	virtual bool OnCommand(
 		const std::string& line,
 		const std::string& subject,
 		const std::string& cmd,
-		const std::vector<std::string>& args) =0;
+		const std::vector<std::string>& args);
 
 	/**
-		@brief Process a query command
+		@brief Process a query command (legacy string-based interface)
 
 		@param line		Full SCPI line (for display in error messages or logs)
 		@param subject	Subject of the SCPI command (for example "C2" in "C2:OFFS?")
@@ -79,10 +243,138 @@ protected:
 	virtual bool OnQuery(
 		const std::string& line,
 		const std::string& subject,
-		const std::string& cmd) =0;
+		const std::string& cmd);
 
 protected:
 	Socket m_socket;
+
+	///@brief Buffer of inbound data not yet consumed by RecvCommand()
+	std::vector<char> m_rxBuffer;
+
+	///@brief Offset of the first unconsumed byte in m_rxBuffer
+	size_t m_rxStart;
+
+	///@brief Offset one past the last valid byte in m_rxBuffer
+	size_t m_rxEnd;
+
+	///@brief Offset of the first byte not yet searched for a command terminator
+	size_t m_rxScan;
+
+	///@brief Reply data waiting to be sent
+	std::string m_txBuffer;
+
+	///@brief Offset of the first unsent byte in m_txBuffer
+	size_t m_txOffset;
+
+	///@brief True if the socket is in non-blocking mode and driven by an event loop
+	bool m_nonblocking;
+
+	///@brief True if the event loop does all socket I/O and replies are only queued (see SetCompletionIO())
+	bool m_completionIO;
+
+	///@brief Time the socket stopped accepting reply data in non-blocking mode, or zero if not stalled
+	uint64_t m_stallStart;
+
+	///@brief Parsed form of the command currently being processed (reused to avoid allocations)
+	SCPICommand m_command;
+
+	///@brief True if the socket is a Unix domain socket
+	bool m_local;
+
+	///@brief Shared memory waveform ring opened by the client, if any
+	std::shared_ptr<WaveformSharedRing> m_sharedRing;
+
+	///@brief Trace file the session is being recorded to, if any
+	SCPITraceWriter m_trace;
+
+	//Asynchronous command execution
+protected:
+
+	///@brief Reply data for one command, filled in when the command finishes
+	class AsyncReply
+	{
+	public:
+		AsyncReply()
+		: m_done(false)
+		{}
+
+		std::string m_data;
+		bool m_done;
+	};
+
+	///@brief A command waiting for the worker thread
+	class AsyncJob
+	{
+	public:
+		std::string m_line;
+
+		///@brief Reply slot (queries only)
+		AsyncReply* m_reply;
+	};
+
+	void AsyncWorkerLoop();
+	void CompleteAsyncReply(AsyncReply* reply);
+	void DrainAsyncReplies();
+	AsyncReply* GetCurrentAsyncReply();
+
+	///@brief Worker thread running commands in order (null if async execution is disabled)
+	std::unique_ptr<std::thread> m_asyncThread;
+
+	///@brief ID of m_asyncThread
+	std::thread::id m_asyncThreadId;
+
+	///@brief Mutex protecting m_asyncJobs, m_asyncReplies and m_asyncStopping
+	std::mutex m_asyncMutex;
+
+	///@brief Signaled when a job is queued or the worker should stop
+	std::condition_variable m_asyncCond;
+
+	///@brief Commands waiting for the worker thread
+	std::deque<AsyncJob> m_asyncJobs;
+
+	///@brief Reply slots for every query not yet answered and sent, in protocol order
+	std::list<AsyncReply> m_asyncReplies;
+
+	///@brief Set to make the worker thread exit once the job queue is empty
+	bool m_asyncStopping;
+
+	///@brief Reply slot of the command running on the worker thread
+	AsyncReply* m_workerReply;
+
+	///@brief Reply slot of the non-blocking query running on the I/O thread
+	AsyncReply* m_inlineReply;
+
+	///@brief Parsed form of the command running on the worker thread
+	SCPICommand m_asyncCommand;
+
+	///@brief Protects m_txBuffer in blocking mode when both threads send replies
+	std::mutex m_txMutex;
+
+	///@brief Called from the worker thread (or an event source) to have the event loop pick up finished replies
+	std::function<void()> m_asyncWake;
+
+	//Event notifications
+protected:
+
+	///@brief Bitmask of subscribed events (1 << EventType)
+	std::atomic<uint32_t> m_subscriptions;
+
+	void TakePendingEvents();
+
+	///@brief Set on the first SUBSCRIBE, after which events may be queued from other threads at any time
+	std::atomic<bool> m_eventsUsed;
+
+	///@brief Protects m_pendingEvents
+	std::mutex m_eventMutex;
+
+	///@brief Event lines queued by other threads, waiting for the session's own thread to send them
+	std::string m_pendingEvents;
+
+	///@brief Pipe written to wake the session thread when an event is queued (blocking mode only, -1 if unused)
+	int m_eventWake[2];
+
+	///@brief Number of BroadcastEvent() calls holding a pointer to this session (protected by the sessions mutex)
+	size_t m_broadcastRefs;
 };
 
 #endif
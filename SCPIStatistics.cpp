@@ -0,0 +1,410 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#include "SCPIStatistics.h"
+#include <log.h>
+#include <chrono>
+#include <map>
+#include <string.h>
+
+using namespace std;
+
+/**
+	@brief Holds the calling thread's counter block, handing it back to SCPIStatistics when the thread exits
+ */
+class SCPIStatisticsThreadBlock
+{
+public:
+	~SCPIStatisticsThreadBlock()
+	{
+		if(m_block)
+			SCPIStatistics::Get().ReleaseThreadBlock(m_block);
+	}
+
+	SCPIStatistics::ThreadBlock* m_block = nullptr;
+};
+
+//Per-thread counter block, assigned on first use
+static thread_local SCPIStatisticsThreadBlock g_threadBlock;
+
+//Linear probe distance when looking for a command's counters
+#define COMMAND_PROBE_LIMIT 8
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+SCPIStatistics::SCPIStatistics()
+	: m_enabled(true)
+	, m_dumpStopping(false)
+{
+}
+
+SCPIStatistics::~SCPIStatistics()
+{
+	StopPeriodicDump();
+}
+
+SCPIStatistics::ThreadBlock::ThreadBlock()
+{
+	for(auto& phase : m_histograms)
+	{
+		for(auto& bucket : phase)
+			bucket = 0;
+	}
+
+	m_commands = 0;
+	m_untrackedCommands = 0;
+	m_bytesIn = 0;
+	m_bytesOut = 0;
+	m_stalls = 0;
+	m_stallNs = 0;
+
+	for(auto& c : m_commandCounters)
+	{
+		c.m_key = 0;
+		c.m_name[0] = '\0';
+		c.m_count = 0;
+		c.m_totalNs = 0;
+		c.m_maxNs = 0;
+	}
+}
+
+/**
+	@brief Returns the process wide statistics object
+ */
+SCPIStatistics& SCPIStatistics::Get()
+{
+	static SCPIStatistics stats;
+	return stats;
+}
+
+/**
+	@brief Returns the calling thread's counter block, assigning one if this is the thread's first use
+
+	A block left by an exited thread is reused if there is one. All counters are cumulative, so the new thread just
+	keeps adding to them. The mutex orders the old thread's last writes before the new thread's first.
+ */
+SCPIStatistics::ThreadBlock& SCPIStatistics::GetThreadBlock()
+{
+	if(!g_threadBlock.m_block)
+	{
+		lock_guard<mutex> lock(m_blocksMutex);
+		if(!m_freeBlocks.empty())
+		{
+			g_threadBlock.m_block = m_freeBlocks.back();
+			m_freeBlocks.pop_back();
+		}
+		else
+		{
+			m_blocks.push_back(make_unique<ThreadBlock>());
+			g_threadBlock.m_block = m_blocks.back().get();
+		}
+	}
+	return *g_threadBlock.m_block;
+}
+
+/**
+	@brief Makes an exiting thread's counter block available for reuse
+ */
+void SCPIStatistics::ReleaseThreadBlock(ThreadBlock* block)
+{
+	lock_guard<mutex> lock(m_blocksMutex);
+	m_freeBlocks.push_back(block);
+}
+
+/**
+	@brief Returns a monotonic timestamp in nanoseconds
+ */
+uint64_t SCPIStatistics::Now()
+{
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Histogram buckets
+
+/**
+	@brief Maps a latency to its histogram bucket
+
+	Values below 2^HISTOGRAM_SUB_BITS get a bucket each. Above that, each power of two is split into
+	2^HISTOGRAM_SUB_BITS linear sub-buckets.
+ */
+size_t SCPIStatistics::GetBucket(uint64_t ns)
+{
+	const uint64_t sub = 1 << HISTOGRAM_SUB_BITS;
+	if(ns < sub)
+		return ns;
+
+	size_t exp = 63 - __builtin_clzll(ns);
+	size_t mantissa = (ns >> (exp - HISTOGRAM_SUB_BITS)) & (sub - 1);
+	return (exp - HISTOGRAM_SUB_BITS + 1) * sub + mantissa;
+}
+
+/**
+	@brief Returns the smallest latency which maps to a bucket
+ */
+uint64_t SCPIStatistics::GetBucketValue(size_t bucket)
+{
+	const uint64_t sub = 1 << HISTOGRAM_SUB_BITS;
+	if(bucket < sub)
+		return bucket;
+
+	size_t exp = bucket / sub + HISTOGRAM_SUB_BITS - 1;
+	uint64_t mantissa = bucket % sub;
+	return (sub + mantissa) << (exp - HISTOGRAM_SUB_BITS);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Recording
+
+void SCPIStatistics::RecordLatency(Phase phase, uint64_t ns)
+{
+	Add(GetThreadBlock().m_histograms[phase][GetBucket(ns)], 1);
+}
+
+/**
+	@brief Counts one run of a command handler
+
+	@param cmd			Command name (without subject)
+	@param query		True if the command was a query
+	@param handlerNs	Time spent in the handler
+ */
+void SCPIStatistics::RecordCommand(string_view cmd, bool query, uint64_t handlerNs)
+{
+	auto& block = GetThreadBlock();
+	Add(block.m_commands, 1);
+
+	if(cmd.length() > COMMAND_NAME_LEN - 2)
+		cmd = cmd.substr(0, COMMAND_NAME_LEN - 2);
+
+	//FNV-1a, never zero since that marks an empty slot
+	uint64_t key = 0xcbf29ce484222325ULL;
+	for(auto c : cmd)
+		key = (key ^ static_cast<uint8_t>(c)) * 0x100000001b3ULL;
+	key = (key ^ (query ? '?' : ' ')) * 0x100000001b3ULL;
+	if(key == 0)
+		key = 1;
+
+	for(size_t i=0; i<COMMAND_PROBE_LIMIT; i++)
+	{
+		auto& c = block.m_commandCounters[(key + i) % COMMAND_SLOTS];
+		uint64_t slotKey = c.m_key.load(memory_order_relaxed);
+
+		//Claim an empty slot. Only this thread writes the block, so no need for a compare-exchange.
+		if(slotKey == 0)
+		{
+			memcpy(c.m_name, cmd.data(), cmd.length());
+			c.m_name[cmd.length()] = query ? '?' : '\0';
+			c.m_name[cmd.length() + 1] = '\0';
+			c.m_key.store(key, memory_order_release);
+			slotKey = key;
+		}
+
+		if(slotKey == key)
+		{
+			Add(c.m_count, 1);
+			Add(c.m_totalNs, handlerNs);
+			if(handlerNs > c.m_maxNs.load(memory_order_relaxed))
+				c.m_maxNs.store(handlerNs, memory_order_relaxed);
+			return;
+		}
+	}
+
+	Add(block.m_untrackedCommands, 1);
+}
+
+void SCPIStatistics::RecordBytesIn(uint64_t bytes)
+{
+	Add(GetThreadBlock().m_bytesIn, bytes);
+}
+
+void SCPIStatistics::RecordBytesOut(uint64_t bytes)
+{
+	Add(GetThreadBlock().m_bytesOut, bytes);
+}
+
+/**
+	@brief Counts time spent waiting for a client to accept reply data
+ */
+void SCPIStatistics::RecordStall(uint64_t ns)
+{
+	auto& block = GetThreadBlock();
+	Add(block.m_stalls, 1);
+	Add(block.m_stallNs, ns);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Reporting
+
+/**
+	@brief Formats a histogram as count/p50/p90/p99/max (latencies in ns)
+ */
+static string FormatHistogram(const uint64_t* buckets)
+{
+	uint64_t total = 0;
+	size_t maxBucket = 0;
+	for(size_t i=0; i<SCPIStatistics::HISTOGRAM_BUCKETS; i++)
+	{
+		total += buckets[i];
+		if(buckets[i])
+			maxBucket = i;
+	}
+	if(total == 0)
+		return "0/0/0/0/0";
+
+	const double quantiles[] = {0.5, 0.9, 0.99};
+	uint64_t values[3] = {0};
+	uint64_t seen = 0;
+	size_t q = 0;
+	for(size_t i=0; (i<SCPIStatistics::HISTOGRAM_BUCKETS) && (q < 3); i++)
+	{
+		seen += buckets[i];
+		while( (q < 3) && (seen >= quantiles[q] * total) )
+			values[q++] = SCPIStatistics::GetBucketValue(i);
+	}
+
+	return to_string(total) + "/" + to_string(values[0]) + "/" + to_string(values[1]) + "/" + to_string(values[2]) +
+		"/" + to_string(SCPIStatistics::GetBucketValue(maxBucket));
+}
+
+/**
+	@brief Returns all statistics as a single line of space separated key=value pairs
+
+	Latency histograms are reported as count/p50/p90/p99/max in nanoseconds (bucket lower bounds), and each command
+	as count/mean/max handler time in nanoseconds. All counters are cumulative since startup.
+ */
+string SCPIStatistics::Format()
+{
+	uint64_t histograms[PHASE_COUNT][HISTOGRAM_BUCKETS] = {};
+	uint64_t commands = 0;
+	uint64_t untracked = 0;
+	uint64_t bytesIn = 0;
+	uint64_t bytesOut = 0;
+	uint64_t stalls = 0;
+	uint64_t stallNs = 0;
+
+	class Totals
+	{
+	public:
+		uint64_t m_count = 0;
+		uint64_t m_totalNs = 0;
+		uint64_t m_maxNs = 0;
+	};
+	map<string, Totals> perCommand;
+
+	{
+		lock_guard<mutex> lock(m_blocksMutex);
+		for(auto& block : m_blocks)
+		{
+			for(size_t p=0; p<PHASE_COUNT; p++)
+			{
+				for(size_t i=0; i<HISTOGRAM_BUCKETS; i++)
+					histograms[p][i] += block->m_histograms[p][i].load(memory_order_relaxed);
+			}
+
+			commands += block->m_commands.load(memory_order_relaxed);
+			untracked += block->m_untrackedCommands.load(memory_order_relaxed);
+			bytesIn += block->m_bytesIn.load(memory_order_relaxed);
+			bytesOut += block->m_bytesOut.load(memory_order_relaxed);
+			stalls += block->m_stalls.load(memory_order_relaxed);
+			stallNs += block->m_stallNs.load(memory_order_relaxed);
+
+			for(auto& c : block->m_commandCounters)
+			{
+				if(!c.m_key.load(memory_order_acquire))
+					continue;
+
+				auto& t = perCommand[c.m_name];
+				t.m_count += c.m_count.load(memory_order_relaxed);
+				t.m_totalNs += c.m_totalNs.load(memory_order_relaxed);
+				t.m_maxNs = max(t.m_maxNs, c.m_maxNs.load(memory_order_relaxed));
+			}
+		}
+	}
+
+	string ret =
+		"commands=" + to_string(commands) +
+		" untracked=" + to_string(untracked) +
+		" bytes_in=" + to_string(bytesIn) +
+		" bytes_out=" + to_string(bytesOut) +
+		" stalls=" + to_string(stalls) +
+		" stall_ns=" + to_string(stallNs) +
+		" parse_ns=" + FormatHistogram(histograms[PHASE_PARSE]) +
+		" handler_ns=" + FormatHistogram(histograms[PHASE_HANDLER]) +
+		" send_ns=" + FormatHistogram(histograms[PHASE_SEND]);
+
+	for(auto& it : perCommand)
+	{
+		auto& t = it.second;
+		uint64_t mean = t.m_count ? (t.m_totalNs / t.m_count) : 0;
+		ret += " " + it.first + "=" + to_string(t.m_count) + "/" + to_string(mean) + "/" + to_string(t.m_maxNs);
+	}
+
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Periodic dump
+
+/**
+	@brief Starts logging the statistics every intervalSeconds seconds, replacing any previous dump interval
+ */
+void SCPIStatistics::StartPeriodicDump(unsigned int intervalSeconds)
+{
+	StopPeriodicDump();
+	if(intervalSeconds == 0)
+		return;
+
+	m_dumpStopping = false;
+	m_dumpThread = make_unique<thread>(&SCPIStatistics::DumpThreadProc, this, intervalSeconds);
+}
+
+/**
+	@brief Stops the periodic dump started by StartPeriodicDump()
+ */
+void SCPIStatistics::StopPeriodicDump()
+{
+	if(!m_dumpThread)
+		return;
+
+	{
+		lock_guard<mutex> lock(m_dumpMutex);
+		m_dumpStopping = true;
+	}
+	m_dumpCond.notify_one();
+	m_dumpThread->join();
+	m_dumpThread.reset();
+}
+
+void SCPIStatistics::DumpThreadProc(unsigned int intervalSeconds)
+{
+	unique_lock<mutex> lock(m_dumpMutex);
+	while(!m_dumpCond.wait_for(lock, chrono::seconds(intervalSeconds), [this]{ return m_dumpStopping; }))
+		LogNotice("SCPI statistics: %s\n", Format().c_str());
+}
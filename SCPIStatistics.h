@@ -0,0 +1,182 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef SCPIStatistics_h
+#define SCPIStatistics_h
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+/**
+	@brief Process wide command latency and throughput counters for all SCPI sessions
+
+	Each thread records into its own block of counters, so the hot path takes no locks and doesn't share cache lines
+	with other threads. Counters are only combined when a report is generated. When a thread exits its block is kept,
+	counts and all, and handed to the next thread that starts recording, so memory use is bounded by the largest
+	number of threads alive at once.
+
+	Latencies are kept in log-linear histograms: four buckets per power of two, giving about 25% precision from
+	nanoseconds to hours in a fixed 2 kB per histogram.
+ */
+class SCPIStatistics
+{
+public:
+	static SCPIStatistics& Get();
+	~SCPIStatistics();
+
+	///@brief Stages of command processing with a latency histogram
+	enum Phase
+	{
+		PHASE_PARSE,
+		PHASE_HANDLER,
+		PHASE_SEND,
+
+		PHASE_COUNT
+	};
+
+	///@brief Returns true if statistics are being recorded
+	bool IsEnabled() const
+	{ return m_enabled.load(std::memory_order_relaxed); }
+
+	///@brief Turns recording on or off (on by default)
+	void SetEnabled(bool enabled)
+	{ m_enabled.store(enabled, std::memory_order_relaxed); }
+
+	//Recording (call only if IsEnabled() returns true)
+	void RecordLatency(Phase phase, uint64_t ns);
+	void RecordCommand(std::string_view cmd, bool query, uint64_t handlerNs);
+	void RecordBytesIn(uint64_t bytes);
+	void RecordBytesOut(uint64_t bytes);
+	void RecordStall(uint64_t ns);
+
+	std::string Format();
+
+	void StartPeriodicDump(unsigned int intervalSeconds);
+	void StopPeriodicDump();
+
+	static uint64_t Now();
+
+	///@brief Number of sub-buckets per power of two, as a power of two
+	static const size_t HISTOGRAM_SUB_BITS = 2;
+
+	///@brief Number of buckets in each latency histogram
+	static const size_t HISTOGRAM_BUCKETS = 64 << HISTOGRAM_SUB_BITS;
+
+	///@brief Number of distinct commands tracked per thread (further commands are only counted in the totals)
+	static const size_t COMMAND_SLOTS = 128;
+
+	///@brief Maximum length of a tracked command name
+	static const size_t COMMAND_NAME_LEN = 32;
+
+	static size_t GetBucket(uint64_t ns);
+	static uint64_t GetBucketValue(size_t bucket);
+
+protected:
+	SCPIStatistics();
+
+	friend class SCPIStatisticsThreadBlock;
+
+	///@brief Counters for one command name
+	class CommandCounters
+	{
+	public:
+		///@brief Hash of the name, or zero if the slot is empty. Published after m_name is written.
+		std::atomic<uint64_t> m_key;
+
+		char m_name[COMMAND_NAME_LEN];
+
+		std::atomic<uint64_t> m_count;
+		std::atomic<uint64_t> m_totalNs;
+		std::atomic<uint64_t> m_maxNs;
+	};
+
+	///@brief All counters written by one thread
+	class alignas(64) ThreadBlock
+	{
+	public:
+		ThreadBlock();
+
+		std::atomic<uint64_t> m_histograms[PHASE_COUNT][HISTOGRAM_BUCKETS];
+
+		std::atomic<uint64_t> m_commands;
+		std::atomic<uint64_t> m_untrackedCommands;
+		std::atomic<uint64_t> m_bytesIn;
+		std::atomic<uint64_t> m_bytesOut;
+		std::atomic<uint64_t> m_stalls;
+		std::atomic<uint64_t> m_stallNs;
+
+		CommandCounters m_commandCounters[COMMAND_SLOTS];
+	};
+
+	ThreadBlock& GetThreadBlock();
+	void ReleaseThreadBlock(ThreadBlock* block);
+	void DumpThreadProc(unsigned int intervalSeconds);
+
+	/**
+		@brief Adds to a counter only ever written by the calling thread
+
+		A plain load and store rather than fetch_add, since there's no other writer to race with and a locked
+		read-modify-write is several times slower.
+	 */
+	static void Add(std::atomic<uint64_t>& counter, uint64_t value)
+	{ counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed); }
+
+	///@brief True if statistics are being recorded
+	std::atomic<bool> m_enabled;
+
+	///@brief Mutex protecting m_blocks and m_freeBlocks
+	std::mutex m_blocksMutex;
+
+	///@brief Every counter block ever created, whether in use by a thread or not
+	std::vector<std::unique_ptr<ThreadBlock>> m_blocks;
+
+	///@brief Blocks whose threads have exited, ready for reuse
+	std::vector<ThreadBlock*> m_freeBlocks;
+
+	///@brief Thread logging the statistics periodically, if enabled
+	std::unique_ptr<std::thread> m_dumpThread;
+
+	///@brief Mutex protecting m_dumpStopping
+	std::mutex m_dumpMutex;
+
+	///@brief Signaled to stop the dump thread
+	std::condition_variable m_dumpCond;
+
+	///@brief Set to stop the dump thread
+	bool m_dumpStopping;
+};
+
+#endif
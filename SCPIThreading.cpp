@@ -0,0 +1,478 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#include "SCPIThreading.h"
+#include <log.h>
+#include <errno.h>
+#include <charconv>
+#include <fstream>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+//Memory policy mode from linux/mempolicy.h, which isn't installed everywhere
+#define SCPI_MPOL_PREFERRED 1
+
+static const char* g_roleNames[SCPIThreading::THREAD_ROLE_COUNT] =
+{
+	"control",
+	"sender",
+	"acquisition"
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// CPU lists
+
+/**
+	@brief Parses a plain decimal integer, rejecting anything else in the string
+
+	Unlike ParseSCPIUint64(), SI suffixes and trailing characters aren't accepted, since "2k" or "3abc" in a CPU list
+	or priority is a typo rather than a number.
+ */
+static bool ParseInteger(string_view s, uint64_t& v)
+{
+	auto result = from_chars(s.data(), s.data() + s.length(), v);
+	return !s.empty() && (result.ec == errc()) && (result.ptr == s.data() + s.length());
+}
+
+/**
+	@brief Parses a CPU list in the kernel's format ("0-3,8,10-11")
+ */
+static bool ParseCpuList(string_view s, vector<int>& cpus)
+{
+	cpus.clear();
+	while(!s.empty())
+	{
+		auto item = s.substr(0, s.find(','));
+		s.remove_prefix(min(item.length() + 1, s.length()));
+
+		auto dash = item.find('-');
+		uint64_t first;
+		uint64_t last;
+		if(!ParseInteger(item.substr(0, dash), first))
+			return false;
+		last = first;
+		if( (dash != string_view::npos) && !ParseInteger(item.substr(dash + 1), last) )
+			return false;
+		if( (last < first) || (last >= 4096) )
+			return false;
+
+		for(uint64_t i=first; i<=last; i++)
+			cpus.push_back(static_cast<int>(i));
+	}
+	return !cpus.empty();
+}
+
+/**
+	@brief Formats a sorted list of CPUs in the kernel's format
+ */
+static string FormatCpuList(const vector<int>& cpus)
+{
+	string ret;
+	for(size_t i=0; i<cpus.size(); )
+	{
+		size_t j = i;
+		while( (j+1 < cpus.size()) && (cpus[j+1] == cpus[j] + 1) )
+			j++;
+
+		if(!ret.empty())
+			ret += ',';
+		ret += to_string(cpus[i]);
+		if(j > i)
+			ret += '-' + to_string(cpus[j]);
+		i = j + 1;
+	}
+	return ret;
+}
+
+/**
+	@brief Reads the list of CPUs in a NUMA node from sysfs
+ */
+static bool GetNodeCpus(int node, vector<int>& cpus)
+{
+	ifstream in("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+	string line;
+	if(!in || !getline(in, line))
+		return false;
+	return ParseCpuList(line, cpus);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+SCPIThreading::SCPIThreading()
+	: m_mlockall(false)
+	, m_mlockStatus("off")
+	, m_mlockDone(false)
+{
+	LoadEnvironment();
+}
+
+/**
+	@brief Returns the process wide threading configuration
+ */
+SCPIThreading& SCPIThreading::Get()
+{
+	static SCPIThreading threading;
+	return threading;
+}
+
+/**
+	@brief Returns the name of a role, as used in arguments and the THREADS? reply
+ */
+const char* SCPIThreading::GetRoleName(Role role)
+{
+	if(role >= THREAD_ROLE_COUNT)
+		return "";
+	return g_roleNames[role];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Configuration
+
+/**
+	@brief Reads settings from SCPI_<ROLE>_CPUS, SCPI_<ROLE>_FIFO, SCPI_<ROLE>_NODE and SCPI_MLOCKALL
+ */
+void SCPIThreading::LoadEnvironment()
+{
+	static const char* options[] = { "cpus", "fifo", "node" };
+
+	for(int r=0; r<THREAD_ROLE_COUNT; r++)
+	{
+		for(auto option : options)
+		{
+			string name = string("SCPI_") + g_roleNames[r] + "_" + option;
+			for(auto& c : name)
+				c = toupper(c);
+
+			auto value = getenv(name.c_str());
+			if(value)
+				SetOption(static_cast<Role>(r), option, value);
+		}
+	}
+
+	auto mlock = getenv("SCPI_MLOCKALL");
+	if(mlock && (atoi(mlock) != 0))
+		m_mlockall = true;
+}
+
+/**
+	@brief Handles a command line argument if it's one of ours (see the class description for the list)
+
+	Call before starting any threads.
+
+	@return True if the argument was a valid threading argument, false if it wasn't one (or had a bad value, which is
+			logged)
+ */
+bool SCPIThreading::ParseArgument(string_view arg)
+{
+	if(arg == "--mlockall")
+	{
+		m_mlockall = true;
+		return true;
+	}
+
+	if( (arg.substr(0, 2) != "--") || (arg.find('=') == string_view::npos) )
+		return false;
+	arg.remove_prefix(2);
+	auto eq = arg.find('=');
+	auto name = arg.substr(0, eq);
+	auto value = arg.substr(eq + 1);
+
+	for(int r=0; r<THREAD_ROLE_COUNT; r++)
+	{
+		string_view role(g_roleNames[r]);
+		if( (name.length() > role.length()) && (name.substr(0, role.length()) == role) && (name[role.length()] == '-') )
+			return SetOption(static_cast<Role>(r), name.substr(role.length() + 1), value);
+	}
+	return false;
+}
+
+/**
+	@brief Sets one option for a role
+
+	@param role		The role
+	@param option	"cpus", "fifo" or "node"
+	@param value	CPU list, SCHED_FIFO priority (0 for the normal scheduler), or NUMA node (-1 for none)
+ */
+bool SCPIThreading::SetOption(Role role, string_view option, string_view value)
+{
+	auto& s = m_settings[role];
+	uint64_t n;
+	bool ok = false;
+
+	if(option == "cpus")
+		ok = ParseCpuList(value, s.m_cpus);
+	else if(option == "fifo")
+	{
+		ok = ParseInteger(value, n) && (n <= 99);
+		if(ok)
+			s.m_priority = n;
+	}
+	else if(option == "node")
+	{
+		if(value == "-1")
+		{
+			s.m_node = -1;
+			ok = true;
+		}
+		else
+		{
+			ok = ParseInteger(value, n) && (n < 1024);
+			if(ok)
+				s.m_node = n;
+		}
+	}
+
+	if(!ok)
+	{
+		LogWarning("Invalid %s thread setting %.*s=%.*s\n",
+			g_roleNames[role],
+			static_cast<int>(option.length()), option.data(),
+			static_cast<int>(value.length()), value.data());
+	}
+	return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Applying settings
+
+/**
+	@brief Applies a role's settings to the calling thread, and records what it actually got
+
+	The first call also locks the process's memory if that was requested. Settings that can't be applied (usually for
+	lack of privileges) are logged and skipped.
+
+	@return True if everything requested was applied
+ */
+bool SCPIThreading::ApplyToCurrentThread(Role role)
+{
+	LockMemory();
+
+	bool ok = true;
+	Status status;
+
+#ifdef __linux__
+	auto& s = m_settings[role];
+	auto name = g_roleNames[role];
+	pthread_t self = pthread_self();
+
+	vector<int> cpus = s.m_cpus;
+	if(cpus.empty() && (s.m_node >= 0) && !GetNodeCpus(s.m_node, cpus))
+		LogWarning("Couldn't get the CPUs of NUMA node %d for the %s thread\n", s.m_node, name);
+
+	if(!cpus.empty())
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for(auto c : cpus)
+		{
+			if(c < CPU_SETSIZE)
+				CPU_SET(c, &set);
+		}
+
+		int err = pthread_setaffinity_np(self, sizeof(set), &set);
+		if(err != 0)
+		{
+			LogWarning("Couldn't pin the %s thread to CPUs %s (%s)\n", name, FormatCpuList(cpus).c_str(), strerror(err));
+			ok = false;
+		}
+	}
+
+	if(s.m_priority > 0)
+	{
+		sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = s.m_priority;
+		int err = pthread_setschedparam(self, SCHED_FIFO, &param);
+		if(err != 0)
+		{
+			LogWarning("Couldn't run the %s thread under SCHED_FIFO at priority %d (%s)\n",
+				name, s.m_priority, strerror(err));
+			ok = false;
+		}
+	}
+
+	if(s.m_node >= 0)
+	{
+		vector<unsigned long> mask(s.m_node / (8 * sizeof(unsigned long)) + 1, 0);
+		mask[s.m_node / (8 * sizeof(unsigned long))] = 1UL << (s.m_node % (8 * sizeof(unsigned long)));
+		if(0 != syscall(SYS_set_mempolicy, SCPI_MPOL_PREFERRED, mask.data(), mask.size() * 8 * sizeof(unsigned long)))
+		{
+			LogWarning("Couldn't prefer memory from NUMA node %d for the %s thread (%s)\n",
+				s.m_node, name, strerror(errno));
+			ok = false;
+		}
+	}
+
+	//Read back what we actually got
+	status.m_applied = true;
+	status.m_tid = syscall(SYS_gettid);
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if(0 == pthread_getaffinity_np(self, sizeof(set), &set))
+	{
+		vector<int> actual;
+		for(int c=0; c<CPU_SETSIZE; c++)
+		{
+			if(CPU_ISSET(c, &set))
+				actual.push_back(c);
+		}
+		status.m_cpus = FormatCpuList(actual);
+	}
+
+	int policy;
+	sched_param param;
+	if(0 == pthread_getschedparam(self, &policy, &param))
+	{
+		switch(policy)
+		{
+			case SCHED_FIFO:	status.m_policy = "fifo";	break;
+			case SCHED_RR:		status.m_policy = "rr";		break;
+			case SCHED_OTHER:	status.m_policy = "other";	break;
+			default:			status.m_policy = to_string(policy);	break;
+		}
+		status.m_priority = param.sched_priority;
+	}
+
+	unsigned int cpu;
+	unsigned int node;
+	if(0 == syscall(SYS_getcpu, &cpu, &node, nullptr))
+		status.m_node = node;
+#else
+	auto& s = m_settings[role];
+	if(!s.m_cpus.empty() || (s.m_priority > 0) || (s.m_node >= 0))
+	{
+		LogWarning("Thread affinity, priority and NUMA settings are only supported on Linux\n");
+		ok = false;
+	}
+#endif
+
+	lock_guard<mutex> lock(m_mutex);
+	m_status[role] = status;
+	return ok;
+}
+
+/**
+	@brief Locks all current and future memory, if requested and not already done
+ */
+void SCPIThreading::LockMemory()
+{
+	lock_guard<mutex> lock(m_mutex);
+	if(m_mlockDone || !m_mlockall)
+		return;
+	m_mlockDone = true;
+
+#ifdef _WIN32
+	LogWarning("mlockall() is not supported on Windows\n");
+	m_mlockStatus = "failed";
+#else
+	if(0 == mlockall(MCL_CURRENT | MCL_FUTURE))
+		m_mlockStatus = "on";
+	else
+	{
+		LogWarning("Couldn't lock memory with mlockall() (%s)\n", strerror(errno));
+		m_mlockStatus = "failed";
+	}
+#endif
+}
+
+/**
+	@brief Asks for a range of memory to be placed on a NUMA node, before its pages are first touched
+
+	@param p	Start of the range (rounded down to a page boundary)
+	@param len	Length of the range in bytes
+	@param node	NUMA node
+
+	@return True if the policy was set (always false on platforms other than Linux)
+ */
+bool SCPIThreading::BindMemory(void* p, size_t len, int node)
+{
+#ifdef __linux__
+	size_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = reinterpret_cast<uintptr_t>(p) & ~(page - 1);
+	len += reinterpret_cast<uintptr_t>(p) - start;
+
+	vector<unsigned long> mask(node / (8 * sizeof(unsigned long)) + 1, 0);
+	mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+	if(0 != syscall(SYS_mbind, start, len, SCPI_MPOL_PREFERRED, mask.data(), mask.size() * 8 * sizeof(unsigned long), 0))
+	{
+		LogWarning("Couldn't bind %zu bytes to NUMA node %d (%s)\n", len, node, strerror(errno));
+		return false;
+	}
+	return true;
+#else
+	(void)p;
+	(void)len;
+	(void)node;
+	return false;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Reporting
+
+/**
+	@brief Formats the THREADS? reply: what each role's most recent thread actually got
+
+	The reply is a space separated list of key=value pairs, starting with mlockall=on|off|failed, then for each role
+	that has applied its settings, <role>.tid, <role>.cpus, <role>.policy, <role>.priority and <role>.node (the node
+	the thread was running on when it applied its settings).
+ */
+string SCPIThreading::Format()
+{
+	lock_guard<mutex> lock(m_mutex);
+
+	string ret = "mlockall=" + m_mlockStatus;
+	for(int r=0; r<THREAD_ROLE_COUNT; r++)
+	{
+		auto& st = m_status[r];
+		if(!st.m_applied)
+			continue;
+
+		string prefix = string(" ") + g_roleNames[r] + ".";
+		ret += prefix + "tid=" + to_string(st.m_tid);
+		ret += prefix + "cpus=" + st.m_cpus;
+		ret += prefix + "policy=" + st.m_policy;
+		ret += prefix + "priority=" + to_string(st.m_priority);
+		ret += prefix + "node=" + to_string(st.m_node);
+	}
+	return ret;
+}
@@ -0,0 +1,162 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef SCPIThreading_h
+#define SCPIThreading_h
+
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+	@brief Process wide CPU affinity, real-time priority, memory locking and NUMA placement for server threads
+
+	Settings are per thread role, and come from the environment when the object is first used, optionally overridden
+	by command line arguments passed to ParseArgument():
+
+		--<role>-cpus=<list>	SCPI_<ROLE>_CPUS	Pin the thread to a CPU list such as "2-3,6"
+		--<role>-fifo=<prio>	SCPI_<ROLE>_FIFO	Run the thread under SCHED_FIFO at the given priority (1-99)
+		--<role>-node=<node>	SCPI_<ROLE>_NODE	Prefer memory from a NUMA node (and its CPUs, if no list is given)
+		--mlockall				SCPI_MLOCKALL=1		Lock all current and future memory with mlockall()
+
+	where the roles are "control" (SCPI command handling), "sender" (data plane waveform sending) and "acquisition"
+	(the driver's capture callback). Each thread applies its settings by calling ApplyToCurrentThread() with its
+	role; the library does this for its own control threads, and drivers do it for their sender and acquisition
+	threads. What each thread actually got is recorded and reported by the THREADS? query, since a server without
+	the needed privileges (CAP_SYS_NICE, CAP_IPC_LOCK) keeps running with whatever it was allowed.
+
+	Affinity, priority and NUMA settings are only supported on Linux.
+ */
+class SCPIThreading
+{
+public:
+	static SCPIThreading& Get();
+
+	///@brief Thread roles with their own settings
+	enum Role
+	{
+		///@brief SCPI session threads (MainLoop(), event loop workers and async command workers)
+		THREAD_CONTROL,
+
+		///@brief Data plane threads sending waveforms
+		THREAD_SENDER,
+
+		///@brief Driver threads receiving captures from hardware
+		THREAD_ACQUISITION,
+
+		THREAD_ROLE_COUNT
+	};
+
+	static const char* GetRoleName(Role role);
+
+	bool ParseArgument(std::string_view arg);
+	bool SetOption(Role role, std::string_view option, std::string_view value);
+
+	///@brief Selects whether ApplyToCurrentThread() locks the process's memory the first time it's called
+	void SetMemoryLock(bool enable)
+	{ m_mlockall = enable; }
+
+	///@brief Returns the NUMA node configured for a role, or -1 if none
+	int GetNumaNode(Role role) const
+	{ return m_settings[role].m_node; }
+
+	bool ApplyToCurrentThread(Role role);
+
+	std::string Format();
+
+	static bool BindMemory(void* p, size_t len, int node);
+
+protected:
+	SCPIThreading();
+
+	void LoadEnvironment();
+	void LockMemory();
+
+	///@brief Requested settings for one role
+	class Settings
+	{
+	public:
+		Settings()
+		: m_priority(0)
+		, m_node(-1)
+		{}
+
+		///@brief CPUs to run on (empty for no restriction)
+		std::vector<int> m_cpus;
+
+		///@brief SCHED_FIFO priority, or zero to leave the scheduling policy alone
+		int m_priority;
+
+		///@brief Preferred NUMA node, or -1 for none
+		int m_node;
+	};
+
+	///@brief What a thread of one role actually got, read back after applying its settings
+	class Status
+	{
+	public:
+		Status()
+		: m_applied(false)
+		, m_tid(0)
+		, m_priority(0)
+		, m_node(-1)
+		{}
+
+		bool m_applied;
+		int64_t m_tid;
+		std::string m_cpus;
+		std::string m_policy;
+		int m_priority;
+
+		///@brief NUMA node of the CPU the thread was running on
+		int m_node;
+	};
+
+	Settings m_settings[THREAD_ROLE_COUNT];
+
+	///@brief True to call mlockall() on the first ApplyToCurrentThread()
+	bool m_mlockall;
+
+	///@brief Protects everything below
+	std::mutex m_mutex;
+
+	///@brief Most recent thread of each role to apply its settings
+	Status m_status[THREAD_ROLE_COUNT];
+
+	///@brief Result of mlockall(): "off" if not requested or not yet applied, then "on" or "failed"
+	std::string m_mlockStatus;
+
+	///@brief True once mlockall() has been attempted
+	bool m_mlockDone;
+};
+
+#endif
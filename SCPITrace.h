@@ -0,0 +1,114 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef SCPITrace_h
+#define SCPITrace_h
+
+#include <stdint.h>
+
+/*
+	Binary session trace format, written by SCPITraceWriter and read by SCPITraceReader
+
+	A trace is a SCPITraceFileHeader followed by records. Each record is a SCPITraceRecord followed by its payload,
+	padded with zeros to a multiple of 8 bytes. All fields are in host byte order.
+
+	The writer grows the file in large zero-filled steps and only trims it when the trace is closed, so a record
+	type of TRACE_END (zero) also marks the end of the trace. A trace from a process that crashed therefore still
+	ends cleanly after the last complete record.
+ */
+
+#define SCPI_TRACE_MAGIC 0x3143525449504353ULL	//"SCPITRC1"
+#define SCPI_TRACE_VERSION 1
+
+///@brief Record types in a session trace
+enum SCPITraceRecordType
+{
+	///@brief End of trace
+	TRACE_END = 0,
+
+	///@brief Line received from the client (payload is the line, without terminator)
+	TRACE_COMMAND = 1,
+
+	///@brief Reply sent to the client (payload is the reply, without terminator)
+	TRACE_REPLY = 2,
+
+	///@brief Event notification sent to the client (payload is the line, without terminator)
+	TRACE_EVENT = 3,
+
+	/**
+		@brief A command handler ran
+
+		The timestamp is when the handler started. The payload is the handler's run time in nanoseconds (uint64_t),
+		followed by the command line.
+	 */
+	TRACE_HANDLER = 4
+};
+
+#pragma pack(push, 1)
+
+/**
+	@brief Header at the start of a session trace file
+ */
+class SCPITraceFileHeader
+{
+public:
+	///@brief Always SCPI_TRACE_MAGIC
+	uint64_t m_magic;
+
+	///@brief Format version (SCPI_TRACE_VERSION)
+	uint32_t m_version;
+
+	///@brief Size of this header, so later versions can extend it
+	uint32_t m_headerSize;
+
+	///@brief Wall clock time the trace was started, in nanoseconds since the Unix epoch
+	uint64_t m_startTime;
+};
+
+/**
+	@brief Header of one record in a session trace
+ */
+class SCPITraceRecord
+{
+public:
+	///@brief Payload size in bytes, not counting padding
+	uint32_t m_length;
+
+	///@brief Record type (see SCPITraceRecordType)
+	uint8_t m_type;
+
+	uint8_t m_reserved[3];
+
+	///@brief Time since the trace was started, in nanoseconds
+	uint64_t m_timestamp;
+};
+
+#pragma pack(pop)
+
+#endif
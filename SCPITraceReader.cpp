@@ -0,0 +1,159 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#include "SCPITraceReader.h"
+#include <log.h>
+#include <string.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+//Records start on 8 byte boundaries
+#define TRACE_ALIGNMENT 8
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+SCPITraceReader::SCPITraceReader()
+	: m_map(nullptr)
+	, m_size(0)
+	, m_firstRecord(0)
+	, m_offset(0)
+	, m_startTime(0)
+{
+}
+
+SCPITraceReader::~SCPITraceReader()
+{
+	Close();
+}
+
+/**
+	@brief Maps a trace file and checks its header
+ */
+bool SCPITraceReader::Open(const string& path)
+{
+	Close();
+
+#ifdef _WIN32
+	LogError("SCPITraceReader: session traces are not supported on Windows (%s)\n", path.c_str());
+	return false;
+#else
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+	{
+		LogError("SCPITraceReader: couldn't open %s (%s)\n", path.c_str(), strerror(errno));
+		return false;
+	}
+
+	struct stat st;
+	if( (0 != fstat(fd, &st)) || (static_cast<size_t>(st.st_size) < sizeof(SCPITraceFileHeader)) )
+	{
+		LogError("SCPITraceReader: %s is not a session trace\n", path.c_str());
+		close(fd);
+		return false;
+	}
+
+	void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+	{
+		LogError("SCPITraceReader: couldn't map %s (%s)\n", path.c_str(), strerror(errno));
+		return false;
+	}
+	m_map = reinterpret_cast<const uint8_t*>(map);
+	m_size = st.st_size;
+
+	auto header = reinterpret_cast<const SCPITraceFileHeader*>(m_map);
+	if( (header->m_magic != SCPI_TRACE_MAGIC) ||
+		(header->m_version != SCPI_TRACE_VERSION) ||
+		(header->m_headerSize < sizeof(SCPITraceFileHeader)) ||
+		(header->m_headerSize > m_size) )
+	{
+		LogError("SCPITraceReader: %s is not a version %d session trace\n", path.c_str(), SCPI_TRACE_VERSION);
+		Close();
+		return false;
+	}
+
+	m_startTime = header->m_startTime;
+	m_firstRecord = (header->m_headerSize + TRACE_ALIGNMENT - 1) & ~static_cast<size_t>(TRACE_ALIGNMENT - 1);
+	m_offset = m_firstRecord;
+	return true;
+#endif
+}
+
+void SCPITraceReader::Close()
+{
+#ifndef _WIN32
+	if(m_map)
+		munmap(const_cast<uint8_t*>(m_map), m_size);
+#endif
+	m_map = nullptr;
+	m_size = 0;
+	m_offset = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Reading
+
+/**
+	@brief Reads the next record
+
+	@param record	Set to the record header
+	@param payload	Set to the record payload (pointing into the mapping)
+
+	@return False at the end of the trace, or if the rest of the trace is damaged
+ */
+bool SCPITraceReader::Next(SCPITraceRecord& record, string_view& payload)
+{
+	if(!m_map || (m_offset + sizeof(SCPITraceRecord) > m_size))
+		return false;
+
+	memcpy(&record, m_map + m_offset, sizeof(record));
+	if(record.m_type == TRACE_END)
+		return false;
+
+	size_t end = m_offset + sizeof(SCPITraceRecord) + record.m_length;
+	if(end > m_size)
+	{
+		LogWarning("SCPITraceReader: trace ends partway through a record\n");
+		m_offset = m_size;
+		return false;
+	}
+
+	payload = string_view(reinterpret_cast<const char*>(m_map) + m_offset + sizeof(SCPITraceRecord), record.m_length);
+	m_offset = (end + TRACE_ALIGNMENT - 1) & ~static_cast<size_t>(TRACE_ALIGNMENT - 1);
+	return true;
+}
@@ -0,0 +1,79 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef SCPITraceReader_h
+#define SCPITraceReader_h
+
+#include "SCPITrace.h"
+#include <string>
+#include <string_view>
+
+/**
+	@brief Reads records from a session trace file written by SCPITraceWriter
+
+	The file is mapped read-only; payloads returned by Next() point into the mapping and stay valid until Close().
+	Not supported on Windows.
+ */
+class SCPITraceReader
+{
+public:
+	SCPITraceReader();
+	virtual ~SCPITraceReader();
+
+	bool Open(const std::string& path);
+	void Close();
+
+	bool Next(SCPITraceRecord& record, std::string_view& payload);
+
+	///@brief Goes back to the first record
+	void Rewind()
+	{ m_offset = m_firstRecord; }
+
+	///@brief Returns the wall clock time the trace was started, in nanoseconds since the Unix epoch
+	uint64_t GetStartTime() const
+	{ return m_startTime; }
+
+protected:
+	///@brief Mapping of the whole file
+	const uint8_t* m_map;
+
+	///@brief Size of m_map
+	size_t m_size;
+
+	///@brief Offset of the first record (just past the file header)
+	size_t m_firstRecord;
+
+	///@brief Offset of the next record
+	size_t m_offset;
+
+	///@brief Wall clock start time from the file header
+	uint64_t m_startTime;
+};
+
+#endif
@@ -0,0 +1,241 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#include "SCPITraceWriter.h"
+#include "SCPIStatistics.h"
+#include <log.h>
+#include <atomic>
+#include <chrono>
+#include <string.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+//The file is grown (and remapped) in steps of this size
+#define TRACE_GROW_SIZE (16 * 1024 * 1024)
+
+//Records start on 8 byte boundaries
+#define TRACE_ALIGNMENT 8
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+SCPITraceWriter::SCPITraceWriter()
+	: m_open(false)
+	, m_fd(-1)
+	, m_map(nullptr)
+	, m_mapSize(0)
+	, m_offset(0)
+	, m_startTime(0)
+{
+}
+
+SCPITraceWriter::~SCPITraceWriter()
+{
+	Close();
+}
+
+/**
+	@brief Creates a trace file, replacing any existing file at the path
+ */
+bool SCPITraceWriter::Open(const string& path)
+{
+	Close();
+
+#ifdef _WIN32
+	LogError("SCPITraceWriter: session traces are not supported on Windows (%s)\n", path.c_str());
+	return false;
+#else
+	lock_guard<mutex> lock(m_mutex);
+
+	m_fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(m_fd < 0)
+	{
+		LogError("SCPITraceWriter: couldn't create %s (%s)\n", path.c_str(), strerror(errno));
+		return false;
+	}
+
+	m_offset = 0;
+	if(!Reserve(sizeof(SCPITraceFileHeader)))
+	{
+		close(m_fd);
+		m_fd = -1;
+		return false;
+	}
+
+	auto header = reinterpret_cast<SCPITraceFileHeader*>(m_map);
+	header->m_magic = SCPI_TRACE_MAGIC;
+	header->m_version = SCPI_TRACE_VERSION;
+	header->m_headerSize = sizeof(SCPITraceFileHeader);
+	header->m_startTime = chrono::duration_cast<chrono::nanoseconds>(
+		chrono::system_clock::now().time_since_epoch()).count();
+	m_offset = sizeof(SCPITraceFileHeader);
+	m_startTime = SCPIStatistics::Now();
+	m_open = true;
+
+	LogVerbose("Recording SCPI session trace to %s\n", path.c_str());
+	return true;
+#endif
+}
+
+/**
+	@brief Finishes the trace, trimming the file to the records written
+ */
+void SCPITraceWriter::Close()
+{
+	lock_guard<mutex> lock(m_mutex);
+	if(m_fd < 0)
+		return;
+
+	Unmap();
+#ifndef _WIN32
+	if(0 != ftruncate(m_fd, m_offset))
+		LogWarning("SCPITraceWriter: couldn't trim trace file (%s)\n", strerror(errno));
+	close(m_fd);
+#endif
+	m_fd = -1;
+}
+
+void SCPITraceWriter::Unmap()
+{
+#ifndef _WIN32
+	if(m_map)
+		munmap(m_map, m_mapSize);
+#endif
+	m_open = false;
+	m_map = nullptr;
+	m_mapSize = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Recording
+
+/**
+	@brief Returns the time since the trace was opened, in nanoseconds, for timestamping records
+ */
+uint64_t SCPITraceWriter::Now() const
+{
+	return SCPIStatistics::Now() - m_startTime;
+}
+
+/**
+	@brief Appends a record timestamped now
+
+	@param type		Record type
+	@param payload	Record payload (a line without its terminator, for all types but TRACE_HANDLER)
+ */
+void SCPITraceWriter::Record(SCPITraceRecordType type, string_view payload)
+{
+	Append(type, Now(), nullptr, 0, payload);
+}
+
+/**
+	@brief Appends a TRACE_HANDLER record
+
+	@param line		The command line
+	@param start	Time the handler started (from Now())
+	@param duration	Handler run time in nanoseconds
+ */
+void SCPITraceWriter::RecordHandler(string_view line, uint64_t start, uint64_t duration)
+{
+	Append(TRACE_HANDLER, start, &duration, sizeof(duration), line);
+}
+
+/**
+	@brief Appends a record whose payload is a binary prefix followed by text
+ */
+void SCPITraceWriter::Append(
+	SCPITraceRecordType type,
+	uint64_t timestamp,
+	const void* prefix,
+	size_t prefixLen,
+	string_view text)
+{
+	size_t length = prefixLen + text.length();
+	size_t padded = (sizeof(SCPITraceRecord) + length + TRACE_ALIGNMENT - 1) & ~static_cast<size_t>(TRACE_ALIGNMENT - 1);
+
+	lock_guard<mutex> lock(m_mutex);
+	if(!m_map || !Reserve(padded))
+		return;
+
+	//Payload first and the type last, so a reader of a trace cut short never sees a partial record
+	uint8_t* p = m_map + m_offset;
+	auto record = reinterpret_cast<SCPITraceRecord*>(p);
+	record->m_length = length;
+	memset(record->m_reserved, 0, sizeof(record->m_reserved));
+	record->m_timestamp = timestamp;
+	if(prefixLen)
+		memcpy(p + sizeof(SCPITraceRecord), prefix, prefixLen);
+	memcpy(p + sizeof(SCPITraceRecord) + prefixLen, text.data(), text.length());
+	atomic_signal_fence(memory_order_release);
+	record->m_type = type;
+
+	m_offset += padded;
+}
+
+/**
+	@brief Makes sure there's room for len more bytes at m_offset, growing the file if needed
+
+	The file is grown with ftruncate(), so the new space reads as zeros (TRACE_END) until written.
+	On failure the mapping is dropped and nothing more is recorded.
+ */
+bool SCPITraceWriter::Reserve(size_t len)
+{
+	if(m_offset + len <= m_mapSize)
+		return true;
+
+#ifdef _WIN32
+	return false;
+#else
+	size_t size = (m_offset + len + TRACE_GROW_SIZE - 1) / TRACE_GROW_SIZE * TRACE_GROW_SIZE;
+	Unmap();
+	if(0 != ftruncate(m_fd, size))
+	{
+		LogError("SCPITraceWriter: couldn't grow trace file, recording stopped (%s)\n", strerror(errno));
+		return false;
+	}
+
+	void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+	if(map == MAP_FAILED)
+	{
+		LogError("SCPITraceWriter: couldn't map trace file, recording stopped (%s)\n", strerror(errno));
+		return false;
+	}
+
+	m_map = reinterpret_cast<uint8_t*>(map);
+	m_mapSize = size;
+	m_open = true;
+	return true;
+#endif
+}
@@ -0,0 +1,90 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef SCPITraceWriter_h
+#define SCPITraceWriter_h
+
+#include "SCPITrace.h"
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+/**
+	@brief Appends records to a memory-mapped session trace file (see SCPITrace.h for the format)
+
+	Recording a record is a copy into the mapping under a mutex, so it's cheap enough to leave on in the field.
+	Records may be written from any thread. Not supported on Windows.
+ */
+class SCPITraceWriter
+{
+public:
+	SCPITraceWriter();
+	virtual ~SCPITraceWriter();
+
+	bool Open(const std::string& path);
+	void Close();
+
+	///@brief Returns true if records are being written (cheap, callable from any thread)
+	bool IsOpen() const
+	{ return m_open.load(std::memory_order_relaxed); }
+
+	uint64_t Now() const;
+
+	void Record(SCPITraceRecordType type, std::string_view payload);
+	void RecordHandler(std::string_view line, uint64_t start, uint64_t duration);
+
+protected:
+	void Append(SCPITraceRecordType type, uint64_t timestamp, const void* prefix, size_t prefixLen, std::string_view text);
+	bool Reserve(size_t len);
+	void Unmap();
+
+	///@brief True while m_map is valid, for checking without taking the mutex
+	std::atomic<bool> m_open;
+
+	///@brief Protects everything below
+	std::mutex m_mutex;
+
+	///@brief The trace file
+	int m_fd;
+
+	///@brief Mapping of the whole file
+	uint8_t* m_map;
+
+	///@brief Size of m_map (and of the file, until it's trimmed on close)
+	size_t m_mapSize;
+
+	///@brief Offset the next record will be written at
+	size_t m_offset;
+
+	///@brief Monotonic time the trace was opened (SCPIStatistics::Now() units)
+	uint64_t m_startTime;
+};
+
+#endif
@@ -0,0 +1,141 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#include "SCPIUnixListener.h"
+#include <log.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+SCPIUnixListener::SCPIUnixListener()
+	: m_socket(-1)
+{
+}
+
+SCPIUnixListener::~SCPIUnixListener()
+{
+	Close();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Socket management
+
+/**
+	@brief Binds to the given filesystem path and starts listening
+
+	A stale socket left at the path by a previous run is removed first.
+
+	@param path		Path to bind to
+	@param mode		Permissions for the socket file, which control which local users may connect
+ */
+bool SCPIUnixListener::Listen(const string& path, int mode)
+{
+	Close();
+
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(path.empty() || (path.length() >= sizeof(addr.sun_path)) )
+	{
+		LogError("SCPIUnixListener: invalid socket path \"%s\"\n", path.c_str());
+		return false;
+	}
+	memcpy(addr.sun_path, path.c_str(), path.length());
+
+	m_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(m_socket < 0)
+	{
+		LogError("SCPIUnixListener: failed to create socket (%s)\n", strerror(errno));
+		return false;
+	}
+
+	//Only remove sockets, never a regular file someone pointed us at by mistake
+	struct stat st;
+	if( (0 == lstat(path.c_str(), &st)) && S_ISSOCK(st.st_mode) )
+		unlink(path.c_str());
+
+	if(0 != bind(m_socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)))
+	{
+		LogError("SCPIUnixListener: failed to bind %s (%s)\n", path.c_str(), strerror(errno));
+		Close();
+		return false;
+	}
+	m_path = path;
+
+	if(0 != chmod(path.c_str(), mode))
+		LogWarning("SCPIUnixListener: failed to set permissions on %s (%s)\n", path.c_str(), strerror(errno));
+
+	if(0 != listen(m_socket, SOMAXCONN))
+	{
+		LogError("SCPIUnixListener: failed to listen on %s (%s)\n", path.c_str(), strerror(errno));
+		Close();
+		return false;
+	}
+
+	LogVerbose("SCPIUnixListener: listening on %s\n", path.c_str());
+	return true;
+}
+
+/**
+	@brief Waits for a client to connect
+
+	@return The connected socket, or -1 on failure
+ */
+ZSOCKET SCPIUnixListener::Accept()
+{
+	while(true)
+	{
+		ZSOCKET sock = accept4(m_socket, nullptr, nullptr, SOCK_CLOEXEC);
+		if( (sock < 0) && (errno == EINTR) )
+			continue;
+		if(sock < 0)
+			LogWarning("SCPIUnixListener: accept failed (%s)\n", strerror(errno));
+		return sock;
+	}
+}
+
+/**
+	@brief Stops listening and removes the socket file
+ */
+void SCPIUnixListener::Close()
+{
+	if(m_socket >= 0)
+		close(m_socket);
+	m_socket = -1;
+
+	if(!m_path.empty())
+		unlink(m_path.c_str());
+	m_path.clear();
+}
@@ -0,0 +1,72 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef SCPIUnixListener_h
+#define SCPIUnixListener_h
+
+#include "../../lib/xptools/Socket.h"
+#include <string>
+
+/**
+	@brief Listening Unix domain socket, for clients running on the same host as the server
+
+	Sessions accepted from a Unix socket work exactly like TCP ones: pass the socket to the same SCPIServer (or
+	BridgeSCPIServer) subclass, or to SCPIEventLoop::AddClient(). Local sessions can also negotiate a shared memory
+	waveform ring (see WaveformSharedRing).
+
+	Not available on Windows.
+ */
+class SCPIUnixListener
+{
+public:
+	SCPIUnixListener();
+	virtual ~SCPIUnixListener();
+
+	bool Listen(const std::string& path, int mode = 0660);
+	ZSOCKET Accept();
+	void Close();
+
+	///@brief Returns the listening socket handle, or -1 if not listening
+	int GetSocket() const
+	{ return m_socket; }
+
+	///@brief Returns the filesystem path the socket is bound to
+	const std::string& GetPath() const
+	{ return m_path; }
+
+protected:
+
+	///@brief The listening socket
+	int m_socket;
+
+	///@brief Path the socket is bound to (removed again when the listener is closed)
+	std::string m_path;
+};
+
+#endif
@@ -0,0 +1,524 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#include "SCPIUring.h"
+#include <log.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+//Buffer group ID of the provided receive buffer ring
+#define RX_BUFFER_GROUP 0
+
+//Highest operation code we ask the kernel about
+#define PROBE_OPS 256
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// System call wrappers
+
+static int io_uring_setup(unsigned entries, io_uring_params* p)
+{
+	return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int io_uring_enter(int fd, unsigned submit, unsigned waitFor, unsigned flags)
+{
+	return static_cast<int>(syscall(__NR_io_uring_enter, fd, submit, waitFor, flags, nullptr, 0));
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void* arg, unsigned count)
+{
+	return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+SCPIUring::SCPIUring()
+	: m_fd(-1)
+	, m_sqRing(nullptr)
+	, m_sqRingSize(0)
+	, m_cqRing(nullptr)
+	, m_cqRingSize(0)
+	, m_sqes(nullptr)
+	, m_sqEntries(0)
+	, m_sqHead(nullptr)
+	, m_sqTail(nullptr)
+	, m_sqMask(0)
+	, m_sqLocalTail(0)
+	, m_cqHead(nullptr)
+	, m_cqTail(nullptr)
+	, m_cqMask(0)
+	, m_cqes(nullptr)
+	, m_rxRing(nullptr)
+	, m_rxRingSize(0)
+	, m_rxBufferCount(0)
+	, m_rxBufferSize(0)
+	, m_rxBuffers(nullptr)
+	, m_rxTail(0)
+{
+}
+
+SCPIUring::~SCPIUring()
+{
+	Close();
+}
+
+/**
+	@brief Checks once per process if the kernel has everything the io_uring backends need
+
+	Multishot receives and zero-copy sends both arrived in kernel 6.0, so IORING_OP_SEND_ZC is used as the marker for
+	the former, which can't be probed for directly. Also fails if io_uring is disabled by sysctl or seccomp.
+ */
+bool SCPIUring::IsSupported()
+{
+	static bool supported = []
+		{
+			SCPIUring ring;
+			if(!ring.Open(4))
+				return false;
+
+			if(!ring.IsOpSupported(IORING_OP_SEND) || !ring.IsOpSupported(IORING_OP_RECV) ||
+				!ring.IsOpSupported(IORING_OP_POLL_ADD) || !ring.IsOpSupported(IORING_OP_ASYNC_CANCEL) ||
+				!ring.IsOpSupported(IORING_OP_SEND_ZC) )
+			{
+				LogVerbose("SCPIUring: kernel is missing io_uring operations we need\n");
+				return false;
+			}
+
+			return ring.SetupReceiveBuffers(1, 64);
+		}();
+	return supported;
+}
+
+/**
+	@brief Creates the ring
+
+	@param entries	Size of the submission queue (rounded up to a power of two by the kernel). The completion queue is
+					twice as big.
+ */
+bool SCPIUring::Open(unsigned entries)
+{
+	Close();
+
+	io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CLAMP;
+	m_fd = io_uring_setup(entries, &p);
+	if(m_fd < 0)
+	{
+		LogVerbose("SCPIUring: io_uring_setup failed (%s)\n", strerror(errno));
+		return false;
+	}
+
+	//Map the rings. Newer kernels let both queue rings share one mapping.
+	m_sqRingSize = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+	m_cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if(single)
+		m_sqRingSize = m_cqRingSize = max(m_sqRingSize, m_cqRingSize);
+
+	m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+	if(m_sqRing == MAP_FAILED)
+	{
+		m_sqRing = nullptr;
+		LogWarning("SCPIUring: failed to map submission queue (%s)\n", strerror(errno));
+		Close();
+		return false;
+	}
+
+	if(single)
+		m_cqRing = m_sqRing;
+	else
+	{
+		m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd,
+			IORING_OFF_CQ_RING);
+		if(m_cqRing == MAP_FAILED)
+		{
+			m_cqRing = nullptr;
+			LogWarning("SCPIUring: failed to map completion queue (%s)\n", strerror(errno));
+			Close();
+			return false;
+		}
+	}
+
+	m_sqEntries = p.sq_entries;
+	void* sqes = mmap(nullptr, m_sqEntries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		m_fd, IORING_OFF_SQES);
+	if(sqes == MAP_FAILED)
+	{
+		LogWarning("SCPIUring: failed to map submission queue entries (%s)\n", strerror(errno));
+		Close();
+		return false;
+	}
+	m_sqes = reinterpret_cast<io_uring_sqe*>(sqes);
+
+	auto sq = reinterpret_cast<char*>(m_sqRing);
+	m_sqHead = reinterpret_cast<uint32_t*>(sq + p.sq_off.head);
+	m_sqTail = reinterpret_cast<uint32_t*>(sq + p.sq_off.tail);
+	m_sqMask = *reinterpret_cast<uint32_t*>(sq + p.sq_off.ring_mask);
+	m_sqLocalTail = *m_sqTail;
+
+	//Entries are always filled in queue order, so the index array is the identity mapping
+	auto array = reinterpret_cast<uint32_t*>(sq + p.sq_off.array);
+	for(unsigned i=0; i<m_sqEntries; i++)
+		array[i] = i;
+
+	auto cq = reinterpret_cast<char*>(m_cqRing);
+	m_cqHead = reinterpret_cast<uint32_t*>(cq + p.cq_off.head);
+	m_cqTail = reinterpret_cast<uint32_t*>(cq + p.cq_off.tail);
+	m_cqMask = *reinterpret_cast<uint32_t*>(cq + p.cq_off.ring_mask);
+	m_cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+	//Find out what the kernel can do
+	vector<uint8_t> probe(sizeof(io_uring_probe) + PROBE_OPS * sizeof(io_uring_probe_op), 0);
+	auto pr = reinterpret_cast<io_uring_probe*>(probe.data());
+	m_supportedOps.assign(PROBE_OPS, false);
+	if(0 == io_uring_register(m_fd, IORING_REGISTER_PROBE, pr, PROBE_OPS))
+	{
+		for(unsigned i=0; (i < pr->ops_len) && (i < PROBE_OPS); i++)
+		{
+			if(pr->ops[i].flags & IO_URING_OP_SUPPORTED)
+				m_supportedOps[pr->ops[i].op] = true;
+		}
+	}
+
+	return true;
+}
+
+/**
+	@brief Tears down the ring, along with the provided and registered buffers
+
+	Operations still in flight are cancelled by the kernel, so make sure nothing they reference is freed before they
+	complete.
+ */
+void SCPIUring::Close()
+{
+	if(m_fd >= 0)
+		close(m_fd);
+	m_fd = -1;
+	m_registered.clear();
+
+	Unmap();
+}
+
+/**
+	@brief Unmaps the queues and frees the provided receive buffers
+ */
+void SCPIUring::Unmap()
+{
+	if(m_sqes)
+		munmap(m_sqes, m_sqEntries * sizeof(io_uring_sqe));
+	if(m_cqRing && (m_cqRing != m_sqRing))
+		munmap(m_cqRing, m_cqRingSize);
+	if(m_sqRing)
+		munmap(m_sqRing, m_sqRingSize);
+	m_sqes = nullptr;
+	m_cqRing = nullptr;
+	m_sqRing = nullptr;
+
+	if(m_rxRing)
+		munmap(m_rxRing, m_rxRingSize);
+	m_rxRing = nullptr;
+	delete[] m_rxBuffers;
+	m_rxBuffers = nullptr;
+	m_rxBufferCount = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Submission
+
+/**
+	@brief Gets a free submission queue entry, zeroed, submitting what's queued first if the queue is full
+
+	@return The entry, or null if the queue is still full
+ */
+io_uring_sqe* SCPIUring::GetSQE()
+{
+	if(m_sqLocalTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries)
+	{
+		Submit();
+		if(m_sqLocalTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries)
+			return nullptr;
+	}
+
+	auto sqe = &m_sqes[m_sqLocalTail & m_sqMask];
+	memset(sqe, 0, sizeof(*sqe));
+	m_sqLocalTail ++;
+	return sqe;
+}
+
+/**
+	@brief Hands every queued entry to the kernel, optionally waiting for completions, in one system call
+
+	@param waitFor	Number of completions to wait for (0 to return right away)
+
+	@return Number of entries submitted, or -1 on failure. Interrupted waits return 0.
+ */
+int SCPIUring::Submit(unsigned waitFor)
+{
+	__atomic_store_n(m_sqTail, m_sqLocalTail, __ATOMIC_RELEASE);
+	unsigned pending = m_sqLocalTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+	if( (pending == 0) && (waitFor == 0) )
+		return 0;
+
+	int ret = io_uring_enter(m_fd, pending, waitFor, waitFor ? IORING_ENTER_GETEVENTS : 0);
+	if(ret < 0)
+	{
+		if( (errno == EINTR) || (errno == EAGAIN) || (errno == EBUSY) )
+			return 0;
+		LogWarning("SCPIUring: io_uring_enter failed (%s)\n", strerror(errno));
+	}
+	return ret;
+}
+
+/**
+	@brief Prepares a send
+ */
+void SCPIUring::PrepSend(io_uring_sqe* sqe, int fd, const void* data, size_t len, int flags, uint64_t userData)
+{
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<uint64_t>(data);
+	sqe->len = len;
+	sqe->msg_flags = flags;
+	sqe->user_data = userData;
+}
+
+/**
+	@brief Prepares a zero-copy send from a registered buffer
+
+	Completes twice: once when the data has been queued (with IORING_CQE_F_MORE set), then again with
+	IORING_CQE_F_NOTIF set once the kernel no longer references the buffer.
+
+	@param index	Registered buffer holding the data (see FindRegisteredBuffer())
+ */
+void SCPIUring::PrepSendFixed(
+	io_uring_sqe* sqe,
+	int fd,
+	const void* data,
+	size_t len,
+	int flags,
+	uint16_t index,
+	uint64_t userData)
+{
+	sqe->opcode = IORING_OP_SEND_ZC;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<uint64_t>(data);
+	sqe->len = len;
+	sqe->msg_flags = flags;
+	sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+	sqe->buf_index = index;
+	sqe->user_data = userData;
+}
+
+/**
+	@brief Prepares a multishot receive into the provided buffers (see SetupReceiveBuffers())
+
+	Completes once per chunk of data received, with IORING_CQE_F_MORE set as long as the receive stays armed.
+ */
+void SCPIUring::PrepRecvMultishot(io_uring_sqe* sqe, int fd, uint64_t userData)
+{
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = RX_BUFFER_GROUP;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->user_data = userData;
+}
+
+/**
+	@brief Prepares a multishot poll for readability
+
+	Completes every time the descriptor becomes readable, with IORING_CQE_F_MORE set as long as the poll stays armed.
+ */
+void SCPIUring::PrepPollMultishot(io_uring_sqe* sqe, int fd, uint64_t userData)
+{
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = userData;
+}
+
+/**
+	@brief Prepares a cancellation of the operation submitted with the given user data
+ */
+void SCPIUring::PrepCancel(io_uring_sqe* sqe, uint64_t target, uint64_t userData)
+{
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = target;
+	sqe->user_data = userData;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Completion
+
+/**
+	@brief Returns the oldest unhandled completion, or null if there are none
+
+	Call AdvanceCQ() once done with it.
+ */
+io_uring_cqe* SCPIUring::PeekCQE()
+{
+	uint32_t head = *m_cqHead;
+	if(head == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE))
+		return nullptr;
+	return &m_cqes[head & m_cqMask];
+}
+
+/**
+	@brief Gives the completion returned by PeekCQE() back to the kernel
+ */
+void SCPIUring::AdvanceCQ()
+{
+	__atomic_store_n(m_cqHead, *m_cqHead + 1, __ATOMIC_RELEASE);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Provided receive buffers
+
+/**
+	@brief Sets up a ring of buffers the kernel fills with received data, for PrepRecvMultishot()
+
+	Each completion of a multishot receive names the buffer the data went into (cqe->flags >> IORING_CQE_BUFFER_SHIFT).
+	Hand it back with RecycleReceiveBuffer() once the data has been consumed.
+
+	@param count	Number of buffers (power of two, at most 32768)
+	@param size		Size of each buffer
+ */
+bool SCPIUring::SetupReceiveBuffers(unsigned count, size_t size)
+{
+	if( (count == 0) || (count > 32768) || (count & (count - 1)) )
+		return false;
+
+	m_rxRingSize = count * sizeof(io_uring_buf);
+	void* ring = mmap(nullptr, m_rxRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(ring == MAP_FAILED)
+		return false;
+	m_rxRing = reinterpret_cast<io_uring_buf_ring*>(ring);
+
+	io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+	reg.ring_entries = count;
+	reg.bgid = RX_BUFFER_GROUP;
+	if(0 != io_uring_register(m_fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+	{
+		LogVerbose("SCPIUring: failed to register provided buffer ring (%s)\n", strerror(errno));
+		munmap(ring, m_rxRingSize);
+		m_rxRing = nullptr;
+		return false;
+	}
+
+	m_rxBufferCount = count;
+	m_rxBufferSize = size;
+	m_rxBuffers = new char[count * size];
+	m_rxTail = 0;
+	for(unsigned i=0; i<count; i++)
+		RecycleReceiveBuffer(i);
+	return true;
+}
+
+/**
+	@brief Hands a provided receive buffer back to the kernel
+ */
+void SCPIUring::RecycleReceiveBuffer(uint16_t id)
+{
+	//The entries start at the beginning of the ring. (Don't use m_rxRing->bufs: the kernel header's flexible array
+	//member ends up at the wrong offset when compiled as C++.)
+	auto& buf = reinterpret_cast<io_uring_buf*>(m_rxRing)[m_rxTail & (m_rxBufferCount - 1)];
+	buf.addr = reinterpret_cast<uint64_t>(m_rxBuffers + static_cast<size_t>(id) * m_rxBufferSize);
+	buf.len = m_rxBufferSize;
+	buf.bid = id;
+	m_rxTail ++;
+	__atomic_store_n(&m_rxRing->tail, m_rxTail, __ATOMIC_RELEASE);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Registered buffers
+
+/**
+	@brief Registers memory that sends will be made from, replacing any previous registration
+
+	The pages are pinned once here instead of on every send. Registered memory counts against RLIMIT_MEMLOCK on
+	older kernels, so this may fail for large pools; sends then just use unregistered buffers.
+
+	@return True if the buffers were registered
+ */
+bool SCPIUring::RegisterBuffers(const vector<iovec>& regions)
+{
+	UnregisterBuffers();
+	if(regions.empty())
+		return true;
+
+	if(0 != io_uring_register(m_fd, IORING_REGISTER_BUFFERS, regions.data(), regions.size()))
+	{
+		LogWarning("SCPIUring: failed to register %zu buffers (%s)\n", regions.size(), strerror(errno));
+		return false;
+	}
+
+	m_registered = regions;
+	return true;
+}
+
+/**
+	@brief Drops all registered buffers
+ */
+void SCPIUring::UnregisterBuffers()
+{
+	if(m_registered.empty())
+		return;
+
+	io_uring_register(m_fd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+	m_registered.clear();
+}
+
+/**
+	@brief Finds the registered buffer containing a block of memory
+
+	@return Index of the buffer, or -1 if the block isn't entirely inside one
+ */
+int SCPIUring::FindRegisteredBuffer(const void* data, size_t len) const
+{
+	auto p = reinterpret_cast<uintptr_t>(data);
+	for(size_t i=0; i<m_registered.size(); i++)
+	{
+		auto base = reinterpret_cast<uintptr_t>(m_registered[i].iov_base);
+		if( (p >= base) && (p + len <= base + m_registered[i].iov_len) )
+			return static_cast<int>(i);
+	}
+	return -1;
+}
@@ -0,0 +1,174 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef SCPIUring_h
+#define SCPIUring_h
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <vector>
+
+/**
+	@brief Minimal io_uring instance, driven with raw system calls so there's no dependency on liburing
+
+	Wraps the submission and completion queues, a ring of provided receive buffers (for multishot receives, which
+	pick a buffer only once data arrives), and a table of registered buffers (for fixed buffer sends, which skip
+	pinning the pages on every send).
+
+	Not thread safe: each instance must only be used from one thread at a time. Only available on Linux, and only
+	compiled in if the kernel headers support io_uring (HAVE_IO_URING).
+ */
+class SCPIUring
+{
+public:
+	SCPIUring();
+	~SCPIUring();
+
+	static bool IsSupported();
+
+	bool Open(unsigned entries);
+	void Close();
+
+	///@brief Returns true if the ring was set up successfully
+	bool IsOpen() const
+	{ return m_fd >= 0; }
+
+	///@brief Returns true if the kernel supports an operation (IORING_OP_*)
+	bool IsOpSupported(uint8_t op) const
+	{ return (op < m_supportedOps.size()) && m_supportedOps[op]; }
+
+	//Submission
+	io_uring_sqe* GetSQE();
+	int Submit(unsigned waitFor = 0);
+
+	static void PrepSend(io_uring_sqe* sqe, int fd, const void* data, size_t len, int flags, uint64_t userData);
+	static void PrepSendFixed(
+		io_uring_sqe* sqe,
+		int fd,
+		const void* data,
+		size_t len,
+		int flags,
+		uint16_t index,
+		uint64_t userData);
+	static void PrepPollMultishot(io_uring_sqe* sqe, int fd, uint64_t userData);
+	static void PrepRecvMultishot(io_uring_sqe* sqe, int fd, uint64_t userData);
+	static void PrepCancel(io_uring_sqe* sqe, uint64_t target, uint64_t userData);
+
+	//Completion
+	io_uring_cqe* PeekCQE();
+	void AdvanceCQ();
+
+	//Provided receive buffers
+	bool SetupReceiveBuffers(unsigned count, size_t size);
+	void RecycleReceiveBuffer(uint16_t id);
+
+	///@brief Returns the data of a provided receive buffer, as picked by the kernel for a completion
+	const char* GetReceiveBuffer(uint16_t id) const
+	{ return m_rxBuffers + static_cast<size_t>(id) * m_rxBufferSize; }
+
+	//Registered buffers
+	bool RegisterBuffers(const std::vector<iovec>& regions);
+	void UnregisterBuffers();
+	int FindRegisteredBuffer(const void* data, size_t len) const;
+
+protected:
+	void Unmap();
+
+	///@brief The ring file descriptor
+	int m_fd;
+
+	///@brief Mapping of the submission queue ring
+	void* m_sqRing;
+
+	///@brief Size of m_sqRing
+	size_t m_sqRingSize;
+
+	///@brief Mapping of the completion queue ring (the same as m_sqRing if the kernel maps both at once)
+	void* m_cqRing;
+
+	///@brief Size of m_cqRing
+	size_t m_cqRingSize;
+
+	///@brief Mapping of the submission queue entries
+	io_uring_sqe* m_sqes;
+
+	///@brief Number of submission queue entries
+	unsigned m_sqEntries;
+
+	uint32_t* m_sqHead;
+	uint32_t* m_sqTail;
+	uint32_t m_sqMask;
+
+	///@brief Tail of the submission queue including entries not yet handed to the kernel
+	uint32_t m_sqLocalTail;
+
+	uint32_t* m_cqHead;
+	uint32_t* m_cqTail;
+	uint32_t m_cqMask;
+	io_uring_cqe* m_cqes;
+
+	///@brief Operations the kernel supports, indexed by IORING_OP_*
+	std::vector<bool> m_supportedOps;
+
+	///@brief Provided buffer ring shared with the kernel (null if SetupReceiveBuffers() wasn't called)
+	io_uring_buf_ring* m_rxRing;
+
+	///@brief Size of m_rxRing
+	size_t m_rxRingSize;
+
+	///@brief Number of provided receive buffers
+	unsigned m_rxBufferCount;
+
+	///@brief Size of each provided receive buffer
+	size_t m_rxBufferSize;
+
+	///@brief Backing memory of the provided receive buffers
+	char* m_rxBuffers;
+
+	///@brief Our copy of the provided buffer ring's tail
+	uint16_t m_rxTail;
+
+	///@brief Registered buffers, in table order (empty if none are registered)
+	std::vector<iovec> m_registered;
+};
+
+#else
+
+///@brief Placeholder when io_uring support isn't compiled in (never instantiated)
+class SCPIUring
+{
+};
+
+#endif
+
+#endif
@@ -0,0 +1,382 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#include "SampleCompression.h"
+#include "SampleConversion.h"
+#include <algorithm>
+#include <string.h>
+
+using namespace std;
+
+//Fully unroll loops over a group of eight values, so shifts by the compile time width become constants
+#if defined(__GNUC__) || defined(__clang__)
+#define UNROLL_GROUP _Pragma("GCC unroll 8")
+#else
+#define UNROLL_GROUP
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Bit packing
+
+/**
+	@brief Packs values of the given width into a byte stream, least significant bit first
+
+	@return Pointer one past the last byte written (exactly ceil(count * width / 8) bytes are written)
+ */
+static uint8_t* PackBits(const uint16_t* in, size_t count, unsigned width, uint8_t* out)
+{
+	uint64_t acc = 0;
+	unsigned nbits = 0;
+	for(size_t i=0; i<count; i++)
+	{
+		acc |= static_cast<uint64_t>(in[i]) << nbits;
+		nbits += width;
+		if(nbits >= 32)
+		{
+			uint32_t word = static_cast<uint32_t>(acc);
+			memcpy(out, &word, sizeof(word));
+			out += sizeof(word);
+			acc >>= 32;
+			nbits -= 32;
+		}
+	}
+
+	while(nbits > 0)
+	{
+		*out++ = static_cast<uint8_t>(acc);
+		acc >>= 8;
+		nbits = (nbits > 8) ? (nbits - 8) : 0;
+	}
+	return out;
+}
+
+/**
+	@brief Unpacks values written by PackBits(), reading no more than len bytes
+ */
+static void UnpackBits(const uint8_t* in, size_t len, unsigned width, uint16_t* out, size_t count)
+{
+	uint64_t acc = 0;
+	unsigned nbits = 0;
+	size_t pos = 0;
+	uint32_t mask = (1u << width) - 1;
+	for(size_t i=0; i<count; i++)
+	{
+		if(nbits < width)
+		{
+			if(pos + sizeof(uint32_t) <= len)
+			{
+				uint32_t word;
+				memcpy(&word, in + pos, sizeof(word));
+				acc |= static_cast<uint64_t>(word) << nbits;
+				nbits += 32;
+				pos += sizeof(word);
+			}
+			else
+			{
+				while(nbits < width)
+				{
+					acc |= static_cast<uint64_t>(in[pos++]) << nbits;
+					nbits += 8;
+				}
+			}
+		}
+
+		out[i] = static_cast<uint16_t>(acc & mask);
+		acc >>= width;
+		nbits -= width;
+	}
+}
+
+/**
+	@brief Packs groups of eight values at a fixed width
+
+	Eight values of W bits fill exactly W bytes, so with the width known at compile time every shift is a constant
+	and there are no branches. This produces the same bytes as PackBits().
+ */
+template<unsigned W>
+static uint8_t* PackGroups(const uint16_t* in, size_t groups, uint8_t* out)
+{
+	for(size_t g=0; g<groups; g++)
+	{
+		uint64_t lo = 0;
+		uint64_t hi = 0;
+		UNROLL_GROUP
+		for(unsigned j=0; j<8; j++)
+		{
+			uint64_t v = in[j];
+			unsigned shift = j*W;
+			if(shift < 64)
+			{
+				lo |= v << shift;
+				if(shift + W > 64)
+					hi |= v >> (64 - shift);
+			}
+			else
+				hi |= v << (shift - 64);
+		}
+
+		memcpy(out, &lo, min(W, 8u));
+		if(W > 8)
+			memcpy(out + 8, &hi, W - 8);
+		out += W;
+		in += 8;
+	}
+	return out;
+}
+
+/**
+	@brief Unpacks groups of eight values written by PackGroups()
+ */
+template<unsigned W>
+static const uint8_t* UnpackGroups(const uint8_t* in, size_t groups, uint16_t* out)
+{
+	const uint64_t mask = (1ull << W) - 1;
+	for(size_t g=0; g<groups; g++)
+	{
+		uint64_t lo = 0;
+		uint64_t hi = 0;
+		memcpy(&lo, in, min(W, 8u));
+		if(W > 8)
+			memcpy(&hi, in + 8, W - 8);
+
+		UNROLL_GROUP
+		for(unsigned j=0; j<8; j++)
+		{
+			unsigned shift = j*W;
+			uint64_t v;
+			if(shift < 64)
+			{
+				v = lo >> shift;
+				if(shift + W > 64)
+					v |= hi << (64 - shift);
+			}
+			else
+				v = hi >> (shift - 64);
+			out[j] = static_cast<uint16_t>(v & mask);
+		}
+
+		in += W;
+		out += 8;
+	}
+	return in;
+}
+
+typedef uint8_t* (*PackFunction)(const uint16_t*, size_t, uint8_t*);
+typedef const uint8_t* (*UnpackFunction)(const uint8_t*, size_t, uint16_t*);
+
+///@brief Group packers indexed by width
+static const PackFunction g_packers[] =
+{
+	PackGroups<0>,  PackGroups<1>,  PackGroups<2>,  PackGroups<3>,  PackGroups<4>,  PackGroups<5>,
+	PackGroups<6>,  PackGroups<7>,  PackGroups<8>,  PackGroups<9>,  PackGroups<10>, PackGroups<11>,
+	PackGroups<12>, PackGroups<13>, PackGroups<14>, PackGroups<15>, PackGroups<16>
+};
+
+///@brief Group unpackers indexed by width
+static const UnpackFunction g_unpackers[] =
+{
+	UnpackGroups<0>,  UnpackGroups<1>,  UnpackGroups<2>,  UnpackGroups<3>,  UnpackGroups<4>,  UnpackGroups<5>,
+	UnpackGroups<6>,  UnpackGroups<7>,  UnpackGroups<8>,  UnpackGroups<9>,  UnpackGroups<10>, UnpackGroups<11>,
+	UnpackGroups<12>, UnpackGroups<13>, UnpackGroups<14>, UnpackGroups<15>, UnpackGroups<16>
+};
+
+/**
+	@brief Packs a block: whole groups of eight at a fixed width, then any remaining values bit by bit
+ */
+static uint8_t* PackBlock(const uint16_t* in, size_t count, unsigned width, uint8_t* out)
+{
+	size_t groups = count / 8;
+	out = g_packers[width](in, groups, out);
+	return PackBits(in + groups*8, count - groups*8, width, out);
+}
+
+/**
+	@brief Unpacks a block written by PackBlock() from exactly ceil(count * width / 8) bytes
+ */
+static void UnpackBlock(const uint8_t* in, size_t count, unsigned width, uint16_t* out)
+{
+	size_t groups = count / 8;
+	const uint8_t* tail = g_unpackers[width](in, groups, out);
+	size_t tailValues = count - groups*8;
+	UnpackBits(tail, (tailValues*width + 7) / 8, width, out + groups*8, tailValues);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Block coding
+
+/**
+	@brief Delta and zigzag codes one block, returning the OR of all coded values
+ */
+static inline uint16_t DeltaEncodeBlock(const int8_t* in, size_t count, int8_t prev, uint16_t* out)
+{
+	return DeltaZigZagInt8(in, count, prev, out);
+}
+
+static inline uint16_t DeltaEncodeBlock(const int16_t* in, size_t count, int16_t prev, uint16_t* out)
+{
+	return DeltaZigZagInt16(in, count, prev, out);
+}
+
+template<class T>
+static size_t CompressBlocks(const T* in, size_t count, uint8_t* out)
+{
+	uint16_t coded[COMPRESSION_BLOCK_SAMPLES];
+	uint8_t* p = out;
+	T prev = 0;
+	for(size_t base=0; base<count; base += COMPRESSION_BLOCK_SAMPLES)
+	{
+		size_t n = min<size_t>(COMPRESSION_BLOCK_SAMPLES, count - base);
+		const T* src = in + base;
+
+		uint16_t any = DeltaEncodeBlock(src, n, prev, coded);
+		unsigned width = 0;
+		while(any >> width)
+			width ++;
+
+		size_t rawSize = n * sizeof(T);
+		if( (n*width + 7) / 8 >= rawSize)
+		{
+			*p++ = COMPRESSION_BLOCK_RAW;
+			memcpy(p, src, rawSize);
+			p += rawSize;
+		}
+		else
+		{
+			*p++ = static_cast<uint8_t>(width);
+			p = PackBlock(coded, n, width, p);
+		}
+
+		prev = src[n-1];
+	}
+	return p - out;
+}
+
+template<class T>
+static bool DecompressBlocks(const uint8_t* in, size_t length, T* out, size_t count)
+{
+	uint16_t coded[COMPRESSION_BLOCK_SAMPLES];
+	const uint8_t* end = in + length;
+	T prev = 0;
+	for(size_t base=0; base<count; base += COMPRESSION_BLOCK_SAMPLES)
+	{
+		size_t n = min<size_t>(COMPRESSION_BLOCK_SAMPLES, count - base);
+		T* dst = out + base;
+
+		if(in >= end)
+			return false;
+		uint8_t header = *in++;
+
+		if(header == COMPRESSION_BLOCK_RAW)
+		{
+			size_t rawSize = n * sizeof(T);
+			if(static_cast<size_t>(end - in) < rawSize)
+				return false;
+			memcpy(dst, in, rawSize);
+			in += rawSize;
+		}
+		else
+		{
+			//Reject reserved bits and widths too large for the sample size
+			unsigned width = header;
+			if(width > 8*sizeof(T))
+				return false;
+
+			size_t packedSize = (n*width + 7) / 8;
+			if(static_cast<size_t>(end - in) < packedSize)
+				return false;
+			UnpackBlock(in, n, width, coded);
+			in += packedSize;
+
+			//Sum in 32 bits and truncate on store, so the running sum is the only serial dependency
+			uint32_t sum = static_cast<uint32_t>(prev);
+			for(size_t i=0; i<n; i++)
+			{
+				uint32_t zz = coded[i];
+				sum += (zz >> 1) ^ (0 - (zz & 1));
+				dst[i] = static_cast<T>(sum);
+			}
+		}
+
+		prev = dst[n-1];
+	}
+
+	//Trailing data means the stream doesn't match the sample count
+	return in == end;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Public API
+
+/**
+	@brief Returns the largest possible compressed size for a waveform
+ */
+size_t GetCompressedBound(size_t count, uint8_t bytesPerSample)
+{
+	size_t blocks = (count + COMPRESSION_BLOCK_SAMPLES - 1) / COMPRESSION_BLOCK_SAMPLES;
+	return count*bytesPerSample + blocks;
+}
+
+/**
+	@brief Compresses signed integer samples
+
+	@param in				Input samples
+	@param count			Number of samples
+	@param bytesPerSample	Size of each sample (1 or 2)
+	@param out				Output buffer, at least GetCompressedBound() bytes
+
+	@return Number of bytes written, or zero if the sample size isn't supported
+ */
+size_t CompressSamples(const void* in, size_t count, uint8_t bytesPerSample, uint8_t* out)
+{
+	if(bytesPerSample == 1)
+		return CompressBlocks(reinterpret_cast<const int8_t*>(in), count, out);
+	else if(bytesPerSample == 2)
+		return CompressBlocks(reinterpret_cast<const int16_t*>(in), count, out);
+	return 0;
+}
+
+/**
+	@brief Decompresses a stream written by CompressSamples()
+
+	@param in				Compressed data
+	@param length			Size of the compressed data
+	@param out				Output buffer, count * bytesPerSample bytes
+	@param count			Number of samples expected
+	@param bytesPerSample	Size of each sample (1 or 2)
+
+	@return True on success, false if the stream is malformed or doesn't hold exactly count samples
+ */
+bool DecompressSamples(const uint8_t* in, size_t length, void* out, size_t count, uint8_t bytesPerSample)
+{
+	if(bytesPerSample == 1)
+		return DecompressBlocks(in, length, reinterpret_cast<int8_t*>(out), count);
+	else if(bytesPerSample == 2)
+		return DecompressBlocks(in, length, reinterpret_cast<int16_t*>(out), count);
+	return false;
+}
@@ -0,0 +1,67 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef SampleCompression_h
+#define SampleCompression_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+	Lossless compression for signed integer ADC samples (8 or 16 bits per sample)
+
+	Samples are coded in blocks of COMPRESSION_BLOCK_SAMPLES (the last block may be shorter). Each sample is replaced
+	by its difference from the previous one (wrapping at the sample width, and starting from zero), the difference is
+	zigzag coded so small negative values become small positive ones, and the block is bit-packed at the width of the
+	largest value in it.
+
+	Each block starts with one header byte:
+		bits 0-4: width of each packed value in bits (0 to 16)
+		bit 7:    set if the block is stored raw instead (samples in host byte order, little endian)
+
+	A packed block is followed by ceil(n * width / 8) bytes of values, least significant bit first, where n is the
+	number of samples in the block. A raw block is followed by n * bytesPerSample bytes. Blocks that don't get smaller
+	by packing are stored raw, so the output is never more than one byte per block larger than the input. Delta
+	coding continues across raw blocks.
+ */
+
+///@brief Number of samples per block
+#define COMPRESSION_BLOCK_SAMPLES 128
+
+///@brief Block header flag marking a raw block
+#define COMPRESSION_BLOCK_RAW 0x80
+
+///@brief Mask for the packed value width in a block header
+#define COMPRESSION_WIDTH_MASK 0x1f
+
+size_t GetCompressedBound(size_t count, uint8_t bytesPerSample);
+size_t CompressSamples(const void* in, size_t count, uint8_t bytesPerSample, uint8_t* out);
+bool DecompressSamples(const uint8_t* in, size_t length, void* out, size_t count, uint8_t bytesPerSample);
+
+#endif
@@ -0,0 +1,1526 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#include "SampleConversion.h"
+#include <algorithm>
+#include <atomic>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#define TARGET(isa) __attribute__((target(isa)))
+#endif
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Scalar kernels
+
+static void ConvertInt8ToFloat_Scalar(const int8_t* in, float* out, size_t count, float gain, float offset)
+{
+	for(size_t i=0; i<count; i++)
+		out[i] = in[i]*gain + offset;
+}
+
+static void ConvertInt16ToFloat_Scalar(const int16_t* in, float* out, size_t count, float gain, float offset)
+{
+	for(size_t i=0; i<count; i++)
+		out[i] = in[i]*gain + offset;
+}
+
+/**
+	@brief Decodes packed 12-bit samples: two samples in three bytes, little endian, two's complement
+
+	Sample 2n is byte 3n plus the low nibble of byte 3n+1; sample 2n+1 is the high nibble of byte 3n+1 plus byte 3n+2.
+ */
+static void ConvertPackedInt12ToFloat_Scalar(const uint8_t* in, float* out, size_t count, float gain, float offset)
+{
+	for(size_t i=0; i<count; i++)
+	{
+		const uint8_t* p = in + (i/2)*3;
+		uint16_t raw;
+		if(i & 1)
+			raw = (p[1] >> 4) | (p[2] << 4);
+		else
+			raw = p[0] | ((p[1] & 0xf) << 8);
+
+		//Sign extend from 12 bits
+		int16_t code = static_cast<int16_t>(raw << 4) >> 4;
+		out[i] = code*gain + offset;
+	}
+}
+
+/**
+	@brief Deinterleaves samples [start, end) of each channel (shared by the scalar kernels and the SIMD tails)
+ */
+template<class T>
+static void DeinterleaveRange(const T* in, T* const* out, size_t channels, size_t start, size_t end)
+{
+	for(size_t i=start; i<end; i++)
+	{
+		for(size_t j=0; j<channels; j++)
+			out[j][i] = in[i*channels + j];
+	}
+}
+
+static void DeinterleaveInt8_Scalar(const int8_t* in, int8_t* const* out, size_t channels, size_t count)
+{
+	DeinterleaveRange(in, out, channels, 0, count);
+}
+
+static void DeinterleaveInt16_Scalar(const int16_t* in, int16_t* const* out, size_t channels, size_t count)
+{
+	DeinterleaveRange(in, out, channels, 0, count);
+}
+
+static void ExtractDigitalBits_Scalar(const uint8_t* in, uint8_t* const* out, size_t count)
+{
+	for(size_t bit=0; bit<8; bit++)
+	{
+		if(!out[bit])
+			continue;
+		for(size_t i=0; i<count; i++)
+			out[bit][i] = (in[i] >> bit) & 1;
+	}
+}
+
+/**
+	@brief Finds the smallest and largest of count (at least one) samples (shared by the scalar kernels and the SIMD
+	kernels for short inputs)
+ */
+template<class T>
+static void MinMaxRange(const T* in, size_t count, T& vmin, T& vmax)
+{
+	T lo = in[0];
+	T hi = in[0];
+	for(size_t i=1; i<count; i++)
+	{
+		lo = min(lo, in[i]);
+		hi = max(hi, in[i]);
+	}
+	vmin = lo;
+	vmax = hi;
+}
+
+static void MinMaxInt8_Scalar(const int8_t* in, size_t count, int8_t& vmin, int8_t& vmax)
+{
+	MinMaxRange(in, count, vmin, vmax);
+}
+
+static void MinMaxInt16_Scalar(const int16_t* in, size_t count, int16_t& vmin, int16_t& vmax)
+{
+	MinMaxRange(in, count, vmin, vmax);
+}
+
+static void MinMaxFloat_Scalar(const float* in, size_t count, float& vmin, float& vmax)
+{
+	MinMaxRange(in, count, vmin, vmax);
+}
+
+/**
+	@brief Delta and zigzag codes samples [start, count) (shared by the scalar kernels and the SIMD tails)
+
+	@return The OR of all codes written
+ */
+template<class T>
+static uint16_t DeltaZigZagRange(const T* in, size_t start, size_t count, T prev, uint16_t* out)
+{
+	uint16_t any = 0;
+	for(size_t i=start; i<count; i++)
+	{
+		T last = i ? in[i-1] : prev;
+		int32_t delta = static_cast<T>(in[i] - last);
+		uint32_t zz = (static_cast<uint32_t>(delta) << 1) ^ static_cast<uint32_t>(delta >> 31);
+		out[i] = static_cast<uint16_t>(zz & ((1u << (8*sizeof(T))) - 1));
+		any |= out[i];
+	}
+	return any;
+}
+
+static uint16_t DeltaZigZagInt8_Scalar(const int8_t* in, size_t count, int8_t prev, uint16_t* out)
+{
+	return DeltaZigZagRange(in, 0, count, prev, out);
+}
+
+static uint16_t DeltaZigZagInt16_Scalar(const int16_t* in, size_t count, int16_t prev, uint16_t* out)
+{
+	return DeltaZigZagRange(in, 0, count, prev, out);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Helpers for the vector float conversions
+
+//Outputs at least this big (in bytes) are written with non-temporal stores. A buffer this size won't still be in cache
+//when it's read back, so there's no point reading each line in just to overwrite it.
+#define STREAMING_STORE_THRESHOLD (1024 * 1024)
+
+/**
+	@brief Returns the number of leading samples to convert one at a time so the rest of out is aligned
+
+	@param alignment	Required alignment in bytes (a power of two)
+ */
+static size_t GetAlignmentPeel(const float* out, size_t count, size_t alignment)
+{
+	size_t misalign = reinterpret_cast<uintptr_t>(out) & (alignment - 1);
+	size_t peel = misalign ? (alignment - misalign) / sizeof(float) : 0;
+	return min(peel, count);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// SSE4.1 kernels
+
+/**
+	@brief Converts int8 samples to float into 16-byte aligned output, with aligned or non-temporal stores
+ */
+template<bool stream>
+TARGET("sse4.1")
+static void ConvertInt8ToFloatAligned_SSE41(const int8_t* in, float* out, size_t count, float gain, float offset)
+{
+	__m128 vgain = _mm_set1_ps(gain);
+	__m128 voffset = _mm_set1_ps(offset);
+
+	size_t i = 0;
+	for(; i + 16 <= count; i += 16)
+	{
+		__m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+		__m128 f0 = _mm_cvtepi32_ps(_mm_cvtepi8_epi32(raw));
+		__m128 f1 = _mm_cvtepi32_ps(_mm_cvtepi8_epi32(_mm_srli_si128(raw, 4)));
+		__m128 f2 = _mm_cvtepi32_ps(_mm_cvtepi8_epi32(_mm_srli_si128(raw, 8)));
+		__m128 f3 = _mm_cvtepi32_ps(_mm_cvtepi8_epi32(_mm_srli_si128(raw, 12)));
+		f0 = _mm_add_ps(_mm_mul_ps(f0, vgain), voffset);
+		f1 = _mm_add_ps(_mm_mul_ps(f1, vgain), voffset);
+		f2 = _mm_add_ps(_mm_mul_ps(f2, vgain), voffset);
+		f3 = _mm_add_ps(_mm_mul_ps(f3, vgain), voffset);
+
+		if(stream)
+		{
+			_mm_stream_ps(out + i, f0);
+			_mm_stream_ps(out + i + 4, f1);
+			_mm_stream_ps(out + i + 8, f2);
+			_mm_stream_ps(out + i + 12, f3);
+		}
+		else
+		{
+			_mm_store_ps(out + i, f0);
+			_mm_store_ps(out + i + 4, f1);
+			_mm_store_ps(out + i + 8, f2);
+			_mm_store_ps(out + i + 12, f3);
+		}
+	}
+	if(stream)
+		_mm_sfence();
+
+	ConvertInt8ToFloat_Scalar(in + i, out + i, count - i, gain, offset);
+}
+
+TARGET("sse4.1")
+static void ConvertInt8ToFloat_SSE41(const int8_t* in, float* out, size_t count, float gain, float offset)
+{
+	size_t head = GetAlignmentPeel(out, count, 16);
+	ConvertInt8ToFloat_Scalar(in, out, head, gain, offset);
+	if(count * sizeof(float) >= STREAMING_STORE_THRESHOLD)
+		ConvertInt8ToFloatAligned_SSE41<true>(in + head, out + head, count - head, gain, offset);
+	else
+		ConvertInt8ToFloatAligned_SSE41<false>(in + head, out + head, count - head, gain, offset);
+}
+
+/**
+	@brief Converts int16 samples to float into 16-byte aligned output, with aligned or non-temporal stores
+ */
+template<bool stream>
+TARGET("sse4.1")
+static void ConvertInt16ToFloatAligned_SSE41(const int16_t* in, float* out, size_t count, float gain, float offset)
+{
+	__m128 vgain = _mm_set1_ps(gain);
+	__m128 voffset = _mm_set1_ps(offset);
+
+	size_t i = 0;
+	for(; i + 16 <= count; i += 16)
+	{
+		__m128 f0 = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + i))));
+		__m128 f1 = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + i + 4))));
+		__m128 f2 = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + i + 8))));
+		__m128 f3 = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + i + 12))));
+		f0 = _mm_add_ps(_mm_mul_ps(f0, vgain), voffset);
+		f1 = _mm_add_ps(_mm_mul_ps(f1, vgain), voffset);
+		f2 = _mm_add_ps(_mm_mul_ps(f2, vgain), voffset);
+		f3 = _mm_add_ps(_mm_mul_ps(f3, vgain), voffset);
+
+		if(stream)
+		{
+			_mm_stream_ps(out + i, f0);
+			_mm_stream_ps(out + i + 4, f1);
+			_mm_stream_ps(out + i + 8, f2);
+			_mm_stream_ps(out + i + 12, f3);
+		}
+		else
+		{
+			_mm_store_ps(out + i, f0);
+			_mm_store_ps(out + i + 4, f1);
+			_mm_store_ps(out + i + 8, f2);
+			_mm_store_ps(out + i + 12, f3);
+		}
+	}
+	if(stream)
+		_mm_sfence();
+
+	ConvertInt16ToFloat_Scalar(in + i, out + i, count - i, gain, offset);
+}
+
+TARGET("sse4.1")
+static void ConvertInt16ToFloat_SSE41(const int16_t* in, float* out, size_t count, float gain, float offset)
+{
+	size_t head = GetAlignmentPeel(out, count, 16);
+	ConvertInt16ToFloat_Scalar(in, out, head, gain, offset);
+	if(count * sizeof(float) >= STREAMING_STORE_THRESHOLD)
+		ConvertInt16ToFloatAligned_SSE41<true>(in + head, out + head, count - head, gain, offset);
+	else
+		ConvertInt16ToFloatAligned_SSE41<false>(in + head, out + head, count - head, gain, offset);
+}
+
+/**
+	@brief Unpacks 12 bytes (in the low part of a 16-byte vector) into eight sign-extended 16-bit samples
+ */
+TARGET("sse4.1")
+static inline __m128i UnpackInt12_SSE41(__m128i raw)
+{
+	//Even samples take bytes (3n, 3n+1), odd samples (3n+1, 3n+2)
+	const __m128i shuf = _mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+	__m128i words = _mm_shuffle_epi8(raw, shuf);
+
+	//Even samples are in the low 12 bits, odd samples in the high 12 bits. Shift into place and sign extend.
+	__m128i even = _mm_srai_epi16(_mm_slli_epi16(words, 4), 4);
+	__m128i odd = _mm_srai_epi16(words, 4);
+	return _mm_blend_epi16(even, odd, 0xaa);
+}
+
+TARGET("sse4.1")
+static void ConvertPackedInt12ToFloat_SSE41(const uint8_t* in, float* out, size_t count, float gain, float offset)
+{
+	__m128 vgain = _mm_set1_ps(gain);
+	__m128 voffset = _mm_set1_ps(offset);
+
+	//Each iteration consumes 12 bytes but loads 16, so stop early enough to stay inside the input
+	size_t nbytes = (count*3 + 1) / 2;
+	size_t i = 0;
+	for(; (i + 8 <= count) && ((i/2)*3 + 16 <= nbytes); i += 8)
+	{
+		__m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + (i/2)*3));
+		__m128i samples = UnpackInt12_SSE41(raw);
+
+		__m128 lo = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(samples));
+		__m128 hi = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(_mm_srli_si128(samples, 8)));
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_mul_ps(lo, vgain), voffset));
+		_mm_storeu_ps(out + i + 4, _mm_add_ps(_mm_mul_ps(hi, vgain), voffset));
+	}
+
+	ConvertPackedInt12ToFloat_Scalar(in + (i/2)*3, out + i, count - i, gain, offset);
+}
+
+TARGET("sse4.1")
+static void DeinterleaveInt8_SSE41(const int8_t* in, int8_t* const* out, size_t channels, size_t count)
+{
+	size_t i = 0;
+	if(channels == 2)
+	{
+		const __m128i shuf = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+		for(; i + 8 <= count; i += 8)
+		{
+			__m128i v = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i*2)), shuf);
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(out[0] + i), v);
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(out[1] + i), _mm_srli_si128(v, 8));
+		}
+	}
+	else if(channels == 4)
+	{
+		const __m128i shuf = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+		for(; i + 4 <= count; i += 4)
+		{
+			__m128i v = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i*4)), shuf);
+			for(int j=0; j<4; j++)
+			{
+				int32_t word = _mm_cvtsi128_si32(v);
+				__builtin_memcpy(out[j] + i, &word, 4);
+				v = _mm_srli_si128(v, 4);
+			}
+		}
+	}
+
+	DeinterleaveRange(in, out, channels, i, count);
+}
+
+TARGET("sse4.1")
+static void DeinterleaveInt16_SSE41(const int16_t* in, int16_t* const* out, size_t channels, size_t count)
+{
+	size_t i = 0;
+	if(channels == 2)
+	{
+		//Gather each vector's even samples into the low half and odd samples into the high half, then merge halves
+		const __m128i shuf = _mm_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15);
+		for(; i + 8 <= count; i += 8)
+		{
+			__m128i a = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i*2)), shuf);
+			__m128i b = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i*2 + 8)), shuf);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out[0] + i), _mm_unpacklo_epi64(a, b));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out[1] + i), _mm_unpackhi_epi64(a, b));
+		}
+	}
+
+	DeinterleaveRange(in, out, channels, i, count);
+}
+
+TARGET("sse4.1")
+static void ExtractDigitalBits_SSE41(const uint8_t* in, uint8_t* const* out, size_t count)
+{
+	const __m128i ones = _mm_set1_epi8(1);
+
+	size_t i = 0;
+	for(; i + 16 <= count; i += 16)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+		for(int bit=0; bit<8; bit++)
+		{
+			if(out[bit])
+			{
+				__m128i b = _mm_and_si128(_mm_srl_epi16(v, _mm_cvtsi32_si128(bit)), ones);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(out[bit] + i), b);
+			}
+		}
+	}
+
+	uint8_t* rest[8];
+	for(int bit=0; bit<8; bit++)
+		rest[bit] = out[bit] ? out[bit] + i : nullptr;
+	ExtractDigitalBits_Scalar(in + i, rest, count - i);
+}
+
+//The min/max kernels seed their accumulators with the last full vector of the input. That covers the tail, and
+//seeing some samples twice doesn't change the result, so no scalar tail loop is needed.
+
+TARGET("sse4.1")
+static inline void HorizontalMinMaxInt8_SSE41(__m128i lo, __m128i hi, int8_t& vmin, int8_t& vmax)
+{
+	lo = _mm_min_epi8(lo, _mm_srli_si128(lo, 8));
+	hi = _mm_max_epi8(hi, _mm_srli_si128(hi, 8));
+	lo = _mm_min_epi8(lo, _mm_srli_si128(lo, 4));
+	hi = _mm_max_epi8(hi, _mm_srli_si128(hi, 4));
+	lo = _mm_min_epi8(lo, _mm_srli_si128(lo, 2));
+	hi = _mm_max_epi8(hi, _mm_srli_si128(hi, 2));
+	lo = _mm_min_epi8(lo, _mm_srli_si128(lo, 1));
+	hi = _mm_max_epi8(hi, _mm_srli_si128(hi, 1));
+	vmin = static_cast<int8_t>(_mm_extract_epi8(lo, 0));
+	vmax = static_cast<int8_t>(_mm_extract_epi8(hi, 0));
+}
+
+TARGET("sse4.1")
+static inline void HorizontalMinMaxInt16_SSE41(__m128i lo, __m128i hi, int16_t& vmin, int16_t& vmax)
+{
+	lo = _mm_min_epi16(lo, _mm_srli_si128(lo, 8));
+	hi = _mm_max_epi16(hi, _mm_srli_si128(hi, 8));
+	lo = _mm_min_epi16(lo, _mm_srli_si128(lo, 4));
+	hi = _mm_max_epi16(hi, _mm_srli_si128(hi, 4));
+	lo = _mm_min_epi16(lo, _mm_srli_si128(lo, 2));
+	hi = _mm_max_epi16(hi, _mm_srli_si128(hi, 2));
+	vmin = static_cast<int16_t>(_mm_extract_epi16(lo, 0));
+	vmax = static_cast<int16_t>(_mm_extract_epi16(hi, 0));
+}
+
+TARGET("sse4.1")
+static inline void HorizontalMinMaxFloat_SSE41(__m128 lo, __m128 hi, float& vmin, float& vmax)
+{
+	lo = _mm_min_ps(lo, _mm_movehl_ps(lo, lo));
+	hi = _mm_max_ps(hi, _mm_movehl_ps(hi, hi));
+	lo = _mm_min_ss(lo, _mm_shuffle_ps(lo, lo, 1));
+	hi = _mm_max_ss(hi, _mm_shuffle_ps(hi, hi, 1));
+	vmin = _mm_cvtss_f32(lo);
+	vmax = _mm_cvtss_f32(hi);
+}
+
+TARGET("sse4.1")
+static void MinMaxInt8_SSE41(const int8_t* in, size_t count, int8_t& vmin, int8_t& vmax)
+{
+	if(count < 8)
+	{
+		MinMaxRange(in, count, vmin, vmax);
+		return;
+	}
+	//Too short for the loop, but two overlapping 8-byte loads still fill a vector
+	if(count < 16)
+	{
+		__m128i v = _mm_unpacklo_epi64(
+			_mm_loadl_epi64(reinterpret_cast<const __m128i*>(in)),
+			_mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + count - 8)));
+		HorizontalMinMaxInt8_SSE41(v, v, vmin, vmax);
+		return;
+	}
+
+	__m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + count - 16));
+	__m128i hi = lo;
+	for(size_t i=0; i + 16 <= count; i += 16)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+		lo = _mm_min_epi8(lo, v);
+		hi = _mm_max_epi8(hi, v);
+	}
+	HorizontalMinMaxInt8_SSE41(lo, hi, vmin, vmax);
+}
+
+TARGET("sse4.1")
+static void MinMaxInt16_SSE41(const int16_t* in, size_t count, int16_t& vmin, int16_t& vmax)
+{
+	if(count < 8)
+	{
+		MinMaxRange(in, count, vmin, vmax);
+		return;
+	}
+
+	__m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + count - 8));
+	__m128i hi = lo;
+	for(size_t i=0; i + 8 <= count; i += 8)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+		lo = _mm_min_epi16(lo, v);
+		hi = _mm_max_epi16(hi, v);
+	}
+	HorizontalMinMaxInt16_SSE41(lo, hi, vmin, vmax);
+}
+
+TARGET("sse4.1")
+static void MinMaxFloat_SSE41(const float* in, size_t count, float& vmin, float& vmax)
+{
+	if(count < 4)
+	{
+		MinMaxRange(in, count, vmin, vmax);
+		return;
+	}
+
+	__m128 lo = _mm_loadu_ps(in + count - 4);
+	__m128 hi = lo;
+	for(size_t i=0; i + 4 <= count; i += 4)
+	{
+		__m128 v = _mm_loadu_ps(in + i);
+		lo = _mm_min_ps(lo, v);
+		hi = _mm_max_ps(hi, v);
+	}
+	HorizontalMinMaxFloat_SSE41(lo, hi, vmin, vmax);
+}
+
+TARGET("sse4.1")
+static inline uint16_t HorizontalOr16_SSE41(__m128i v)
+{
+	v = _mm_or_si128(v, _mm_srli_si128(v, 8));
+	v = _mm_or_si128(v, _mm_srli_si128(v, 4));
+	v = _mm_or_si128(v, _mm_srli_si128(v, 2));
+	return static_cast<uint16_t>(_mm_extract_epi16(v, 0));
+}
+
+/**
+	@brief Codes in[0 ... 15] relative to in[-1 ... 14], returning the widened codes ORed together
+ */
+TARGET("sse4.1")
+static inline __m128i DeltaZigZagStepInt8_SSE41(const int8_t* in, uint16_t* out)
+{
+	__m128i cur = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+	__m128i last = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in - 1));
+	__m128i d = _mm_sub_epi8(cur, last);
+	__m128i zz = _mm_xor_si128(_mm_add_epi8(d, d), _mm_cmpgt_epi8(_mm_setzero_si128(), d));
+
+	__m128i lo = _mm_cvtepu8_epi16(zz);
+	__m128i hi = _mm_cvtepu8_epi16(_mm_srli_si128(zz, 8));
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(out), lo);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 8), hi);
+	return _mm_or_si128(lo, hi);
+}
+
+/**
+	@brief Codes in[0 ... 7] relative to in[-1 ... 6]
+ */
+TARGET("sse4.1")
+static inline __m128i DeltaZigZagStepInt16_SSE41(const int16_t* in, uint16_t* out)
+{
+	__m128i cur = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+	__m128i last = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in - 1));
+	__m128i d = _mm_sub_epi16(cur, last);
+	__m128i zz = _mm_xor_si128(_mm_add_epi16(d, d), _mm_srai_epi16(d, 15));
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(out), zz);
+	return zz;
+}
+
+TARGET("sse4.1")
+static uint16_t DeltaZigZagInt8_SSE41(const int8_t* in, size_t count, int8_t prev, uint16_t* out)
+{
+	if(count <= 16)
+		return DeltaZigZagRange(in, 0, count, prev, out);
+
+	//The first sample is relative to prev, every later one to the sample before it. The last vector ends at the
+	//last sample and may overlap the loop, which just rewrites the same codes.
+	uint16_t any = DeltaZigZagRange(in, 0, 1, prev, out);
+	__m128i acc = _mm_setzero_si128();
+	for(size_t i=1; i + 16 <= count; i += 16)
+		acc = _mm_or_si128(acc, DeltaZigZagStepInt8_SSE41(in + i, out + i));
+	acc = _mm_or_si128(acc, DeltaZigZagStepInt8_SSE41(in + count - 16, out + count - 16));
+	return any | HorizontalOr16_SSE41(acc);
+}
+
+TARGET("sse4.1")
+static uint16_t DeltaZigZagInt16_SSE41(const int16_t* in, size_t count, int16_t prev, uint16_t* out)
+{
+	if(count <= 8)
+		return DeltaZigZagRange(in, 0, count, prev, out);
+
+	uint16_t any = DeltaZigZagRange(in, 0, 1, prev, out);
+	__m128i acc = _mm_setzero_si128();
+	for(size_t i=1; i + 8 <= count; i += 8)
+		acc = _mm_or_si128(acc, DeltaZigZagStepInt16_SSE41(in + i, out + i));
+	acc = _mm_or_si128(acc, DeltaZigZagStepInt16_SSE41(in + count - 8, out + count - 8));
+	return any | HorizontalOr16_SSE41(acc);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// AVX2 kernels
+
+/**
+	@brief Converts int8 samples to float into 32-byte aligned output, with aligned or non-temporal stores
+ */
+template<bool stream>
+TARGET("avx2")
+static void ConvertInt8ToFloatAligned_AVX2(const int8_t* in, float* out, size_t count, float gain, float offset)
+{
+	__m256 vgain = _mm256_set1_ps(gain);
+	__m256 voffset = _mm256_set1_ps(offset);
+
+	size_t i = 0;
+	for(; i + 32 <= count; i += 32)
+	{
+		//Widen straight from memory: each load folds into vpmovsxbd, keeping shuffles off the critical port
+		__m256 f0 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(
+			_mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + i))));
+		__m256 f1 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(
+			_mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + i + 8))));
+		__m256 f2 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(
+			_mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + i + 16))));
+		__m256 f3 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(
+			_mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + i + 24))));
+		f0 = _mm256_add_ps(_mm256_mul_ps(f0, vgain), voffset);
+		f1 = _mm256_add_ps(_mm256_mul_ps(f1, vgain), voffset);
+		f2 = _mm256_add_ps(_mm256_mul_ps(f2, vgain), voffset);
+		f3 = _mm256_add_ps(_mm256_mul_ps(f3, vgain), voffset);
+
+		if(stream)
+		{
+			_mm256_stream_ps(out + i, f0);
+			_mm256_stream_ps(out + i + 8, f1);
+			_mm256_stream_ps(out + i + 16, f2);
+			_mm256_stream_ps(out + i + 24, f3);
+		}
+		else
+		{
+			_mm256_store_ps(out + i, f0);
+			_mm256_store_ps(out + i + 8, f1);
+			_mm256_store_ps(out + i + 16, f2);
+			_mm256_store_ps(out + i + 24, f3);
+		}
+	}
+	if(stream)
+		_mm_sfence();
+
+	ConvertInt8ToFloat_Scalar(in + i, out + i, count - i, gain, offset);
+}
+
+TARGET("avx2")
+static void ConvertInt8ToFloat_AVX2(const int8_t* in, float* out, size_t count, float gain, float offset)
+{
+	size_t head = GetAlignmentPeel(out, count, 32);
+	ConvertInt8ToFloat_Scalar(in, out, head, gain, offset);
+	if(count * sizeof(float) >= STREAMING_STORE_THRESHOLD)
+		ConvertInt8ToFloatAligned_AVX2<true>(in + head, out + head, count - head, gain, offset);
+	else
+		ConvertInt8ToFloatAligned_AVX2<false>(in + head, out + head, count - head, gain, offset);
+}
+
+/**
+	@brief Converts int16 samples to float into 32-byte aligned output, with aligned or non-temporal stores
+ */
+template<bool stream>
+TARGET("avx2")
+static void ConvertInt16ToFloatAligned_AVX2(const int16_t* in, float* out, size_t count, float gain, float offset)
+{
+	__m256 vgain = _mm256_set1_ps(gain);
+	__m256 voffset = _mm256_set1_ps(offset);
+
+	size_t i = 0;
+	for(; i + 32 <= count; i += 32)
+	{
+		__m256 f0 = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i))));
+		__m256 f1 = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 8))));
+		__m256 f2 = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 16))));
+		__m256 f3 = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 24))));
+		f0 = _mm256_add_ps(_mm256_mul_ps(f0, vgain), voffset);
+		f1 = _mm256_add_ps(_mm256_mul_ps(f1, vgain), voffset);
+		f2 = _mm256_add_ps(_mm256_mul_ps(f2, vgain), voffset);
+		f3 = _mm256_add_ps(_mm256_mul_ps(f3, vgain), voffset);
+
+		if(stream)
+		{
+			_mm256_stream_ps(out + i, f0);
+			_mm256_stream_ps(out + i + 8, f1);
+			_mm256_stream_ps(out + i + 16, f2);
+			_mm256_stream_ps(out + i + 24, f3);
+		}
+		else
+		{
+			_mm256_store_ps(out + i, f0);
+			_mm256_store_ps(out + i + 8, f1);
+			_mm256_store_ps(out + i + 16, f2);
+			_mm256_store_ps(out + i + 24, f3);
+		}
+	}
+	if(stream)
+		_mm_sfence();
+
+	ConvertInt16ToFloat_Scalar(in + i, out + i, count - i, gain, offset);
+}
+
+TARGET("avx2")
+static void ConvertInt16ToFloat_AVX2(const int16_t* in, float* out, size_t count, float gain, float offset)
+{
+	size_t head = GetAlignmentPeel(out, count, 32);
+	ConvertInt16ToFloat_Scalar(in, out, head, gain, offset);
+	if(count * sizeof(float) >= STREAMING_STORE_THRESHOLD)
+		ConvertInt16ToFloatAligned_AVX2<true>(in + head, out + head, count - head, gain, offset);
+	else
+		ConvertInt16ToFloatAligned_AVX2<false>(in + head, out + head, count - head, gain, offset);
+}
+
+TARGET("avx2")
+static void ConvertPackedInt12ToFloat_AVX2(const uint8_t* in, float* out, size_t count, float gain, float offset)
+{
+	__m256 vgain = _mm256_set1_ps(gain);
+	__m256 voffset = _mm256_set1_ps(offset);
+
+	//Same shuffle as the SSE4.1 version, applied to 12 bytes in each 128-bit lane
+	const __m256i shuf = _mm256_setr_epi8(
+		0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11,
+		0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+
+	//Each iteration consumes 24 bytes, but the upper lane loads 16 bytes starting at offset 12
+	size_t nbytes = (count*3 + 1) / 2;
+	size_t i = 0;
+	for(; (i + 16 <= count) && ((i/2)*3 + 28 <= nbytes); i += 16)
+	{
+		const uint8_t* p = in + (i/2)*3;
+		__m256i raw = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))),
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 12)),
+			1);
+
+		__m256i words = _mm256_shuffle_epi8(raw, shuf);
+		__m256i even = _mm256_srai_epi16(_mm256_slli_epi16(words, 4), 4);
+		__m256i odd = _mm256_srai_epi16(words, 4);
+		__m256i samples = _mm256_blend_epi16(even, odd, 0xaa);
+
+		__m256 f0 = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(samples)));
+		__m256 f1 = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(samples, 1)));
+		_mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_mul_ps(f0, vgain), voffset));
+		_mm256_storeu_ps(out + i + 8, _mm256_add_ps(_mm256_mul_ps(f1, vgain), voffset));
+	}
+
+	ConvertPackedInt12ToFloat_Scalar(in + (i/2)*3, out + i, count - i, gain, offset);
+}
+
+TARGET("avx2")
+static void DeinterleaveInt8_AVX2(const int8_t* in, int8_t* const* out, size_t channels, size_t count)
+{
+	size_t i = 0;
+	if(channels == 2)
+	{
+		//Group each lane into (8 x ch0, 8 x ch1), then gather the ch0 halves and ch1 halves together
+		const __m256i shuf = _mm256_setr_epi8(
+			0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15,
+			0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+		for(; i + 16 <= count; i += 16)
+		{
+			__m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i*2)), shuf);
+			v = _mm256_permute4x64_epi64(v, 0xd8);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out[0] + i), _mm256_castsi256_si128(v));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out[1] + i), _mm256_extracti128_si256(v, 1));
+		}
+	}
+	else if(channels == 4)
+	{
+		//Group each lane into (4 x ch0, 4 x ch1, 4 x ch2, 4 x ch3), then pair up the dwords for each channel
+		const __m256i shuf = _mm256_setr_epi8(
+			0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15,
+			0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+		const __m256i perm = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+		for(; i + 8 <= count; i += 8)
+		{
+			__m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i*4)), shuf);
+			v = _mm256_permutevar8x32_epi32(v, perm);
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(out[0] + i), _mm256_castsi256_si128(v));
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(out[1] + i), _mm_srli_si128(_mm256_castsi256_si128(v), 8));
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(out[2] + i), _mm256_extracti128_si256(v, 1));
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(out[3] + i),
+				_mm_srli_si128(_mm256_extracti128_si256(v, 1), 8));
+		}
+	}
+
+	DeinterleaveRange(in, out, channels, i, count);
+}
+
+TARGET("avx2")
+static void DeinterleaveInt16_AVX2(const int16_t* in, int16_t* const* out, size_t channels, size_t count)
+{
+	size_t i = 0;
+	if(channels == 2)
+	{
+		const __m256i shuf = _mm256_setr_epi8(
+			0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15,
+			0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15);
+		for(; i + 8 <= count; i += 8)
+		{
+			__m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i*2)), shuf);
+			v = _mm256_permute4x64_epi64(v, 0xd8);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out[0] + i), _mm256_castsi256_si128(v));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out[1] + i), _mm256_extracti128_si256(v, 1));
+		}
+	}
+
+	DeinterleaveRange(in, out, channels, i, count);
+}
+
+TARGET("avx2")
+static void ExtractDigitalBits_AVX2(const uint8_t* in, uint8_t* const* out, size_t count)
+{
+	const __m256i ones = _mm256_set1_epi8(1);
+
+	size_t i = 0;
+	for(; i + 32 <= count; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+		for(int bit=0; bit<8; bit++)
+		{
+			if(out[bit])
+			{
+				__m256i b = _mm256_and_si256(_mm256_srl_epi16(v, _mm_cvtsi32_si128(bit)), ones);
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(out[bit] + i), b);
+			}
+		}
+	}
+
+	uint8_t* rest[8];
+	for(int bit=0; bit<8; bit++)
+		rest[bit] = out[bit] ? out[bit] + i : nullptr;
+	ExtractDigitalBits_Scalar(in + i, rest, count - i);
+}
+
+TARGET("avx2")
+static void MinMaxInt8_AVX2(const int8_t* in, size_t count, int8_t& vmin, int8_t& vmax)
+{
+	if(count < 32)
+	{
+		MinMaxInt8_SSE41(in, count, vmin, vmax);
+		return;
+	}
+
+	__m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + count - 32));
+	__m256i hi = lo;
+	for(size_t i=0; i + 32 <= count; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+		lo = _mm256_min_epi8(lo, v);
+		hi = _mm256_max_epi8(hi, v);
+	}
+	HorizontalMinMaxInt8_SSE41(
+		_mm_min_epi8(_mm256_castsi256_si128(lo), _mm256_extracti128_si256(lo, 1)),
+		_mm_max_epi8(_mm256_castsi256_si128(hi), _mm256_extracti128_si256(hi, 1)),
+		vmin, vmax);
+}
+
+TARGET("avx2")
+static void MinMaxInt16_AVX2(const int16_t* in, size_t count, int16_t& vmin, int16_t& vmax)
+{
+	if(count < 16)
+	{
+		MinMaxInt16_SSE41(in, count, vmin, vmax);
+		return;
+	}
+
+	__m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + count - 16));
+	__m256i hi = lo;
+	for(size_t i=0; i + 16 <= count; i += 16)
+	{
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+		lo = _mm256_min_epi16(lo, v);
+		hi = _mm256_max_epi16(hi, v);
+	}
+	HorizontalMinMaxInt16_SSE41(
+		_mm_min_epi16(_mm256_castsi256_si128(lo), _mm256_extracti128_si256(lo, 1)),
+		_mm_max_epi16(_mm256_castsi256_si128(hi), _mm256_extracti128_si256(hi, 1)),
+		vmin, vmax);
+}
+
+TARGET("avx2")
+static void MinMaxFloat_AVX2(const float* in, size_t count, float& vmin, float& vmax)
+{
+	if(count < 8)
+	{
+		MinMaxFloat_SSE41(in, count, vmin, vmax);
+		return;
+	}
+
+	__m256 lo = _mm256_loadu_ps(in + count - 8);
+	__m256 hi = lo;
+	for(size_t i=0; i + 8 <= count; i += 8)
+	{
+		__m256 v = _mm256_loadu_ps(in + i);
+		lo = _mm256_min_ps(lo, v);
+		hi = _mm256_max_ps(hi, v);
+	}
+	HorizontalMinMaxFloat_SSE41(
+		_mm_min_ps(_mm256_castps256_ps128(lo), _mm256_extractf128_ps(lo, 1)),
+		_mm_max_ps(_mm256_castps256_ps128(hi), _mm256_extractf128_ps(hi, 1)),
+		vmin, vmax);
+}
+
+TARGET("avx2")
+static inline __m256i DeltaZigZagStepInt8_AVX2(const int8_t* in, uint16_t* out)
+{
+	__m256i cur = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+	__m256i last = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in - 1));
+	__m256i d = _mm256_sub_epi8(cur, last);
+	__m256i zz = _mm256_xor_si256(_mm256_add_epi8(d, d), _mm256_cmpgt_epi8(_mm256_setzero_si256(), d));
+
+	__m256i lo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(zz));
+	__m256i hi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(zz, 1));
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(out), lo);
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 16), hi);
+	return _mm256_or_si256(lo, hi);
+}
+
+TARGET("avx2")
+static inline __m256i DeltaZigZagStepInt16_AVX2(const int16_t* in, uint16_t* out)
+{
+	__m256i cur = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+	__m256i last = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in - 1));
+	__m256i d = _mm256_sub_epi16(cur, last);
+	__m256i zz = _mm256_xor_si256(_mm256_add_epi16(d, d), _mm256_srai_epi16(d, 15));
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(out), zz);
+	return zz;
+}
+
+//Short inputs use the scalar code rather than the SSE4.1 kernels, since calling non-VEX code from here costs more
+//than it saves
+TARGET("avx2")
+static uint16_t DeltaZigZagInt8_AVX2(const int8_t* in, size_t count, int8_t prev, uint16_t* out)
+{
+	if(count <= 32)
+		return DeltaZigZagRange(in, 0, count, prev, out);
+
+	uint16_t any = DeltaZigZagRange(in, 0, 1, prev, out);
+	__m256i acc = _mm256_setzero_si256();
+	for(size_t i=1; i + 32 <= count; i += 32)
+		acc = _mm256_or_si256(acc, DeltaZigZagStepInt8_AVX2(in + i, out + i));
+	acc = _mm256_or_si256(acc, DeltaZigZagStepInt8_AVX2(in + count - 32, out + count - 32));
+	return any | HorizontalOr16_SSE41(_mm_or_si128(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1)));
+}
+
+TARGET("avx2")
+static uint16_t DeltaZigZagInt16_AVX2(const int16_t* in, size_t count, int16_t prev, uint16_t* out)
+{
+	if(count <= 16)
+		return DeltaZigZagRange(in, 0, count, prev, out);
+
+	uint16_t any = DeltaZigZagRange(in, 0, 1, prev, out);
+	__m256i acc = _mm256_setzero_si256();
+	for(size_t i=1; i + 16 <= count; i += 16)
+		acc = _mm256_or_si256(acc, DeltaZigZagStepInt16_AVX2(in + i, out + i));
+	acc = _mm256_or_si256(acc, DeltaZigZagStepInt16_AVX2(in + count - 16, out + count - 16));
+	return any | HorizontalOr16_SSE41(_mm_or_si128(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1)));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// AVX-512 kernels (conversions only; the shuffle-bound kernels use the AVX2 versions)
+
+//GCC 12 headers trip -Wmaybe-uninitialized on _mm512_undefined_*() inside the conversion intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+/**
+	@brief Converts int8 samples to float into 64-byte aligned output, with aligned or non-temporal stores
+ */
+template<bool stream>
+TARGET("avx512f,avx512bw")
+static void ConvertInt8ToFloatAligned_AVX512(const int8_t* in, float* out, size_t count, float gain, float offset)
+{
+	__m512 vgain = _mm512_set1_ps(gain);
+	__m512 voffset = _mm512_set1_ps(offset);
+
+	size_t i = 0;
+	for(; i + 64 <= count; i += 64)
+	{
+		__m512 f0 = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i))));
+		__m512 f1 = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 16))));
+		__m512 f2 = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 32))));
+		__m512 f3 = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 48))));
+		f0 = _mm512_add_ps(_mm512_mul_ps(f0, vgain), voffset);
+		f1 = _mm512_add_ps(_mm512_mul_ps(f1, vgain), voffset);
+		f2 = _mm512_add_ps(_mm512_mul_ps(f2, vgain), voffset);
+		f3 = _mm512_add_ps(_mm512_mul_ps(f3, vgain), voffset);
+
+		if(stream)
+		{
+			_mm512_stream_ps(out + i, f0);
+			_mm512_stream_ps(out + i + 16, f1);
+			_mm512_stream_ps(out + i + 32, f2);
+			_mm512_stream_ps(out + i + 48, f3);
+		}
+		else
+		{
+			_mm512_store_ps(out + i, f0);
+			_mm512_store_ps(out + i + 16, f1);
+			_mm512_store_ps(out + i + 32, f2);
+			_mm512_store_ps(out + i + 48, f3);
+		}
+	}
+	if(stream)
+		_mm_sfence();
+
+	ConvertInt8ToFloat_Scalar(in + i, out + i, count - i, gain, offset);
+}
+
+TARGET("avx512f,avx512bw")
+static void ConvertInt8ToFloat_AVX512(const int8_t* in, float* out, size_t count, float gain, float offset)
+{
+	size_t head = GetAlignmentPeel(out, count, 64);
+	ConvertInt8ToFloat_Scalar(in, out, head, gain, offset);
+	if(count * sizeof(float) >= STREAMING_STORE_THRESHOLD)
+		ConvertInt8ToFloatAligned_AVX512<true>(in + head, out + head, count - head, gain, offset);
+	else
+		ConvertInt8ToFloatAligned_AVX512<false>(in + head, out + head, count - head, gain, offset);
+}
+
+/**
+	@brief Converts int16 samples to float into 64-byte aligned output, with aligned or non-temporal stores
+ */
+template<bool stream>
+TARGET("avx512f,avx512bw")
+static void ConvertInt16ToFloatAligned_AVX512(const int16_t* in, float* out, size_t count, float gain, float offset)
+{
+	__m512 vgain = _mm512_set1_ps(gain);
+	__m512 voffset = _mm512_set1_ps(offset);
+
+	size_t i = 0;
+	for(; i + 64 <= count; i += 64)
+	{
+		__m512 f0 = _mm512_cvtepi32_ps(_mm512_cvtepi16_epi32(
+			_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i))));
+		__m512 f1 = _mm512_cvtepi32_ps(_mm512_cvtepi16_epi32(
+			_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i + 16))));
+		__m512 f2 = _mm512_cvtepi32_ps(_mm512_cvtepi16_epi32(
+			_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i + 32))));
+		__m512 f3 = _mm512_cvtepi32_ps(_mm512_cvtepi16_epi32(
+			_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i + 48))));
+		f0 = _mm512_add_ps(_mm512_mul_ps(f0, vgain), voffset);
+		f1 = _mm512_add_ps(_mm512_mul_ps(f1, vgain), voffset);
+		f2 = _mm512_add_ps(_mm512_mul_ps(f2, vgain), voffset);
+		f3 = _mm512_add_ps(_mm512_mul_ps(f3, vgain), voffset);
+
+		if(stream)
+		{
+			_mm512_stream_ps(out + i, f0);
+			_mm512_stream_ps(out + i + 16, f1);
+			_mm512_stream_ps(out + i + 32, f2);
+			_mm512_stream_ps(out + i + 48, f3);
+		}
+		else
+		{
+			_mm512_store_ps(out + i, f0);
+			_mm512_store_ps(out + i + 16, f1);
+			_mm512_store_ps(out + i + 32, f2);
+			_mm512_store_ps(out + i + 48, f3);
+		}
+	}
+	if(stream)
+		_mm_sfence();
+
+	ConvertInt16ToFloat_Scalar(in + i, out + i, count - i, gain, offset);
+}
+
+TARGET("avx512f,avx512bw")
+static void ConvertInt16ToFloat_AVX512(const int16_t* in, float* out, size_t count, float gain, float offset)
+{
+	size_t head = GetAlignmentPeel(out, count, 64);
+	ConvertInt16ToFloat_Scalar(in, out, head, gain, offset);
+	if(count * sizeof(float) >= STREAMING_STORE_THRESHOLD)
+		ConvertInt16ToFloatAligned_AVX512<true>(in + head, out + head, count - head, gain, offset);
+	else
+		ConvertInt16ToFloatAligned_AVX512<false>(in + head, out + head, count - head, gain, offset);
+}
+
+TARGET("avx512f,avx512bw")
+static void ExtractDigitalBits_AVX512(const uint8_t* in, uint8_t* const* out, size_t count)
+{
+	const __m512i ones = _mm512_set1_epi8(1);
+
+	size_t i = 0;
+	for(; i + 64 <= count; i += 64)
+	{
+		__m512i v = _mm512_loadu_si512(in + i);
+		for(int bit=0; bit<8; bit++)
+		{
+			if(out[bit])
+			{
+				__m512i b = _mm512_and_si512(_mm512_srl_epi16(v, _mm_cvtsi32_si128(bit)), ones);
+				_mm512_storeu_si512(out[bit] + i, b);
+			}
+		}
+	}
+
+	uint8_t* rest[8];
+	for(int bit=0; bit<8; bit++)
+		rest[bit] = out[bit] ? out[bit] + i : nullptr;
+	ExtractDigitalBits_Scalar(in + i, rest, count - i);
+}
+
+TARGET("avx512f,avx512bw")
+static void MinMaxInt8_AVX512(const int8_t* in, size_t count, int8_t& vmin, int8_t& vmax)
+{
+	if(count < 64)
+	{
+		MinMaxInt8_AVX2(in, count, vmin, vmax);
+		return;
+	}
+
+	__m512i lo = _mm512_loadu_si512(in + count - 64);
+	__m512i hi = lo;
+	for(size_t i=0; i + 64 <= count; i += 64)
+	{
+		__m512i v = _mm512_loadu_si512(in + i);
+		lo = _mm512_min_epi8(lo, v);
+		hi = _mm512_max_epi8(hi, v);
+	}
+	__m256i lo256 = _mm256_min_epi8(_mm512_castsi512_si256(lo), _mm512_extracti64x4_epi64(lo, 1));
+	__m256i hi256 = _mm256_max_epi8(_mm512_castsi512_si256(hi), _mm512_extracti64x4_epi64(hi, 1));
+	HorizontalMinMaxInt8_SSE41(
+		_mm_min_epi8(_mm256_castsi256_si128(lo256), _mm256_extracti128_si256(lo256, 1)),
+		_mm_max_epi8(_mm256_castsi256_si128(hi256), _mm256_extracti128_si256(hi256, 1)),
+		vmin, vmax);
+}
+
+TARGET("avx512f,avx512bw")
+static void MinMaxInt16_AVX512(const int16_t* in, size_t count, int16_t& vmin, int16_t& vmax)
+{
+	if(count < 32)
+	{
+		MinMaxInt16_AVX2(in, count, vmin, vmax);
+		return;
+	}
+
+	__m512i lo = _mm512_loadu_si512(in + count - 32);
+	__m512i hi = lo;
+	for(size_t i=0; i + 32 <= count; i += 32)
+	{
+		__m512i v = _mm512_loadu_si512(in + i);
+		lo = _mm512_min_epi16(lo, v);
+		hi = _mm512_max_epi16(hi, v);
+	}
+	__m256i lo256 = _mm256_min_epi16(_mm512_castsi512_si256(lo), _mm512_extracti64x4_epi64(lo, 1));
+	__m256i hi256 = _mm256_max_epi16(_mm512_castsi512_si256(hi), _mm512_extracti64x4_epi64(hi, 1));
+	HorizontalMinMaxInt16_SSE41(
+		_mm_min_epi16(_mm256_castsi256_si128(lo256), _mm256_extracti128_si256(lo256, 1)),
+		_mm_max_epi16(_mm256_castsi256_si128(hi256), _mm256_extracti128_si256(hi256, 1)),
+		vmin, vmax);
+}
+
+TARGET("avx512f,avx512bw")
+static void MinMaxFloat_AVX512(const float* in, size_t count, float& vmin, float& vmax)
+{
+	if(count < 16)
+	{
+		MinMaxFloat_AVX2(in, count, vmin, vmax);
+		return;
+	}
+
+	__m512 lo = _mm512_loadu_ps(in + count - 16);
+	__m512 hi = lo;
+	for(size_t i=0; i + 16 <= count; i += 16)
+	{
+		__m512 v = _mm512_loadu_ps(in + i);
+		lo = _mm512_min_ps(lo, v);
+		hi = _mm512_max_ps(hi, v);
+	}
+	vmin = _mm512_reduce_min_ps(lo);
+	vmax = _mm512_reduce_max_ps(hi);
+}
+
+#pragma GCC diagnostic pop
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Dispatch
+
+/**
+	@brief Function pointers for one instruction set level
+ */
+class SampleKernels
+{
+public:
+	void (*m_int8ToFloat)(const int8_t*, float*, size_t, float, float);
+	void (*m_int16ToFloat)(const int16_t*, float*, size_t, float, float);
+	void (*m_packedInt12ToFloat)(const uint8_t*, float*, size_t, float, float);
+	void (*m_deinterleaveInt8)(const int8_t*, int8_t* const*, size_t, size_t);
+	void (*m_deinterleaveInt16)(const int16_t*, int16_t* const*, size_t, size_t);
+	void (*m_extractDigitalBits)(const uint8_t*, uint8_t* const*, size_t);
+	void (*m_minMaxInt8)(const int8_t*, size_t, int8_t&, int8_t&);
+	void (*m_minMaxInt16)(const int16_t*, size_t, int16_t&, int16_t&);
+	void (*m_minMaxFloat)(const float*, size_t, float&, float&);
+	uint16_t (*m_deltaZigZagInt8)(const int8_t*, size_t, int8_t, uint16_t*);
+	uint16_t (*m_deltaZigZagInt16)(const int16_t*, size_t, int16_t, uint16_t*);
+};
+
+static const SampleKernels g_kernels[KERNEL_COUNT] =
+{
+	{
+		ConvertInt8ToFloat_Scalar,
+		ConvertInt16ToFloat_Scalar,
+		ConvertPackedInt12ToFloat_Scalar,
+		DeinterleaveInt8_Scalar,
+		DeinterleaveInt16_Scalar,
+		ExtractDigitalBits_Scalar,
+		MinMaxInt8_Scalar,
+		MinMaxInt16_Scalar,
+		MinMaxFloat_Scalar,
+		DeltaZigZagInt8_Scalar,
+		DeltaZigZagInt16_Scalar
+	},
+
+#ifdef HAVE_X86_KERNELS
+	{
+		ConvertInt8ToFloat_SSE41,
+		ConvertInt16ToFloat_SSE41,
+		ConvertPackedInt12ToFloat_SSE41,
+		DeinterleaveInt8_SSE41,
+		DeinterleaveInt16_SSE41,
+		ExtractDigitalBits_SSE41,
+		MinMaxInt8_SSE41,
+		MinMaxInt16_SSE41,
+		MinMaxFloat_SSE41,
+		DeltaZigZagInt8_SSE41,
+		DeltaZigZagInt16_SSE41
+	},
+	{
+		ConvertInt8ToFloat_AVX2,
+		ConvertInt16ToFloat_AVX2,
+		ConvertPackedInt12ToFloat_AVX2,
+		DeinterleaveInt8_AVX2,
+		DeinterleaveInt16_AVX2,
+		ExtractDigitalBits_AVX2,
+		MinMaxInt8_AVX2,
+		MinMaxInt16_AVX2,
+		MinMaxFloat_AVX2,
+		DeltaZigZagInt8_AVX2,
+		DeltaZigZagInt16_AVX2
+	},
+	{
+		ConvertInt8ToFloat_AVX512,
+		ConvertInt16ToFloat_AVX512,
+		ConvertPackedInt12ToFloat_AVX2,
+		DeinterleaveInt8_AVX2,
+		DeinterleaveInt16_AVX2,
+		ExtractDigitalBits_AVX512,
+		MinMaxInt8_AVX512,
+		MinMaxInt16_AVX512,
+		MinMaxFloat_AVX512,
+		DeltaZigZagInt8_AVX2,
+		DeltaZigZagInt16_AVX2
+	}
+#endif
+};
+
+static atomic<int> g_kernelLevel(-1);
+
+/**
+	@brief Returns the best kernel level the CPU supports
+ */
+SampleKernelLevel GetSupportedKernelLevel()
+{
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+		return KERNEL_AVX512;
+	if(__builtin_cpu_supports("avx2"))
+		return KERNEL_AVX2;
+	if(__builtin_cpu_supports("sse4.1"))
+		return KERNEL_SSE41;
+#endif
+	return KERNEL_SCALAR;
+}
+
+/**
+	@brief Returns the kernel level currently in use
+ */
+SampleKernelLevel GetKernelLevel()
+{
+	int level = g_kernelLevel.load(memory_order_relaxed);
+	if(level < 0)
+	{
+		level = GetSupportedKernelLevel();
+		g_kernelLevel.store(level, memory_order_relaxed);
+	}
+	return static_cast<SampleKernelLevel>(level);
+}
+
+/**
+	@brief Forces a specific kernel level (clamped to what the CPU supports), for benchmarking or testing
+ */
+void SetKernelLevel(SampleKernelLevel level)
+{
+	auto supported = GetSupportedKernelLevel();
+	if(level > supported)
+		level = supported;
+	g_kernelLevel.store(level, memory_order_relaxed);
+}
+
+const char* GetKernelLevelName(SampleKernelLevel level)
+{
+	switch(level)
+	{
+		case KERNEL_SCALAR:
+			return "scalar";
+		case KERNEL_SSE41:
+			return "sse4.1";
+		case KERNEL_AVX2:
+			return "avx2";
+		case KERNEL_AVX512:
+			return "avx512";
+		default:
+			return "unknown";
+	}
+}
+
+static inline const SampleKernels& Kernels()
+{
+	return g_kernels[GetKernelLevel()];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Public entry points
+
+/**
+	@brief Converts signed 8-bit ADC codes to voltages
+
+	@param in		Input codes
+	@param out		Output voltages
+	@param count	Number of samples
+	@param gain		Volts per code
+	@param offset	Volts added after scaling
+ */
+void ConvertInt8ToFloat(const int8_t* in, float* out, size_t count, float gain, float offset)
+{
+	Kernels().m_int8ToFloat(in, out, count, gain, offset);
+}
+
+/**
+	@brief Converts signed 16-bit ADC codes to voltages (see ConvertInt8ToFloat())
+ */
+void ConvertInt16ToFloat(const int16_t* in, float* out, size_t count, float gain, float offset)
+{
+	Kernels().m_int16ToFloat(in, out, count, gain, offset);
+}
+
+/**
+	@brief Converts packed signed 12-bit ADC codes (two samples in three bytes, little endian) to voltages
+
+	@param in		Input data, (count*3 + 1)/2 bytes
+	@param out		Output voltages
+	@param count	Number of samples
+	@param gain		Volts per code
+	@param offset	Volts added after scaling
+ */
+void ConvertPackedInt12ToFloat(const uint8_t* in, float* out, size_t count, float gain, float offset)
+{
+	Kernels().m_packedInt12ToFloat(in, out, count, gain, offset);
+}
+
+/**
+	@brief Splits interleaved 8-bit samples into one buffer per channel
+
+	@param in		Input samples, count*channels values
+	@param out		Output buffers, one per channel, count values each
+	@param channels	Number of channels (2 and 4 have vectorized paths)
+	@param count	Number of samples per channel
+ */
+void DeinterleaveInt8(const int8_t* in, int8_t* const* out, size_t channels, size_t count)
+{
+	Kernels().m_deinterleaveInt8(in, out, channels, count);
+}
+
+/**
+	@brief Splits interleaved 16-bit samples into one buffer per channel (see DeinterleaveInt8())
+ */
+void DeinterleaveInt16(const int16_t* in, int16_t* const* out, size_t channels, size_t count)
+{
+	Kernels().m_deinterleaveInt16(in, out, channels, count);
+}
+
+/**
+	@brief Splits packed digital samples (bit N of each byte is channel N) into one byte per sample per channel
+
+	@param in		Input samples
+	@param out		Eight output buffers, one per bit. Null entries are skipped.
+	@param count	Number of samples
+ */
+void ExtractDigitalBits(const uint8_t* in, uint8_t* const* out, size_t count)
+{
+	Kernels().m_extractDigitalBits(in, out, count);
+}
+
+/**
+	@brief Finds the smallest and largest of a block of 8-bit samples
+
+	@param in		Input samples
+	@param count	Number of samples (must be at least one)
+	@param vmin		Set to the smallest sample
+	@param vmax		Set to the largest sample
+ */
+void MinMaxInt8(const int8_t* in, size_t count, int8_t& vmin, int8_t& vmax)
+{
+	Kernels().m_minMaxInt8(in, count, vmin, vmax);
+}
+
+/**
+	@brief Finds the smallest and largest of a block of 16-bit samples (see MinMaxInt8())
+ */
+void MinMaxInt16(const int16_t* in, size_t count, int16_t& vmin, int16_t& vmax)
+{
+	Kernels().m_minMaxInt16(in, count, vmin, vmax);
+}
+
+/**
+	@brief Finds the smallest and largest of a block of floating point samples (see MinMaxInt8())
+ */
+void MinMaxFloat(const float* in, size_t count, float& vmin, float& vmax)
+{
+	Kernels().m_minMaxFloat(in, count, vmin, vmax);
+}
+
+/**
+	@brief Runs a min/max kernel over each bucket of a waveform (see DecimateMinMaxInt8())
+
+	Buckets too short to fill an SSE vector (16 bytes, or 8 samples for int8, which the SSE kernel loads as two
+	overlapping halves) are reduced inline: the vector kernels would only fall back to the scalar loop for them, and
+	calling through the kernel pointer (and each level's fallback to the next) for a handful of samples costs more
+	than the reduction itself.
+ */
+template<class T>
+static void DecimateMinMax(const T* in, size_t count, T* out, size_t buckets, void (*kernel)(const T*, size_t, T&, T&))
+{
+	const size_t shortBucket = min<size_t>(8, 16 / sizeof(T));
+
+	size_t start = 0;
+	for(size_t i=0; i<buckets; i++)
+	{
+		size_t end = (i+1) * count / buckets;
+		if(end - start < shortBucket)
+			MinMaxRange(in + start, end - start, out[i*2], out[i*2 + 1]);
+		else
+			kernel(in + start, end - start, out[i*2], out[i*2 + 1]);
+		start = end;
+	}
+}
+
+/**
+	@brief Reduces a waveform to a min/max envelope for display (peak detect decimation)
+
+	Bucket i covers samples [i*count/buckets, (i+1)*count/buckets), so buckets differ in size by at most one sample
+	and no sample is skipped.
+
+	@param in		Input samples
+	@param count	Number of samples
+	@param out		Output envelope, 2*buckets values: out[2*i] is the minimum of bucket i and out[2*i+1] the maximum
+	@param buckets	Number of buckets (at most count)
+ */
+void DecimateMinMaxInt8(const int8_t* in, size_t count, int8_t* out, size_t buckets)
+{
+	DecimateMinMax(in, count, out, buckets, Kernels().m_minMaxInt8);
+}
+
+/**
+	@brief Reduces a waveform of 16-bit samples to a min/max envelope (see DecimateMinMaxInt8())
+ */
+void DecimateMinMaxInt16(const int16_t* in, size_t count, int16_t* out, size_t buckets)
+{
+	DecimateMinMax(in, count, out, buckets, Kernels().m_minMaxInt16);
+}
+
+/**
+	@brief Reduces a waveform of floating point samples to a min/max envelope (see DecimateMinMaxInt8())
+ */
+void DecimateMinMaxFloat(const float* in, size_t count, float* out, size_t buckets)
+{
+	DecimateMinMax(in, count, out, buckets, Kernels().m_minMaxFloat);
+}
+
+/**
+	@brief Replaces each 8-bit sample by its difference from the previous one, zigzag coded
+
+	Differences wrap at 8 bits. Zigzag coding maps 0, -1, 1, -2, 2 ... to 0, 1, 2, 3, 4 ... so small changes in either
+	direction give small codes, which is what SampleCompression packs.
+
+	@param in		Input samples
+	@param count	Number of samples
+	@param prev		Sample before in[0]
+	@param out		Output codes (0 to 255)
+
+	@return The OR of all codes, for finding the width needed to hold them
+ */
+uint16_t DeltaZigZagInt8(const int8_t* in, size_t count, int8_t prev, uint16_t* out)
+{
+	return Kernels().m_deltaZigZagInt8(in, count, prev, out);
+}
+
+/**
+	@brief Delta and zigzag codes 16-bit samples (see DeltaZigZagInt8())
+ */
+uint16_t DeltaZigZagInt16(const int16_t* in, size_t count, int16_t prev, uint16_t* out)
+{
+	return Kernels().m_deltaZigZagInt16(in, count, prev, out);
+}
@@ -0,0 +1,81 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef SampleConversion_h
+#define SampleConversion_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+	@brief Instruction set levels for the sample conversion kernels, in increasing order of capability
+ */
+enum SampleKernelLevel
+{
+	KERNEL_SCALAR,
+	KERNEL_SSE41,
+	KERNEL_AVX2,
+	KERNEL_AVX512,
+
+	KERNEL_COUNT
+};
+
+//Kernel selection. The best level the CPU supports is used unless overridden (for benchmarking).
+SampleKernelLevel GetSupportedKernelLevel();
+SampleKernelLevel GetKernelLevel();
+void SetKernelLevel(SampleKernelLevel level);
+const char* GetKernelLevelName(SampleKernelLevel level);
+
+//ADC code to voltage: out[i] = in[i]*gain + offset
+void ConvertInt8ToFloat(const int8_t* in, float* out, size_t count, float gain, float offset);
+void ConvertInt16ToFloat(const int16_t* in, float* out, size_t count, float gain, float offset);
+void ConvertPackedInt12ToFloat(const uint8_t* in, float* out, size_t count, float gain, float offset);
+
+//Interleaved (c0 c1 c2 ... c0 c1 c2 ...) to one buffer per channel
+void DeinterleaveInt8(const int8_t* in, int8_t* const* out, size_t channels, size_t count);
+void DeinterleaveInt16(const int16_t* in, int16_t* const* out, size_t channels, size_t count);
+
+//Packed digital samples (one bit per channel) to one bool per sample per channel
+void ExtractDigitalBits(const uint8_t* in, uint8_t* const* out, size_t count);
+
+//Smallest and largest sample of a block
+void MinMaxInt8(const int8_t* in, size_t count, int8_t& vmin, int8_t& vmax);
+void MinMaxInt16(const int16_t* in, size_t count, int16_t& vmin, int16_t& vmax);
+void MinMaxFloat(const float* in, size_t count, float& vmin, float& vmax);
+
+//Peak detect decimation to interleaved (min, max) pairs, one per bucket
+void DecimateMinMaxInt8(const int8_t* in, size_t count, int8_t* out, size_t buckets);
+void DecimateMinMaxInt16(const int16_t* in, size_t count, int16_t* out, size_t buckets);
+void DecimateMinMaxFloat(const float* in, size_t count, float* out, size_t buckets);
+
+//Difference from the previous sample, zigzag coded, returning the OR of all codes
+uint16_t DeltaZigZagInt8(const int8_t* in, size_t count, int8_t prev, uint16_t* out);
+uint16_t DeltaZigZagInt16(const int16_t* in, size_t count, int16_t prev, uint16_t* out);
+
+#endif
@@ -0,0 +1,382 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#include "WaveformBufferPool.h"
+#include "SCPIThreading.h"
+#include <log.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+//Huge page size assumed when rounding buffer sizes for MAP_HUGETLB
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+//Stride used to fault in pages of newly allocated buffers
+#define PAGE_SIZE_MIN 4096
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// WaveformBuffer
+
+WaveformBuffer::WaveformBuffer(WaveformBufferPool* pool, void* data, size_t size, bool hugePages, uint32_t generation)
+	: m_pool(pool)
+	, m_data(data)
+	, m_size(size)
+	, m_hugePages(hugePages)
+	, m_generation(generation)
+	, m_refcount(0)
+	, m_next(nullptr)
+{
+}
+
+WaveformBuffer::~WaveformBuffer()
+{
+}
+
+/**
+	@brief Drops a reference, returning the buffer to its pool if that was the last one
+ */
+void WaveformBuffer::Release()
+{
+	if(m_refcount.fetch_sub(1, memory_order_acq_rel) == 1)
+		m_pool->OnBufferReleased(this);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+/**
+	@brief Creates an empty pool. Call Configure() to set the buffer geometry.
+
+	@param alignment	Alignment of each buffer, in bytes (power of two)
+	@param hugePages	True to back buffers with huge pages where possible
+ */
+WaveformBufferPool::WaveformBufferPool(size_t alignment, bool hugePages)
+	: m_alignment(alignment)
+	, m_hugePages(hugePages)
+	, m_numaNode(-1)
+	, m_bufferSize(0)
+	, m_bufferCount(0)
+	, m_generation(0)
+	, m_freeList(nullptr)
+	, m_geometryChanged(false)
+	, m_requestedBufferSize(0)
+	, m_requestedBufferCount(0)
+	, m_regionGeneration(0)
+	, m_missCount(0)
+	, m_outstanding(0)
+{
+}
+
+WaveformBufferPool::~WaveformBufferPool()
+{
+	if(m_outstanding.load() != 0)
+		LogWarning("WaveformBufferPool: destroyed with %ld buffers still in use\n", (long)m_outstanding.load());
+	FreeAll();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Geometry
+
+/**
+	@brief Sets the geometry from the capture configuration
+
+	@param depth				Memory depth, in samples
+	@param bytesPerSample		Size of one sample
+	@param channels				Number of enabled channels
+	@param buffersPerChannel	Number of buffers to preallocate for each channel (captures in flight at once)
+ */
+void WaveformBufferPool::Configure(size_t depth, size_t bytesPerSample, size_t channels, size_t buffersPerChannel)
+{
+	Configure(depth * bytesPerSample, channels * buffersPerChannel);
+}
+
+/**
+	@brief Sets the size and number of buffers to preallocate
+
+	May be called from any thread. Nothing is reallocated unless the geometry actually changed, and the change takes
+	effect on the next call to Allocate().
+ */
+void WaveformBufferPool::Configure(size_t bufferSize, size_t count)
+{
+	lock_guard<mutex> lock(m_geometryMutex);
+	if( (bufferSize == m_requestedBufferSize) && (count == m_requestedBufferCount) )
+		return;
+
+	m_requestedBufferSize = bufferSize;
+	m_requestedBufferCount = count;
+	m_geometryChanged = true;
+}
+
+/**
+	@brief Frees the old buffers and preallocates new ones to match the requested geometry
+ */
+void WaveformBufferPool::ApplyGeometry()
+{
+	{
+		lock_guard<mutex> lock(m_geometryMutex);
+		m_bufferSize = m_requestedBufferSize;
+		m_bufferCount = m_requestedBufferCount;
+		m_geometryChanged = false;
+	}
+
+	//Anything still in use gets freed instead of recycled when it comes back
+	m_generation ++;
+	FreeAll();
+
+	vector<pair<void*, size_t>> regions;
+	if(m_bufferSize != 0)
+	{
+		LogVerbose("WaveformBufferPool: allocating %zu buffers of %zu bytes\n", m_bufferCount, m_bufferSize);
+		for(size_t i=0; i<m_bufferCount; i++)
+		{
+			auto buf = CreateBuffer();
+			if(!buf)
+				break;
+			regions.push_back(pair<void*, size_t>(buf->m_data, buf->m_size));
+			Recycle(buf);
+		}
+	}
+
+	lock_guard<mutex> lock(m_geometryMutex);
+	m_regions.swap(regions);
+	m_regionGeneration = m_generation.load(memory_order_relaxed);
+}
+
+/**
+	@brief Gets the location of every buffer preallocated under the current geometry
+
+	These stay allocated until the geometry changes, so they can be registered with the kernel once (for example as
+	io_uring fixed buffers) rather than on every send. Buffers the pool grows by after a miss aren't included.
+
+	May be called from any thread.
+
+	@param regions	Address and size of each buffer
+
+	@return The generation the regions belong to. Once GetGeneration() returns something else they may be freed.
+ */
+uint32_t WaveformBufferPool::GetRegions(vector<pair<void*, size_t>>& regions)
+{
+	lock_guard<mutex> lock(m_geometryMutex);
+	regions = m_regions;
+	return m_regionGeneration;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Allocation
+
+/**
+	@brief Gets a buffer from the pool, with one reference held by the caller
+
+	Must not be called from more than one thread at a time.
+
+	@return The buffer, or nullptr if no geometry is configured or memory is exhausted
+ */
+WaveformBuffer* WaveformBufferPool::Allocate()
+{
+	if(m_geometryChanged.load(memory_order_acquire))
+		ApplyGeometry();
+
+	if(m_bufferSize == 0)
+		return nullptr;
+
+	auto buf = PopFreeList();
+	if(!buf)
+	{
+		//Everything is still in flight. Grow the pool rather than fail.
+		m_missCount.fetch_add(1, memory_order_relaxed);
+		buf = CreateBuffer();
+		if(!buf)
+			return nullptr;
+	}
+
+	buf->m_refcount.store(1, memory_order_relaxed);
+	m_outstanding.fetch_add(1, memory_order_relaxed);
+	return buf;
+}
+
+/**
+	@brief Takes a buffer from the free list, freeing any left over from an old geometry
+
+	The free list has a single consumer (this function), so it is not subject to the ABA problem.
+ */
+WaveformBuffer* WaveformBufferPool::PopFreeList()
+{
+	uint32_t generation = m_generation.load(memory_order_relaxed);
+	while(true)
+	{
+		auto head = m_freeList.load(memory_order_acquire);
+		if(!head)
+			return nullptr;
+		if(!m_freeList.compare_exchange_weak(head, head->m_next, memory_order_acq_rel))
+			continue;
+
+		if(head->m_generation == generation)
+			return head;
+		DestroyBuffer(head);
+	}
+}
+
+/**
+	@brief Called when the last reference to a buffer from Allocate() is released. May be called from any thread.
+ */
+void WaveformBufferPool::OnBufferReleased(WaveformBuffer* buf)
+{
+	m_outstanding.fetch_sub(1, memory_order_relaxed);
+	Recycle(buf);
+}
+
+/**
+	@brief Puts a buffer on the free list, or frees it if it's left over from an old geometry
+ */
+void WaveformBufferPool::Recycle(WaveformBuffer* buf)
+{
+	if(buf->m_generation != m_generation.load(memory_order_acquire))
+	{
+		DestroyBuffer(buf);
+		return;
+	}
+
+	auto head = m_freeList.load(memory_order_relaxed);
+	do
+	{
+		buf->m_next = head;
+	} while(!m_freeList.compare_exchange_weak(head, buf, memory_order_release, memory_order_relaxed));
+}
+
+/**
+	@brief Frees every buffer in the free list
+ */
+void WaveformBufferPool::FreeAll()
+{
+	auto buf = m_freeList.exchange(nullptr, memory_order_acq_rel);
+	while(buf)
+	{
+		auto next = buf->m_next;
+		DestroyBuffer(buf);
+		buf = next;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Memory management
+
+/**
+	@brief Allocates a new buffer for the current geometry and faults in its pages
+ */
+WaveformBuffer* WaveformBufferPool::CreateBuffer()
+{
+	size_t size = m_bufferSize;
+	void* data = nullptr;
+	bool huge = false;
+	bool bind = (m_numaNode >= 0);
+
+#ifdef _WIN32
+	data = _aligned_malloc(size, m_alignment);
+#else
+
+#ifdef MAP_HUGETLB
+	//Explicit huge pages if the system has some reserved. MAP_POPULATE faults them all in now, unless they have to be
+	//bound to a NUMA node first.
+	if(m_hugePages)
+	{
+		size_t hugeSize = (size + HUGE_PAGE_SIZE - 1) & ~static_cast<size_t>(HUGE_PAGE_SIZE - 1);
+		data = mmap(nullptr, hugeSize, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (bind ? 0 : MAP_POPULATE), -1, 0);
+		if(data == MAP_FAILED)
+			data = nullptr;
+		else
+			huge = true;
+	}
+#endif
+
+	if(!data)
+	{
+		size_t alignment = m_alignment;
+		if(m_hugePages)
+			alignment = max(alignment, static_cast<size_t>(HUGE_PAGE_SIZE));
+		if(bind)
+			alignment = max(alignment, static_cast<size_t>(PAGE_SIZE_MIN));
+		if(0 != posix_memalign(&data, alignment, size))
+			data = nullptr;
+
+#ifdef MADV_HUGEPAGE
+		//Fall back to transparent huge pages
+		if(data && m_hugePages)
+			madvise(data, size, MADV_HUGEPAGE);
+#endif
+	}
+
+#endif
+
+	if(!data)
+	{
+		LogError("WaveformBufferPool: failed to allocate %zu byte buffer\n", size);
+		return nullptr;
+	}
+
+	if(bind)
+		SCPIThreading::BindMemory(data, size, m_numaNode);
+
+	//Touch every page now so capturing into the buffer doesn't page fault
+	if(!huge || bind)
+	{
+		auto p = reinterpret_cast<volatile uint8_t*>(data);
+		for(size_t i=0; i<size; i += PAGE_SIZE_MIN)
+			p[i] = 0;
+	}
+
+	return new WaveformBuffer(this, data, size, huge, m_generation.load(memory_order_relaxed));
+}
+
+/**
+	@brief Frees a buffer's memory and the buffer object itself
+ */
+void WaveformBufferPool::DestroyBuffer(WaveformBuffer* buf)
+{
+#ifdef _WIN32
+	_aligned_free(buf->m_data);
+#else
+	if(buf->m_hugePages)
+	{
+		size_t hugeSize = (buf->m_size + HUGE_PAGE_SIZE - 1) & ~static_cast<size_t>(HUGE_PAGE_SIZE - 1);
+		munmap(buf->m_data, hugeSize);
+	}
+	else
+		free(buf->m_data);
+#endif
+
+	delete buf;
+}
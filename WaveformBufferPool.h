@@ -0,0 +1,197 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef WaveformBufferPool_h
+#define WaveformBufferPool_h
+
+#include <atomic>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+class WaveformBufferPool;
+
+/**
+	@brief A reference counted block of sample memory from a WaveformBufferPool
+
+	The buffer goes back to the pool when the last reference is released, so a buffer still being sent (for example,
+	held by a WaveformStreamer zero-copy send) is never handed back to the driver.
+ */
+class WaveformBuffer
+{
+public:
+	///@brief Returns a pointer to the sample memory
+	void* GetData() const
+	{ return m_data; }
+
+	///@brief Returns the size of the buffer in bytes
+	size_t GetSize() const
+	{ return m_size; }
+
+	void AddRef()
+	{ m_refcount.fetch_add(1, std::memory_order_relaxed); }
+
+	void Release();
+
+protected:
+	friend class WaveformBufferPool;
+
+	WaveformBuffer(WaveformBufferPool* pool, void* data, size_t size, bool hugePages, uint32_t generation);
+	~WaveformBuffer();
+
+	///@brief The pool we came from
+	WaveformBufferPool* m_pool;
+
+	///@brief Sample memory
+	void* m_data;
+
+	///@brief Size of the sample memory, in bytes
+	size_t m_size;
+
+	///@brief True if m_data was allocated with mmap(MAP_HUGETLB)
+	bool m_hugePages;
+
+	///@brief Pool geometry generation this buffer was allocated for
+	uint32_t m_generation;
+
+	///@brief Number of outstanding references
+	std::atomic<int> m_refcount;
+
+	///@brief Next buffer in the pool's free list
+	WaveformBuffer* m_next;
+};
+
+/**
+	@brief Pool of preallocated, aligned sample buffers, sized for the current capture configuration
+
+	Buffers are allocated (and their pages faulted in) up front whenever the geometry changes, and recycled through a
+	lock-free free list, so capturing a waveform never touches the allocator.
+
+	Allocate() must only be called from one thread at a time (normally the acquisition thread), and is where a
+	geometry change requested by Configure() actually takes effect. Buffers may be released from any thread.
+	Buffers allocated under an old geometry are freed rather than recycled when their last reference goes away.
+ */
+class WaveformBufferPool
+{
+public:
+	WaveformBufferPool(size_t alignment = 64, bool hugePages = false);
+	virtual ~WaveformBufferPool();
+
+	void Configure(size_t depth, size_t bytesPerSample, size_t channels, size_t buffersPerChannel);
+	void Configure(size_t bufferSize, size_t count);
+
+	WaveformBuffer* Allocate();
+
+	/**
+		@brief Places buffers created from now on in a NUMA node's memory (-1 for the default placement)
+
+		Call before Configure() so the preallocated buffers are placed too. Only has an effect on Linux.
+	 */
+	void SetNumaNode(int node)
+	{ m_numaNode = node; }
+
+	///@brief Returns the size of each buffer, in bytes
+	size_t GetBufferSize() const
+	{ return m_bufferSize; }
+
+	///@brief Returns the number of times Allocate() found the free list empty and had to allocate a new buffer
+	uint64_t GetMissCount() const
+	{ return m_missCount.load(std::memory_order_relaxed); }
+
+	///@brief Returns the number of buffers currently handed out
+	int64_t GetOutstandingCount() const
+	{ return m_outstanding.load(std::memory_order_relaxed); }
+
+	/**
+		@brief Returns the current geometry generation
+
+		Changes whenever the preallocated buffers are replaced, so callers caching GetRegions() know to refresh.
+	 */
+	uint32_t GetGeneration() const
+	{ return m_generation.load(std::memory_order_acquire); }
+
+	uint32_t GetRegions(std::vector<std::pair<void*, size_t>>& regions);
+
+protected:
+	friend class WaveformBuffer;
+
+	void ApplyGeometry();
+	WaveformBuffer* CreateBuffer();
+	void DestroyBuffer(WaveformBuffer* buf);
+	void OnBufferReleased(WaveformBuffer* buf);
+	void Recycle(WaveformBuffer* buf);
+	WaveformBuffer* PopFreeList();
+	void FreeAll();
+
+	///@brief Alignment of every buffer, in bytes
+	size_t m_alignment;
+
+	///@brief True to back buffers with huge pages
+	bool m_hugePages;
+
+	///@brief NUMA node to place buffers on, or -1 for the default placement
+	int m_numaNode;
+
+	///@brief Size of each buffer under the current geometry
+	size_t m_bufferSize;
+
+	///@brief Number of buffers preallocated under the current geometry
+	size_t m_bufferCount;
+
+	///@brief Current geometry generation. Buffers from other generations are freed on release.
+	std::atomic<uint32_t> m_generation;
+
+	///@brief Head of the free list (pushed from any thread, popped only by Allocate())
+	std::atomic<WaveformBuffer*> m_freeList;
+
+	///@brief Set by Configure() when the geometry needs to change
+	std::atomic<bool> m_geometryChanged;
+
+	///@brief Mutex protecting the requested geometry
+	std::mutex m_geometryMutex;
+
+	///@brief Requested buffer size
+	size_t m_requestedBufferSize;
+
+	///@brief Requested buffer count
+	size_t m_requestedBufferCount;
+
+	///@brief Address and size of each buffer preallocated under the current geometry
+	std::vector<std::pair<void*, size_t>> m_regions;
+
+	///@brief Generation m_regions belongs to
+	uint32_t m_regionGeneration;
+
+	std::atomic<uint64_t> m_missCount;
+	std::atomic<int64_t> m_outstanding;
+};
+
+#endif
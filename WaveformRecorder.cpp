@@ -0,0 +1,438 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#include "WaveformRecorder.h"
+#include "SCPIStatistics.h"
+#include <log.h>
+#include <string.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+//Alignment of the data area and of each waveform's samples within it
+#define RECORD_ALIGNMENT 4096
+
+//Index slots per segment: one per this many bytes of segment, but at least RECORD_MIN_INDEX
+#define RECORD_BYTES_PER_INDEX 16384
+#define RECORD_MIN_INDEX 64
+
+//Segment files are numbered with three digits
+#define RECORD_MAX_SEGMENTS 1000
+
+//How long the writer thread sleeps if it misses a wakeup
+#define RECORD_POLL_MS 10
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+WaveformRecorder::WaveformRecorder()
+	: m_running(false)
+	, m_submitting(0)
+	, m_stopping(false)
+	, m_segmentCount(0)
+	, m_segmentSize(0)
+	, m_indexCapacity(0)
+	, m_dataOffset(0)
+	, m_segment(0)
+	, m_map(nullptr)
+	, m_writtenCount(0)
+	, m_writtenBytes(0)
+	, m_oversizeCount(0)
+	, m_errorCount(0)
+	, m_generation(0)
+	, m_startTime(0)
+	, m_stopTime(0)
+	, m_queuedCount(0)
+	, m_completedCount(0)
+{
+}
+
+WaveformRecorder::~WaveformRecorder()
+{
+	Stop();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Starting and stopping
+
+/**
+	@brief Creates the segment files and starts recording
+
+	Must not be called while a recording is in progress.
+
+	@param path			Base path of the segment files (".000", ".001", ... are appended). Existing files are replaced.
+	@param segmentSize	Size of each segment file in bytes (the largest waveform that can be recorded is a little
+						smaller than this)
+	@param segmentCount	Number of segment files in the ring
+	@param queueDepth	Number of waveforms that can be waiting for the writer thread before new ones are dropped
+ */
+bool WaveformRecorder::Start(const string& path, size_t segmentSize, size_t segmentCount, size_t queueDepth)
+{
+	if(IsRunning())
+	{
+		LogWarning("WaveformRecorder: already recording\n");
+		return false;
+	}
+
+#ifdef _WIN32
+	(void)segmentSize;
+	(void)segmentCount;
+	(void)queueDepth;
+	LogError("WaveformRecorder: recording is not supported on Windows (%s)\n", path.c_str());
+	return false;
+#else
+	m_indexCapacity = max<size_t>(segmentSize / RECORD_BYTES_PER_INDEX, RECORD_MIN_INDEX);
+	size_t indexEnd = sizeof(WaveformRecordSegmentHeader) + m_indexCapacity * sizeof(WaveformRecordIndexEntry);
+	m_dataOffset = (indexEnd + RECORD_ALIGNMENT - 1) / RECORD_ALIGNMENT * RECORD_ALIGNMENT;
+	m_segmentSize = segmentSize / RECORD_ALIGNMENT * RECORD_ALIGNMENT;
+	if( (segmentCount == 0) || (segmentCount > RECORD_MAX_SEGMENTS) || (m_segmentSize <= m_dataOffset) )
+	{
+		LogWarning("WaveformRecorder: can't record to a ring of %zu segments of %zu bytes\n",
+			segmentCount, segmentSize);
+		return false;
+	}
+
+	//Create every file at full size now, so we find out about a full disk before recording rather than during
+	m_segmentCount = segmentCount;
+	m_fds.reset(new int[segmentCount]);
+	for(size_t i=0; i<segmentCount; i++)
+		m_fds[i] = -1;
+	for(size_t i=0; i<segmentCount; i++)
+	{
+		char suffix[24];
+		snprintf(suffix, sizeof(suffix), ".%03zu", i);
+		string fname = path + suffix;
+
+		m_fds[i] = open(fname.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if(m_fds[i] < 0)
+		{
+			LogError("WaveformRecorder: couldn't create %s (%s)\n", fname.c_str(), strerror(errno));
+			CloseFiles();
+			return false;
+		}
+
+		int err = EOPNOTSUPP;
+#ifdef __linux__
+		err = posix_fallocate(m_fds[i], 0, m_segmentSize);
+#endif
+		//Not every filesystem can preallocate; a sparse file is the best we can do there
+		if( (err == EOPNOTSUPP) || (err == EINVAL) )
+			err = (0 == ftruncate(m_fds[i], m_segmentSize)) ? 0 : errno;
+		if(err != 0)
+		{
+			LogError("WaveformRecorder: couldn't allocate %zu bytes for %s (%s)\n",
+				m_segmentSize, fname.c_str(), strerror(err));
+			CloseFiles();
+			return false;
+		}
+	}
+
+	m_writtenCount = 0;
+	m_writtenBytes = 0;
+	m_oversizeCount = 0;
+	m_errorCount = 0;
+	m_generation = 0;
+	if(!OpenSegment(0))
+	{
+		CloseFiles();
+		return false;
+	}
+
+	m_queue = make_unique<WaveformRing>(queueDepth, WaveformRing::OVERFLOW_LOSSLESS);
+	m_stopping = false;
+	m_startTime = SCPIStatistics::Now();
+	m_stopTime = 0;
+	m_writerThread = make_unique<thread>(&WaveformRecorder::WriterThreadProc, this);
+	m_running.store(true, memory_order_release);
+
+	LogNotice("Recording waveforms to %zu segments of %zu bytes at %s.*\n", segmentCount, m_segmentSize, path.c_str());
+	return true;
+#endif
+}
+
+/**
+	@brief Stops recording, after writing every waveform already submitted
+ */
+void WaveformRecorder::Stop()
+{
+	if(!IsRunning())
+		return;
+
+	//Once no Submit() is in flight, nothing more can be queued
+	m_running.store(false, memory_order_seq_cst);
+	while(m_submitting.load(memory_order_seq_cst) != 0)
+		this_thread::yield();
+
+	{
+		lock_guard<mutex> lock(m_wakeMutex);
+		m_stopping = true;
+	}
+	m_wakeCond.notify_one();
+	m_writerThread->join();
+	m_writerThread.reset();
+	m_stopTime = SCPIStatistics::Now();
+
+	CloseSegment();
+	CloseFiles();
+
+	LogNotice("Recording stopped: %lu waveforms, %lu bytes, %lu dropped\n",
+		(unsigned long)GetWrittenCount(), (unsigned long)GetWrittenBytes(), (unsigned long)GetDropCount());
+}
+
+/**
+	@brief Waits until every waveform submitted so far has been written and handed back through the completion
+	callback, without stopping the recording
+
+	Call before freeing memory that submitted waveforms may still point to (for example a buffer pool).
+ */
+void WaveformRecorder::Flush()
+{
+	uint64_t target = m_queuedCount.load(memory_order_acquire);
+	while(m_completedCount.load(memory_order_acquire) < target)
+	{
+		m_wakeCond.notify_one();
+		this_thread::sleep_for(chrono::milliseconds(1));
+	}
+}
+
+void WaveformRecorder::CloseFiles()
+{
+#ifndef _WIN32
+	for(size_t i=0; i<m_segmentCount; i++)
+	{
+		if(m_fds[i] >= 0)
+			close(m_fds[i]);
+	}
+#endif
+	m_fds.reset();
+	m_segmentCount = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Producer side
+
+/**
+	@brief Queues a waveform for recording. Never waits for the writer thread.
+
+	May be called from several threads (every session's acquisition path submits to the same recorder): the queue
+	has a single producer, so concurrent calls take turns pushing. If this returns true, the sample memory must stay
+	valid until the completion callback is called with wfm.m_cookie; otherwise it's still the caller's.
+
+	@return True if the waveform was queued, false if not recording or the queue was full
+ */
+bool WaveformRecorder::Submit(const WaveformDescriptor& wfm)
+{
+	m_submitting.fetch_add(1, memory_order_seq_cst);
+
+	bool queued = false;
+	if(m_running.load(memory_order_seq_cst))
+	{
+		lock_guard<mutex> lock(m_submitMutex);
+		queued = m_queue->Push(wfm);
+	}
+	if(queued)
+		m_queuedCount.fetch_add(1, memory_order_release);
+
+	m_submitting.fetch_sub(1, memory_order_release);
+
+	if(queued)
+		m_wakeCond.notify_one();
+	return queued;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Writer thread
+
+void WaveformRecorder::WriterThreadProc()
+{
+	while(true)
+	{
+		WaveformDescriptor wfm;
+		if(m_queue->Pop(wfm))
+		{
+			Write(wfm);
+			if(m_callback)
+				m_callback(wfm.m_cookie);
+			m_completedCount.fetch_add(1, memory_order_release);
+			continue;
+		}
+
+		//Submit() doesn't take the mutex, so a wakeup can slip past; poll as a backstop
+		unique_lock<mutex> lock(m_wakeMutex);
+		if(m_stopping && (m_queue->GetOccupancy() == 0))
+			return;
+		m_wakeCond.wait_for(lock, chrono::milliseconds(RECORD_POLL_MS));
+	}
+}
+
+/**
+	@brief Copies one waveform into the current segment, moving on to the next segment if it doesn't fit
+
+	@return False if the waveform couldn't be written (too big for a segment, or the segment couldn't be mapped)
+ */
+bool WaveformRecorder::Write(const WaveformDescriptor& wfm)
+{
+	size_t length = wfm.m_sampleCount * wfm.m_bytesPerSample;
+	size_t padded = (length + RECORD_ALIGNMENT - 1) / RECORD_ALIGNMENT * RECORD_ALIGNMENT;
+	if(padded > m_segmentSize - m_dataOffset)
+	{
+		m_oversizeCount.fetch_add(1, memory_order_relaxed);
+		return false;
+	}
+
+	if(!m_map)
+	{
+		m_errorCount.fetch_add(1, memory_order_relaxed);
+		return false;
+	}
+
+	auto header = reinterpret_cast<WaveformRecordSegmentHeader*>(m_map);
+	if( (header->m_indexCount == m_indexCapacity) || (header->m_dataUsed + padded > header->m_dataSize) )
+	{
+		if(!OpenSegment((m_segment + 1) % m_segmentCount))
+		{
+			m_errorCount.fetch_add(1, memory_order_relaxed);
+			return false;
+		}
+		header = reinterpret_cast<WaveformRecordSegmentHeader*>(m_map);
+	}
+
+	auto& entry = reinterpret_cast<WaveformRecordIndexEntry*>(m_map + sizeof(WaveformRecordSegmentHeader))
+		[header->m_indexCount];
+	entry.m_timestamp = wfm.m_timestamp;
+	entry.m_sequence = wfm.m_sequence;
+	entry.m_offset = m_dataOffset + header->m_dataUsed;
+	entry.m_length = length;
+	entry.m_sampleCount = wfm.m_sampleCount;
+	entry.m_sampleRate = wfm.m_sampleRate;
+	entry.m_triggerPhase = wfm.m_triggerPhase;
+	entry.m_channel = wfm.m_channel;
+	entry.m_encoding = wfm.m_encoding;
+	entry.m_bytesPerSample = wfm.m_bytesPerSample;
+	memset(entry.m_reserved, 0, sizeof(entry.m_reserved));
+	memcpy(m_map + entry.m_offset, wfm.m_samples, length);
+
+	//Publish the entry only once it and its samples are in place
+	atomic_signal_fence(memory_order_release);
+	header->m_dataUsed += padded;
+	header->m_indexCount ++;
+
+	m_writtenCount.fetch_add(1, memory_order_relaxed);
+	m_writtenBytes.fetch_add(length, memory_order_relaxed);
+	return true;
+}
+
+/**
+	@brief Finishes the current segment and maps a fresh one, overwriting whatever it held
+ */
+bool WaveformRecorder::OpenSegment(size_t index)
+{
+	CloseSegment();
+
+#ifdef _WIN32
+	(void)index;
+	return false;
+#else
+	void* map = mmap(nullptr, m_segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_fds[index], 0);
+	if(map == MAP_FAILED)
+	{
+		LogError("WaveformRecorder: couldn't map segment %zu (%s)\n", index, strerror(errno));
+		return false;
+	}
+	madvise(map, m_segmentSize, MADV_SEQUENTIAL);
+
+	m_map = reinterpret_cast<uint8_t*>(map);
+	m_segment = index;
+
+	//Invalidate the old contents before anything else, so a crash can't leave a new header on a stale index
+	auto header = reinterpret_cast<WaveformRecordSegmentHeader*>(m_map);
+	header->m_indexCount = 0;
+	header->m_dataUsed = 0;
+	atomic_signal_fence(memory_order_release);
+
+	header->m_magic = WAVEFORM_RECORD_MAGIC;
+	header->m_version = WAVEFORM_RECORD_VERSION;
+	header->m_indexCapacity = m_indexCapacity;
+	header->m_generation = m_generation.fetch_add(1, memory_order_relaxed) + 1;
+	header->m_dataOffset = m_dataOffset;
+	header->m_dataSize = m_segmentSize - m_dataOffset;
+	header->m_reserved = 0;
+	return true;
+#endif
+}
+
+/**
+	@brief Starts writeback of the current segment and unmaps it
+ */
+void WaveformRecorder::CloseSegment()
+{
+#ifndef _WIN32
+	if(m_map)
+	{
+		msync(m_map, m_segmentSize, MS_ASYNC);
+		munmap(m_map, m_segmentSize);
+	}
+#endif
+	m_map = nullptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Statistics
+
+/**
+	@brief Returns the number of waveforms dropped since the recording started
+
+	This counts waveforms that arrived while the queue was full, were too big for a segment, or couldn't be written.
+ */
+uint64_t WaveformRecorder::GetDropCount() const
+{
+	uint64_t drops = m_oversizeCount.load(memory_order_relaxed) + m_errorCount.load(memory_order_relaxed);
+	if(m_queue)
+		drops += m_queue->GetDropCount();
+	return drops;
+}
+
+/**
+	@brief Returns the average rate sample data has been written at since the recording started, in bytes per second
+ */
+double WaveformRecorder::GetThroughput() const
+{
+	if(m_startTime == 0)
+		return 0;
+
+	uint64_t end = m_stopTime ? m_stopTime : SCPIStatistics::Now();
+	if(end <= m_startTime)
+		return 0;
+	return GetWrittenBytes() * 1e9 / (end - m_startTime);
+}
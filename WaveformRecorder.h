@@ -0,0 +1,252 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef WaveformRecorder_h
+#define WaveformRecorder_h
+
+#include "WaveformRing.h"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#define WAVEFORM_RECORD_MAGIC 0x31474553444d4657ULL	//"WFMDSEG1"
+#define WAVEFORM_RECORD_VERSION 1
+
+/**
+	@brief Header at the start of each recorder segment file
+
+	A segment file is this header, then an index of m_indexCapacity WaveformRecordIndexEntry slots, then the data
+	area at m_dataOffset. Only the first m_indexCount index entries are valid; each is written, along with its sample
+	data, before m_indexCount is incremented, so a segment read after a crash is consistent up to its last entry.
+
+	Segment files are reused as a ring, so the file with the highest m_generation holds the newest waveforms.
+ */
+#pragma pack(push, 1)
+class WaveformRecordSegmentHeader
+{
+public:
+	///@brief Always WAVEFORM_RECORD_MAGIC
+	uint64_t m_magic;
+
+	///@brief Always WAVEFORM_RECORD_VERSION
+	uint32_t m_version;
+
+	///@brief Number of index slots
+	uint32_t m_indexCapacity;
+
+	///@brief Number of segments filled since the recording started, including this one (0 if never used)
+	uint64_t m_generation;
+
+	///@brief Offset of the data area from the start of the file
+	uint64_t m_dataOffset;
+
+	///@brief Size of the data area in bytes
+	uint64_t m_dataSize;
+
+	///@brief Number of valid index entries
+	uint64_t m_indexCount;
+
+	///@brief Number of bytes of the data area in use
+	uint64_t m_dataUsed;
+
+	uint64_t m_reserved;
+};
+
+/**
+	@brief Index entry for one recorded waveform
+ */
+class WaveformRecordIndexEntry
+{
+public:
+	///@brief Capture timestamp (from WaveformDescriptor::m_timestamp)
+	int64_t m_timestamp;
+
+	///@brief Capture sequence number
+	uint64_t m_sequence;
+
+	///@brief Offset of the sample data from the start of the file
+	uint64_t m_offset;
+
+	///@brief Number of bytes of sample data
+	uint64_t m_length;
+
+	///@brief Number of samples
+	uint64_t m_sampleCount;
+
+	///@brief Sample rate in Hz
+	uint64_t m_sampleRate;
+
+	///@brief Offset from the trigger to the first sample, in femtoseconds
+	int64_t m_triggerPhase;
+
+	///@brief Channel ID
+	uint16_t m_channel;
+
+	///@brief Encoding of the samples (see WaveformEncoding)
+	uint8_t m_encoding;
+
+	///@brief Size of one sample in bytes
+	uint8_t m_bytesPerSample;
+
+	uint8_t m_reserved[4];
+};
+#pragma pack(pop)
+
+/**
+	@brief Records waveforms to a ring of preallocated, memory-mapped segment files
+
+	Acquisition threads hand waveforms over with Submit(), which never waits for the writer: the descriptor goes
+	into a lock-free ring (pushes from different threads take turns on a mutex), and a writer thread copies the
+	samples into the current segment file and returns the buffer through the completion callback. If the writer falls
+	behind and the ring fills up, the waveform is dropped and counted instead. When a segment is full, the writer
+	moves on to the next file, overwriting the oldest one once every file has been used.
+
+	Segment files are named <path>.000, <path>.001 and so on, and are created at full size up front so the disk
+	space is reserved before recording starts. Not supported on Windows.
+ */
+class WaveformRecorder
+{
+public:
+	/**
+		@brief Called on the writer thread once the samples of a submitted waveform are no longer needed
+
+		@param cookie	The descriptor's m_cookie
+	 */
+	typedef std::function<void(void* cookie)> CompletionCallback;
+
+	WaveformRecorder();
+	virtual ~WaveformRecorder();
+
+	void SetCompletionCallback(CompletionCallback callback)
+	{ m_callback = callback; }
+
+	bool Start(const std::string& path, size_t segmentSize, size_t segmentCount, size_t queueDepth = 256);
+	void Stop();
+	void Flush();
+
+	///@brief Returns true if a recording is in progress
+	bool IsRunning() const
+	{ return m_running.load(std::memory_order_acquire); }
+
+	bool Submit(const WaveformDescriptor& wfm);
+
+	///@brief Returns the number of waveforms written since the recording started
+	uint64_t GetWrittenCount() const
+	{ return m_writtenCount.load(std::memory_order_relaxed); }
+
+	///@brief Returns the number of bytes of sample data written since the recording started
+	uint64_t GetWrittenBytes() const
+	{ return m_writtenBytes.load(std::memory_order_relaxed); }
+
+	uint64_t GetDropCount() const;
+
+	///@brief Returns the number of segment files started since the recording started
+	uint64_t GetGeneration() const
+	{ return m_generation.load(std::memory_order_relaxed); }
+
+	double GetThroughput() const;
+
+protected:
+	void WriterThreadProc();
+	bool Write(const WaveformDescriptor& wfm);
+	bool OpenSegment(size_t index);
+	void CloseSegment();
+	void CloseFiles();
+
+	CompletionCallback m_callback;
+
+	///@brief Waveforms waiting for the writer thread (kept after Stop() for its statistics)
+	std::unique_ptr<WaveformRing> m_queue;
+
+	///@brief True between Start() and Stop()
+	std::atomic<bool> m_running;
+
+	///@brief Number of Submit() calls in progress, so Stop() can wait for them before draining the queue
+	std::atomic<int> m_submitting;
+
+	///@brief Serializes Submit() calls from different threads, since m_queue only supports one producer
+	std::mutex m_submitMutex;
+
+	///@brief Set to make the writer thread exit once the queue is empty
+	std::atomic<bool> m_stopping;
+
+	std::unique_ptr<std::thread> m_writerThread;
+
+	///@brief Wakes the writer thread when waveforms are queued
+	std::condition_variable m_wakeCond;
+
+	///@brief Mutex for m_wakeCond
+	std::mutex m_wakeMutex;
+
+	///@brief File descriptors of the segment files
+	std::unique_ptr<int[]> m_fds;
+
+	///@brief Number of segment files
+	size_t m_segmentCount;
+
+	///@brief Size of each segment file in bytes
+	size_t m_segmentSize;
+
+	///@brief Number of index slots in each segment
+	uint32_t m_indexCapacity;
+
+	///@brief Offset of the data area in each segment
+	size_t m_dataOffset;
+
+	///@brief Index of the segment being written
+	size_t m_segment;
+
+	///@brief Mapping of the segment being written (null if none)
+	uint8_t* m_map;
+
+	//Statistics
+	std::atomic<uint64_t> m_writtenCount;
+	std::atomic<uint64_t> m_writtenBytes;
+	std::atomic<uint64_t> m_oversizeCount;
+	std::atomic<uint64_t> m_errorCount;
+	std::atomic<uint64_t> m_generation;
+
+	///@brief Time the recording started (SCPIStatistics::Now() units)
+	uint64_t m_startTime;
+
+	///@brief Time the recording stopped, or zero if still running
+	uint64_t m_stopTime;
+
+	///@brief Number of waveforms ever queued by Submit() (never reset, for Flush())
+	std::atomic<uint64_t> m_queuedCount;
+
+	///@brief Number of waveforms ever handed back through the completion callback (never reset, for Flush())
+	std::atomic<uint64_t> m_completedCount;
+};
+
+#endif
@@ -0,0 +1,170 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#include "WaveformRing.h"
+#include <string.h>
+
+using namespace std;
+
+static_assert(sizeof(WaveformDescriptor) % sizeof(uint64_t) == 0, "WaveformDescriptor must be a whole number of words");
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+/**
+	@brief Creates a ring
+
+	@param capacity	Maximum number of queued waveforms (rounded up to a power of two)
+	@param mode		What to do when the ring is full
+ */
+WaveformRing::WaveformRing(size_t capacity, OverflowMode mode)
+	: m_mode(mode)
+	, m_head(0)
+	, m_pushCount(0)
+	, m_dropCount(0)
+	, m_overwriteCount(0)
+	, m_highWatermark(0)
+	, m_tail(0)
+	, m_popCount(0)
+{
+	m_capacity = 1;
+	while(m_capacity < capacity)
+		m_capacity <<= 1;
+	m_mask = m_capacity - 1;
+
+	m_slots.reset(new Slot[m_capacity]);
+	memset(m_padding, 0, sizeof(m_padding));
+}
+
+WaveformRing::~WaveformRing()
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Slot access
+
+void WaveformRing::Store(Slot& slot, const WaveformDescriptor& wfm)
+{
+	uint64_t words[SLOT_WORDS];
+	memcpy(words, &wfm, sizeof(words));
+	for(size_t i=0; i<SLOT_WORDS; i++)
+		slot.m_words[i].store(words[i], memory_order_relaxed);
+}
+
+void WaveformRing::Load(const Slot& slot, WaveformDescriptor& wfm)
+{
+	uint64_t words[SLOT_WORDS];
+	for(size_t i=0; i<SLOT_WORDS; i++)
+		words[i] = slot.m_words[i].load(memory_order_relaxed);
+	memcpy(&wfm, words, sizeof(words));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Queue operations
+
+/**
+	@brief Queues a waveform. Must only be called from the producer thread.
+
+	@return True if the waveform was queued, false if the ring was full in lossless mode
+ */
+bool WaveformRing::Push(const WaveformDescriptor& wfm)
+{
+	uint64_t head = m_head.load(memory_order_relaxed);
+	uint64_t tail = m_tail.load(memory_order_acquire);
+
+	if(head - tail >= m_capacity)
+	{
+		if(m_mode == OVERFLOW_LOSSLESS)
+		{
+			Increment(m_dropCount);
+			return false;
+		}
+
+		//Claim the oldest waveform. If the consumer beat us to it, there's room now anyway.
+		if(m_tail.compare_exchange_strong(tail, tail + 1, memory_order_acq_rel))
+		{
+			WaveformDescriptor old;
+			Load(m_slots[tail & m_mask], old);
+			Increment(m_overwriteCount);
+			if(m_evictionCallback)
+				m_evictionCallback(old);
+		}
+	}
+
+	Store(m_slots[head & m_mask], wfm);
+	m_head.store(head + 1, memory_order_release);
+
+	Increment(m_pushCount);
+	uint64_t occupancy = head + 1 - m_tail.load(memory_order_relaxed);
+	if(occupancy > m_highWatermark.load(memory_order_relaxed))
+		m_highWatermark.store(occupancy, memory_order_relaxed);
+	return true;
+}
+
+/**
+	@brief Removes the oldest queued waveform. Must only be called from the consumer thread.
+
+	@return True if a waveform was removed, false if the ring was empty
+ */
+bool WaveformRing::Pop(WaveformDescriptor& wfm)
+{
+	while(true)
+	{
+		uint64_t tail = m_tail.load(memory_order_acquire);
+		uint64_t head = m_head.load(memory_order_acquire);
+		if(tail == head)
+			return false;
+
+		Load(m_slots[tail & m_mask], wfm);
+
+		//In lossless mode nobody else moves the tail
+		if(m_mode == OVERFLOW_LOSSLESS)
+		{
+			m_tail.store(tail + 1, memory_order_release);
+			break;
+		}
+
+		//In overwrite mode, the producer may have evicted this waveform while we were reading it. Try again if so.
+		if(m_tail.compare_exchange_strong(tail, tail + 1, memory_order_acq_rel))
+			break;
+	}
+
+	Increment(m_popCount);
+	return true;
+}
+
+/**
+	@brief Returns the number of waveforms currently queued (approximate if called while the ring is in use)
+ */
+size_t WaveformRing::GetOccupancy() const
+{
+	uint64_t tail = m_tail.load(memory_order_acquire);
+	uint64_t head = m_head.load(memory_order_acquire);
+	return head - tail;
+}
@@ -0,0 +1,194 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef WaveformRing_h
+#define WaveformRing_h
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <stdint.h>
+
+//Size of a cache line, used to keep producer and consumer state from sharing lines
+#define CACHE_LINE_SIZE 64
+
+/**
+	@brief Description of one captured waveform, passed from the acquisition thread to the sender
+
+	The descriptor doesn't own the sample memory; m_cookie identifies the driver's buffer so it can be returned once
+	the waveform has been sent.
+ */
+class WaveformDescriptor
+{
+public:
+	///@brief Sample data
+	void* m_samples;
+
+	///@brief Driver handle for the buffer holding the samples
+	void* m_cookie;
+
+	///@brief Number of samples
+	uint64_t m_sampleCount;
+
+	///@brief Sample rate in Hz
+	uint64_t m_sampleRate;
+
+	///@brief Offset from the trigger to the first sample, in femtoseconds
+	int64_t m_triggerPhase;
+
+	///@brief Capture timestamp (driver defined units, typically nanoseconds)
+	int64_t m_timestamp;
+
+	///@brief Capture sequence number
+	uint64_t m_sequence;
+
+	///@brief Channel ID
+	uint16_t m_channel;
+
+	///@brief Size of one sample in bytes
+	uint8_t m_bytesPerSample;
+
+	///@brief Encoding of the samples (see WaveformEncoding)
+	uint8_t m_encoding;
+
+	uint8_t m_reserved[4];
+};
+
+/**
+	@brief Bounded, lock-free single producer / single consumer ring of waveform descriptors
+
+	One thread (normally the driver's acquisition callback) calls Push(), and one other thread (normally the data
+	plane sender) calls Pop(). Neither call ever blocks or takes a lock.
+
+	When the ring is full, lossless mode rejects the new waveform so the producer can decide what to do with it,
+	while overwrite mode discards the oldest queued waveform so the consumer always gets the most recent data. The
+	eviction callback is called (on the producer thread) with every discarded descriptor so its buffer can be
+	returned to the driver.
+ */
+class WaveformRing
+{
+public:
+	enum OverflowMode
+	{
+		///@brief Reject new waveforms when full (for recording clients)
+		OVERFLOW_LOSSLESS,
+
+		///@brief Discard the oldest waveform when full (latest wins, for display clients)
+		OVERFLOW_OVERWRITE
+	};
+
+	WaveformRing(size_t capacity, OverflowMode mode);
+	virtual ~WaveformRing();
+
+	void SetEvictionCallback(std::function<void(const WaveformDescriptor&)> callback)
+	{ m_evictionCallback = callback; }
+
+	bool Push(const WaveformDescriptor& wfm);
+	bool Pop(WaveformDescriptor& wfm);
+
+	///@brief Returns the maximum number of waveforms the ring can hold
+	size_t GetCapacity() const
+	{ return m_capacity; }
+
+	OverflowMode GetMode() const
+	{ return m_mode; }
+
+	size_t GetOccupancy() const;
+
+	///@brief Returns the number of waveforms successfully pushed
+	uint64_t GetPushCount() const
+	{ return m_pushCount.load(std::memory_order_relaxed); }
+
+	///@brief Returns the number of waveforms popped by the consumer
+	uint64_t GetPopCount() const
+	{ return m_popCount.load(std::memory_order_relaxed); }
+
+	///@brief Returns the number of waveforms rejected because the ring was full (lossless mode)
+	uint64_t GetDropCount() const
+	{ return m_dropCount.load(std::memory_order_relaxed); }
+
+	///@brief Returns the number of queued waveforms discarded to make room for newer ones (overwrite mode)
+	uint64_t GetOverwriteCount() const
+	{ return m_overwriteCount.load(std::memory_order_relaxed); }
+
+	///@brief Returns the highest occupancy seen by the producer
+	uint64_t GetHighWatermark() const
+	{ return m_highWatermark.load(std::memory_order_relaxed); }
+
+protected:
+	static const size_t SLOT_WORDS = sizeof(WaveformDescriptor) / sizeof(uint64_t);
+
+	/**
+		@brief Storage for one descriptor
+
+		The descriptor is copied in and out a word at a time through relaxed atomics. In overwrite mode the producer
+		may overwrite a slot while the consumer is still reading it; the consumer then notices that the slot was
+		evicted and discards what it read, and the atomics keep that well defined.
+	 */
+	class Slot
+	{
+	public:
+		std::atomic<uint64_t> m_words[SLOT_WORDS];
+	};
+
+	static void Store(Slot& slot, const WaveformDescriptor& wfm);
+	static void Load(const Slot& slot, WaveformDescriptor& wfm);
+
+	static void Increment(std::atomic<uint64_t>& counter)
+	{ counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+
+	///@brief Descriptor storage
+	std::unique_ptr<Slot[]> m_slots;
+
+	///@brief Number of slots (power of two)
+	size_t m_capacity;
+
+	///@brief m_capacity - 1
+	size_t m_mask;
+
+	OverflowMode m_mode;
+
+	std::function<void(const WaveformDescriptor&)> m_evictionCallback;
+
+	//Producer state
+	alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> m_head;
+	std::atomic<uint64_t> m_pushCount;
+	std::atomic<uint64_t> m_dropCount;
+	std::atomic<uint64_t> m_overwriteCount;
+	std::atomic<uint64_t> m_highWatermark;
+
+	//Consumer state
+	alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> m_tail;
+	std::atomic<uint64_t> m_popCount;
+
+	//Keep whatever follows us in memory off the consumer's line
+	char m_padding[CACHE_LINE_SIZE - 2*sizeof(std::atomic<uint64_t>)];
+};
+
+#endif
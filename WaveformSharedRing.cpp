@@ -0,0 +1,273 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#include "WaveformSharedRing.h"
+#include <log.h>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+//The data area starts on its own page, after the control block
+#define RING_DATA_OFFSET 4096
+
+//Records start on cache line boundaries
+#define RING_ALIGNMENT 64
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+WaveformSharedRing::WaveformSharedRing()
+	: m_fd(-1)
+	, m_control(nullptr)
+	, m_data(nullptr)
+	, m_mappingSize(0)
+	, m_dataSize(0)
+	, m_writePosition(0)
+{
+}
+
+WaveformSharedRing::~WaveformSharedRing()
+{
+	Close();
+}
+
+/**
+	@brief Creates a new ring (server side)
+
+	@param size		Size of the data area in bytes, rounded up to a whole number of pages
+ */
+bool WaveformSharedRing::Create(size_t size)
+{
+	Close();
+
+	size = (size + RING_DATA_OFFSET - 1) & ~static_cast<size_t>(RING_DATA_OFFSET - 1);
+	if(size == 0)
+		return false;
+
+	m_fd = memfd_create("scpi-waveform-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if(m_fd < 0)
+	{
+		LogWarning("WaveformSharedRing: memfd_create failed (%s)\n", strerror(errno));
+		return false;
+	}
+
+	size_t mappingSize = RING_DATA_OFFSET + size;
+	if(0 != ftruncate(m_fd, mappingSize))
+	{
+		LogWarning("WaveformSharedRing: failed to size ring (%s)\n", strerror(errno));
+		Close();
+		return false;
+	}
+
+	//The client must not be able to resize the file out from under us
+	if(0 != fcntl(m_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL))
+		LogWarning("WaveformSharedRing: failed to seal ring (%s)\n", strerror(errno));
+
+	if(!Map(mappingSize))
+		return false;
+
+	m_control->m_magic = WAVEFORM_RING_MAGIC;
+	m_control->m_version = WAVEFORM_RING_VERSION;
+	m_control->m_dataOffset = RING_DATA_OFFSET;
+	m_control->m_dataSize = size;
+	m_control->m_writePosition.store(0, memory_order_relaxed);
+	m_dataSize = size;
+	m_writePosition = 0;
+	m_control->m_readPosition.store(0, memory_order_release);
+	return true;
+}
+
+/**
+	@brief Maps a ring created by a server (client side)
+
+	@param fd	The file descriptor received from the server. The ring takes ownership of it.
+ */
+bool WaveformSharedRing::Attach(int fd)
+{
+	Close();
+	m_fd = fd;
+
+	struct stat st;
+	if( (0 != fstat(fd, &st)) || (static_cast<size_t>(st.st_size) <= RING_DATA_OFFSET) )
+	{
+		LogWarning("WaveformSharedRing: descriptor is not a waveform ring\n");
+		Close();
+		return false;
+	}
+
+	if(!Map(st.st_size))
+		return false;
+
+	if( (m_control->m_magic != WAVEFORM_RING_MAGIC) ||
+		(m_control->m_version != WAVEFORM_RING_VERSION) ||
+		(m_control->m_dataOffset + m_control->m_dataSize != m_mappingSize) )
+	{
+		LogWarning("WaveformSharedRing: bad ring header\n");
+		Close();
+		return false;
+	}
+
+	m_data = reinterpret_cast<uint8_t*>(m_control) + m_control->m_dataOffset;
+	m_dataSize = m_control->m_dataSize;
+	return true;
+}
+
+bool WaveformSharedRing::Map(size_t mappingSize)
+{
+	void* p = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+	if(p == MAP_FAILED)
+	{
+		LogWarning("WaveformSharedRing: mmap failed (%s)\n", strerror(errno));
+		Close();
+		return false;
+	}
+
+	m_control = reinterpret_cast<WaveformRingControl*>(p);
+	m_data = reinterpret_cast<uint8_t*>(p) + RING_DATA_OFFSET;
+	m_mappingSize = mappingSize;
+	return true;
+}
+
+void WaveformSharedRing::Close()
+{
+	if(m_control)
+		munmap(m_control, m_mappingSize);
+	m_control = nullptr;
+	m_data = nullptr;
+	m_mappingSize = 0;
+	m_dataSize = 0;
+	m_writePosition = 0;
+
+	if(m_fd >= 0)
+		close(m_fd);
+	m_fd = -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Producer side
+
+/**
+	@brief Copies a waveform into the ring
+
+	A record never wraps around the end of the data area; if it doesn't fit in the space left before the end, the
+	tail is skipped and the record starts over at the beginning.
+
+	The client can write anything to the control block, so the size and write position come from private copies,
+	and the read position it publishes is clamped to the range of data actually outstanding.
+
+	@param data		Sample data buffers
+	@param iovcnt	Number of sample data buffers
+	@param desc		Filled in with the location of the record, to send to the client
+
+	@return False if the client hasn't released enough space yet
+ */
+bool WaveformSharedRing::Write(const iovec* data, size_t iovcnt, WaveformRingDescriptor& desc)
+{
+	if(!m_control)
+		return false;
+
+	size_t length = 0;
+	for(size_t i=0; i<iovcnt; i++)
+		length += data[i].iov_len;
+
+	uint64_t size = m_dataSize;
+	if(length > size)
+		return false;
+
+	uint64_t position = m_writePosition;
+	uint64_t offset = position % size;
+	if(offset + length > size)
+	{
+		position += size - offset;
+		offset = 0;
+	}
+
+	uint64_t end = position + length;
+	uint64_t read = m_control->m_readPosition.load(memory_order_acquire);
+	read = min(max(read, (m_writePosition > size) ? (m_writePosition - size) : 0), m_writePosition);
+	if(end - read > size)
+		return false;
+
+	uint8_t* p = m_data + offset;
+	for(size_t i=0; i<iovcnt; i++)
+	{
+		memcpy(p, data[i].iov_base, data[i].iov_len);
+		p += data[i].iov_len;
+	}
+
+	//Keep the next record aligned
+	end = (end + RING_ALIGNMENT - 1) & ~static_cast<uint64_t>(RING_ALIGNMENT - 1);
+	m_writePosition = end;
+	m_control->m_writePosition.store(end, memory_order_release);
+
+	desc.m_position = position;
+	desc.m_length = length;
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Consumer side
+
+/**
+	@brief Returns a pointer to the data of a record
+
+	@return The data, or null if the descriptor doesn't describe a valid record
+ */
+const void* WaveformSharedRing::GetData(const WaveformRingDescriptor& desc) const
+{
+	if(!m_control)
+		return nullptr;
+
+	uint64_t size = m_dataSize;
+	uint64_t offset = desc.m_position % size;
+	if(offset + desc.m_length > size)
+		return nullptr;
+	return m_data + offset;
+}
+
+/**
+	@brief Gives the space used by a record (and everything before it) back to the server
+
+	Records must be released in the order they were received.
+ */
+void WaveformSharedRing::Release(const WaveformRingDescriptor& desc)
+{
+	if(!m_control)
+		return;
+
+	uint64_t end = desc.m_position + desc.m_length;
+	end = (end + RING_ALIGNMENT - 1) & ~static_cast<uint64_t>(RING_ALIGNMENT - 1);
+	m_control->m_readPosition.store(end, memory_order_release);
+}
@@ -0,0 +1,133 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef WaveformSharedRing_h
+#define WaveformSharedRing_h
+
+#include "WaveformStreamer.h"
+#include <atomic>
+
+#define WAVEFORM_RING_MAGIC 0x474e5257	//"WRNG"
+#define WAVEFORM_RING_VERSION 1
+
+/**
+	@brief Control block at the start of a shared waveform ring
+
+	Positions count bytes written since the ring was created and never wrap; the byte at position p is stored at
+	offset (p % m_dataSize) in the data area. Each position is written by only one side, and the two live on separate
+	cache lines so the producer and consumer don't contend.
+ */
+class WaveformRingControl
+{
+public:
+	///@brief Always WAVEFORM_RING_MAGIC
+	uint32_t m_magic;
+
+	///@brief Always WAVEFORM_RING_VERSION
+	uint32_t m_version;
+
+	///@brief Offset of the data area from the start of the mapping
+	uint64_t m_dataOffset;
+
+	///@brief Size of the data area in bytes
+	uint64_t m_dataSize;
+
+	///@brief End of the most recent record (written by the server)
+	alignas(64) std::atomic<uint64_t> m_writePosition;
+
+	///@brief End of the most recent record the client is done with (written by the client)
+	alignas(64) std::atomic<uint64_t> m_readPosition;
+};
+
+/**
+	@brief Single producer, single consumer ring of waveform data in a memfd shared with a local client
+
+	The server creates the ring and passes the file descriptor to the client over a Unix domain socket (see the
+	SHM:OPEN? query in SCPIServer). WaveformStreamer then copies sample data into the ring and sends only a
+	WaveformRingDescriptor on the socket. Records are always contiguous in the data area, so the client can process
+	them in place; once it's done with a record, it calls Release() so the space can be reused.
+
+	If the client falls behind and the ring fills up, Write() fails and the streamer sends the waveform inline on the
+	socket instead.
+
+	Only available on Linux.
+ */
+class WaveformSharedRing
+{
+public:
+	WaveformSharedRing();
+	virtual ~WaveformSharedRing();
+
+	bool Create(size_t size);
+	bool Attach(int fd);
+
+	///@brief Returns the memfd backing the ring, or -1 if not open
+	int GetFD() const
+	{ return m_fd; }
+
+	///@brief Returns the size of the data area in bytes
+	size_t GetSize() const
+	{ return m_dataSize; }
+
+	//Producer side
+	bool Write(const iovec* data, size_t iovcnt, WaveformRingDescriptor& desc);
+
+	//Consumer side
+	const void* GetData(const WaveformRingDescriptor& desc) const;
+	void Release(const WaveformRingDescriptor& desc);
+
+protected:
+	bool Map(size_t mappingSize);
+	void Close();
+
+	///@brief The memfd
+	int m_fd;
+
+	///@brief Start of the mapping (control block)
+	WaveformRingControl* m_control;
+
+	///@brief Start of the data area
+	uint8_t* m_data;
+
+	///@brief Size of the whole mapping in bytes
+	size_t m_mappingSize;
+
+	/**
+		@brief Size of the data area in bytes
+
+		A private copy, since the other side can write to the control block at any time and the producer must never
+		size a copy from it.
+	 */
+	uint64_t m_dataSize;
+
+	///@brief End of the most recent record (producer side; published through the control block, never read back)
+	uint64_t m_writePosition;
+};
+
+#endif
@@ -0,0 +1,933 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#include "WaveformStreamer.h"
+#include "WaveformBufferPool.h"
+#include "SampleCompression.h"
+#include "SampleConversion.h"
+#include "SCPIUring.h"
+#include <log.h>
+#include <string.h>
+#include <stdio.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <poll.h>
+#endif
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include "WaveformSharedRing.h"
+#endif
+
+using namespace std;
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+//Zero-copy transmission needs kernel 4.14 or newer, and headers to match
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define HAVE_ZEROCOPY
+#endif
+
+//Maximum number of buffers passed to one sendmsg() call
+#define MAX_IOVECS 64
+
+//Size of the io_uring used for sending, and the longest chain of sends submitted to it at once
+#define RING_ENTRIES 64
+#define RING_CHAIN_MAX 32
+
+//Largest single io_uring send (the length field is 32 bits)
+#define RING_SEND_MAX (1U << 30)
+
+//Terminator after an IEEE 488.2 block. Static, so it's safe to reference from zero-copy sends.
+static const char g_blockTrailer[] = "\n";
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+WaveformStreamer::WaveformStreamer(ZSOCKET sock)
+	: m_socket(sock)
+	, m_sequence(0)
+	, m_zeroCopy(false)
+	, m_blockFraming(false)
+	, m_headerEnabled(true)
+	, m_warnedCopied(false)
+	, m_decimation(0)
+	, m_compression(false)
+	, m_nextZeroCopyID(0)
+	, m_completedID(0)
+	, m_bufferPool(nullptr)
+	, m_registeredGeneration(0)
+	, m_poolRegistered(false)
+	, m_fixedSends(true)
+	, m_nextRingID(0)
+	, m_ringNotifications(0)
+	, m_chainPending(0)
+{
+}
+
+WaveformStreamer::~WaveformStreamer()
+{
+	//Wait for the kernel to release everything so the driver gets all of its buffers back
+	while(!m_pending.empty())
+		PollCompletions(true);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Configuration
+
+/**
+	@brief Turns on zero-copy transmission (MSG_ZEROCOPY), if the platform supports it
+
+	@return True if zero-copy mode is now enabled
+ */
+bool WaveformStreamer::EnableZeroCopy()
+{
+#ifdef HAVE_ZEROCOPY
+	int one = 1;
+	if(0 != setsockopt(m_socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)))
+	{
+		LogWarning("WaveformStreamer: SO_ZEROCOPY not supported (%s), using normal sends\n", strerror(errno));
+		return false;
+	}
+	m_zeroCopy = true;
+	return true;
+#else
+	LogWarning("WaveformStreamer: zero-copy sends not supported on this platform, using normal sends\n");
+	return false;
+#endif
+}
+
+/**
+	@brief Sends waveforms through io_uring instead of sendmsg(), if the platform supports it
+
+	Each waveform's buffers are submitted as one linked chain of sends, so the whole waveform goes out in a single
+	system call. Takes precedence over EnableZeroCopy(): only buffers registered through SetBufferPool() are sent
+	zero-copy.
+
+	@return True if io_uring sends are now enabled
+ */
+bool WaveformStreamer::EnableUring()
+{
+#ifdef HAVE_IO_URING
+	auto ring = make_unique<SCPIUring>();
+	if(!ring->Open(RING_ENTRIES) || !ring->IsOpSupported(IORING_OP_SEND))
+	{
+		LogWarning("WaveformStreamer: io_uring sends not supported by the kernel, using normal sends\n");
+		return false;
+	}
+	m_ring = move(ring);
+	m_poolRegistered = false;
+	return true;
+#else
+	LogWarning("WaveformStreamer: io_uring not supported on this platform, using normal sends\n");
+	return false;
+#endif
+}
+
+/**
+	@brief Registers a pool's preallocated buffers with the kernel, so io_uring sends from them are zero-copy
+
+	Only has an effect once EnableUring() has succeeded. The buffers are registered again whenever the pool's geometry
+	changes. Must not be called while another thread is sending. Pass null to stop using the pool.
+ */
+void WaveformStreamer::SetBufferPool(WaveformBufferPool* pool)
+{
+	m_bufferPool = pool;
+	m_poolRegistered = false;
+}
+
+/**
+	@brief Copies sample data into a shared memory ring instead of sending it on the socket
+
+	The client must have mapped the same ring (see the SHM:OPEN? query). Pass null to go back to sending sample data
+	on the socket.
+ */
+void WaveformStreamer::SetSharedRing(shared_ptr<WaveformSharedRing> ring)
+{
+	m_sharedRing = ring;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Decimation
+
+/**
+	@brief Checks if waveforms in a given format can be reduced to a min/max envelope
+
+	Signed 8 and 16 bit ADC codes and 32-bit floats are supported.
+ */
+bool WaveformStreamer::CanDecimate(uint8_t encoding, uint8_t bytesPerSample)
+{
+	if(encoding == WAVEFORM_RAW_INT)
+		return (bytesPerSample == 1) || (bytesPerSample == 2);
+	if(encoding == WAVEFORM_RAW_FLOAT)
+		return bytesPerSample == 4;
+	return false;
+}
+
+/**
+	@brief Computes the min/max envelope of a waveform (see WAVEFORM_MIN_MAX for the layout)
+
+	@param encoding			Sample encoding (must pass CanDecimate())
+	@param bytesPerSample	Size of one sample
+	@param samples			Sample data
+	@param sampleCount		Number of samples
+	@param buckets			Number of buckets, clamped to sampleCount
+	@param envelope			Output buffer, resized to fit
+ */
+void WaveformStreamer::Decimate(
+	uint8_t encoding,
+	uint8_t bytesPerSample,
+	const void* samples,
+	size_t sampleCount,
+	size_t buckets,
+	vector<uint8_t>& envelope)
+{
+	buckets = min(buckets, sampleCount);
+	envelope.resize(buckets * 2 * bytesPerSample);
+	if(buckets == 0)
+		return;
+
+	if(encoding == WAVEFORM_RAW_FLOAT)
+	{
+		DecimateMinMaxFloat(reinterpret_cast<const float*>(samples), sampleCount,
+			reinterpret_cast<float*>(envelope.data()), buckets);
+	}
+	else if(bytesPerSample == 1)
+	{
+		DecimateMinMaxInt8(reinterpret_cast<const int8_t*>(samples), sampleCount,
+			reinterpret_cast<int8_t*>(envelope.data()), buckets);
+	}
+	else
+	{
+		DecimateMinMaxInt16(reinterpret_cast<const int16_t*>(samples), sampleCount,
+			reinterpret_cast<int16_t*>(envelope.data()), buckets);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Compression
+
+/**
+	@brief Checks if waveforms in a given format can be compressed
+
+	Only signed 8 and 16 bit ADC codes are supported; floating point data doesn't delta code well.
+ */
+bool WaveformStreamer::CanCompress(uint8_t encoding, uint8_t bytesPerSample)
+{
+	return (encoding == WAVEFORM_RAW_INT) && ( (bytesPerSample == 1) || (bytesPerSample == 2) );
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sending
+
+/**
+	@brief Sends a waveform from a single contiguous buffer
+
+	@param channel			Channel ID
+	@param sampleRate		Sample rate in Hz
+	@param triggerPhase		Offset from the trigger to the first sample, in femtoseconds
+	@param bytesPerSample	Size of one sample
+	@param samples			Sample data
+	@param sampleCount		Number of samples
+	@param cookie			Passed to the completion callback once the buffer may be reused
+ */
+bool WaveformStreamer::SendWaveform(
+	uint16_t channel,
+	uint64_t sampleRate,
+	int64_t triggerPhase,
+	uint8_t bytesPerSample,
+	const void* samples,
+	size_t sampleCount,
+	void* cookie)
+{
+	WaveformHeader header;
+	header.m_channel = channel;
+	header.m_encoding = WAVEFORM_RAW_INT;
+	header.m_bytesPerSample = bytesPerSample;
+	header.m_sampleRate = sampleRate;
+	header.m_triggerPhase = triggerPhase;
+	header.m_sampleCount = sampleCount;
+
+	iovec iov;
+	iov.iov_base = const_cast<void*>(samples);
+	iov.iov_len = sampleCount * bytesPerSample;
+	return SendWaveform(header, &iov, 1, cookie);
+}
+
+/**
+	@brief Sends a waveform whose sample data is split across several buffers
+
+	@param header	Header for the waveform. The caller fills out the channel, encoding, sample size, sample rate,
+					trigger phase and sample count; the magic number, sequence number and data length are filled in
+					here, and WAVEFORM_MIN_MAX, WAVEFORM_COMPRESSED or WAVEFORM_SHARED_MEMORY are set in the
+					encoding if the waveform was decimated, compressed or went into the shared ring.
+	@param data		Sample data buffers
+	@param iovcnt	Number of sample data buffers
+	@param cookie	Passed to the completion callback once all of the buffers may be reused
+ */
+bool WaveformStreamer::SendWaveform(WaveformHeader& header, const iovec* data, size_t iovcnt, void* cookie)
+{
+	return SendPending(AddPending(cookie), header, data, iovcnt);
+}
+
+/**
+	@brief Sends all segments of a segmented acquisition as one waveform (see WAVEFORM_SEGMENTED)
+
+	@param header		Header for the waveform, as for SendWaveform(). m_sampleCount is the number of samples in
+						each segment. The trigger phase is taken from the first segment.
+	@param segments		Timing of each segment
+	@param data			Sample data of each segment, one buffer per segment
+	@param segmentCount	Number of segments
+	@param cookie		Passed to the completion callback once all of the buffers may be reused
+ */
+bool WaveformStreamer::SendSegments(
+	WaveformHeader& header,
+	const WaveformSegment* segments,
+	const iovec* data,
+	size_t segmentCount,
+	void* cookie)
+{
+	if(segmentCount == 0)
+		return false;
+
+	//The segment table goes out in front of the samples. It's kept with the waveform since, in zero-copy mode,
+	//the kernel reads it after we return.
+	auto& wfm = AddPending(cookie);
+	uint64_t count = segmentCount;
+	wfm.m_segmentTable.resize(sizeof(count) + segmentCount*sizeof(WaveformSegment));
+	memcpy(wfm.m_segmentTable.data(), &count, sizeof(count));
+	memcpy(wfm.m_segmentTable.data() + sizeof(count), segments, segmentCount*sizeof(WaveformSegment));
+
+	m_segmentIovs.clear();
+	m_segmentIovs.push_back({wfm.m_segmentTable.data(), wfm.m_segmentTable.size()});
+	m_segmentIovs.insert(m_segmentIovs.end(), data, data + segmentCount);
+
+	header.m_encoding |= WAVEFORM_SEGMENTED;
+	header.m_triggerPhase = segments[0].m_triggerPhase;
+	return SendPending(wfm, header, m_segmentIovs.data(), m_segmentIovs.size());
+}
+
+/**
+	@brief Adds a waveform to the list of those the kernel may still reference
+ */
+WaveformStreamer::PendingWaveform& WaveformStreamer::AddPending(void* cookie)
+{
+	m_pending.emplace_back();
+	auto& wfm = m_pending.back();
+	wfm.m_zeroCopySent = false;
+	wfm.m_sending = true;
+	wfm.m_ringID = m_nextRingID ++;
+	wfm.m_ringNotifications = 0;
+	wfm.m_cookie = cookie;
+	return wfm;
+}
+
+/**
+	@brief Encodes and sends a waveform just added with AddPending() (see SendWaveform())
+ */
+bool WaveformStreamer::SendPending(PendingWaveform& wfm, WaveformHeader& header, const iovec* data, size_t iovcnt)
+{
+	size_t dataLength = 0;
+	for(size_t i=0; i<iovcnt; i++)
+		dataLength += data[i].iov_len;
+
+	//Send only the min/max envelope if the client asked for decimation and it's worth it.
+	//Waveforms split across several buffers are always sent in full.
+	size_t buckets = m_decimation.load(memory_order_relaxed);
+	iovec encodedData;
+	if( buckets && (iovcnt == 1) && (header.m_sampleCount > 2*buckets) &&
+		(dataLength == header.m_sampleCount * header.m_bytesPerSample) &&
+		CanDecimate(header.m_encoding, header.m_bytesPerSample) )
+	{
+		Decimate(header.m_encoding, header.m_bytesPerSample, data[0].iov_base, header.m_sampleCount, buckets,
+			wfm.m_encoded);
+		header.m_encoding |= WAVEFORM_MIN_MAX;
+		encodedData.iov_base = wfm.m_encoded.data();
+		encodedData.iov_len = wfm.m_encoded.size();
+		data = &encodedData;
+		dataLength = encodedData.iov_len;
+	}
+
+	//Otherwise compress the samples if the client asked for it, keeping the original if that doesn't save anything
+	else if( m_compression.load(memory_order_relaxed) && (iovcnt == 1) &&
+		(dataLength == header.m_sampleCount * header.m_bytesPerSample) &&
+		CanCompress(header.m_encoding, header.m_bytesPerSample) )
+	{
+		wfm.m_encoded.resize(GetCompressedBound(header.m_sampleCount, header.m_bytesPerSample));
+		size_t len = CompressSamples(data[0].iov_base, header.m_sampleCount, header.m_bytesPerSample,
+			wfm.m_encoded.data());
+		if(len < dataLength)
+		{
+			header.m_encoding |= WAVEFORM_COMPRESSED;
+			encodedData.iov_base = wfm.m_encoded.data();
+			encodedData.iov_len = len;
+			data = &encodedData;
+			dataLength = len;
+		}
+	}
+
+	//If the client shares a ring with us, copy the samples there and only send their location.
+	//When the ring is full, fall back to sending them on the socket.
+#ifdef __linux__
+	iovec ringData;
+	if(m_sharedRing && m_sharedRing->Write(data, iovcnt, wfm.m_ringDescriptor))
+	{
+		header.m_encoding |= WAVEFORM_SHARED_MEMORY;
+		ringData.iov_base = &wfm.m_ringDescriptor;
+		ringData.iov_len = sizeof(WaveformRingDescriptor);
+		data = &ringData;
+		iovcnt = 1;
+		dataLength = ringData.iov_len;
+	}
+#endif
+
+	//Block framing can't describe more than 9 digits of length. Reject the waveform before it uses up a sequence
+	//number, and give the buffer back through the completion callback as usual.
+	size_t payloadLength = dataLength;
+	if(m_headerEnabled)
+		payloadLength += sizeof(WaveformHeader);
+	char digits[32];
+	int ndigits = 0;
+	if(m_blockFraming)
+		ndigits = snprintf(digits, sizeof(digits), "%zu", payloadLength);
+	if(ndigits > 9)
+	{
+		LogWarning("WaveformStreamer: waveform too large for IEEE 488.2 definite length block\n");
+		wfm.m_sending = false;
+		ReleaseCompleted();
+		return false;
+	}
+
+	header.m_magic = WAVEFORM_MAGIC;
+	header.m_sequence = m_sequence ++;
+	header.m_dataLength = dataLength;
+	wfm.m_header = header;
+
+	m_iovs.clear();
+
+	//Length prefix for block framing
+	if(m_blockFraming)
+	{
+		wfm.m_prefix[0] = '#';
+		wfm.m_prefix[1] = '0' + ndigits;
+		memcpy(wfm.m_prefix + 2, digits, ndigits);
+		m_iovs.push_back({wfm.m_prefix, static_cast<size_t>(ndigits) + 2});
+	}
+
+	if(m_headerEnabled)
+		m_iovs.push_back({&wfm.m_header, sizeof(WaveformHeader)});
+
+	for(size_t i=0; i<iovcnt; i++)
+	{
+		if(data[i].iov_len)
+			m_iovs.push_back(data[i]);
+	}
+
+	if(m_blockFraming)
+		m_iovs.push_back({const_cast<char*>(g_blockTrailer), 1});
+
+	bool ok = SendBuffers(&m_iovs[0], m_iovs.size(), &wfm);
+	wfm.m_sending = false;
+
+	//Give back anything the kernel is already done with (including this waveform, if sent normally)
+	ReleaseCompleted();
+	return ok;
+}
+
+/**
+	@brief Sends a list of buffers, retrying until everything has gone out
+
+	@param iov		Buffer list (modified to track progress)
+	@param iovcnt	Number of buffers
+	@param wfm		The waveform being sent
+ */
+bool WaveformStreamer::SendBuffers(iovec* iov, size_t iovcnt, PendingWaveform* wfm)
+{
+#ifdef _WIN32
+	(void)wfm;
+	for(size_t i=0; i<iovcnt; i++)
+	{
+		const char* p = reinterpret_cast<const char*>(iov[i].iov_base);
+		size_t len = iov[i].iov_len;
+		while(len > 0)
+		{
+			int sent = send(m_socket, p, len, 0);
+			if(sent <= 0)
+				return false;
+			p += sent;
+			len -= sent;
+		}
+	}
+	return true;
+#else
+
+#ifdef HAVE_IO_URING
+	if(m_ring)
+		return SendRing(iov, iovcnt, wfm);
+#endif
+
+	int flags = SEND_FLAGS;
+#ifdef HAVE_ZEROCOPY
+	if(m_zeroCopy)
+		flags |= MSG_ZEROCOPY;
+#endif
+
+	while(iovcnt > 0)
+	{
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = min(iovcnt, static_cast<size_t>(MAX_IOVECS));
+
+		ssize_t len = sendmsg(m_socket, &msg, flags);
+		if(len < 0)
+		{
+			if(errno == EINTR)
+				continue;
+
+			//Non-blocking socket is full
+			if( (errno == EAGAIN) || (errno == EWOULDBLOCK) )
+			{
+				if(!WaitWritable())
+					return false;
+				continue;
+			}
+
+			//Too many zero-copy sends outstanding, wait for some to complete
+			if( (errno == ENOBUFS) && m_zeroCopy && !m_pending.empty() )
+			{
+				PollCompletions(true);
+				continue;
+			}
+
+			LogWarning("WaveformStreamer: send failed (%s)\n", strerror(errno));
+			return false;
+		}
+
+		//Every successful zero-copy send gets the next notification ID
+		if(m_zeroCopy)
+		{
+			if(!wfm->m_zeroCopySent)
+				wfm->m_firstID = m_nextZeroCopyID;
+			wfm->m_lastID = m_nextZeroCopyID;
+			wfm->m_zeroCopySent = true;
+			m_nextZeroCopyID ++;
+		}
+
+		//Skip past whatever was sent
+		size_t remaining = len;
+		while( (iovcnt > 0) && (remaining >= iov->iov_len) )
+		{
+			remaining -= iov->iov_len;
+			iov ++;
+			iovcnt --;
+		}
+		if(iovcnt > 0)
+		{
+			iov->iov_base = reinterpret_cast<char*>(iov->iov_base) + remaining;
+			iov->iov_len -= remaining;
+		}
+	}
+
+	return true;
+#endif
+}
+
+#ifdef HAVE_IO_URING
+/**
+	@brief Sends a list of buffers through the io_uring, retrying until everything has gone out
+
+	Buffers are submitted as linked chains, so each send starts only once the previous one has finished and the data
+	stays in order. We wait for every send of a chain to complete before returning, so that nothing else written to
+	the socket can get in between.
+
+	@param iov		Buffer list (modified to track progress)
+	@param iovcnt	Number of buffers
+	@param wfm		The waveform being sent
+ */
+bool WaveformStreamer::SendRing(iovec* iov, size_t iovcnt, PendingWaveform* wfm)
+{
+	UpdateRegisteredBuffers();
+
+	//Registered buffers are only valid as long as the pool hasn't reallocated them
+	bool useFixed = m_fixedSends && m_bufferPool && (m_bufferPool->GetGeneration() == m_registeredGeneration);
+
+	while(iovcnt > 0)
+	{
+		//Chain as many buffers as fit. Anything too big for one send has to end the chain, since the next send
+		//mustn't start until all of it has gone out.
+		size_t maxCount = min(iovcnt, static_cast<size_t>(RING_CHAIN_MAX));
+		io_uring_sqe* prev = nullptr;
+		m_chain.clear();
+		while(m_chain.size() < maxCount)
+		{
+			auto sqe = m_ring->GetSQE();
+			if(!sqe)
+			{
+				LogError("WaveformStreamer: io_uring submission queue full\n");
+				return false;
+			}
+			if(prev)
+				prev->flags |= IOSQE_IO_LINK;
+			prev = sqe;
+
+			size_t i = m_chain.size();
+			m_chain.emplace_back();
+			auto& send = m_chain.back();
+			send.m_length = min(iov[i].iov_len, static_cast<size_t>(RING_SEND_MAX));
+			send.m_result = 0;
+			int index = useFixed ? m_ring->FindRegisteredBuffer(iov[i].iov_base, send.m_length) : -1;
+			send.m_fixed = (index >= 0);
+
+			uint64_t userData = (wfm->m_ringID << 16) | i;
+			if(send.m_fixed)
+			{
+				SCPIUring::PrepSendFixed(sqe, m_socket, iov[i].iov_base, send.m_length, SEND_FLAGS | MSG_WAITALL,
+					index, userData);
+				wfm->m_ringNotifications ++;
+				m_ringNotifications ++;
+			}
+			else
+				SCPIUring::PrepSend(sqe, m_socket, iov[i].iov_base, send.m_length, SEND_FLAGS | MSG_WAITALL, userData);
+
+			if(send.m_length < iov[i].iov_len)
+				break;
+		}
+		size_t count = m_chain.size();
+		m_chainPending = count;
+
+		//Submit the chain and wait for all of it in the same system call where possible
+		while(m_chainPending > 0)
+		{
+			if(m_ring->Submit(1) < 0)
+				return false;
+			ReapRing();
+		}
+
+		//Skip past whatever was sent. A short send cancels the rest of the chain, so resubmit from there.
+		for(size_t i=0; i<count; i++)
+		{
+			auto& send = m_chain[i];
+			if(send.m_result > 0)
+			{
+				iov->iov_base = reinterpret_cast<char*>(iov->iov_base) + send.m_result;
+				iov->iov_len -= send.m_result;
+			}
+			if(send.m_result == static_cast<int>(send.m_length))
+			{
+				if(iov->iov_len > 0)
+					break;
+				iov ++;
+				iovcnt --;
+				continue;
+			}
+
+			//Non-blocking socket is full
+			if(send.m_result == -EAGAIN)
+			{
+				if(!WaitWritable())
+					return false;
+			}
+
+			//Zero-copy sends only work on TCP and UDP sockets, so stop using registered buffers on anything else
+			else if( (send.m_result == -EOPNOTSUPP) && send.m_fixed )
+			{
+				LogVerbose("WaveformStreamer: socket doesn't support zero-copy io_uring sends, copying instead\n");
+				m_fixedSends = false;
+				useFixed = false;
+			}
+			else if( (send.m_result == 0) ||
+				( (send.m_result < 0) && (send.m_result != -EINTR) && (send.m_result != -ECANCELED) ) )
+			{
+				LogWarning("WaveformStreamer: send failed (%s)\n",
+					send.m_result ? strerror(-send.m_result) : "connection closed");
+				return false;
+			}
+			break;
+		}
+	}
+
+	return true;
+}
+
+/**
+	@brief Registers the buffer pool's preallocated buffers with the io_uring, if they changed since last time
+ */
+void WaveformStreamer::UpdateRegisteredBuffers()
+{
+	if(m_poolRegistered && (!m_bufferPool || (m_bufferPool->GetGeneration() == m_registeredGeneration)))
+		return;
+
+	//The kernel may still be reading from the old registered buffers
+	while(m_ringNotifications > 0)
+	{
+		if(m_ring->Submit(1) < 0)
+			return;
+		ReapRing();
+	}
+
+	vector<iovec> regions;
+	if(m_bufferPool && m_fixedSends && m_ring->IsOpSupported(IORING_OP_SEND_ZC))
+	{
+		vector<pair<void*, size_t>> buffers;
+		m_registeredGeneration = m_bufferPool->GetRegions(buffers);
+		for(auto& b : buffers)
+			regions.push_back({b.first, b.second});
+	}
+	m_ring->RegisterBuffers(regions);
+	m_poolRegistered = true;
+}
+
+/**
+	@brief Processes every completion waiting on the io_uring
+
+	Zero-copy sends complete twice: once with the result, then again with IORING_CQE_F_NOTIF once the kernel is done
+	with the buffer. The first completion has IORING_CQE_F_MORE set if the second is still to come.
+ */
+void WaveformStreamer::ReapRing()
+{
+	while(auto cqe = m_ring->PeekCQE())
+	{
+		uint64_t id = cqe->user_data >> 16;
+		size_t index = cqe->user_data & 0xffff;
+		int res = cqe->res;
+		uint32_t flags = cqe->flags;
+		m_ring->AdvanceCQ();
+
+		//We always wait for a whole chain before submitting more, so results belong to the current chain
+		bool released = (flags & IORING_CQE_F_NOTIF) != 0;
+		if(!released && (index < m_chain.size()) )
+		{
+			auto& send = m_chain[index];
+			send.m_result = res;
+			m_chainPending --;
+			released = send.m_fixed && !(flags & IORING_CQE_F_MORE);
+		}
+
+		if(released)
+		{
+			auto wfm = FindRingWaveform(id);
+			if(wfm)
+				wfm->m_ringNotifications --;
+			m_ringNotifications --;
+		}
+	}
+}
+
+/**
+	@brief Finds the pending waveform whose io_uring sends carry a given ID
+
+	@return The waveform, or null if it's no longer pending
+ */
+WaveformStreamer::PendingWaveform* WaveformStreamer::FindRingWaveform(uint64_t id)
+{
+	//Usually one of the most recent
+	for(auto it = m_pending.rbegin(); it != m_pending.rend(); it++)
+	{
+		if(it->m_ringID == id)
+			return &*it;
+	}
+	return nullptr;
+}
+#endif
+
+/**
+	@brief Blocks until the socket can accept more data
+
+	@return False if the socket failed
+ */
+bool WaveformStreamer::WaitWritable()
+{
+#ifdef _WIN32
+	return true;
+#else
+	pollfd pfd;
+	pfd.fd = m_socket;
+	pfd.events = POLLOUT;
+	while(true)
+	{
+		int ret = poll(&pfd, 1, -1);
+		if( (ret < 0) && (errno == EINTR) )
+			continue;
+		if(ret < 0)
+			return false;
+
+		//POLLERR also fires when zero-copy completions are waiting, so collect those and keep going
+		if(pfd.revents & POLLERR)
+		{
+			if(!m_zeroCopy)
+				return false;
+			PollCompletions(false);
+		}
+		if(pfd.revents & POLLHUP)
+			return false;
+		if(pfd.revents & POLLOUT)
+			return true;
+	}
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Zero-copy completion handling
+
+/**
+	@brief Reads zero-copy completion notifications from the kernel and releases the buffers they refer to
+
+	@param wait		If true, block until at least one notification arrives (if any sends are outstanding)
+ */
+void WaveformStreamer::PollCompletions(bool wait)
+{
+#ifdef HAVE_IO_URING
+	if(m_ring)
+	{
+		size_t outstanding = m_ringNotifications;
+		ReapRing();
+		if(wait && (outstanding > 0) && (m_ringNotifications == outstanding) )
+		{
+			m_ring->Submit(1);
+			ReapRing();
+		}
+		ReleaseCompleted();
+		return;
+	}
+#endif
+
+#ifdef HAVE_ZEROCOPY
+	if(!m_zeroCopy)
+	{
+		ReleaseCompleted();
+		return;
+	}
+
+	bool gotAny = false;
+	while(true)
+	{
+		char control[128];
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if(recvmsg(m_socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+
+			//Nothing waiting. Block until something shows up if asked to.
+			if( (errno == EAGAIN) && wait && !gotAny && !m_pending.empty() )
+			{
+				pollfd pfd;
+				pfd.fd = m_socket;
+				pfd.events = 0;
+				if( (poll(&pfd, 1, 1000) < 0) && (errno != EINTR) )
+					break;
+				continue;
+			}
+			break;
+		}
+
+		for(auto cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+		{
+			if( !( (cm->cmsg_level == SOL_IP) && (cm->cmsg_type == IP_RECVERR) ) &&
+				!( (cm->cmsg_level == SOL_IPV6) && (cm->cmsg_type == IPV6_RECVERR) ) )
+			{
+				continue;
+			}
+
+			auto serr = reinterpret_cast<sock_extended_err*>(CMSG_DATA(cm));
+			if( (serr->ee_errno != 0) || (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) )
+				continue;
+
+			if( (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && !m_warnedCopied )
+			{
+				LogVerbose("WaveformStreamer: kernel fell back to copying zero-copy sends (loopback or no SG support)\n");
+				m_warnedCopied = true;
+			}
+
+			MarkCompleted(serr->ee_info, serr->ee_data);
+			gotAny = true;
+		}
+	}
+#else
+	(void)wait;
+#endif
+
+	ReleaseCompleted();
+}
+
+/**
+	@brief Records that zero-copy sends with IDs lo through hi (inclusive) have completed
+ */
+void WaveformStreamer::MarkCompleted(uint32_t lo, uint32_t hi)
+{
+	m_completedRanges.push_back(pair<uint32_t, uint32_t>(lo, hi));
+
+	//Advance m_completedID through every range contiguous with it (ranges almost always arrive in order)
+	bool progress = true;
+	while(progress)
+	{
+		progress = false;
+		for(size_t i=0; i<m_completedRanges.size(); i++)
+		{
+			auto r = m_completedRanges[i];
+			if(static_cast<int32_t>(r.first - m_completedID) > 0)
+				continue;
+
+			if(static_cast<int32_t>(r.second + 1 - m_completedID) > 0)
+				m_completedID = r.second + 1;
+			m_completedRanges.erase(m_completedRanges.begin() + i);
+			progress = true;
+			break;
+		}
+	}
+}
+
+/**
+	@brief Calls the completion callback for every waveform, in order, that the kernel no longer references
+ */
+void WaveformStreamer::ReleaseCompleted()
+{
+	while(!m_pending.empty())
+	{
+		auto& wfm = m_pending.front();
+		if(wfm.m_sending)
+			break;
+		if(wfm.m_zeroCopySent && (static_cast<int32_t>(wfm.m_lastID - m_completedID) >= 0) )
+			break;
+		if(wfm.m_ringNotifications > 0)
+			break;
+
+		if(m_callback)
+			m_callback(wfm.m_cookie);
+		m_pending.pop_front();
+	}
+}
@@ -0,0 +1,433 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef WaveformStreamer_h
+#define WaveformStreamer_h
+
+#include "SCPIServer.h"
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <stdint.h>
+
+class SCPIUring;
+class WaveformBufferPool;
+class WaveformSharedRing;
+
+/**
+	@brief Header sent in front of each waveform
+
+	All fields are in host byte order (little endian on every platform we support).
+ */
+#pragma pack(push, 1)
+class WaveformHeader
+{
+public:
+	///@brief Always WAVEFORM_MAGIC, so clients can detect framing errors
+	uint32_t m_magic;
+
+	///@brief Implementation-specific channel ID (same numbering as BridgeSCPIServer::GetChannelID())
+	uint16_t m_channel;
+
+	///@brief Encoding of the sample data (see WaveformEncoding)
+	uint8_t m_encoding;
+
+	///@brief Size of one sample in bytes, for raw encodings
+	uint8_t m_bytesPerSample;
+
+	///@brief Sequence number, incremented for every waveform sent on the stream
+	uint64_t m_sequence;
+
+	///@brief Sample rate in Hz
+	uint64_t m_sampleRate;
+
+	///@brief Offset from the trigger to the first sample, in femtoseconds
+	int64_t m_triggerPhase;
+
+	///@brief Number of samples in the waveform
+	uint64_t m_sampleCount;
+
+	///@brief Number of bytes of sample data following the header
+	uint64_t m_dataLength;
+};
+
+/**
+	@brief Sent in place of the sample data when a waveform was written to a shared memory ring
+
+	The header's m_dataLength is the size of this descriptor; the size of the sample data is m_length.
+ */
+class WaveformRingDescriptor
+{
+public:
+	///@brief Position of the first byte of sample data in the ring (see WaveformRingControl)
+	uint64_t m_position;
+
+	///@brief Number of bytes of sample data
+	uint64_t m_length;
+};
+
+/**
+	@brief Timing of one segment of a segmented acquisition (see WAVEFORM_SEGMENTED)
+ */
+class WaveformSegment
+{
+public:
+	///@brief Time of this segment's trigger relative to the first segment's, in femtoseconds
+	int64_t m_triggerTime;
+
+	///@brief Offset from this segment's trigger to its first sample, in femtoseconds
+	int64_t m_triggerPhase;
+};
+#pragma pack(pop)
+
+#define WAVEFORM_MAGIC 0x4d524657	//"WFRM"
+
+///@brief Encodings for WaveformHeader::m_encoding
+enum WaveformEncoding
+{
+	///@brief Raw signed ADC codes, m_bytesPerSample bytes each
+	WAVEFORM_RAW_INT = 0,
+
+	///@brief 32-bit floating point values
+	WAVEFORM_RAW_FLOAT = 1,
+
+	/**
+		@brief Flag ORed into the encoding if the sample data is a min/max envelope rather than the samples
+
+		The data is (min, max) pairs, one per bucket, in the waveform's sample format. m_sampleCount is still the
+		number of samples in the full waveform; the number of buckets is m_dataLength / (2 * m_bytesPerSample), and
+		bucket i covers samples [i*m_sampleCount/buckets, (i+1)*m_sampleCount/buckets).
+	 */
+	WAVEFORM_MIN_MAX = 0x40,
+
+	/**
+		@brief Flag ORed into the encoding if the sample data is compressed (see SampleCompression.h for the format)
+
+		Only used with WAVEFORM_RAW_INT at 1 or 2 bytes per sample. m_sampleCount and m_bytesPerSample describe the
+		samples after decompression; m_dataLength is the compressed size. Waveforms that don't get smaller are sent
+		uncompressed, without the flag.
+	 */
+	WAVEFORM_COMPRESSED = 0x20,
+
+	/**
+		@brief Flag ORed into the encoding if the waveform is the batch of segments from one segmented acquisition
+
+		The sample data starts with a uint64_t segment count N, then N WaveformSegment entries, then the samples of
+		each segment in turn. m_sampleCount is the number of samples per segment, and m_triggerPhase is the first
+		segment's. Segmented waveforms are never decimated or compressed.
+	 */
+	WAVEFORM_SEGMENTED = 0x10,
+
+	///@brief Flag ORed into the encoding if the sample data is in the shared memory ring
+	WAVEFORM_SHARED_MEMORY = 0x80
+};
+
+/**
+	@brief Sends channel sample buffers over a socket with minimal copying
+
+	Sample data is sent with scatter-gather I/O straight from the caller's buffers. If zero-copy mode is enabled, the
+	kernel reads the buffers directly as it transmits them, so they must not be modified or reused until the
+	completion callback has been called for them. Call PollCompletions() periodically (for example after each batch of
+	waveforms) to collect completion notifications. In normal mode the callback is called before SendWaveform()
+	returns.
+
+	With EnableUring(), buffers are sent as a linked chain of io_uring sends rather than with sendmsg(). Buffers from a
+	WaveformBufferPool given to SetBufferPool() are registered with the ring once, and sent zero-copy from there
+	without pinning their pages on every send; as in zero-copy mode, they're held until the kernel is done with them.
+
+	For clients on the same host, sample data can instead be copied into a shared memory ring (SetSharedRing()), with
+	only the header and a WaveformRingDescriptor sent on the socket.
+
+	The socket is not owned by the streamer. If it's also used for SCPI replies, the session must flush its replies
+	(SCPIServer::FlushReplies()) before sending a waveform so the two don't interleave.
+ */
+class WaveformStreamer
+{
+public:
+	/**
+		@brief Called when the kernel no longer needs a buffer passed to SendWaveform()
+
+		@param cookie	The cookie value passed to SendWaveform()
+	 */
+	typedef std::function<void(void* cookie)> CompletionCallback;
+
+	WaveformStreamer(ZSOCKET sock);
+	virtual ~WaveformStreamer();
+
+	void SetCompletionCallback(CompletionCallback callback)
+	{ m_callback = callback; }
+
+	bool EnableZeroCopy();
+
+	///@brief Returns true if zero-copy transmission is enabled
+	bool IsZeroCopyEnabled() const
+	{ return m_zeroCopy; }
+
+	bool EnableUring();
+
+	///@brief Returns true if waveforms are sent through io_uring
+	bool IsUringEnabled() const
+	{ return m_ring != nullptr; }
+
+	void SetBufferPool(WaveformBufferPool* pool);
+
+	/**
+		@brief Selects whether waveforms are wrapped in an IEEE 488.2 definite length block ("#<n><length><data>\n")
+	 */
+	void SetBlockFraming(bool enable)
+	{ m_blockFraming = enable; }
+
+	/**
+		@brief Selects whether each waveform is preceded by a WaveformHeader
+	 */
+	void SetHeaderEnabled(bool enable)
+	{ m_headerEnabled = enable; }
+
+	void SetSharedRing(std::shared_ptr<WaveformSharedRing> ring);
+
+	/**
+		@brief Sends a min/max envelope of at most this many buckets instead of the full waveform (0 to disable)
+
+		May be called from any thread; takes effect from the next waveform.
+	 */
+	void SetDecimation(size_t buckets)
+	{ m_decimation.store(buckets, std::memory_order_relaxed); }
+
+	///@brief Returns the number of min/max buckets waveforms are decimated to, or 0 if decimation is disabled
+	size_t GetDecimation() const
+	{ return m_decimation.load(std::memory_order_relaxed); }
+
+	/**
+		@brief Selects whether waveforms are compressed (see WAVEFORM_COMPRESSED)
+
+		May be called from any thread; takes effect from the next waveform. Decimated waveforms are not compressed.
+	 */
+	void SetCompression(bool enable)
+	{ m_compression.store(enable, std::memory_order_relaxed); }
+
+	///@brief Returns true if waveforms are compressed
+	bool IsCompressionEnabled() const
+	{ return m_compression.load(std::memory_order_relaxed); }
+
+	static bool CanDecimate(uint8_t encoding, uint8_t bytesPerSample);
+	static void Decimate(
+		uint8_t encoding,
+		uint8_t bytesPerSample,
+		const void* samples,
+		size_t sampleCount,
+		size_t buckets,
+		std::vector<uint8_t>& envelope);
+
+	static bool CanCompress(uint8_t encoding, uint8_t bytesPerSample);
+
+	///@brief Returns the shared memory ring waveforms are written to, if any
+	std::shared_ptr<WaveformSharedRing> GetSharedRing() const
+	{ return m_sharedRing; }
+
+	bool SendWaveform(
+		uint16_t channel,
+		uint64_t sampleRate,
+		int64_t triggerPhase,
+		uint8_t bytesPerSample,
+		const void* samples,
+		size_t sampleCount,
+		void* cookie = nullptr);
+
+	bool SendWaveform(WaveformHeader& header, const iovec* data, size_t iovcnt, void* cookie = nullptr);
+
+	bool SendSegments(
+		WaveformHeader& header,
+		const WaveformSegment* segments,
+		const iovec* data,
+		size_t segmentCount,
+		void* cookie = nullptr);
+
+	void PollCompletions(bool wait = false);
+
+	///@brief Returns the number of buffers the kernel still holds references to
+	size_t GetPendingCompletions() const
+	{ return m_pending.size(); }
+
+	///@brief Returns the sequence number the next waveform will be sent with
+	uint64_t GetNextSequence() const
+	{ return m_sequence; }
+
+protected:
+	class PendingWaveform;
+	PendingWaveform& AddPending(void* cookie);
+	bool SendPending(PendingWaveform& wfm, WaveformHeader& header, const iovec* data, size_t iovcnt);
+	bool SendBuffers(iovec* iov, size_t iovcnt, PendingWaveform* wfm);
+	bool SendRing(iovec* iov, size_t iovcnt, PendingWaveform* wfm);
+	bool WaitWritable();
+
+	///@brief The socket we send on
+	ZSOCKET m_socket;
+
+	///@brief Called when the kernel is done with a buffer
+	CompletionCallback m_callback;
+
+	///@brief Sequence number for the next waveform
+	uint64_t m_sequence;
+
+	///@brief True if MSG_ZEROCOPY is enabled on the socket
+	bool m_zeroCopy;
+
+	///@brief True to wrap waveforms in IEEE 488.2 block framing
+	bool m_blockFraming;
+
+	///@brief True to send a WaveformHeader in front of each waveform
+	bool m_headerEnabled;
+
+	///@brief Set once we've warned that the kernel is copying zero-copy sends anyway
+	bool m_warnedCopied;
+
+	///@brief Shared memory ring sample data is copied into, or null to send it on the socket
+	std::shared_ptr<WaveformSharedRing> m_sharedRing;
+
+	///@brief Number of min/max buckets to decimate waveforms to, or 0 to send them in full
+	std::atomic<size_t> m_decimation;
+
+	///@brief True to compress waveforms
+	std::atomic<bool> m_compression;
+
+	/**
+		@brief A waveform that has been sent, but may still be referenced by the kernel
+
+		The framing and header are stored here rather than on the stack since, in zero-copy mode, the kernel reads
+		them after SendWaveform() returns.
+	 */
+	class PendingWaveform
+	{
+	public:
+		///@brief Zero-copy notification ID of the first send for this waveform
+		uint32_t m_firstID;
+
+		///@brief Zero-copy notification ID of the last send for this waveform
+		uint32_t m_lastID;
+
+		///@brief True if at least one zero-copy send was issued for this waveform
+		bool m_zeroCopySent;
+
+		///@brief True while SendWaveform() is still sending this waveform
+		bool m_sending;
+
+		///@brief ID of this waveform's sends in the io_uring completions
+		uint64_t m_ringID;
+
+		///@brief Number of io_uring zero-copy sends of this waveform whose buffers the kernel still references
+		size_t m_ringNotifications;
+
+		///@brief Cookie to pass to the completion callback
+		void* m_cookie;
+
+		///@brief IEEE 488.2 block prefix
+		char m_prefix[16];
+
+		///@brief Waveform header
+		WaveformHeader m_header;
+
+		///@brief Location of the sample data, if it was written to the shared memory ring
+		WaveformRingDescriptor m_ringDescriptor;
+
+		///@brief Sample data as re-encoded by the streamer (min/max envelope or compressed samples), if it was
+		std::vector<uint8_t> m_encoded;
+
+		///@brief Segment count and WaveformSegment entries, for segmented waveforms
+		std::vector<uint8_t> m_segmentTable;
+	};
+
+	void ReleaseCompleted();
+	void MarkCompleted(uint32_t lo, uint32_t hi);
+
+	///@brief Waveforms in order of submission (elements don't move as the deque grows, so iovecs can point at them)
+	std::deque<PendingWaveform> m_pending;
+
+	///@brief Notification ID the kernel will assign to the next zero-copy send
+	uint32_t m_nextZeroCopyID;
+
+	///@brief All zero-copy sends with IDs before this one have completed
+	uint32_t m_completedID;
+
+	///@brief Completed ID ranges that arrived out of order (not contiguous with m_completedID)
+	std::vector<std::pair<uint32_t, uint32_t>> m_completedRanges;
+
+	///@brief Scratch buffer list, reused across sends
+	std::vector<iovec> m_iovs;
+
+	///@brief Scratch list of the segment table and segment buffers, reused across SendSegments() calls
+	std::vector<iovec> m_segmentIovs;
+
+	void UpdateRegisteredBuffers();
+	void ReapRing();
+	PendingWaveform* FindRingWaveform(uint64_t id);
+
+	///@brief One send in the chain currently submitted to the io_uring
+	class ChainedSend
+	{
+	public:
+		///@brief Number of bytes submitted
+		size_t m_length;
+
+		///@brief Result of the send (bytes sent or negative error code)
+		int m_result;
+
+		///@brief True if this was a zero-copy send from a registered buffer
+		bool m_fixed;
+	};
+
+	///@brief io_uring waveforms are sent through, or null to send them with sendmsg()
+	std::unique_ptr<SCPIUring> m_ring;
+
+	///@brief Pool whose preallocated buffers are registered with m_ring, or null
+	WaveformBufferPool* m_bufferPool;
+
+	///@brief Pool generation the buffers registered with m_ring belong to
+	uint32_t m_registeredGeneration;
+
+	///@brief True if the buffers registered with m_ring are up to date with m_bufferPool
+	bool m_poolRegistered;
+
+	///@brief False once the socket has turned out not to support zero-copy io_uring sends
+	bool m_fixedSends;
+
+	///@brief ID for the next waveform sent through m_ring
+	uint64_t m_nextRingID;
+
+	///@brief Number of zero-copy sends through m_ring whose buffers the kernel still references
+	size_t m_ringNotifications;
+
+	///@brief Sends in the chain currently submitted to m_ring, in chain order
+	std::vector<ChainedSend> m_chain;
+
+	///@brief Number of sends in m_chain that haven't completed yet
+	size_t m_chainPending;
+};
+
+#endif
@@ -0,0 +1,200 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@brief Mock bridge and loopback transport shared by the server benchmark and the trace replay tool
+ */
+
+#ifndef MockBridge_h
+#define MockBridge_h
+
+#include "../BridgeSCPIServer.h"
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Mock bridge
+
+/**
+	@brief Bridge with four analog channels and no hardware behind it
+ */
+class MockBridge : public BridgeSCPIServer
+{
+public:
+	MockBridge(ZSOCKET sock)
+		: BridgeSCPIServer(sock)
+	{}
+
+protected:
+	virtual std::string GetMake()
+	{ return "Benchmark"; }
+
+	virtual std::string GetModel()
+	{ return "MockBridge"; }
+
+	virtual std::string GetSerial()
+	{ return "0000"; }
+
+	virtual std::string GetFirmwareVersion()
+	{ return "1.0"; }
+
+	virtual size_t GetAnalogChannelCount()
+	{ return 4; }
+
+	virtual std::vector<size_t> GetSampleRates()
+	{ return { 1000000, 10000000, 100000000, 1000000000, 2500000000 }; }
+
+	virtual std::vector<size_t> GetSampleDepths()
+	{ return { 1000, 10000, 100000, 1000000, 10000000 }; }
+
+	virtual void AcquisitionStart(bool /*oneShot*/)
+	{}
+
+	virtual void AcquisitionForceTrigger()
+	{}
+
+	virtual void AcquisitionStop()
+	{}
+
+	virtual bool IsTriggerArmed()
+	{ return false; }
+
+	//START, SINGLE and STOP are the only things that change the trigger state, and they record it themselves
+	virtual bool UsesPushedTriggerState()
+	{ return true; }
+
+	virtual void SetChannelEnabled(size_t /*chIndex*/, bool /*enabled*/)
+	{}
+
+	virtual void SetAnalogCoupling(size_t /*chIndex*/, const std::string& /*coupling*/)
+	{}
+
+	virtual void SetAnalogRange(size_t /*chIndex*/, double /*range_V*/)
+	{}
+
+	virtual void SetAnalogOffset(size_t /*chIndex*/, double /*offset_V*/)
+	{}
+
+	virtual void SetDigitalThreshold(size_t /*chIndex*/, double /*threshold_V*/)
+	{}
+
+	virtual void SetDigitalHysteresis(size_t /*chIndex*/, double /*hysteresis*/)
+	{}
+
+	virtual void SetSampleRate(uint64_t /*rate_hz*/)
+	{}
+
+	virtual void SetSampleDepth(uint64_t /*depth*/)
+	{}
+
+	virtual void SetTriggerDelay(uint64_t /*delay_fs*/)
+	{}
+
+	virtual void SetTriggerSource(size_t /*chIndex*/)
+	{}
+
+	virtual void SetTriggerLevel(double /*level_V*/)
+	{}
+
+	virtual void SetTriggerTypeEdge()
+	{}
+
+	virtual void SetEdgeTriggerEdge(const std::string& /*edge*/)
+	{}
+
+	virtual bool GetChannelID(const std::string& subject, size_t& id_out)
+	{
+		if( (subject.length() == 2) && (subject[0] == 'C') && (subject[1] >= '1') && (subject[1] <= '4') )
+		{
+			id_out = subject[1] - '1';
+			return true;
+		}
+		return false;
+	}
+
+	virtual ChannelType GetChannelType(size_t /*channel*/)
+	{ return CH_ANALOG; }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Transport
+
+/**
+	@brief Creates a connected pair of sockets, either a socketpair or a loopback TCP connection
+
+	@param server	Server end
+	@param client	Client end
+ */
+inline bool Connect(bool tcp, int& server, int& client)
+{
+	if(!tcp)
+	{
+		int sv[2];
+		if(0 != socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+			return false;
+		server = sv[0];
+		client = sv[1];
+		return true;
+	}
+
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	socklen_t len = sizeof(addr);
+	if( (0 != ::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))) ||
+		(0 != listen(listener, 1)) ||
+		(0 != getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &len)) )
+	{
+		close(listener);
+		return false;
+	}
+
+	client = socket(AF_INET, SOCK_STREAM, 0);
+	if(0 != connect(client, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)))
+	{
+		close(listener);
+		return false;
+	}
+	server = accept(listener, nullptr, nullptr);
+	close(listener);
+
+	int one = 1;
+	setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return server >= 0;
+}
+
+#endif
@@ -0,0 +1,447 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@brief Loopback benchmark for the SCPI server: replays command scripts against a mock bridge
+
+	The server runs a BridgeSCPIServer subclass whose hardware hooks do nothing, so the numbers measure only the
+	socket I/O, parsing and dispatch code in this library. A client thread sends each batch of a script, waits for
+	all of its replies, and records the round trip time.
+
+	Usage: scpi-server-bench [options] [scenario or script file...]
+
+	Built in scenarios:
+		config		Connect-time configuration burst (every channel setting, then the capability queries)
+		armed		ARMED? polling, one query per round trip
+		pipeline	Batches of 64 commands and queries on one line
+
+	Script files contain one batch per line; each line is sent as-is and every query in it must be answered
+	before the next line is sent. Lines starting with '#' are ignored.
+
+	Options:
+		--tcp				Use loopback TCP instead of a socketpair
+		--async				Run handlers on the async worker thread (SCPIServer::EnableAsyncExecution)
+		--loop=BACKEND		Run the server session in an SCPIEventLoop with the given backend ("epoll" or "uring")
+							instead of SCPIServer::MainLoop(). Linux only.
+		--handlers=MODE		Which command path to measure: "legacy" (through the string-based handlers, the
+							BridgeSCPIServer default), "table" (straight to the dispatch table, see
+							BridgeSCPIServer::SetLegacyHandlersEnabled) or "both" (the default)
+		--iterations N		Number of times to run each script (default 2000)
+		--no-stats			Turn off SCPIStatistics recording
+		--json				Print one JSON object per scenario instead of a table
+
+	The thread settings from SCPIThreading (--control-cpus=, --control-fifo= and so on) are also accepted, and apply to
+	the server thread.
+ */
+
+#include "../SCPIStatistics.h"
+#include "../SCPIThreading.h"
+#ifdef __linux__
+#include "../SCPIEventLoop.h"
+#endif
+#include "MockBridge.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Scripts
+
+/**
+	@brief A named list of batches, each sent as one write
+ */
+class Script
+{
+public:
+	string m_name;
+	vector<string> m_batches;
+};
+
+static Script ConfigScript()
+{
+	Script s;
+	s.m_name = "config";
+	s.m_batches.push_back("*IDN?");
+	s.m_batches.push_back("CHANS?");
+
+	string burst;
+	for(int i=1; i<=4; i++)
+	{
+		string ch = "C" + to_string(i);
+		burst += ch + ":ON;" + ch + ":COUP DC1M;" + ch + ":RANGE 2.5;" + ch + ":OFFS -0.125;";
+	}
+	burst += "RATE 1000000000;DEPTH 1000000;TRIG:MODE EDGE;TRIG:SOU C1;TRIG:LEV 0.25;TRIG:EDGE:DIR RISING;"
+		"TRIG:DELAY 500000000;RATES?;DEPTHS?";
+	s.m_batches.push_back(burst);
+	return s;
+}
+
+static Script ArmedScript()
+{
+	Script s;
+	s.m_name = "armed";
+	for(int i=0; i<100; i++)
+		s.m_batches.push_back("ARMED?");
+	return s;
+}
+
+static Script PipelineScript()
+{
+	Script s;
+	s.m_name = "pipeline";
+	string batch;
+	for(int i=0; i<16; i++)
+		batch += string(i ? ";" : "") + "C1:OFFS 0.1;C2:RANGE 1.5;ARMED?;TRIG:LEV 0.5";
+	s.m_batches.push_back(batch);
+	return s;
+}
+
+/**
+	@brief Loads a script file (one batch per line)
+ */
+static bool LoadScript(const string& path, Script& s)
+{
+	ifstream in(path);
+	if(!in)
+		return false;
+
+	s.m_name = path;
+	string line;
+	while(getline(in, line))
+	{
+		if(line.empty() || (line[0] == '#'))
+			continue;
+		s.m_batches.push_back(line);
+	}
+	return true;
+}
+
+/**
+	@brief Counts the commands in a batch, and how many of them are queries
+ */
+static void CountCommands(const string& batch, size_t& commands, size_t& queries)
+{
+	commands = 0;
+	queries = 0;
+	size_t start = 0;
+	while(start <= batch.length())
+	{
+		size_t end = batch.find(';', start);
+		if(end == string::npos)
+			end = batch.length();
+
+		auto cmd = batch.substr(start, end - start);
+		if(cmd.find_first_not_of(" \t") != string::npos)
+		{
+			commands ++;
+			if(cmd.find('?') != string::npos)
+				queries ++;
+		}
+		start = end + 1;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Benchmark
+
+/**
+	@brief Server session for the benchmark, optionally running handlers asynchronously
+ */
+class BenchBridge : public MockBridge
+{
+public:
+	BenchBridge(ZSOCKET sock, bool async, bool legacy)
+		: MockBridge(sock)
+	{
+		SetLegacyHandlersEnabled(legacy);
+		if(async)
+			EnableAsyncExecution();
+	}
+};
+
+/**
+	@brief Results of one scenario
+ */
+class Result
+{
+public:
+	size_t m_batches;
+	size_t m_commands;
+	double m_seconds;
+	vector<uint64_t> m_rtt;
+};
+
+/**
+	@brief Sends every batch of a script the given number of times, timing each round trip
+
+	@return False if the connection failed
+ */
+static bool RunScript(int sock, const Script& script, size_t iterations, Result& result)
+{
+	//Precompute the wire format and reply count for each batch
+	vector<string> wire;
+	vector<size_t> replies;
+	size_t commandsPerIteration = 0;
+	for(auto& b : script.m_batches)
+	{
+		size_t commands;
+		size_t queries;
+		CountCommands(b, commands, queries);
+		commandsPerIteration += commands;
+		wire.push_back(b + "\n");
+		replies.push_back(queries);
+	}
+
+	//Scripts ending in a command with no reply would never wait for the server; finish each iteration with a
+	//query so every round trip is measured end to end
+	wire.push_back("ARMED?\n");
+	replies.push_back(1);
+	commandsPerIteration ++;
+
+	result.m_rtt.clear();
+	result.m_rtt.reserve(iterations * wire.size());
+	result.m_batches = iterations * wire.size();
+	result.m_commands = iterations * commandsPerIteration;
+
+	char buf[65536];
+	auto start = chrono::steady_clock::now();
+	for(size_t it=0; it<iterations; it++)
+	{
+		for(size_t i=0; i<wire.size(); i++)
+		{
+			auto t0 = chrono::steady_clock::now();
+			if(wire[i].length() != (size_t)send(sock, wire[i].c_str(), wire[i].length(), MSG_NOSIGNAL))
+				return false;
+
+			size_t lines = 0;
+			while(lines < replies[i])
+			{
+				ssize_t len = recv(sock, buf, sizeof(buf), 0);
+				if(len <= 0)
+					return false;
+				lines += count(buf, buf + len, '\n');
+			}
+			auto t1 = chrono::steady_clock::now();
+
+			if(replies[i])
+				result.m_rtt.push_back(chrono::duration_cast<chrono::nanoseconds>(t1 - t0).count());
+		}
+	}
+	result.m_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	sort(result.m_rtt.begin(), result.m_rtt.end());
+	return true;
+}
+
+static uint64_t Percentile(const vector<uint64_t>& sorted, double p)
+{
+	if(sorted.empty())
+		return 0;
+	size_t i = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+	return sorted[min(i, sorted.size() - 1)];
+}
+
+int main(int argc, char* argv[])
+{
+	bool tcp = false;
+	bool async = false;
+	bool json = false;
+	string loop;
+	string handlers = "both";
+	size_t iterations = 2000;
+	vector<Script> scripts;
+
+	for(int i=1; i<argc; i++)
+	{
+		string arg(argv[i]);
+		if(arg == "--tcp")
+			tcp = true;
+		else if(arg == "--async")
+			async = true;
+		else if(arg == "--json")
+			json = true;
+		else if(arg.find("--loop=") == 0)
+			loop = arg.substr(7);
+		else if(arg.find("--handlers=") == 0)
+			handlers = arg.substr(11);
+		else if(arg == "--no-stats")
+			SCPIStatistics::Get().SetEnabled(false);
+		else if(SCPIThreading::Get().ParseArgument(arg))
+			continue;
+		else if( (arg == "--iterations") && (i+1 < argc) )
+			iterations = strtoul(argv[++i], nullptr, 10);
+		else if(arg == "config")
+			scripts.push_back(ConfigScript());
+		else if(arg == "armed")
+			scripts.push_back(ArmedScript());
+		else if(arg == "pipeline")
+			scripts.push_back(PipelineScript());
+		else
+		{
+			Script s;
+			if(!LoadScript(arg, s))
+			{
+				fprintf(stderr, "Couldn't load script %s\n", arg.c_str());
+				return 1;
+			}
+			scripts.push_back(s);
+		}
+	}
+	if(scripts.empty())
+		scripts = { ConfigScript(), ArmedScript(), PipelineScript() };
+
+#ifdef __linux__
+	auto backend = SCPIEventLoop::BACKEND_EPOLL;
+	if(loop == "uring")
+		backend = SCPIEventLoop::BACKEND_URING;
+	else if(!loop.empty() && (loop != "epoll"))
+	{
+		fprintf(stderr, "Unknown event loop backend %s\n", loop.c_str());
+		return 1;
+	}
+#else
+	if(!loop.empty())
+	{
+		fprintf(stderr, "--loop is only supported on Linux\n");
+		return 1;
+	}
+#endif
+
+	vector<bool> legacyModes;
+	if(handlers == "legacy")
+		legacyModes = { true };
+	else if(handlers == "table")
+		legacyModes = { false };
+	else if(handlers == "both")
+		legacyModes = { true, false };
+	else
+	{
+		fprintf(stderr, "Unknown handler mode %s\n", handlers.c_str());
+		return 1;
+	}
+
+	const char* transport = tcp ? "tcp" : "socketpair";
+	const char* mode = async ? "async" : "blocking";
+	if(!json)
+	{
+		printf("%-12s %-8s %10s %12s %10s %10s %10s %10s\n",
+			"scenario", "handlers", "commands", "cmds/sec", "p50 us", "p99 us", "p999 us", "max us");
+	}
+
+	for(bool legacy : legacyModes)
+	for(auto& script : scripts)
+	{
+		const char* handlerMode = legacy ? "legacy" : "table";
+
+		int server;
+		int client;
+		if(!Connect(tcp, server, client))
+		{
+			fprintf(stderr, "Couldn't create %s connection\n", transport);
+			return 1;
+		}
+
+#ifdef __linux__
+		//Report the backend actually in use, since io_uring falls back to epoll if the kernel doesn't support it
+		unique_ptr<SCPIEventLoop> eventLoop;
+		if(!loop.empty())
+		{
+			eventLoop = make_unique<SCPIEventLoop>(
+				[async, legacy](ZSOCKET sock) { return new BenchBridge(sock, async, legacy); },
+				1,
+				backend);
+			eventLoop->AddClient(server);
+			loop = SCPIEventLoop::GetBackendName(eventLoop->GetBackend());
+		}
+#endif
+
+		thread serverThread([&]
+			{
+#ifdef __linux__
+				if(eventLoop)
+				{
+					eventLoop->Run();
+					return;
+				}
+#endif
+				BenchBridge bridge(server, async, legacy);
+				bridge.MainLoop();
+			});
+
+		//Warm up, then measure
+		Result result;
+		bool ok = RunScript(client, script, max<size_t>(iterations / 10, 1), result) &&
+			RunScript(client, script, iterations, result);
+
+		send(client, "EXIT\n", 5, MSG_NOSIGNAL);
+#ifdef __linux__
+		if(eventLoop)
+			eventLoop->Stop();
+#endif
+		serverThread.join();
+		close(client);
+
+		if(!ok)
+		{
+			fprintf(stderr, "Connection failed during %s\n", script.m_name.c_str());
+			return 1;
+		}
+
+		double rate = result.m_commands / result.m_seconds;
+		if(json)
+		{
+			printf("{\"scenario\":\"%s\",\"transport\":\"%s\",\"mode\":\"%s\",\"loop\":\"%s\",\"handlers\":\"%s\","
+				"\"iterations\":%zu,\"batches\":%zu,\"commands\":%zu,\"seconds\":%.6f,\"commands_per_sec\":%.1f,"
+				"\"rtt_ns\":{\"p50\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu}}\n",
+				script.m_name.c_str(), transport, mode, loop.empty() ? "mainloop" : loop.c_str(), handlerMode, iterations,
+				result.m_batches, result.m_commands, result.m_seconds, rate,
+				(unsigned long)Percentile(result.m_rtt, 0.5),
+				(unsigned long)Percentile(result.m_rtt, 0.99),
+				(unsigned long)Percentile(result.m_rtt, 0.999),
+				(unsigned long)(result.m_rtt.empty() ? 0 : result.m_rtt.back()));
+		}
+		else
+		{
+			printf("%-12s %-8s %10zu %12.0f %10.1f %10.1f %10.1f %10.1f\n",
+				script.m_name.c_str(), handlerMode, result.m_commands, rate,
+				Percentile(result.m_rtt, 0.5) * 1e-3,
+				Percentile(result.m_rtt, 0.99) * 1e-3,
+				Percentile(result.m_rtt, 0.999) * 1e-3,
+				(result.m_rtt.empty() ? 0 : result.m_rtt.back()) * 1e-3);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,300 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@brief Replays a recorded SCPI session trace against a mock bridge
+
+	Reads a trace written by SCPIServer::StartTrace(), sends its command lines to a BridgeSCPIServer subclass with
+	no hardware behind it, and compares the handler run times in the original trace with those of the replay (which
+	is itself recorded, so it can be replayed or inspected later). Replies are counted but not compared, since the
+	mock bridge doesn't know the state of the original hardware.
+
+	Usage: scpi-trace-replay [options] trace
+
+	Options:
+		--realtime			Send each command at its original time instead of as fast as possible
+		--tcp				Use loopback TCP instead of a socketpair
+		--async				Run handlers on the async worker thread (SCPIServer::EnableAsyncExecution)
+		--record path		Trace file for the replay (default: the input path with ".replay" appended)
+ */
+
+#include "../SCPITraceReader.h"
+#include "MockBridge.h"
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Trace summaries
+
+/**
+	@brief Handler run times for one command header
+ */
+class HandlerTimes
+{
+public:
+	HandlerTimes()
+		: m_count(0)
+		, m_total(0)
+	{}
+
+	size_t m_count;
+	uint64_t m_total;
+};
+
+/**
+	@brief What a trace contains
+ */
+class TraceSummary
+{
+public:
+	TraceSummary()
+		: m_replies(0)
+		, m_events(0)
+	{}
+
+	///@brief Command lines and their timestamps, without the final EXIT
+	vector<pair<uint64_t, string>> m_commands;
+
+	size_t m_replies;
+	size_t m_events;
+
+	///@brief Handler run times keyed by command header (the line up to the first space)
+	map<string, HandlerTimes> m_handlers;
+};
+
+/**
+	@brief Reads a trace into a summary
+ */
+static bool LoadTrace(const string& path, TraceSummary& summary)
+{
+	SCPITraceReader reader;
+	if(!reader.Open(path))
+		return false;
+
+	SCPITraceRecord record;
+	string_view payload;
+	while(reader.Next(record, payload))
+	{
+		switch(record.m_type)
+		{
+			case TRACE_COMMAND:
+				if(payload != "EXIT")
+					summary.m_commands.emplace_back(record.m_timestamp, string(payload));
+				break;
+
+			case TRACE_REPLY:
+				summary.m_replies ++;
+				break;
+
+			case TRACE_EVENT:
+				summary.m_events ++;
+				break;
+
+			case TRACE_HANDLER:
+				{
+					uint64_t duration;
+					if(payload.length() < sizeof(duration))
+						break;
+					memcpy(&duration, payload.data(), sizeof(duration));
+					auto line = payload.substr(sizeof(duration));
+					auto& times = summary.m_handlers[string(line.substr(0, line.find(' ')))];
+					times.m_count ++;
+					times.m_total += duration;
+				}
+				break;
+
+			default:
+				break;
+		}
+	}
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Replay
+
+/**
+	@brief Server session for the replay, recording itself to a trace
+ */
+class ReplayBridge : public MockBridge
+{
+public:
+	ReplayBridge(ZSOCKET sock, bool async)
+		: MockBridge(sock)
+	{
+		if(async)
+			EnableAsyncExecution();
+	}
+};
+
+/**
+	@brief Sends every command in a trace, then EXIT
+
+	@param realtime	True to send each command at its original offset from the first one
+ */
+static void SendCommands(int sock, const TraceSummary& summary, bool realtime)
+{
+	auto start = chrono::steady_clock::now();
+	uint64_t first = summary.m_commands.empty() ? 0 : summary.m_commands[0].first;
+
+	//Batch lines into large writes when not pacing them, as a pipelining client would
+	string wire;
+	for(auto& c : summary.m_commands)
+	{
+		if(realtime)
+		{
+			this_thread::sleep_until(start + chrono::nanoseconds(c.first - first));
+			wire = c.second + "\n";
+			if(wire.length() != (size_t)send(sock, wire.c_str(), wire.length(), MSG_NOSIGNAL))
+				return;
+			continue;
+		}
+
+		wire += c.second;
+		wire += '\n';
+		if(wire.length() >= 65536)
+		{
+			if(wire.length() != (size_t)send(sock, wire.c_str(), wire.length(), MSG_NOSIGNAL))
+				return;
+			wire.clear();
+		}
+	}
+	if(realtime)
+		wire.clear();
+	wire += "EXIT\n";
+	send(sock, wire.c_str(), wire.length(), MSG_NOSIGNAL);
+}
+
+int main(int argc, char* argv[])
+{
+	bool tcp = false;
+	bool async = false;
+	bool realtime = false;
+	string input;
+	string output;
+
+	for(int i=1; i<argc; i++)
+	{
+		string arg(argv[i]);
+		if(arg == "--tcp")
+			tcp = true;
+		else if(arg == "--async")
+			async = true;
+		else if(arg == "--realtime")
+			realtime = true;
+		else if( (arg == "--record") && (i+1 < argc) )
+			output = argv[++i];
+		else if(input.empty())
+			input = arg;
+		else
+		{
+			fprintf(stderr, "Unexpected argument %s\n", arg.c_str());
+			return 1;
+		}
+	}
+	if(input.empty())
+	{
+		fprintf(stderr, "Usage: scpi-trace-replay [--realtime] [--tcp] [--async] [--record path] trace\n");
+		return 1;
+	}
+	if(output.empty())
+		output = input + ".replay";
+
+	TraceSummary original;
+	if(!LoadTrace(input, original))
+		return 1;
+
+	int server;
+	int client;
+	if(!Connect(tcp, server, client))
+	{
+		fprintf(stderr, "Couldn't create %s connection\n", tcp ? "tcp" : "socketpair");
+		return 1;
+	}
+
+	bool recording = false;
+	thread serverThread([server, async, &output, &recording]
+		{
+			ReplayBridge bridge(server, async);
+			recording = bridge.StartTrace(output);
+			bridge.MainLoop();
+			bridge.StopAsyncExecution();
+			bridge.StopTrace();
+		});
+
+	//Send from another thread so a long run of replies can't fill the socket and stall both ends
+	auto start = chrono::steady_clock::now();
+	thread senderThread(SendCommands, client, cref(original), realtime);
+
+	size_t replies = 0;
+	char buf[65536];
+	ssize_t len;
+	while( (len = recv(client, buf, sizeof(buf), 0)) > 0)
+		replies += count(buf, buf + len, '\n');
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	senderThread.join();
+	serverThread.join();
+	close(client);
+
+	printf("%zu commands, %zu replies recorded, %zu received, %zu events recorded\n",
+		original.m_commands.size(), original.m_replies, replies, original.m_events);
+	printf("%.3f s, %.0f cmds/sec (%s, %s%s)\n",
+		seconds, original.m_commands.size() / seconds,
+		tcp ? "tcp" : "socketpair", async ? "async" : "blocking", realtime ? ", realtime" : "");
+
+	TraceSummary replay;
+	if(!recording || !LoadTrace(output, replay))
+		return 1;
+
+	printf("\n%-24s %10s %14s %14s\n", "command", "count", "original us", "replay us");
+	for(auto& it : original.m_handlers)
+	{
+		auto& times = it.second;
+		auto r = replay.m_handlers.find(it.first);
+		double replayMean = -1;
+		if( (r != replay.m_handlers.end()) && r->second.m_count )
+			replayMean = r->second.m_total * 1e-3 / r->second.m_count;
+
+		printf("%-24s %10zu %14.2f ", it.first.c_str(), times.m_count, times.m_total * 1e-3 / times.m_count);
+		if(replayMean < 0)
+			printf("%14s\n", "-");
+		else
+			printf("%14.2f\n", replayMean);
+	}
+
+	return 0;
+}
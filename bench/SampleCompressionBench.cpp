@@ -0,0 +1,155 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@brief Round trip check and benchmark for waveform compression
+
+	Compresses synthetic waveforms typical of 8 and 12 bit ADCs, checks that every one decompresses to the original
+	samples, and prints the compression ratio and throughput. Edge cases (partial blocks, extreme values and damaged
+	streams) are covered by tests/SampleCompressionTest.cpp, which client implementers can also use to check their own
+	decoders against CompressSamples().
+ */
+
+#include "../SampleCompression.h"
+#include <chrono>
+#include <math.h>
+#include <random>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+using namespace std;
+
+///@brief Number of samples per waveform
+static const size_t BENCH_SAMPLES = 4 * 1024 * 1024;
+
+///@brief Number of timed calls per waveform
+static const size_t BENCH_ITERATIONS = 20;
+
+/**
+	@brief Compresses and decompresses a waveform, returning true if the samples come back unchanged
+ */
+static bool RoundTrip(const void* samples, size_t count, uint8_t bytesPerSample, vector<uint8_t>& packed)
+{
+	packed.resize(GetCompressedBound(count, bytesPerSample));
+	size_t len = CompressSamples(samples, count, bytesPerSample, packed.data());
+	if(len > packed.size())
+		return false;
+	packed.resize(len);
+
+	vector<uint8_t> out(count * bytesPerSample + 1, 0xcc);
+	if(!DecompressSamples(packed.data(), len, out.data(), count, bytesPerSample))
+		return false;
+
+	//Must not write past the end of the output
+	if(out[count * bytesPerSample] != 0xcc)
+		return false;
+	return (count == 0) || (memcmp(out.data(), samples, count * bytesPerSample) == 0);
+}
+
+/**
+	@brief Checks a waveform round trips, then prints its compression ratio and throughput
+ */
+static bool BenchWaveform(const char* name, const void* samples, uint8_t bytesPerSample)
+{
+	vector<uint8_t> packed;
+	if(!RoundTrip(samples, BENCH_SAMPLES, bytesPerSample, packed))
+	{
+		printf("%-28s FAILED\n", name);
+		return false;
+	}
+
+	size_t rawSize = BENCH_SAMPLES * bytesPerSample;
+	vector<uint8_t> buf(GetCompressedBound(BENCH_SAMPLES, bytesPerSample));
+	vector<uint8_t> out(rawSize);
+
+	auto start = chrono::steady_clock::now();
+	for(size_t i=0; i<BENCH_ITERATIONS; i++)
+		CompressSamples(samples, BENCH_SAMPLES, bytesPerSample, buf.data());
+	chrono::duration<double> encodeTime = chrono::steady_clock::now() - start;
+
+	start = chrono::steady_clock::now();
+	for(size_t i=0; i<BENCH_ITERATIONS; i++)
+		DecompressSamples(packed.data(), packed.size(), out.data(), BENCH_SAMPLES, bytesPerSample);
+	chrono::duration<double> decodeTime = chrono::steady_clock::now() - start;
+
+	//Throughput is in bytes of uncompressed samples
+	double bytes = static_cast<double>(rawSize) * BENCH_ITERATIONS;
+	printf("%-28s ratio %5.2f  encode %6.2f GB/s  decode %6.2f GB/s\n",
+		name,
+		static_cast<double>(rawSize) / packed.size(),
+		bytes / encodeTime.count() / 1e9,
+		bytes / decodeTime.count() / 1e9);
+	return true;
+}
+
+int main()
+{
+	bool ok = true;
+
+	minstd_rand rng(42);
+	normal_distribution<float> noise(0, 1);
+
+	//Sine wave plus a few codes of noise, as an 8 bit ADC with a well scaled input would see
+	vector<int8_t> sine8(BENCH_SAMPLES);
+	for(size_t i=0; i<BENCH_SAMPLES; i++)
+		sine8[i] = static_cast<int8_t>(lrintf(100 * sinf(i * 0.001f) + noise(rng)));
+	ok &= BenchWaveform("int8 sine + noise", sine8.data(), 1);
+
+	//The same for a 12 bit ADC in 16 bit containers
+	vector<int16_t> sine12(BENCH_SAMPLES);
+	for(size_t i=0; i<BENCH_SAMPLES; i++)
+		sine12[i] = static_cast<int16_t>(lrintf(1800 * sinf(i * 0.001f) + 2 * noise(rng)));
+	ok &= BenchWaveform("int12 sine + noise", sine12.data(), 2);
+
+	//Mostly idle signal with occasional pulses
+	vector<int8_t> pulses(BENCH_SAMPLES);
+	for(size_t i=0; i<BENCH_SAMPLES; i++)
+		pulses[i] = ((i % 10000) < 50) ? 90 : 0;
+	ok &= BenchWaveform("int8 idle + pulses", pulses.data(), 1);
+
+	//Full scale noise is incompressible, so this measures the raw fallback
+	vector<int8_t> random8(BENCH_SAMPLES);
+	for(size_t i=0; i<BENCH_SAMPLES; i++)
+		random8[i] = static_cast<int8_t>(rng());
+	ok &= BenchWaveform("int8 full scale noise", random8.data(), 1);
+
+	vector<int16_t> random16(BENCH_SAMPLES);
+	for(size_t i=0; i<BENCH_SAMPLES; i++)
+		random16[i] = static_cast<int16_t>(rng());
+	ok &= BenchWaveform("int16 full scale noise", random16.data(), 2);
+
+	if(!ok)
+	{
+		printf("\nFAILED: round trip did not reproduce the input\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,253 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@brief Microbenchmark for the sample conversion kernels
+
+	Runs each kernel at every instruction set level the CPU supports, checks the output against the scalar kernel,
+	and prints throughput in samples per second.
+ */
+
+#include "../SampleConversion.h"
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <functional>
+#include <random>
+#include <stdio.h>
+#include <vector>
+
+using namespace std;
+
+///@brief Number of samples per kernel call (large enough to fall out of L2)
+static const size_t BENCH_SAMPLES = 4 * 1024 * 1024;
+
+///@brief Number of timed calls per kernel and level
+static const size_t BENCH_ITERATIONS = 20;
+
+/**
+	@brief Times a kernel and returns millions of samples per second
+ */
+static double TimeKernel(const function<void()>& kernel)
+{
+	//Warm up caches and page tables
+	kernel();
+
+	auto start = chrono::steady_clock::now();
+	for(size_t i=0; i<BENCH_ITERATIONS; i++)
+		kernel();
+	chrono::duration<double> dt = chrono::steady_clock::now() - start;
+
+	return (BENCH_SAMPLES * BENCH_ITERATIONS) / dt.count() / 1e6;
+}
+
+/**
+	@brief Compares kernel output against the scalar reference
+ */
+template<class T>
+static bool Matches(const vector<T>& a, const vector<T>& b)
+{
+	return a == b;
+}
+
+/**
+	@brief Compares float output against the scalar reference
+
+	Vector kernels may contract the multiply and add into a fused multiply-add, so allow a rounding difference.
+ */
+static bool Matches(const vector<float>& a, const vector<float>& b)
+{
+	if(a.size() != b.size())
+		return false;
+	for(size_t i=0; i<a.size(); i++)
+	{
+		if(fabs(a[i] - b[i]) > 1e-6f * max(1.0f, fabs(b[i])))
+			return false;
+	}
+	return true;
+}
+
+/**
+	@brief Runs one kernel at every supported level and compares the output against the scalar result
+
+	@param name		Kernel name for display
+	@param kernel	Runs the kernel at the current level
+	@param output	Returns the output of the most recent run
+
+	@return True if every level matched the scalar output
+ */
+template<class T>
+static bool BenchKernel(const char* name, const function<void()>& kernel, const function<vector<T>()>& output)
+{
+	bool ok = true;
+
+	SetKernelLevel(KERNEL_SCALAR);
+	kernel();
+	auto reference = output();
+	double scalarRate = TimeKernel(kernel);
+	printf("%-24s %-8s %10.1f MS/s\n", name, GetKernelLevelName(KERNEL_SCALAR), scalarRate);
+
+	auto supported = GetSupportedKernelLevel();
+	for(int level = KERNEL_SCALAR + 1; level <= supported; level++)
+	{
+		auto klevel = static_cast<SampleKernelLevel>(level);
+		SetKernelLevel(klevel);
+
+		kernel();
+		bool match = Matches(output(), reference);
+		ok &= match;
+
+		double rate = TimeKernel(kernel);
+		printf("%-24s %-8s %10.1f MS/s  %5.2fx  %s\n",
+			name, GetKernelLevelName(klevel), rate, rate / scalarRate, match ? "ok" : "MISMATCH");
+	}
+
+	return ok;
+}
+
+/**
+	@brief Concatenates per-channel output buffers for comparison
+ */
+template<class T>
+static vector<T> Concatenate(const vector<vector<T>>& planes)
+{
+	vector<T> ret;
+	for(auto& p : planes)
+		ret.insert(ret.end(), p.begin(), p.end());
+	return ret;
+}
+
+int main()
+{
+	//Random input data. Odd counts exercise the scalar tails of the vector kernels.
+	const size_t count = BENCH_SAMPLES - 3;
+	mt19937 rng(1234);
+	vector<uint8_t> raw(BENCH_SAMPLES * 4);
+	for(auto& b : raw)
+		b = rng();
+
+	const int8_t* in8 = reinterpret_cast<const int8_t*>(raw.data());
+	const int16_t* in16 = reinterpret_cast<const int16_t*>(raw.data());
+
+	vector<float> fout(BENCH_SAMPLES);
+	const float gain = 0.0123f;
+	const float offset = -0.25f;
+
+	printf("Supported kernel level: %s\n\n", GetKernelLevelName(GetSupportedKernelLevel()));
+
+	bool ok = true;
+	function<vector<float>()> floats = [&]{ return fout; };
+
+	ok &= BenchKernel("int8 to float",
+		[&]{ ConvertInt8ToFloat(in8, fout.data(), count, gain, offset); }, floats);
+	ok &= BenchKernel("int16 to float",
+		[&]{ ConvertInt16ToFloat(in16, fout.data(), count, gain, offset); }, floats);
+	ok &= BenchKernel("packed int12 to float",
+		[&]{ ConvertPackedInt12ToFloat(raw.data(), fout.data(), count, gain, offset); }, floats);
+
+	//Deinterleave, at the channel counts with vector paths
+	for(size_t channels : {2, 4})
+	{
+		vector<vector<int8_t>> planes8(channels, vector<int8_t>(BENCH_SAMPLES));
+		vector<int8_t*> ptrs8;
+		for(auto& p : planes8)
+			ptrs8.push_back(p.data());
+
+		char name[64];
+		snprintf(name, sizeof(name), "deinterleave int8 x%zu", channels);
+		ok &= BenchKernel<int8_t>(name,
+			[&]{ DeinterleaveInt8(in8, ptrs8.data(), channels, count); },
+			[&]{ return Concatenate(planes8); });
+	}
+
+	vector<vector<int16_t>> planes16(2, vector<int16_t>(BENCH_SAMPLES));
+	int16_t* ptrs16[2] = { planes16[0].data(), planes16[1].data() };
+	ok &= BenchKernel<int16_t>("deinterleave int16 x2",
+		[&]{ DeinterleaveInt16(in16, ptrs16, 2, count); },
+		[&]{ return Concatenate(planes16); });
+
+	//Digital bit extraction, with one channel disabled
+	vector<vector<uint8_t>> bits(8, vector<uint8_t>(BENCH_SAMPLES));
+	uint8_t* bitptrs[8];
+	for(size_t i=0; i<8; i++)
+		bitptrs[i] = bits[i].data();
+	bitptrs[5] = nullptr;
+	ok &= BenchKernel<uint8_t>("digital bit extract",
+		[&]{ ExtractDigitalBits(raw.data(), bitptrs, count); },
+		[&]{ return Concatenate(bits); });
+
+	//Peak detect decimation, at display width and with buckets short enough to hit the short input paths
+	vector<float> fin(fout);
+	for(size_t buckets : {2000, 400000})
+	{
+		vector<int8_t> env8(buckets * 2);
+		vector<int16_t> env16(buckets * 2);
+		vector<float> envf(buckets * 2);
+
+		char name[64];
+		snprintf(name, sizeof(name), "min/max int8 /%zu", buckets);
+		ok &= BenchKernel<int8_t>(name,
+			[&]{ DecimateMinMaxInt8(in8, count, env8.data(), buckets); },
+			[&]{ return env8; });
+		snprintf(name, sizeof(name), "min/max int16 /%zu", buckets);
+		ok &= BenchKernel<int16_t>(name,
+			[&]{ DecimateMinMaxInt16(in16, count, env16.data(), buckets); },
+			[&]{ return env16; });
+		snprintf(name, sizeof(name), "min/max float /%zu", buckets);
+		ok &= BenchKernel<float>(name,
+			[&]{ DecimateMinMaxFloat(fin.data(), count, envf.data(), buckets); },
+			[&]{ return envf; });
+	}
+
+	//Delta coding, over the whole buffer and in short blocks that end partway through a vector
+	vector<uint16_t> codes(BENCH_SAMPLES + 1);
+	ok &= BenchKernel<uint16_t>("delta zigzag int8",
+		[&]{ codes[count] = DeltaZigZagInt8(in8, count, 3, codes.data()); },
+		[&]{ return codes; });
+	ok &= BenchKernel<uint16_t>("delta zigzag int16",
+		[&]{ codes[count] = DeltaZigZagInt16(in16, count, 3, codes.data()); },
+		[&]{ return codes; });
+	ok &= BenchKernel<uint16_t>("delta zigzag int16 /100",
+		[&]
+		{
+			uint16_t any = 0;
+			for(size_t i=0; i<count; i += 100)
+				any |= DeltaZigZagInt16(in16 + i, min<size_t>(100, count - i), i ? in16[i-1] : 0, codes.data() + i);
+			codes[count] = any;
+		},
+		[&]{ return codes; });
+
+	if(!ok)
+	{
+		printf("\nFAILED: vector kernel output did not match scalar\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,245 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@brief Sustained throughput check for the waveform recorder
+
+	A producer thread captures synthetic waveforms into pooled buffers and submits them to a WaveformRecorder as fast
+	as it can (or at a fixed rate), the way a driver's acquisition thread would. Afterwards the segment files are read
+	back and every recorded waveform is checked against the pattern it was filled with.
+
+	Usage: scpi-recorder-bench [options]
+
+	Options:
+		--path P			Base path of the segment files (default /tmp/scpi-recorder-bench)
+		--size N			Bytes per waveform (default 1M, SI suffixes allowed)
+		--count N			Number of waveforms to capture (default 2000)
+		--rate N			Waveforms per second to capture at, or 0 for as fast as possible (default 0)
+		--segment-size N	Size of each segment file (default 256M)
+		--segments N		Number of segment files (default 4)
+		--keep				Leave the segment files in place afterwards
+ */
+
+#include "../SCPINumeric.h"
+#include "../WaveformBufferPool.h"
+#include "../WaveformRecorder.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+///@brief Number of capture buffers in the pool
+static const size_t BENCH_BUFFERS = 64;
+
+/**
+	@brief Fills a capture with a pattern identifying its sequence number
+ */
+static void FillPattern(uint8_t* data, size_t len, uint64_t sequence)
+{
+	auto words = reinterpret_cast<uint64_t*>(data);
+	for(size_t i=0; i<len/8; i++)
+		words[i] = sequence * 0x9e3779b97f4a7c15ULL + i;
+	for(size_t i=len/8*8; i<len; i++)
+		data[i] = static_cast<uint8_t>(sequence + i);
+}
+
+static bool CheckPattern(const uint8_t* data, size_t len, uint64_t sequence)
+{
+	vector<uint8_t> expected(len);
+	FillPattern(expected.data(), len, sequence);
+	return memcmp(data, expected.data(), len) == 0;
+}
+
+/**
+	@brief Reads back every segment file, checking the index and the samples
+
+	@param recorded	Set to the number of waveforms found
+ */
+static bool Verify(const string& path, size_t segments, size_t& recorded)
+{
+	recorded = 0;
+	for(size_t i=0; i<segments; i++)
+	{
+		char suffix[24];
+		snprintf(suffix, sizeof(suffix), ".%03zu", i);
+		string fname = path + suffix;
+
+		int fd = open(fname.c_str(), O_RDONLY);
+		struct stat st;
+		if( (fd < 0) || (0 != fstat(fd, &st)) )
+		{
+			fprintf(stderr, "Couldn't open %s\n", fname.c_str());
+			return false;
+		}
+		void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if(map == MAP_FAILED)
+			return false;
+		auto base = reinterpret_cast<const uint8_t*>(map);
+
+		bool ok = true;
+		auto header = reinterpret_cast<const WaveformRecordSegmentHeader*>(base);
+		if(header->m_magic != WAVEFORM_RECORD_MAGIC)
+		{
+			//A segment that was never reached is left zeroed
+			ok = (header->m_magic == 0);
+		}
+		else
+		{
+			auto index = reinterpret_cast<const WaveformRecordIndexEntry*>(base + sizeof(WaveformRecordSegmentHeader));
+			for(uint64_t j=0; ok && (j<header->m_indexCount); j++)
+			{
+				auto& e = index[j];
+				ok = (e.m_offset + e.m_length <= static_cast<uint64_t>(st.st_size)) &&
+					(e.m_offset >= header->m_dataOffset) &&
+					CheckPattern(base + e.m_offset, e.m_length, e.m_sequence);
+			}
+			recorded += header->m_indexCount;
+		}
+		munmap(map, st.st_size);
+
+		if(!ok)
+		{
+			fprintf(stderr, "%s is damaged\n", fname.c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	string path = "/tmp/scpi-recorder-bench";
+	uint64_t size = 1024 * 1024;
+	uint64_t count = 2000;
+	uint64_t rate = 0;
+	uint64_t segmentSize = 256 * 1024 * 1024;
+	uint64_t segments = 4;
+	bool keep = false;
+
+	for(int i=1; i<argc; i++)
+	{
+		string arg(argv[i]);
+		bool ok = true;
+		if( (arg == "--path") && (i+1 < argc) )
+			path = argv[++i];
+		else if( (arg == "--size") && (i+1 < argc) )
+			ok = ParseSCPIUint64(argv[++i], size);
+		else if( (arg == "--count") && (i+1 < argc) )
+			ok = ParseSCPIUint64(argv[++i], count);
+		else if( (arg == "--rate") && (i+1 < argc) )
+			ok = ParseSCPIUint64(argv[++i], rate);
+		else if( (arg == "--segment-size") && (i+1 < argc) )
+			ok = ParseSCPIUint64(argv[++i], segmentSize);
+		else if( (arg == "--segments") && (i+1 < argc) )
+			ok = ParseSCPIUint64(argv[++i], segments);
+		else if(arg == "--keep")
+			keep = true;
+		else
+			ok = false;
+
+		if(!ok)
+		{
+			fprintf(stderr, "Bad argument %s\n", arg.c_str());
+			return 1;
+		}
+	}
+
+	WaveformBufferPool pool;
+	pool.Configure(size, BENCH_BUFFERS);
+
+	WaveformRecorder recorder;
+	recorder.SetCompletionCallback([](void* cookie)
+		{ static_cast<WaveformBuffer*>(cookie)->Release(); });
+	if(!recorder.Start(path, segmentSize, segments))
+		return 1;
+
+	//Capture thread: fill a buffer, submit it, and let go of our reference
+	auto start = chrono::steady_clock::now();
+	thread producer([&]
+		{
+			for(uint64_t seq=0; seq<count; seq++)
+			{
+				if(rate)
+					this_thread::sleep_until(start + chrono::nanoseconds(seq * 1000000000ULL / rate));
+
+				auto buf = pool.Allocate();
+				auto data = reinterpret_cast<uint8_t*>(buf->GetData());
+				FillPattern(data, size, seq);
+
+				WaveformDescriptor wfm;
+				memset(&wfm, 0, sizeof(wfm));
+				wfm.m_samples = data;
+				wfm.m_cookie = buf;
+				wfm.m_sampleCount = size;
+				wfm.m_sampleRate = 1000000000;
+				wfm.m_timestamp = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+				wfm.m_sequence = seq;
+				wfm.m_bytesPerSample = 1;
+
+				if(!recorder.Submit(wfm))
+					buf->Release();
+			}
+		});
+	producer.join();
+	double captureSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	recorder.Stop();
+	double totalSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	size_t recorded;
+	bool ok = Verify(path, segments, recorded);
+
+	printf("captured %lu waveforms of %lu bytes in %.3f s (%.1f MB/s offered)\n",
+		(unsigned long)count, (unsigned long)size, captureSeconds, count * size / captureSeconds * 1e-6);
+	printf("wrote %lu waveforms in %.3f s (%.1f MB/s sustained), %lu dropped, %lu segments started, pool misses %lu\n",
+		(unsigned long)recorder.GetWrittenCount(), totalSeconds, recorder.GetThroughput() * 1e-6,
+		(unsigned long)recorder.GetDropCount(), (unsigned long)recorder.GetGeneration(),
+		(unsigned long)pool.GetMissCount());
+	printf("read back %zu waveforms from the segment files: %s\n", recorded, ok ? "OK" : "FAILED");
+
+	if(!keep)
+	{
+		for(size_t i=0; i<segments; i++)
+		{
+			char suffix[24];
+			snprintf(suffix, sizeof(suffix), ".%03zu", i);
+			unlink((path + suffix).c_str());
+		}
+	}
+	return ok ? 0 : 1;
+}
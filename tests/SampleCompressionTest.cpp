@@ -0,0 +1,209 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* scpi-server-tools                                                                                                    *
+*                                                                                                                      *
+* Copyright (c) 2012-2022 Andrew D. Zonenberg and contributors                                                         *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@brief Round trip tests for waveform compression
+
+	Exits with a non-zero status if any case fails, so it can run under ctest.
+ */
+
+#include "../SampleCompression.h"
+#include <random>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+using namespace std;
+
+///@brief Number of failed checks
+static size_t g_failures = 0;
+
+/**
+	@brief Records the result of one check, printing it if it failed
+ */
+static void Check(bool ok, const char* what, size_t count, uint8_t bytesPerSample)
+{
+	if(ok)
+		return;
+
+	printf("FAILED: %s (%zu samples, %u bytes per sample)\n", what, count, bytesPerSample);
+	g_failures ++;
+}
+
+/**
+	@brief Compresses and decompresses a waveform, checking the samples come back unchanged
+
+	@param packed	Output compressed stream
+
+	@return True if the round trip succeeded
+ */
+static bool RoundTrip(const void* samples, size_t count, uint8_t bytesPerSample, vector<uint8_t>& packed)
+{
+	size_t bound = GetCompressedBound(count, bytesPerSample);
+
+	//Guard bytes after both buffers catch writes past the end
+	packed.assign(bound + 1, 0xcc);
+	size_t len = CompressSamples(samples, count, bytesPerSample, packed.data());
+	if( (len > bound) || (packed[bound] != 0xcc) )
+		return false;
+	packed.resize(len);
+
+	vector<uint8_t> out(count * bytesPerSample + 1, 0xcc);
+	if(!DecompressSamples(packed.data(), len, out.data(), count, bytesPerSample))
+		return false;
+	if(out[count * bytesPerSample] != 0xcc)
+		return false;
+	return (count == 0) || (memcmp(out.data(), samples, count * bytesPerSample) == 0);
+}
+
+/**
+	@brief Runs a round trip of both 8 and 16 bit samples
+ */
+static void CheckRoundTrip(const char* what, const vector<int8_t>& s8, const vector<int16_t>& s16)
+{
+	vector<uint8_t> packed;
+	Check(RoundTrip(s8.data(), s8.size(), 1, packed), what, s8.size(), 1);
+	Check(RoundTrip(s16.data(), s16.size(), 2, packed), what, s16.size(), 2);
+}
+
+/**
+	@brief Checks that damaged streams are rejected rather than decoded
+ */
+static void CheckDamaged(const vector<int16_t>& samples)
+{
+	size_t count = samples.size();
+	vector<uint8_t> packed;
+	vector<int16_t> out(count);
+	if(!RoundTrip(samples.data(), count, 2, packed))
+		return;
+
+	Check(!DecompressSamples(packed.data(), packed.size() - 1, out.data(), count, 2), "truncated stream", count, 2);
+
+	packed.push_back(0);
+	Check(!DecompressSamples(packed.data(), packed.size(), out.data(), count, 2), "trailing data", count, 2);
+	packed.pop_back();
+
+	packed[0] = COMPRESSION_WIDTH_MASK;
+	Check(!DecompressSamples(packed.data(), packed.size(), out.data(), count, 2), "invalid block width", count, 2);
+}
+
+int main()
+{
+	minstd_rand rng(1);
+
+	//Block boundary lengths, including the empty and single sample cases
+	static const size_t counts[] =
+	{
+		0,
+		1,
+		2,
+		7,
+		8,
+		9,
+		COMPRESSION_BLOCK_SAMPLES - 1,
+		COMPRESSION_BLOCK_SAMPLES,
+		COMPRESSION_BLOCK_SAMPLES + 1,
+		2 * COMPRESSION_BLOCK_SAMPLES - 1,
+		2 * COMPRESSION_BLOCK_SAMPLES,
+		2 * COMPRESSION_BLOCK_SAMPLES + 1,
+		5 * COMPRESSION_BLOCK_SAMPLES + 17
+	};
+
+	for(size_t count : counts)
+	{
+		vector<int8_t> s8(count);
+		vector<int16_t> s16(count);
+
+		//Constant signal, which packs at zero bits per value
+		for(size_t i=0; i<count; i++)
+		{
+			s8[i] = -5;
+			s16[i] = 1000;
+		}
+		CheckRoundTrip("constant", s8, s16);
+
+		//Full scale alternation: the largest possible deltas, in both directions
+		for(size_t i=0; i<count; i++)
+		{
+			s8[i] = (i & 1) ? INT8_MIN : INT8_MAX;
+			s16[i] = (i & 1) ? INT16_MIN : INT16_MAX;
+		}
+		CheckRoundTrip("full scale alternation", s8, s16);
+
+		//Small random deltas, which pack at a few bits per value
+		for(size_t i=0; i<count; i++)
+		{
+			s8[i] = static_cast<int8_t>(i ? s8[i-1] + static_cast<int>(rng() % 7) - 3 : -100);
+			s16[i] = static_cast<int16_t>(i ? s16[i-1] + static_cast<int>(rng() % 65) - 32 : 2047);
+		}
+		CheckRoundTrip("small deltas", s8, s16);
+
+		if(count > 0)
+			CheckDamaged(s16);
+	}
+
+	//Full scale noise doesn't get smaller by packing, so every block must be stored raw
+	for(uint8_t bytesPerSample = 1; bytesPerSample <= 2; bytesPerSample ++)
+	{
+		size_t count = 3 * COMPRESSION_BLOCK_SAMPLES + 5;
+		vector<uint8_t> samples(count * bytesPerSample);
+		for(auto& b : samples)
+			b = static_cast<uint8_t>(rng());
+
+		vector<uint8_t> packed;
+		Check(RoundTrip(samples.data(), count, bytesPerSample, packed), "raw fallback", count, bytesPerSample);
+
+		size_t blocks = (count + COMPRESSION_BLOCK_SAMPLES - 1) / COMPRESSION_BLOCK_SAMPLES;
+		Check(packed.size() == count * bytesPerSample + blocks, "raw fallback size", count, bytesPerSample);
+		Check(!packed.empty() && (packed[0] & COMPRESSION_BLOCK_RAW), "raw fallback header", count, bytesPerSample);
+	}
+
+	//Raw and packed blocks mixed in one stream, since delta coding carries on across raw blocks
+	{
+		size_t count = 4 * COMPRESSION_BLOCK_SAMPLES;
+		vector<int8_t> s8(count);
+		vector<int16_t> s16(count);
+		for(size_t i=0; i<count; i++)
+		{
+			bool noisy = (i / COMPRESSION_BLOCK_SAMPLES) & 1;
+			s8[i] = noisy ? static_cast<int8_t>(rng()) : static_cast<int8_t>(i % 16);
+			s16[i] = noisy ? static_cast<int16_t>(rng()) : static_cast<int16_t>(i % 16);
+		}
+		CheckRoundTrip("mixed raw and packed blocks", s8, s16);
+	}
+
+	if(g_failures)
+	{
+		printf("%zu checks FAILED\n", g_failures);
+		return 1;
+	}
+	printf("All compression round trip checks passed\n");
+	return 0;
+}